@@ -0,0 +1,74 @@
+
+#ifndef HPJSRPC_BENCH_H
+#define	HPJSRPC_BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+
+/*
+ * Shared by the drivers in example/bench. Built by ./bench into bin/; each
+ * driver takes an optional iteration count as its first argument.
+ */
+
+static inline size_t
+bench_iterations (int argc, char **argv, size_t fallback) {
+  return (1 < argc) ? (size_t) strtoull(argv[1], NULL, 10) : fallback;
+}
+
+/* One result line: operations per second, and MB/s if bytes is not 0 */
+static inline void
+bench_report (const char *name, uint64_t ops, uint64_t bytes,
+  uint64_t elapsed_ns) {
+  double seconds = ((double) elapsed_ns / 1e9);
+
+  printf("%-36s %12.0f ops/s %10.1f ns/op", name, ((double) ops / seconds),
+    ((double) elapsed_ns / (double) ops));
+  if (0 != bytes) {
+    printf(" %10.1f MB/s", (((double) bytes / 1e6) / seconds));
+  }
+  printf("\n");
+}
+
+/*
+ * "echo": returns its one string parameter. The token's bytes are already
+ * escaped JSON, so they are written as they are.
+ */
+static inline HPJSRPC_RETURN
+bench_echo (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  const jsmntok_t *params = &req->tokens[req->paramsToken->first_child];
+  const jsmntok_t *text = &req->tokens[params->first_child];
+
+  return hpjsrpc_json_string_raw(&res->buffer, &req->buffer[text->start],
+    (size_t) (text->end - text->start));
+}
+
+static inline int
+bench_cmp_u64 (const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* Latency percentile, in place over samples (sorted on return) */
+static inline uint64_t
+bench_percentile (uint64_t *samples, size_t count, double pct) {
+  size_t at;
+
+  if (0 == count) {
+    return 0;
+  }
+  qsort(samples, count, sizeof(*samples), bench_cmp_u64);
+  at = (size_t) (((double) (count - 1) * pct) / 100.0);
+  return samples[at];
+}
+
+#endif	/* HPJSRPC_BENCH_H */
+/* vi: set et sw=2 ts=2: */
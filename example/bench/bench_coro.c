@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ucontext.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_coro.h"
+#include "bench.h"
+
+/*
+ * Coroutine costs:
+ * - a bare swapcontext() round trip, the floor under everything else;
+ * - an hpjsrpc_await() round trip through the scheduler, i.e. suspend,
+ *   a pass of hpjsrpc_scheduler_run() and resume;
+ * - resident and mapped memory per suspended request, from /proc/self/statm
+ *   with many requests asleep at once.
+ *
+ *   bin/bench_coro [awaits] [suspended requests]
+ */
+
+#define YIELD_METHOD_AWAITS               1000
+
+static ucontext_t    main_uc;
+static ucontext_t    ping_uc;
+static size_t        completed;
+
+/* ------------------------------------------------------------------------- */
+
+static void
+ping_main (void) {
+  for (;;) {
+    swapcontext(&ping_uc, &main_uc);
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Yields to the scheduler YIELD_METHOD_AWAITS times */
+static HPJSRPC_RETURN
+yield (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  (void) req;
+  for (int ii = 0; ii < YIELD_METHOD_AWAITS; ++ii) {
+    hpjsrpc_await(-1, 0, 0);
+  }
+  return hpjsrpc_json_int(&res->buffer, YIELD_METHOD_AWAITS);
+}
+
+/* Sleeps long enough for every request to be submitted first */
+static HPJSRPC_RETURN
+nap (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  (void) req;
+  hpjsrpc_await(-1, 0, 500);
+  return hpjsrpc_json_int(&res->buffer, 1);
+}
+
+static hpjsrpc_method_t methods[] = {
+  {"yield", sizeof("yield"), yield, false, 0, { 0 }, true, 0},
+  {"nap", sizeof("nap"), nap, false, 0, { 0 }, true, 0},
+};
+
+static const char yield_request[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"yield\",\"params\":[],\"id\":1}";
+static const char nap_request[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"nap\",\"params\":[],\"id\":1}";
+
+/* ------------------------------------------------------------------------- */
+
+static void
+on_done (void *tag, hpjsrpc_response_t *res, HPJSRPC_RETURN rc) {
+  (void) tag;
+  (void) res;
+  if (HPJSRPC_NO_ERROR == rc) {
+    completed++;
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Mapped and resident bytes */
+static void
+read_statm (uint64_t *mapped, uint64_t *resident) {
+  FILE               *fp = fopen("/proc/self/statm", "r");
+  unsigned long long  size = 0;
+  unsigned long long  rss = 0;
+
+  if (NULL != fp) {
+    if (2 != fscanf(fp, "%llu %llu", &size, &rss)) {
+      size = rss = 0;
+    }
+    fclose(fp);
+  }
+  *mapped = (uint64_t) size * (uint64_t) sysconf(_SC_PAGESIZE);
+  *resident = (uint64_t) rss * (uint64_t) sysconf(_SC_PAGESIZE);
+
+} /* read_statm() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+bench_swapcontext (size_t iterations) {
+  static uint8_t  stack[64 * 1024];
+  uint64_t        begin;
+
+  getcontext(&ping_uc);
+  ping_uc.uc_stack.ss_sp = stack;
+  ping_uc.uc_stack.ss_size = sizeof(stack);
+  ping_uc.uc_link = NULL;
+  makecontext(&ping_uc, ping_main, 0);
+
+  begin = hpjsrpc_clock_ns();
+  for (size_t ii = 0; ii < iterations; ++ii) {
+    swapcontext(&main_uc, &ping_uc);
+  }
+  bench_report("swapcontext() round trip", iterations, 0,
+    (hpjsrpc_clock_ns() - begin));
+
+} /* bench_swapcontext() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+bench_await (hpjsrpc_scheduler_t *sched, size_t iterations) {
+  size_t   requests = ((iterations + YIELD_METHOD_AWAITS - 1)
+    / YIELD_METHOD_AWAITS);
+  uint64_t begin;
+
+  completed = 0;
+  begin = hpjsrpc_clock_ns();
+  for (size_t ii = 0; ii < requests; ++ii) {
+    hpjsrpc_scheduler_submit(sched, yield_request, (sizeof(yield_request) - 1),
+      NULL);
+    while (0 != hpjsrpc_scheduler_run(sched, -1)) {
+    }
+  }
+  bench_report("hpjsrpc_await() round trip",
+    ((uint64_t) requests * YIELD_METHOD_AWAITS), 0,
+    (hpjsrpc_clock_ns() - begin));
+  if (completed != requests) {
+    printf("  %zu of %zu requests failed\n", (requests - completed), requests);
+  }
+
+} /* bench_await() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Puts count requests to sleep, twice: the second round reuses the pool */
+static void
+bench_memory (hpjsrpc_scheduler_t *sched, size_t count) {
+  for (int round = 0; round < 2; ++round) {
+    uint64_t mapped_before;
+    uint64_t resident_before;
+    uint64_t mapped;
+    uint64_t resident;
+    size_t   submitted = 0;
+
+    read_statm(&mapped_before, &resident_before);
+    completed = 0;
+    for (size_t ii = 0; ii < count; ++ii) {
+      if (HPJSRPC_NO_ERROR == hpjsrpc_scheduler_submit(sched, nap_request,
+          (sizeof(nap_request) - 1), NULL)) {
+        submitted++;
+      }
+    }
+    read_statm(&mapped, &resident);
+
+    printf("%zu suspended (%s): %.0f bytes resident, %.0f mapped per request\n",
+      hpjsrpc_scheduler_suspended(sched), (0 == round) ? "cold" : "pooled",
+      ((double) (resident - resident_before) / (double) submitted),
+      ((double) (mapped - mapped_before) / (double) submitted));
+
+    while (0 != hpjsrpc_scheduler_run(sched, -1)) {
+    }
+    if (completed != submitted) {
+      printf("  %zu of %zu requests failed\n", (submitted - completed),
+        submitted);
+    }
+  }
+
+} /* bench_memory() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv) {
+  size_t                      iterations = bench_iterations(argc, argv,
+    1000000);
+  size_t                      count = (2 < argc)
+    ? (size_t) strtoull(argv[2], NULL, 10) : 10000;
+  hpjsrpc_engine_t           *engine;
+  hpjsrpc_scheduler_t        *sched;
+  hpjsrpc_scheduler_config_t  config;
+
+  memset(&config, 0, sizeof(config));
+  config.max_coroutines = count;
+  config.max_token_count = 32;
+  config.segment_size_in_bytes = 256;
+  config.done = on_done;
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_new(&engine)
+      || HPJSRPC_NO_ERROR != rpc_register_methods(engine, methods, 2)
+      || HPJSRPC_NO_ERROR != hpjsrpc_scheduler_new(&sched, engine, &config)) {
+    fprintf(stderr, "setup failed\n");
+    return 1;
+  }
+
+  bench_swapcontext(iterations);
+  bench_await(sched, iterations);
+  printf("stack %d KiB per coroutine, plus a guard page\n",
+    HPJSRPC_CORO_DEFAULT_STACK_SIZE / 1024);
+  bench_memory(sched, count);
+
+  hpjsrpc_scheduler_destroy(sched);
+  hpjsrpc_destroy(engine);
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
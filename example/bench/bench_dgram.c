@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_dgram.h"
+#include "bench.h"
+
+/*
+ * Datagram server throughput on UDP loopback, in packets per second and
+ * per CPU second the process spent, client included: requests with an id,
+ * several sockets each keeping a window in flight with one sendmmsg() and
+ * reading the replies with recvmmsg(); then notifications, fire and
+ * forget, with the window bounded by what the method has counted so far.
+ * A request lost to a full socket buffer is sent again after a second.
+ *
+ *   bin/bench_dgram [packets] [shards] [window]
+ */
+
+#define FLOWS                             4
+#define MAX_WINDOW                        HPJSRPC_DGRAM_BATCH
+
+static const char request[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[40,2],\"id\":7}";
+static const char notification[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[40,2]}";
+
+static uint64_t calls;
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+add (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  const jsmntok_t *params = &req->tokens[req->paramsToken->first_child];
+  const jsmntok_t *a = &req->tokens[params->first_child];
+  const jsmntok_t *b = &req->tokens[a->next_sibling];
+
+  __atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+  return hpjsrpc_json_int(&res->buffer,
+    strtoll(&req->buffer[a->start], NULL, 10)
+    + strtoll(&req->buffer[b->start], NULL, 10));
+
+} /* add() */
+
+static hpjsrpc_method_t methods[] = {
+  {"add", sizeof("add"), add, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE },
+    true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+static uint64_t
+cpu_ns (void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000ull) + (uint64_t) ts.tv_nsec;
+
+} /* cpu_ns() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Sends count copies of text as one sendmmsg() */
+static void
+send_window (int fd, const char *text, size_t length, size_t count) {
+  struct mmsghdr msgs[MAX_WINDOW];
+  struct iovec   iov = { (void *) text, length };
+  size_t         sent = 0;
+
+  memset(msgs, 0, sizeof(msgs));
+  for (size_t ii = 0; ii < count; ++ii) {
+    msgs[ii].msg_hdr.msg_iov = &iov;
+    msgs[ii].msg_hdr.msg_iovlen = 1;
+  }
+  while (sent < count) {
+    int rc = sendmmsg(fd, &msgs[sent], (unsigned) (count - sent), 0);
+
+    if (0 > rc) {
+      fprintf(stderr, "sendmmsg failed\n");
+      exit(1);
+    }
+    sent += (size_t) rc;
+  }
+
+} /* send_window() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+report (const char *mode, size_t shards, size_t window, uint64_t packets,
+  uint64_t elapsed_ns, uint64_t cpu_elapsed_ns, uint64_t resent) {
+  char label[64];
+
+  snprintf(label, sizeof(label), "%s, %zu shards, window %zu", mode, shards,
+    window);
+  bench_report(label, packets, 0, elapsed_ns);
+  printf("%-36s %12.0f packets/cpu-s, %llu resent\n", "",
+    ((double) packets / ((double) cpu_elapsed_ns / 1e9)),
+    (unsigned long long) resent);
+
+} /* report() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+run_requests (int *fds, size_t packets, size_t shards, size_t window) {
+  struct pollfd  pfds[FLOWS];
+  size_t         awaited[FLOWS];
+  size_t         sent = 0;
+  uint64_t       done = 0;
+  uint64_t       resent = 0;
+  uint64_t       begin = hpjsrpc_clock_ns();
+  uint64_t       cpu_begin = cpu_ns();
+
+  for (size_t ii = 0; ii < FLOWS; ++ii) {
+    pfds[ii].fd = fds[ii];
+    pfds[ii].events = POLLIN;
+    send_window(fds[ii], request, (sizeof(request) - 1), window);
+    awaited[ii] = window;
+    sent += window;
+  }
+
+  while (done < packets) {
+    int ready = poll(pfds, FLOWS, 1000);
+
+    if (0 == ready) {
+      /* Lost: the missing replies of each flow are asked for again */
+      for (size_t ii = 0; ii < FLOWS; ++ii) {
+        send_window(fds[ii], request, (sizeof(request) - 1), awaited[ii]);
+        resent += awaited[ii];
+      }
+      continue;
+    }
+    for (size_t ii = 0; ii < FLOWS; ++ii) {
+      static char    replies[MAX_WINDOW][128];
+      struct mmsghdr msgs[MAX_WINDOW];
+      struct iovec   iov[MAX_WINDOW];
+      int            got;
+
+      if (0 == (pfds[ii].revents & POLLIN)) {
+        continue;
+      }
+      memset(msgs, 0, sizeof(msgs));
+      for (size_t jj = 0; jj < MAX_WINDOW; ++jj) {
+        iov[jj].iov_base = replies[jj];
+        iov[jj].iov_len = sizeof(replies[jj]);
+        msgs[jj].msg_hdr.msg_iov = &iov[jj];
+        msgs[jj].msg_hdr.msg_iovlen = 1;
+      }
+      got = recvmmsg(fds[ii], msgs, MAX_WINDOW, MSG_DONTWAIT, NULL);
+      if (0 >= got) {
+        continue;
+      }
+      done += (uint64_t) got;
+      awaited[ii] -= ((size_t) got < awaited[ii]) ? (size_t) got
+        : awaited[ii];
+      if (0 == awaited[ii] && sent < packets) {
+        send_window(fds[ii], request, (sizeof(request) - 1), window);
+        awaited[ii] = window;
+        sent += window;
+      }
+    }
+  }
+
+  report("requests", shards, window, done, (hpjsrpc_clock_ns() - begin),
+    (cpu_ns() - cpu_begin), resent);
+
+} /* run_requests() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+run_notifications (int *fds, size_t packets, size_t shards, size_t window) {
+  uint64_t start = __atomic_load_n(&calls, __ATOMIC_RELAXED);
+  uint64_t sent = 0;
+  uint64_t resent = 0;
+  uint64_t begin = hpjsrpc_clock_ns();
+  uint64_t cpu_begin = cpu_ns();
+  uint64_t stalled_ns = begin;
+  uint64_t done = 0;
+
+  while (done < packets) {
+    uint64_t now_ns;
+
+    /* A window per flow may be queued ahead of the shards */
+    if ((sent - done) < (FLOWS * window) && sent < packets) {
+      for (size_t ii = 0; ii < FLOWS; ++ii) {
+        send_window(fds[ii], notification, (sizeof(notification) - 1),
+          window);
+      }
+      sent += (FLOWS * window);
+      continue;
+    }
+
+    sched_yield();
+    now_ns = hpjsrpc_clock_ns();
+    if (done != (__atomic_load_n(&calls, __ATOMIC_RELAXED) - start)) {
+      done = (__atomic_load_n(&calls, __ATOMIC_RELAXED) - start);
+      stalled_ns = now_ns;
+    } else if ((now_ns - stalled_ns) > 1000000000ull) {
+      /* Nothing for a second: what is missing was dropped */
+      resent += (sent - done);
+      sent = done;
+      stalled_ns = now_ns;
+    }
+  }
+
+  report("notifications", shards, window, done, (hpjsrpc_clock_ns() - begin),
+    (cpu_ns() - cpu_begin), resent);
+
+} /* run_notifications() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv) {
+  size_t                  packets = bench_iterations(argc, argv, 500000);
+  size_t                  shards = (2 < argc)
+    ? (size_t) strtoull(argv[2], NULL, 10) : 1;
+  size_t                  window = (3 < argc)
+    ? (size_t) strtoull(argv[3], NULL, 10) : 0;
+  hpjsrpc_dgram_config_t  config;
+  hpjsrpc_dgram_t        *dgram;
+  hpjsrpc_engine_t       *engine;
+  int                     fds[FLOWS];
+
+  if (0 == shards || MAX_WINDOW < window) {
+    fprintf(stderr, "need a shard, a window up to %d\n", MAX_WINDOW);
+    return 1;
+  }
+  if (HPJSRPC_NO_ERROR != hpjsrpc_new(&engine)
+      || HPJSRPC_NO_ERROR != rpc_register_methods(engine, methods, 1)) {
+    fprintf(stderr, "engine setup failed\n");
+    return 1;
+  }
+
+  memset(&config, 0, sizeof(config));
+  config.address = "127.0.0.1";
+  config.shard_count = shards;
+  config.socket_buffer_size_in_bytes = (4 << 20);
+  config.context.max_token_count = 64;
+  config.context.segment_size_in_bytes = 512;
+  if (HPJSRPC_NO_ERROR != hpjsrpc_dgram_new(&dgram, engine, &config)
+      || HPJSRPC_NO_ERROR != hpjsrpc_dgram_start(dgram)) {
+    fprintf(stderr, "server setup failed\n");
+    return 1;
+  }
+
+  /* A socket per flow, so that SO_REUSEPORT spreads them over the shards */
+  for (size_t ii = 0; ii < FLOWS; ++ii) {
+    struct sockaddr_in addr;
+    int                size = (4 << 20);
+
+    fds[ii] = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(hpjsrpc_dgram_port(dgram));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (0 > fds[ii]
+        || 0 != connect(fds[ii], (struct sockaddr *) &addr, sizeof(addr))) {
+      fprintf(stderr, "connect failed\n");
+      return 1;
+    }
+    setsockopt(fds[ii], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fds[ii], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  }
+
+  printf("%zu packets over %d flows, %ld online cpus\n", packets, FLOWS,
+    sysconf(_SC_NPROCESSORS_ONLN));
+  /* Windows of 1, 8 and 64 unless one was given */
+  for (size_t w = ((0 != window) ? window : 1); w <= MAX_WINDOW; w *= 8) {
+    run_requests(fds, packets, shards, w);
+    run_notifications(fds, packets, shards, w);
+    if (0 != window) {
+      break;
+    }
+  }
+
+  for (size_t ii = 0; ii < FLOWS; ++ii) {
+    close(fds[ii]);
+  }
+  hpjsrpc_dgram_destroy(dgram);
+  hpjsrpc_destroy(engine);
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
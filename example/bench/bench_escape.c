@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "bench.h"
+
+/*
+ * Escaper throughput: hpjsrpc_json_string() against a byte-at-a-time
+ * escaper, on mostly clean text (one escape per 200 bytes) and on escape
+ * heavy text (one in four bytes).
+ */
+
+#define TEXT_SIZE_IN_BYTES                (64 * 1024)
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* ------------------------------------------------------------------------- */
+
+/* What the writer replaced: test and copy one byte at a time */
+static size_t
+escape_bytewise (uint8_t *out, const char *str, size_t len) {
+  uint8_t *p = out;
+
+  *p++ = '"';
+  for (size_t ii = 0; ii < len; ++ii) {
+    uint8_t c = (uint8_t) str[ii];
+    if ('"' == c || '\\' == c) {
+      *p++ = '\\';
+      *p++ = c;
+    } else if (0x20 > c) {
+      memcpy(p, "\\u00", 4);
+      p[4] = hex_digits[c >> 4];
+      p[5] = hex_digits[c & 0xf];
+      p += 6;
+    } else {
+      *p++ = c;
+    }
+  }
+  *p++ = '"';
+
+  return (size_t) (p - out);
+
+} /* escape_bytewise() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+fill_text (char *text, size_t len, size_t escape_every) {
+  static const char specials[] = { '"', '\\', '\n', '\t' };
+
+  for (size_t ii = 0; ii < len; ++ii) {
+    text[ii] = (0 == (ii % escape_every))
+      ? specials[(ii / escape_every) % sizeof(specials)]
+      : (char) ('a' + (ii % 26));
+  }
+
+} /* fill_text() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+run (const char *name, size_t escape_every, size_t iterations) {
+  char              *text = malloc(TEXT_SIZE_IN_BYTES);
+  size_t             capacity = ((6 * TEXT_SIZE_IN_BYTES) + 16);
+  hpjsrpc_buffer_t   buf;
+  uint64_t           begin;
+  uint64_t           sink = 0;
+  char               label[64];
+
+  memset(&buf, 0, sizeof(buf));
+  buf.data = malloc(capacity);
+  buf.capacity_in_bytes = capacity;
+  fill_text(text, TEXT_SIZE_IN_BYTES, escape_every);
+
+  begin = hpjsrpc_clock_ns();
+  for (size_t ii = 0; ii < iterations; ++ii) {
+    hpjsrpc_buffer_rewind(&buf);
+    hpjsrpc_json_string(&buf, text, TEXT_SIZE_IN_BYTES);
+    sink += buf.size_in_bytes;
+  }
+  snprintf(label, sizeof(label), "%s, hpjsrpc_json_string", name);
+  bench_report(label, iterations, (uint64_t) iterations * TEXT_SIZE_IN_BYTES,
+    (hpjsrpc_clock_ns() - begin));
+
+  begin = hpjsrpc_clock_ns();
+  for (size_t ii = 0; ii < iterations; ++ii) {
+    sink += escape_bytewise(buf.data, text, TEXT_SIZE_IN_BYTES);
+  }
+  snprintf(label, sizeof(label), "%s, byte at a time", name);
+  bench_report(label, iterations, (uint64_t) iterations * TEXT_SIZE_IN_BYTES,
+    (hpjsrpc_clock_ns() - begin));
+
+  if (0 == sink) {
+    printf("nothing written\n");
+  }
+  free(buf.data);
+  free(text);
+
+} /* run() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv) {
+  size_t iterations = bench_iterations(argc, argv, 20000);
+
+  run("clean (1/200 escaped)", 200, iterations);
+  run("heavy (1/4 escaped)", 4, iterations);
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_client.h"
+#include "bench.h"
+
+/*
+ * Tail latency with and without hedging: an hpjsrpc_client_pool_t keeps a
+ * window of calls in flight to a stub server on loopback, which answers
+ * each request at once, or, one time in slow_per_mille, only after slow_ms,
+ * as a replica stalled by a pause or a noisy neighbour would. The same run
+ * is made with calls the pool may not hedge and with idempotent ones it
+ * hedges once they are late; each latency is from the call to its reply.
+ *
+ *   bin/bench_hedge [calls] [slow per mille] [slow ms] [window]
+ */
+
+#define CONNECTIONS                       4
+#define MAX_WINDOW                        256
+#define MAX_PENDING                       4096
+
+typedef struct {
+  int                             fd;
+  uint64_t                        id;
+  uint64_t                        due_ns;
+} pending_t;
+
+typedef struct {
+  int                             listen_fd;
+  uint16_t                        port;
+  uint32_t                        slow_per_mille;
+  uint64_t                        slow_ns;
+  bool                            is_stopping;
+  pthread_t                       thread;
+} stub_t;
+
+typedef struct {
+  uint64_t                        start_ns;
+  uint64_t                       *samples;
+  size_t                         *done;
+} slot_t;
+
+/* ------------------------------------------------------------------------- */
+
+static void
+stub_reply (int fd, uint64_t id) {
+  char text[96];
+  int  length = snprintf(text, sizeof(text),
+    "{\"jsonrpc\":\"2.0\",\"id\":%llu,\"result\":0}\n",
+    (unsigned long long) id);
+
+  if (0 > fd || length != write(fd, text, (size_t) length)) {
+    /* The peer has gone; replies are too short to be written in part */
+  }
+
+} /* stub_reply() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * One thread serves every connection. Slow requests wait in a list for their
+ * time, so a stalled one holds up no other on its connection.
+ */
+static void *
+stub_main (void *arg) {
+  stub_t          *stub = arg;
+  struct pollfd    pfds[1 + CONNECTIONS];
+  char             buffers[1 + CONNECTIONS][8192];
+  size_t           lengths[1 + CONNECTIONS];
+  static pending_t pending[MAX_PENDING];
+  size_t           pending_count = 0;
+  size_t           nfds = 1;
+  uint64_t         rng = 0x9e3779b97f4a7c15ull;
+
+  pfds[0].fd = stub->listen_fd;
+  pfds[0].events = POLLIN;
+
+  while (!__atomic_load_n(&stub->is_stopping, __ATOMIC_ACQUIRE)) {
+    uint64_t        now_ns = hpjsrpc_clock_ns();
+    uint64_t        wait_ns = 100000000ull;
+    struct timespec ts;
+
+    /* Replies that fell due */
+    for (size_t ii = 0; ii < pending_count; ) {
+      if (pending[ii].due_ns <= now_ns) {
+        stub_reply(pending[ii].fd, pending[ii].id);
+        pending[ii] = pending[--pending_count];
+        continue;
+      }
+      if ((pending[ii].due_ns - now_ns) < wait_ns) {
+        wait_ns = (pending[ii].due_ns - now_ns);
+      }
+      ++ii;
+    }
+
+    ts.tv_sec = (time_t) (wait_ns / 1000000000ull);
+    ts.tv_nsec = (long) (wait_ns % 1000000000ull);
+    if (0 >= ppoll(pfds, nfds, &ts, NULL)) {
+      continue;
+    }
+
+    if (0 != (pfds[0].revents & POLLIN) && (1 + CONNECTIONS) > nfds) {
+      int one = 1;
+
+      pfds[nfds].fd = accept(stub->listen_fd, NULL, NULL);
+      pfds[nfds].events = POLLIN;
+      setsockopt(pfds[nfds].fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      lengths[nfds] = 0;
+      nfds += (0 <= pfds[nfds].fd) ? 1 : 0;
+    }
+
+    for (size_t ii = 1; ii < nfds; ++ii) {
+      char    *line = buffers[ii];
+      char    *newline;
+      ssize_t  got;
+
+      if (0 == (pfds[ii].revents & (POLLIN | POLLHUP))) {
+        continue;
+      }
+      got = read(pfds[ii].fd, &buffers[ii][lengths[ii]],
+        (sizeof(buffers[ii]) - lengths[ii]));
+      if (0 >= got) {
+        /* Closed: forget it, and what it still had coming */
+        for (size_t jj = 0; jj < pending_count; ++jj) {
+          pending[jj].fd = (pending[jj].fd == pfds[ii].fd)
+            ? -1 : pending[jj].fd;
+        }
+        close(pfds[ii].fd);
+        pfds[ii].fd = -1;
+        continue;
+      }
+      lengths[ii] += (size_t) got;
+
+      while (NULL != (newline = memchr(line, '\n',
+          (size_t) (&buffers[ii][lengths[ii]] - line)))) {
+        char     *id = memmem(line, (size_t) (newline - line), "\"id\":", 5);
+        uint64_t  request_id = (NULL != id)
+          ? strtoull(&id[5], NULL, 10) : 0;
+
+        /* xorshift64: slow ones at random, the same run after run */
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        if (0 != request_id) {
+          if ((rng % 1000) < stub->slow_per_mille
+              && MAX_PENDING > pending_count) {
+            pending[pending_count].fd = pfds[ii].fd;
+            pending[pending_count].id = request_id;
+            pending[pending_count].due_ns = (hpjsrpc_clock_ns()
+              + stub->slow_ns);
+            pending_count++;
+          } else {
+            stub_reply(pfds[ii].fd, request_id);
+          }
+        }
+        line = (newline + 1);
+      }
+      lengths[ii] -= (size_t) (line - buffers[ii]);
+      memmove(buffers[ii], line, lengths[ii]);
+    }
+  }
+
+  for (size_t ii = 1; ii < nfds; ++ii) {
+    if (0 <= pfds[ii].fd) {
+      close(pfds[ii].fd);
+    }
+  }
+
+  return NULL;
+
+} /* stub_main() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+stub_start (stub_t *stub) {
+  struct sockaddr_in addr;
+  socklen_t          addr_length = sizeof(addr);
+
+  stub->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (0 > stub->listen_fd
+      || 0 != bind(stub->listen_fd, (struct sockaddr *) &addr, sizeof(addr))
+      || 0 != listen(stub->listen_fd, CONNECTIONS)
+      || 0 != getsockname(stub->listen_fd, (struct sockaddr *) &addr,
+        &addr_length)) {
+    fprintf(stderr, "stub setup failed\n");
+    exit(1);
+  }
+  stub->port = ntohs(addr.sin_port);
+  stub->is_stopping = false;
+  pthread_create(&stub->thread, NULL, stub_main, stub);
+
+} /* stub_start() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+stub_stop (stub_t *stub) {
+
+  __atomic_store_n(&stub->is_stopping, true, __ATOMIC_RELEASE);
+  pthread_join(stub->thread, NULL);
+  close(stub->listen_fd);
+
+} /* stub_stop() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+on_reply (void *arg, const hpjsrpc_client_reply_t *reply) {
+  slot_t *slot = arg;
+
+  if (HPJSRPC_NO_ERROR != reply->rc) {
+    fprintf(stderr, "call failed: %d\n", reply->rc);
+    exit(1);
+  }
+  slot->samples[(*slot->done)++] = (hpjsrpc_clock_ns() - slot->start_ns);
+  slot->start_ns = 0;
+
+} /* on_reply() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+run (const stub_t *stub, size_t calls, size_t window, bool is_idempotent) {
+  hpjsrpc_client_pool_config_t  config;
+  hpjsrpc_client_pool_stats_t   stats;
+  hpjsrpc_client_pool_t        *pool;
+  slot_t                        slots[MAX_WINDOW];
+  uint64_t                     *samples = malloc(calls * sizeof(*samples));
+  size_t                        issued = 0;
+  size_t                        done = 0;
+  uint64_t                      begin;
+  uint64_t                      p50;
+  uint64_t                      p99;
+  uint64_t                      p999;
+
+  memset(&config, 0, sizeof(config));
+  config.connection_count = CONNECTIONS;
+  config.hedge_delay_in_us = 200;
+  if (HPJSRPC_NO_ERROR != hpjsrpc_client_pool_new(&pool, "127.0.0.1",
+      stub->port, &config)) {
+    fprintf(stderr, "pool setup failed\n");
+    exit(1);
+  }
+  for (size_t ii = 0; ii < window; ++ii) {
+    slots[ii].start_ns = 0;
+    slots[ii].samples = samples;
+    slots[ii].done = &done;
+  }
+
+  begin = hpjsrpc_clock_ns();
+  while (done < calls) {
+    for (size_t ii = 0; ii < window && issued < calls; ++ii) {
+      if (0 != slots[ii].start_ns) {
+        continue;
+      }
+      slots[ii].start_ns = hpjsrpc_clock_ns();
+      if (HPJSRPC_NO_ERROR != hpjsrpc_client_pool_call(pool, "work", "[1]",
+          3, is_idempotent, on_reply, &slots[ii], NULL)) {
+        fprintf(stderr, "call failed\n");
+        exit(1);
+      }
+      issued++;
+    }
+    if (HPJSRPC_NO_ERROR != hpjsrpc_client_pool_poll(pool, -1, NULL)) {
+      fprintf(stderr, "poll failed\n");
+      exit(1);
+    }
+  }
+  begin = (hpjsrpc_clock_ns() - begin);
+
+  hpjsrpc_client_pool_stats(pool, &stats);
+  hpjsrpc_client_pool_destroy(pool);
+
+  p50 = bench_percentile(samples, done, 50);
+  p99 = bench_percentile(samples, done, 99);
+  p999 = bench_percentile(samples, done, 99.9);
+  bench_report((is_idempotent) ? "hedged" : "not hedged", done, 0, begin);
+  printf("  p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %8.1f us\n",
+    (p50 / 1e3), (p99 / 1e3), (p999 / 1e3), (samples[done - 1] / 1e3));
+  printf("  %llu hedges (%.1f%%), %llu won, delay %.1f us\n",
+    (unsigned long long) stats.hedges,
+    ((100.0 * (double) stats.hedges) / (double) stats.calls),
+    (unsigned long long) stats.hedge_wins, (stats.hedge_delay_in_ns / 1e3));
+  free(samples);
+
+} /* run() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv) {
+  size_t  calls = bench_iterations(argc, argv, 20000);
+  size_t  window = (4 < argc) ? (size_t) strtoull(argv[4], NULL, 10) : 16;
+  stub_t  stub;
+
+  memset(&stub, 0, sizeof(stub));
+  stub.slow_per_mille = (2 < argc)
+    ? (uint32_t) strtoul(argv[2], NULL, 10) : 20;
+  stub.slow_ns = ((3 < argc)
+    ? strtoull(argv[3], NULL, 10) : 10) * 1000000ull;
+  if (0 == calls || 0 == window || MAX_WINDOW < window) {
+    fprintf(stderr, "need calls and a window of 1 to %d\n", MAX_WINDOW);
+    return 1;
+  }
+
+  printf("%zu calls, window %zu, %u per mille slow by %llu ms, "
+    "%d connections\n", calls, window, stub.slow_per_mille,
+    (unsigned long long) (stub.slow_ns / 1000000ull), CONNECTIONS);
+
+  /* A stub per run, so that no late reply of one lands in the next */
+  stub_start(&stub);
+  run(&stub, calls, window, false);
+  stub_stop(&stub);
+  stub_start(&stub);
+  run(&stub, calls, window, true);
+  stub_stop(&stub);
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_server.h"
+#include "bench.h"
+
+/*
+ * Latency at a fixed load: an open-loop load generator on loopback sends
+ * requests at a set rate over several connections, one outstanding per
+ * connection, and times each reply from when its request was due to go
+ * out, so a stalled server is charged for the requests queued behind the
+ * stall too. Run against the server in each mode: epoll, busy-poll, and
+ * io_uring where the kernel has it. Busy-poll needs a core of its own to
+ * mean anything; with fewer cores than shards plus the generator it only
+ * competes with the generator for the CPU.
+ *
+ *   bin/bench_latency [requests] [requests/s] [connections] [mode]
+ */
+
+#define MAX_CONNECTIONS                   64
+
+typedef struct {
+  int                             fd;
+  bool                            is_busy;
+  uint64_t                        due_ns;
+} client_conn_t;
+
+static const char request[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[40,2],\"id\":7}\n";
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+add (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  const jsmntok_t *params = &req->tokens[req->paramsToken->first_child];
+  const jsmntok_t *a = &req->tokens[params->first_child];
+  const jsmntok_t *b = &req->tokens[a->next_sibling];
+
+  return hpjsrpc_json_int(&res->buffer,
+    strtoll(&req->buffer[a->start], NULL, 10)
+    + strtoll(&req->buffer[b->start], NULL, 10));
+
+} /* add() */
+
+static hpjsrpc_method_t methods[] = {
+  {"add", sizeof("add"), add, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE },
+    true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+static int
+client_connect (uint16_t port) {
+  struct sockaddr_in addr;
+  int                one = 1;
+  int                fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (0 > fd) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (0 != connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  return fd;
+
+} /* client_connect() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Drives the load; returns the number of latency samples taken */
+static size_t
+generate (uint16_t port, size_t requests, size_t rate, size_t conn_count,
+  uint64_t *samples) {
+  client_conn_t   conns[MAX_CONNECTIONS];
+  struct pollfd   pfds[MAX_CONNECTIONS];
+  uint64_t        interval_ns = (1000000000ull / rate);
+  uint64_t        next_ns;
+  size_t          sent = 0;
+  size_t          done = 0;
+
+  for (size_t ii = 0; ii < conn_count; ++ii) {
+    conns[ii].fd = client_connect(port);
+    conns[ii].is_busy = false;
+    if (0 > conns[ii].fd) {
+      fprintf(stderr, "connect failed\n");
+      exit(1);
+    }
+    pfds[ii].fd = conns[ii].fd;
+    pfds[ii].events = POLLIN;
+  }
+
+  next_ns = hpjsrpc_clock_ns();
+  while (done < requests) {
+    uint64_t        now_ns = hpjsrpc_clock_ns();
+    struct timespec wait = { 0, 0 };
+
+    /* Everything due goes out on an idle connection, if there is one */
+    for (size_t ii = 0; ii < conn_count && sent < requests
+        && next_ns <= now_ns; ++ii) {
+      if (!conns[ii].is_busy) {
+        if ((ssize_t) (sizeof(request) - 1) != write(conns[ii].fd, request,
+            (sizeof(request) - 1))) {
+          fprintf(stderr, "write failed\n");
+          exit(1);
+        }
+        conns[ii].is_busy = true;
+        conns[ii].due_ns = next_ns;
+        next_ns += interval_ns;
+        sent++;
+      }
+    }
+
+    if (sent < requests && next_ns > now_ns) {
+      wait.tv_sec = (time_t) ((next_ns - now_ns) / 1000000000ull);
+      wait.tv_nsec = (long) ((next_ns - now_ns) % 1000000000ull);
+    }
+    if (0 >= ppoll(pfds, conn_count, (sent < requests) ? &wait : NULL,
+        NULL)) {
+      continue;
+    }
+
+    now_ns = hpjsrpc_clock_ns();
+    for (size_t ii = 0; ii < conn_count; ++ii) {
+      char    reply[256];
+      ssize_t got;
+
+      if (0 == (pfds[ii].revents & POLLIN)) {
+        continue;
+      }
+      got = read(conns[ii].fd, reply, sizeof(reply));
+      if (0 >= got) {
+        fprintf(stderr, "connection lost\n");
+        exit(1);
+      }
+      /* One request outstanding: a newline ends its reply */
+      if (conns[ii].is_busy && NULL != memchr(reply, '\n', (size_t) got)) {
+        samples[done++] = (now_ns - conns[ii].due_ns);
+        conns[ii].is_busy = false;
+      }
+    }
+  }
+
+  for (size_t ii = 0; ii < conn_count; ++ii) {
+    close(conns[ii].fd);
+  }
+
+  return done;
+
+} /* generate() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+run (hpjsrpc_engine_t *engine, const char *mode, size_t requests,
+  size_t rate, size_t conn_count) {
+  hpjsrpc_server_config_t  config;
+  hpjsrpc_server_t        *server;
+  uint64_t                *samples = malloc(requests * sizeof(*samples));
+  size_t                   count;
+  uint64_t                 p50;
+  uint64_t                 p99;
+  uint64_t                 p999;
+
+  memset(&config, 0, sizeof(config));
+  config.address = "127.0.0.1";
+  config.shard_count = 1;
+  config.read_buffer_size_in_bytes = 16384;
+  config.context.max_token_count = 64;
+  config.context.segment_size_in_bytes = 512;
+  config.busy_poll = (0 == strcmp(mode, "busy"));
+  config.backend = (0 == strcmp(mode, "uring"))
+    ? HPJSRPC_SERVER_IO_URING : HPJSRPC_SERVER_EPOLL;
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_server_new(&server, engine, &config)
+      || HPJSRPC_NO_ERROR != hpjsrpc_server_start(server)) {
+    printf("%-10s not available\n", mode);
+    free(samples);
+    return;
+  }
+
+  count = generate(hpjsrpc_server_port(server), requests, rate, conn_count,
+    samples);
+  hpjsrpc_server_destroy(server);
+
+  /* Sorts samples, so the last one is the maximum */
+  p50 = bench_percentile(samples, count, 50);
+  p99 = bench_percentile(samples, count, 99);
+  p999 = bench_percentile(samples, count, 99.9);
+  printf("%-10s p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us  max %8.1f us\n",
+    mode, (p50 / 1e3), (p99 / 1e3), (p999 / 1e3), (samples[count - 1] / 1e3));
+  free(samples);
+
+} /* run() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv) {
+  size_t             requests = bench_iterations(argc, argv, 20000);
+  size_t             rate = (2 < argc)
+    ? (size_t) strtoull(argv[2], NULL, 10) : 10000;
+  size_t             conn_count = (3 < argc)
+    ? (size_t) strtoull(argv[3], NULL, 10) : 8;
+  hpjsrpc_engine_t  *engine;
+
+  if (0 == requests || 0 == rate || 0 == conn_count
+      || MAX_CONNECTIONS < conn_count) {
+    fprintf(stderr, "need requests, a rate and 1 to %d connections\n",
+      MAX_CONNECTIONS);
+    return 1;
+  }
+  if (HPJSRPC_NO_ERROR != hpjsrpc_new(&engine)
+      || HPJSRPC_NO_ERROR != rpc_register_methods(engine, methods, 1)) {
+    fprintf(stderr, "engine setup failed\n");
+    return 1;
+  }
+
+  printf("%zu requests at %zu/s over %zu connections, %ld online cpus\n",
+    requests, rate, conn_count, sysconf(_SC_NPROCESSORS_ONLN));
+  if (4 < argc) {
+    run(engine, argv[4], requests, rate, conn_count);
+  } else {
+    run(engine, "epoll", requests, rate, conn_count);
+    run(engine, "busy", requests, rate, conn_count);
+    run(engine, "uring", requests, rate, conn_count);
+  }
+
+  hpjsrpc_destroy(engine);
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_segment.h"
+#include "hpjsrpc_queue.h"
+#include "bench.h"
+
+/*
+ * End-to-end pipeline over hpjsrpc_queue_t: a reader thread, standing in
+ * for an I/O thread, replays newline-delimited requests into contexts and
+ * queues them; worker threads process them in batches and queue them back;
+ * the main thread, standing in for the writer, takes the replies and hands
+ * the contexts back to the reader through a third queue. The requests are
+ * read from a file (one per line, e.g. a capture such as requests.jsonl) or
+ * default to a small built-in mix.
+ *
+ *   bin/bench_pipeline [requests] [requests.jsonl] [workers]
+ */
+
+#define PIPELINE_SLOTS                    256
+#define PIPELINE_BATCH                    16
+#define MAX_WORKERS                       16
+#define MAX_LINES                         65536
+
+typedef struct {
+  hpjsrpc_context_t              *ctx;
+  const char                     *line;
+  size_t                          length;
+} job_t;
+
+static hpjsrpc_queue_t   *free_jobs;
+static hpjsrpc_queue_t   *requests;
+static hpjsrpc_queue_t   *replies;
+static const char        *lines[MAX_LINES];
+static size_t             lengths[MAX_LINES];
+static size_t             line_count;
+static size_t             total;
+static int                stopping;
+
+static const char builtin[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[40,2],\"id\":1}\n"
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[1,-1],\"id\":\"two\"}\n"
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[7,7]}\n"
+  "{\"jsonrpc\":\"2.0\",\"method\":\"missing\",\"params\":[],\"id\":4}\n"
+  "[{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[1,2],\"id\":5},"
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[3,4],\"id\":6}]\n"
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[1,\n";
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+add (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  const jsmntok_t *params = &req->tokens[req->paramsToken->first_child];
+  const jsmntok_t *a = &req->tokens[params->first_child];
+  const jsmntok_t *b = &req->tokens[a->next_sibling];
+
+  return hpjsrpc_json_int(&res->buffer,
+    strtoll(&req->buffer[a->start], NULL, 10)
+    + strtoll(&req->buffer[b->start], NULL, 10));
+
+} /* add() */
+
+static hpjsrpc_method_t methods[] = {
+  {"add", sizeof("add"), add, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE },
+    true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* Splits text into lines in place; empty lines are skipped */
+static void
+split_lines (char *text, size_t length) {
+  char *p = text;
+  char *end = (text + length);
+
+  while (p < end && line_count < MAX_LINES) {
+    char *nl = memchr(p, '\n', (size_t) (end - p));
+    char *stop = (NULL == nl) ? end : nl;
+
+    if (stop > p) {
+      lines[line_count] = p;
+      lengths[line_count] = (size_t) (stop - p);
+      line_count++;
+    }
+    p = (stop + 1);
+  }
+
+} /* split_lines() */
+
+/* ------------------------------------------------------------------------- */
+
+static char *
+load (const char *path, size_t *length) {
+  FILE   *fp = fopen(path, "rb");
+  char   *text;
+  long    size;
+
+  if (NULL == fp) {
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  text = (0 < size) ? malloc((size_t) size) : NULL;
+  if (NULL != text && (size_t) size != fread(text, 1, (size_t) size, fp)) {
+    free(text);
+    text = NULL;
+  }
+  fclose(fp);
+  *length = (size_t) size;
+
+  return text;
+
+} /* load() */
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+reader_main (void *arg) {
+  size_t   next = 0;
+
+  (void) arg;
+  while (next < total) {
+    void   *items[PIPELINE_BATCH];
+    size_t  count = hpjsrpc_queue_pop_batch(free_jobs, items,
+      ((total - next) < PIPELINE_BATCH) ? (total - next) : PIPELINE_BATCH);
+
+    if (0 == count) {
+      sched_yield();
+      continue;
+    }
+    for (size_t ii = 0; ii < count; ++ii, ++next) {
+      job_t *job = (job_t *) items[ii];
+      job->line = lines[next % line_count];
+      job->length = lengths[next % line_count];
+    }
+    for (size_t pushed = 0; pushed < count; ) {
+      size_t n = hpjsrpc_queue_push_batch(requests, &items[pushed],
+        (count - pushed));
+      if (0 == n) {
+        sched_yield();
+      }
+      pushed += n;
+    }
+  }
+
+  return NULL;
+
+} /* reader_main() */
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+worker_main (void *arg) {
+  void *items[PIPELINE_BATCH];
+
+  (void) arg;
+  while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+    size_t count = hpjsrpc_queue_pop_batch(requests, items, PIPELINE_BATCH);
+
+    if (0 == count) {
+      sched_yield();
+      continue;
+    }
+    for (size_t ii = 0; ii < count; ++ii) {
+      job_t *job = (job_t *) items[ii];
+      hpjsrpc_context_process(job->ctx, job->line, job->length);
+    }
+    for (size_t pushed = 0; pushed < count; ) {
+      size_t n = hpjsrpc_queue_push_batch(replies, &items[pushed],
+        (count - pushed));
+      if (0 == n) {
+        sched_yield();
+      }
+      pushed += n;
+    }
+  }
+
+  return NULL;
+
+} /* worker_main() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv) {
+  size_t              worker_count = (3 < argc)
+    ? (size_t) strtoull(argv[3], NULL, 10) : 2;
+  hpjsrpc_engine_t   *engine;
+  job_t               jobs[PIPELINE_SLOTS];
+  pthread_t           reader;
+  pthread_t           workers[MAX_WORKERS];
+  char               *text;
+  size_t              length;
+  size_t              received = 0;
+  uint64_t            bytes = 0;
+  uint64_t            begin;
+
+  total = bench_iterations(argc, argv, 1000000);
+  if (2 < argc) {
+    text = load(argv[2], &length);
+    if (NULL == text) {
+      fprintf(stderr, "%s: cannot read\n", argv[2]);
+      return 1;
+    }
+  } else {
+    length = (sizeof(builtin) - 1);
+    text = malloc(length);
+    memcpy(text, builtin, length);
+  }
+  split_lines(text, length);
+  if (0 == line_count || 0 == worker_count || MAX_WORKERS < worker_count) {
+    fprintf(stderr, "no requests, or not 1 to %d workers\n", MAX_WORKERS);
+    return 1;
+  }
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_new(&engine)
+      || HPJSRPC_NO_ERROR != rpc_register_methods(engine, methods, 1)
+      || HPJSRPC_NO_ERROR != hpjsrpc_queue_new(&free_jobs, PIPELINE_SLOTS)
+      || HPJSRPC_NO_ERROR != hpjsrpc_queue_new(&requests, PIPELINE_SLOTS)
+      || HPJSRPC_NO_ERROR != hpjsrpc_queue_new(&replies, PIPELINE_SLOTS)) {
+    fprintf(stderr, "setup failed\n");
+    return 1;
+  }
+  for (size_t ii = 0; ii < PIPELINE_SLOTS; ++ii) {
+    if (HPJSRPC_NO_ERROR != hpjsrpc_context_new(&jobs[ii].ctx, engine, 256,
+        1024, 0, 0)) {
+      fprintf(stderr, "context setup failed\n");
+      return 1;
+    }
+    hpjsrpc_queue_push(free_jobs, &jobs[ii]);
+  }
+
+  printf("%zu distinct requests, %zu workers\n", line_count, worker_count);
+  begin = hpjsrpc_clock_ns();
+  pthread_create(&reader, NULL, reader_main, NULL);
+  for (size_t ii = 0; ii < worker_count; ++ii) {
+    pthread_create(&workers[ii], NULL, worker_main, NULL);
+  }
+
+  while (received < total) {
+    void   *items[PIPELINE_BATCH];
+    size_t  count = hpjsrpc_queue_pop_batch(replies, items, PIPELINE_BATCH);
+
+    if (0 == count) {
+      sched_yield();
+      continue;
+    }
+    for (size_t ii = 0; ii < count; ++ii) {
+      job_t *job = (job_t *) items[ii];
+      bytes += hpjsrpc_buffer_length(
+        &hpjsrpc_context_response(job->ctx)->buffer);
+    }
+    /* The free queue holds every slot, so this cannot fill up */
+    hpjsrpc_queue_push_batch(free_jobs, items, count);
+    received += count;
+  }
+  begin = (hpjsrpc_clock_ns() - begin);
+
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(reader, NULL);
+  for (size_t ii = 0; ii < worker_count; ++ii) {
+    pthread_join(workers[ii], NULL);
+  }
+  bench_report("requests through the pipeline", total, bytes, begin);
+
+  for (size_t ii = 0; ii < PIPELINE_SLOTS; ++ii) {
+    hpjsrpc_context_destroy(jobs[ii].ctx);
+  }
+  hpjsrpc_queue_destroy(free_jobs);
+  hpjsrpc_queue_destroy(requests);
+  hpjsrpc_queue_destroy(replies);
+  hpjsrpc_destroy(engine);
+  free(text);
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_queue.h"
+#include "bench.h"
+
+/*
+ * hpjsrpc_queue_t transfer rate: producers push items that consumers pop,
+ * one at a time and in batches, with 1, 2 and 4 threads on each side. A
+ * thread that finds the queue full (empty) yields and retries.
+ *
+ *   bin/bench_queue [items]
+ */
+
+#define QUEUE_CAPACITY                    1024
+#define MAX_BATCH                         64
+#define MAX_THREADS                       4
+
+typedef struct {
+  hpjsrpc_queue_t                *queue;
+  size_t                          items;
+  size_t                          batch;
+  uint64_t                        sum;
+  pthread_barrier_t              *start;
+} side_t;
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+producer_main (void *arg) {
+  side_t    *s = (side_t *) arg;
+  void      *items[MAX_BATCH];
+  size_t     sent = 0;
+
+  pthread_barrier_wait(s->start);
+  while (sent < s->items) {
+    size_t count = (s->items - sent) < s->batch ? (s->items - sent) : s->batch;
+    size_t pushed;
+
+    for (size_t ii = 0; ii < count; ++ii) {
+      items[ii] = (void *) (uintptr_t) (sent + ii + 1);
+    }
+    pushed = hpjsrpc_queue_push_batch(s->queue, items, count);
+    if (0 == pushed) {
+      sched_yield();
+    }
+    sent += pushed;
+  }
+
+  return NULL;
+
+} /* producer_main() */
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+consumer_main (void *arg) {
+  side_t    *s = (side_t *) arg;
+  void      *items[MAX_BATCH];
+  size_t     received = 0;
+
+  pthread_barrier_wait(s->start);
+  while (received < s->items) {
+    size_t count = (s->items - received) < s->batch
+      ? (s->items - received) : s->batch;
+    size_t popped = hpjsrpc_queue_pop_batch(s->queue, items, count);
+
+    if (0 == popped) {
+      sched_yield();
+    }
+    for (size_t ii = 0; ii < popped; ++ii) {
+      s->sum += (uint64_t) (uintptr_t) items[ii];
+    }
+    received += popped;
+  }
+
+  return NULL;
+
+} /* consumer_main() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+run (size_t threads, size_t batch, size_t items) {
+  hpjsrpc_queue_t    *queue;
+  pthread_t           tids[2 * MAX_THREADS];
+  side_t              sides[2 * MAX_THREADS];
+  pthread_barrier_t   start;
+  size_t              per_thread = (items / threads);
+  uint64_t            expected;
+  uint64_t            sum = 0;
+  uint64_t            begin;
+  char                label[64];
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_queue_new(&queue, QUEUE_CAPACITY)) {
+    fprintf(stderr, "queue setup failed\n");
+    exit(1);
+  }
+
+  pthread_barrier_init(&start, NULL, (unsigned) ((2 * threads) + 1));
+  for (size_t ii = 0; ii < (2 * threads); ++ii) {
+    sides[ii].queue = queue;
+    sides[ii].items = per_thread;
+    sides[ii].batch = batch;
+    sides[ii].sum = 0;
+    sides[ii].start = &start;
+    pthread_create(&tids[ii], NULL,
+      (ii < threads) ? producer_main : consumer_main, &sides[ii]);
+  }
+
+  pthread_barrier_wait(&start);
+  begin = hpjsrpc_clock_ns();
+  for (size_t ii = 0; ii < (2 * threads); ++ii) {
+    pthread_join(tids[ii], NULL);
+    sum += sides[ii].sum;
+  }
+  begin = (hpjsrpc_clock_ns() - begin);
+  pthread_barrier_destroy(&start);
+  hpjsrpc_queue_destroy(queue);
+
+  snprintf(label, sizeof(label), "%zuP/%zuC, batch %zu", threads, threads,
+    batch);
+  bench_report(label, (uint64_t) (per_thread * threads), 0, begin);
+
+  /* Every item arrives exactly once */
+  expected = (uint64_t) threads * (((uint64_t) per_thread
+    * (uint64_t) (per_thread + 1)) / 2);
+  if (sum != expected) {
+    printf("  items lost or duplicated\n");
+    exit(1);
+  }
+
+} /* run() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv) {
+  size_t items = bench_iterations(argc, argv, 4000000);
+
+  for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2) {
+    run(threads, 1, items);
+    run(threads, 16, items);
+    run(threads, MAX_BATCH, items);
+  }
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
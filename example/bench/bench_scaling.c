@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_context.h"
+#include "bench.h"
+
+/*
+ * Multi-core scaling: 1, 2, 4, ... 64 threads share one engine, each
+ * processing requests through a context of its own. With no shared writes
+ * on the request path throughput should grow with the thread count up to
+ * the number of cores. "admission" as the second argument turns admission
+ * control on (with a limit never reached), to show what its shared
+ * counters cost.
+ *
+ *   bin/bench_scaling [requests per thread] [admission]
+ */
+
+#define MAX_THREADS                       64
+
+static const char request[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[40,2],\"id\":7}";
+
+typedef struct {
+  hpjsrpc_engine_t               *engine;
+  size_t                          requests;
+  pthread_barrier_t              *start;
+  uint64_t                        failures;
+} worker_t;
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+add (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  const jsmntok_t *params = &req->tokens[req->paramsToken->first_child];
+  const jsmntok_t *a = &req->tokens[params->first_child];
+  const jsmntok_t *b = &req->tokens[a->next_sibling];
+
+  return hpjsrpc_json_int(&res->buffer,
+    strtoll(&req->buffer[a->start], NULL, 10)
+    + strtoll(&req->buffer[b->start], NULL, 10));
+
+} /* add() */
+
+static hpjsrpc_method_t methods[] = {
+  {"add", sizeof("add"), add, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE },
+    true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+worker_main (void *arg) {
+  worker_t           *w = (worker_t *) arg;
+  hpjsrpc_context_t  *ctx;
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_context_new(&ctx, w->engine, 64, 512, 0,
+      0)) {
+    w->failures = w->requests;
+    pthread_barrier_wait(w->start);
+    return NULL;
+  }
+
+  pthread_barrier_wait(w->start);
+  for (size_t ii = 0; ii < w->requests; ++ii) {
+    if (HPJSRPC_NO_ERROR != hpjsrpc_context_process(ctx, request,
+        (sizeof(request) - 1))) {
+      w->failures++;
+    }
+  }
+
+  hpjsrpc_context_destroy(ctx);
+  return NULL;
+
+} /* worker_main() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Runs thread_count workers at once; returns the wall time in ns */
+static uint64_t
+run (hpjsrpc_engine_t *engine, size_t thread_count, size_t requests,
+  uint64_t *failures) {
+  pthread_t          threads[MAX_THREADS];
+  worker_t           workers[MAX_THREADS];
+  pthread_barrier_t  start;
+  uint64_t           begin;
+
+  pthread_barrier_init(&start, NULL, (unsigned) (thread_count + 1));
+  for (size_t ii = 0; ii < thread_count; ++ii) {
+    workers[ii].engine = engine;
+    workers[ii].requests = requests;
+    workers[ii].start = &start;
+    workers[ii].failures = 0;
+    pthread_create(&threads[ii], NULL, worker_main, &workers[ii]);
+  }
+
+  pthread_barrier_wait(&start);
+  begin = hpjsrpc_clock_ns();
+  for (size_t ii = 0; ii < thread_count; ++ii) {
+    pthread_join(threads[ii], NULL);
+    *failures += workers[ii].failures;
+  }
+  begin = (hpjsrpc_clock_ns() - begin);
+  pthread_barrier_destroy(&start);
+
+  return begin;
+
+} /* run() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv) {
+  size_t             requests = bench_iterations(argc, argv, 200000);
+  hpjsrpc_engine_t  *engine;
+  double             single = 0;
+  uint64_t           failures = 0;
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_new(&engine)
+      || HPJSRPC_NO_ERROR != rpc_register_methods(engine, methods, 1)) {
+    fprintf(stderr, "engine setup failed\n");
+    return 1;
+  }
+
+  if (2 < argc && 0 == strcmp(argv[2], "admission")) {
+    hpjsrpc_admission_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.max_concurrency = (1u << 20);
+    hpjsrpc_set_admission(engine, &config);
+  }
+
+  printf("%ld online cpus, %zu requests per thread\n",
+    sysconf(_SC_NPROCESSORS_ONLN), requests);
+
+  for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2) {
+    uint64_t elapsed = run(engine, threads, requests, &failures);
+    double   rate = (((double) threads * (double) requests * 1e9)
+      / (double) elapsed);
+
+    if (1 == threads) {
+      single = rate;
+    }
+    printf("%3zu threads %14.0f req/s  speedup %6.2f  efficiency %5.1f%%\n",
+      threads, rate, (rate / single),
+      ((100.0 * rate) / (single * (double) threads)));
+  }
+
+  hpjsrpc_destroy(engine);
+
+  if (0 != failures) {
+    printf("%llu requests failed\n", (unsigned long long) failures);
+    return 1;
+  }
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
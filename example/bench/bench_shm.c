@@ -0,0 +1,255 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_server.h"
+#include "hpjsrpc_shm.h"
+#include "bench.h"
+
+/*
+ * Shared memory against TCP loopback, same requests, same engine: a client
+ * thread keeps a window of requests in flight to a server thread, over an
+ * hpjsrpc_shm_t channel and over one NDJSON connection to hpjsrpc_server_t.
+ * A window of 1 is a round trip per request. Spinning for the peer needs
+ * a core per side; on a single core the channel is set to sleep at once.
+ *
+ *   bin/bench_shm [requests] [window]
+ */
+
+#define MAX_WINDOW                        256
+
+static const char request[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[40,2],\"id\":7}\n";
+
+typedef struct {
+  hpjsrpc_shm_t                  *shm;
+  hpjsrpc_engine_t               *engine;
+} server_arg_t;
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+add (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  const jsmntok_t *params = &req->tokens[req->paramsToken->first_child];
+  const jsmntok_t *a = &req->tokens[params->first_child];
+  const jsmntok_t *b = &req->tokens[a->next_sibling];
+
+  return hpjsrpc_json_int(&res->buffer,
+    strtoll(&req->buffer[a->start], NULL, 10)
+    + strtoll(&req->buffer[b->start], NULL, 10));
+
+} /* add() */
+
+static hpjsrpc_method_t methods[] = {
+  {"add", sizeof("add"), add, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE },
+    true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+shm_server_main (void *arg) {
+  server_arg_t       *s = (server_arg_t *) arg;
+  hpjsrpc_context_t  *ctx;
+
+  if (HPJSRPC_NO_ERROR == hpjsrpc_context_new(&ctx, s->engine, 64, 512, 0,
+      0)) {
+    hpjsrpc_shm_serve(s->shm, ctx);
+    hpjsrpc_context_destroy(ctx);
+  }
+
+  return NULL;
+
+} /* shm_server_main() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+run_shm (hpjsrpc_engine_t *engine, size_t requests, size_t window) {
+  hpjsrpc_shm_config_t  config;
+  hpjsrpc_shm_t        *client;
+  server_arg_t          server;
+  pthread_t             thread;
+  unsigned              spin_count = (1 < sysconf(_SC_NPROCESSORS_ONLN))
+    ? 0 : 1;
+  size_t                sent = 0;
+  size_t                done = 0;
+  uint64_t              begin;
+  char                  label[64];
+
+  memset(&config, 0, sizeof(config));
+  config.spin_count = spin_count;
+  if (HPJSRPC_NO_ERROR != hpjsrpc_shm_new(&client, &config)
+      || HPJSRPC_NO_ERROR != hpjsrpc_shm_attach(&server.shm,
+        hpjsrpc_shm_fd(client), spin_count)) {
+    fprintf(stderr, "shm setup failed\n");
+    exit(1);
+  }
+  server.engine = engine;
+  pthread_create(&thread, NULL, shm_server_main, &server);
+
+  begin = hpjsrpc_clock_ns();
+  while (done < requests) {
+    const char *reply;
+    size_t      length;
+
+    while (sent < requests && (sent - done) < window) {
+      if (HPJSRPC_NO_ERROR != hpjsrpc_shm_send(client, request,
+          (sizeof(request) - 2))) {
+        fprintf(stderr, "send failed\n");
+        exit(1);
+      }
+      sent++;
+    }
+    if (HPJSRPC_NO_ERROR != hpjsrpc_shm_receive(client, &reply, &length)) {
+      fprintf(stderr, "receive failed\n");
+      exit(1);
+    }
+    hpjsrpc_shm_consume(client);
+    done++;
+  }
+  begin = (hpjsrpc_clock_ns() - begin);
+
+  snprintf(label, sizeof(label), "shm, window %zu", window);
+  bench_report(label, done, 0, begin);
+
+  hpjsrpc_shm_close(client);
+  pthread_join(thread, NULL);
+  hpjsrpc_shm_destroy(server.shm);
+  hpjsrpc_shm_destroy(client);
+
+} /* run_shm() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+run_tcp (hpjsrpc_engine_t *engine, size_t requests, size_t window) {
+  hpjsrpc_server_config_t  config;
+  hpjsrpc_server_t        *server;
+  struct sockaddr_in       addr;
+  char                     reply[65536];
+  size_t                   sent = 0;
+  size_t                   done = 0;
+  int                      one = 1;
+  int                      fd;
+  uint64_t                 begin;
+  char                     label[64];
+
+  memset(&config, 0, sizeof(config));
+  config.address = "127.0.0.1";
+  config.shard_count = 1;
+  config.read_buffer_size_in_bytes = 65536;
+  config.max_pipeline = MAX_WINDOW;
+  config.context.max_token_count = 64;
+  config.context.segment_size_in_bytes = 512;
+  if (HPJSRPC_NO_ERROR != hpjsrpc_server_new(&server, engine, &config)
+      || HPJSRPC_NO_ERROR != hpjsrpc_server_start(server)) {
+    fprintf(stderr, "server setup failed\n");
+    exit(1);
+  }
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(hpjsrpc_server_port(server));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (0 > fd || 0 != connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    fprintf(stderr, "connect failed\n");
+    exit(1);
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  begin = hpjsrpc_clock_ns();
+  while (done < requests) {
+    ssize_t got;
+
+    /* Top the window up with one write */
+    if (sent < requests && (sent - done) < window) {
+      char   burst[MAX_WINDOW * sizeof(request)];
+      size_t count = (window - (sent - done));
+
+      if (count > (requests - sent)) {
+        count = (requests - sent);
+      }
+      for (size_t ii = 0; ii < count; ++ii) {
+        memcpy(&burst[ii * (sizeof(request) - 1)], request,
+          (sizeof(request) - 1));
+      }
+      if ((ssize_t) (count * (sizeof(request) - 1)) != write(fd, burst,
+          (count * (sizeof(request) - 1)))) {
+        fprintf(stderr, "write failed\n");
+        exit(1);
+      }
+      sent += count;
+    }
+
+    got = read(fd, reply, sizeof(reply));
+    if (0 >= got) {
+      fprintf(stderr, "connection lost\n");
+      exit(1);
+    }
+    for (char *p = reply; NULL != (p = memchr(p, '\n',
+        (size_t) (&reply[got] - p))); ++p) {
+      done++;
+    }
+  }
+  begin = (hpjsrpc_clock_ns() - begin);
+
+  snprintf(label, sizeof(label), "tcp, window %zu", window);
+  bench_report(label, done, 0, begin);
+
+  close(fd);
+  hpjsrpc_server_destroy(server);
+
+} /* run_tcp() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv) {
+  size_t             requests = bench_iterations(argc, argv, 200000);
+  size_t             window = (2 < argc)
+    ? (size_t) strtoull(argv[2], NULL, 10) : 0;
+  hpjsrpc_engine_t  *engine;
+
+  if (MAX_WINDOW < window) {
+    fprintf(stderr, "window up to %d\n", MAX_WINDOW);
+    return 1;
+  }
+  if (HPJSRPC_NO_ERROR != hpjsrpc_new(&engine)
+      || HPJSRPC_NO_ERROR != rpc_register_methods(engine, methods, 1)) {
+    fprintf(stderr, "engine setup failed\n");
+    return 1;
+  }
+
+  printf("%zu requests, %ld online cpus\n", requests,
+    sysconf(_SC_NPROCESSORS_ONLN));
+  /* Windows of 1 and 32 unless one was given */
+  for (size_t w = ((0 != window) ? window : 1); w <= MAX_WINDOW; w *= 32) {
+    run_shm(engine, requests, w);
+    run_tcp(engine, requests, w);
+    if (0 != window) {
+      break;
+    }
+  }
+
+  hpjsrpc_destroy(engine);
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
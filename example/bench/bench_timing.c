@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_timing.h"
+#include "bench.h"
+
+/*
+ * What stage timing costs: first one read of each clock, hpjsrpc_clock_ns()
+ * (CLOCK_MONOTONIC), the raw clock the stage timers fall back on, and the
+ * stage timers' own begin and end, fenced TSC reads where there is an
+ * invariant TSC; then a small request processed with stage timing off,
+ * one request in N timed, and every request timed. Modes alternate over
+ * several rounds and the best round of each counts, so that drift in the
+ * machine's speed does not land on one mode alone. Building with
+ * -DHPJSRPC_TIMING=0 shows what is left with timing compiled out.
+ *
+ *   bin/bench_timing [iterations] [N]
+ */
+
+#define ROUNDS                            5
+
+static const char request[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[40,2],\"id\":7}";
+
+/* Keeps the clock reads from being optimized out */
+static volatile uint64_t sink;
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+add (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  const jsmntok_t *params = &req->tokens[req->paramsToken->first_child];
+  const jsmntok_t *a = &req->tokens[params->first_child];
+  const jsmntok_t *b = &req->tokens[a->next_sibling];
+
+  return hpjsrpc_json_int(&res->buffer,
+    strtoll(&req->buffer[a->start], NULL, 10)
+    + strtoll(&req->buffer[b->start], NULL, 10));
+
+} /* add() */
+
+static hpjsrpc_method_t methods[] = {
+  {"add", sizeof("add"), add, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE },
+    true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* Best of ROUNDS loops of iterations reads of the clock read names */
+#define BENCH_CLOCK(label, read, iterations)                                 \
+  do {                                                                       \
+    uint64_t best = UINT64_MAX;                                              \
+    for (size_t round = 0; round < ROUNDS; ++round) {                        \
+      uint64_t begin = hpjsrpc_clock_ns();                                   \
+      uint64_t sum = 0;                                                      \
+      for (size_t ii = 0; ii < (iterations); ++ii) {                         \
+        sum += read;                                                         \
+      }                                                                      \
+      sink = sum;                                                            \
+      begin = (hpjsrpc_clock_ns() - begin);                                  \
+      best = (begin < best) ? begin : best;                                  \
+    }                                                                        \
+    bench_report((label), (iterations), 0, best);                            \
+  } while (0)
+
+/* ------------------------------------------------------------------------- */
+
+static void
+bench_clocks (size_t iterations) {
+
+  hpjsrpc_timing_calibrate();
+  printf("stage clock: %s\n", (hpjsrpc_timing_clock.is_tsc)
+    ? "invariant TSC" : "CLOCK_MONOTONIC_RAW");
+
+  BENCH_CLOCK("hpjsrpc_clock_ns()", hpjsrpc_clock_ns(), iterations);
+  BENCH_CLOCK("hpjsrpc_timing_raw_ns()", hpjsrpc_timing_raw_ns(),
+    iterations);
+  BENCH_CLOCK("hpjsrpc_timing_begin()", hpjsrpc_timing_begin(), iterations);
+  BENCH_CLOCK("hpjsrpc_timing_end()", hpjsrpc_timing_end(), iterations);
+  BENCH_CLOCK("begin() + end(), one stage", (hpjsrpc_timing_end()
+    - hpjsrpc_timing_begin()), iterations);
+
+} /* bench_clocks() */
+
+/* ------------------------------------------------------------------------- */
+
+/* One round of iterations requests; elapsed nanoseconds */
+static uint64_t
+process (hpjsrpc_context_t *ctx, size_t iterations) {
+  uint64_t begin = hpjsrpc_clock_ns();
+
+  for (size_t ii = 0; ii < iterations; ++ii) {
+    if (HPJSRPC_NO_ERROR != hpjsrpc_context_process(ctx, request,
+        (sizeof(request) - 1))) {
+      fprintf(stderr, "request failed\n");
+      exit(1);
+    }
+  }
+
+  return (hpjsrpc_clock_ns() - begin);
+
+} /* process() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+bench_requests (hpjsrpc_engine_t *engine, size_t iterations,
+  uint32_t sample_every) {
+  uint32_t            modes[3] = { 0, sample_every, 1 };
+  uint64_t            best[3] = { UINT64_MAX, UINT64_MAX, UINT64_MAX };
+  /* Compiled out, timing can only be off */
+  size_t              mode_count = (0 != HPJSRPC_TIMING) ? 3 : 1;
+  hpjsrpc_context_t  *ctx;
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_context_new(&ctx, engine, 64, 512, 0, 0)) {
+    fprintf(stderr, "context setup failed\n");
+    exit(1);
+  }
+  /* Warmed up once, then the modes take turns */
+  process(ctx, (iterations / 10));
+  for (size_t round = 0; round < ROUNDS; ++round) {
+    for (size_t mm = 0; mm < mode_count; ++mm) {
+      uint64_t elapsed;
+
+      hpjsrpc_set_timing(engine, modes[mm]);
+      elapsed = process(ctx, iterations);
+      best[mm] = (elapsed < best[mm]) ? elapsed : best[mm];
+    }
+  }
+  hpjsrpc_context_destroy(ctx);
+
+  bench_report("request, timing off", iterations, 0, best[0]);
+  if (1 == mode_count) {
+    printf("stage timing compiled out (HPJSRPC_TIMING 0)\n");
+    return;
+  }
+  {
+    char label[64];
+
+    snprintf(label, sizeof(label), "request, 1 in %u timed", sample_every);
+    bench_report(label, iterations, 0, best[1]);
+  }
+  bench_report("request, every one timed", iterations, 0, best[2]);
+  printf("overhead against off: %+.1f ns/request 1 in %u, %+.1f ns/request "
+    "every one\n", (((double) best[1] - (double) best[0])
+    / (double) iterations), sample_every, (((double) best[2]
+    - (double) best[0]) / (double) iterations));
+
+} /* bench_requests() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv) {
+  size_t             iterations = bench_iterations(argc, argv, 1000000);
+  uint32_t           sample_every = (2 < argc)
+    ? (uint32_t) strtoul(argv[2], NULL, 10) : 64;
+  hpjsrpc_engine_t  *engine;
+
+  if (0 == iterations || 2 > sample_every) {
+    fprintf(stderr, "need iterations, and N of 2 or more\n");
+    return 1;
+  }
+  if (HPJSRPC_NO_ERROR != hpjsrpc_new(&engine)
+      || HPJSRPC_NO_ERROR != rpc_register_methods(engine, methods, 1)) {
+    fprintf(stderr, "engine setup failed\n");
+    return 1;
+  }
+
+  bench_clocks(iterations);
+  bench_requests(engine, iterations, sample_every);
+
+  hpjsrpc_destroy(engine);
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_server.h"
+#include "bench.h"
+
+/*
+ * Server throughput, epoll backend against io_uring, on loopback: several
+ * connections each keep a window of pipelined ~200-byte requests in
+ * flight, sending the next window once the last reply of the previous one
+ * is in. A window of 1 is one request per round trip, where the per-call
+ * system call cost shows most.
+ *
+ *   bin/bench_transport [requests] [connections] [window]
+ */
+
+#define MAX_CONNECTIONS                   64
+#define MAX_WINDOW                        64
+
+/* About 200 bytes, the request size io_uring was meant for */
+static const char request[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"abcdefghijklmnopqrst"
+  "uvwxyz0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrs"
+  "tuvwxyz0123456789abcdefghijklmnopqrstuvwxyz0123456\"],\"id\":12345}\n";
+
+typedef struct {
+  int                             fd;
+  size_t                          awaited;
+} client_conn_t;
+
+/* ------------------------------------------------------------------------- */
+
+static hpjsrpc_method_t methods[] = {
+  {"echo", sizeof("echo"), bench_echo, false, 1, { JSMN_STRING }, true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+static int
+client_connect (uint16_t port) {
+  struct sockaddr_in addr;
+  int                one = 1;
+  int                fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (0 > fd) {
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (0 != connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  return fd;
+
+} /* client_connect() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Sends window requests in one write */
+static void
+client_send (client_conn_t *conn, const char *burst, size_t window) {
+  size_t length = (window * (sizeof(request) - 1));
+
+  if ((ssize_t) length != write(conn->fd, burst, length)) {
+    fprintf(stderr, "write failed\n");
+    exit(1);
+  }
+  conn->awaited = window;
+
+} /* client_send() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+run (hpjsrpc_engine_t *engine, hpjsrpc_server_backend_t backend,
+  size_t requests, size_t conn_count, size_t window) {
+  hpjsrpc_server_config_t  config;
+  hpjsrpc_server_t        *server;
+  client_conn_t            conns[MAX_CONNECTIONS];
+  struct pollfd            pfds[MAX_CONNECTIONS];
+  char                    *burst = malloc(window * (sizeof(request) - 1));
+  const char              *name = (HPJSRPC_SERVER_IO_URING == backend)
+    ? "io_uring" : "epoll";
+  size_t                   sent = 0;
+  size_t                   done = 0;
+  uint64_t                 bytes = 0;
+  uint64_t                 begin;
+  char                     label[64];
+
+  for (size_t ii = 0; ii < window; ++ii) {
+    memcpy(&burst[ii * (sizeof(request) - 1)], request, (sizeof(request) - 1));
+  }
+
+  memset(&config, 0, sizeof(config));
+  config.address = "127.0.0.1";
+  config.shard_count = 1;
+  config.read_buffer_size_in_bytes = 65536;
+  config.context.max_token_count = 64;
+  config.context.segment_size_in_bytes = 1024;
+  config.backend = backend;
+  if (HPJSRPC_NO_ERROR != hpjsrpc_server_new(&server, engine, &config)
+      || HPJSRPC_NO_ERROR != hpjsrpc_server_start(server)) {
+    printf("%s not available\n", name);
+    free(burst);
+    return;
+  }
+
+  for (size_t ii = 0; ii < conn_count; ++ii) {
+    conns[ii].fd = client_connect(hpjsrpc_server_port(server));
+    if (0 > conns[ii].fd) {
+      fprintf(stderr, "connect failed\n");
+      exit(1);
+    }
+    pfds[ii].fd = conns[ii].fd;
+    pfds[ii].events = POLLIN;
+  }
+
+  begin = hpjsrpc_clock_ns();
+  for (size_t ii = 0; ii < conn_count && sent < requests; ++ii) {
+    client_send(&conns[ii], burst, window);
+    sent += window;
+  }
+  while (done < sent) {
+    if (0 >= poll(pfds, conn_count, -1)) {
+      continue;
+    }
+    for (size_t ii = 0; ii < conn_count; ++ii) {
+      char    reply[16384];
+      ssize_t got;
+
+      if (0 == (pfds[ii].revents & POLLIN)) {
+        continue;
+      }
+      got = read(conns[ii].fd, reply, sizeof(reply));
+      if (0 >= got) {
+        fprintf(stderr, "connection lost\n");
+        exit(1);
+      }
+      bytes += (uint64_t) got;
+      for (char *p = reply; NULL != (p = memchr(p, '\n',
+          (size_t) (&reply[got] - p))); ++p) {
+        conns[ii].awaited--;
+        done++;
+      }
+      if (0 == conns[ii].awaited && sent < requests) {
+        client_send(&conns[ii], burst, window);
+        sent += window;
+      }
+    }
+  }
+  begin = (hpjsrpc_clock_ns() - begin);
+
+  snprintf(label, sizeof(label), "%s, window %zu", name, window);
+  bench_report(label, done, bytes, begin);
+
+  for (size_t ii = 0; ii < conn_count; ++ii) {
+    close(conns[ii].fd);
+  }
+  hpjsrpc_server_destroy(server);
+  free(burst);
+
+} /* run() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (int argc, char **argv) {
+  size_t             requests = bench_iterations(argc, argv, 200000);
+  size_t             conn_count = (2 < argc)
+    ? (size_t) strtoull(argv[2], NULL, 10) : 8;
+  size_t             window = (3 < argc)
+    ? (size_t) strtoull(argv[3], NULL, 10) : 0;
+  hpjsrpc_engine_t  *engine;
+
+  if (0 == conn_count || MAX_CONNECTIONS < conn_count
+      || MAX_WINDOW < window) {
+    fprintf(stderr, "need 1 to %d connections, a window up to %d\n",
+      MAX_CONNECTIONS, MAX_WINDOW);
+    return 1;
+  }
+  if (HPJSRPC_NO_ERROR != hpjsrpc_new(&engine)
+      || HPJSRPC_NO_ERROR != rpc_register_methods(engine, methods, 1)) {
+    fprintf(stderr, "engine setup failed\n");
+    return 1;
+  }
+
+  printf("%zu requests of %zu bytes over %zu connections\n", requests,
+    (sizeof(request) - 1), conn_count);
+  /* Windows of 1, 8 and 64 unless one was given */
+  for (size_t w = ((0 != window) ? window : 1); w <= MAX_WINDOW; w *= 8) {
+    run(engine, HPJSRPC_SERVER_EPOLL, requests, conn_count, w);
+    run(engine, HPJSRPC_SERVER_IO_URING, requests, conn_count, w);
+    if (0 != window) {
+      break;
+    }
+  }
+
+  hpjsrpc_destroy(engine);
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -3,10 +3,17 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include <math.h>
+#include <unistd.h>
+#include <sys/uio.h>
 
 #include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_segment.h"
+#include "hpjsrpc_stream.h"
 #include "strntod.h"
 
 static HPJSRPC_RETURN echo (hpjsrpc_request_t *req, hpjsrpc_response_t *res);
@@ -15,10 +22,10 @@ static HPJSRPC_RETURN subtract_positional (hpjsrpc_request_t *req, hpjsrpc_respo
 static HPJSRPC_RETURN subtract_named (hpjsrpc_request_t *req, hpjsrpc_response_t *res);
 
 static hpjsrpc_method_t test_methods[] = {
-  {"echo", sizeof("echo"), echo, false, 1, { JSMN_STRING }},
-  {"pow", sizeof("pow"), rpc_pow, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE }},
-  {"subtract.positional", sizeof("subtract.positional"), subtract_positional, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE }},
-  {"subtract.named", sizeof("subtract.named"), subtract_named, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE }},
+  {"echo", sizeof("echo"), echo, false, 1, { JSMN_STRING }, true},
+  {"pow", sizeof("pow"), rpc_pow, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE }, true},
+  {"subtract.positional", sizeof("subtract.positional"), subtract_positional, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE }, true},
+  {"subtract.named", sizeof("subtract.named"), subtract_named, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE }, true},
 };
 
 /* ------------------------------------------------------------------------- */
@@ -38,11 +45,7 @@ echo (
 
   const jsmntok_t *echoToken = &req->tokens[paramsToken->first_child];
 
-  hpjsrpc_buffer_printf(&res->buffer, "\"%.*s\"",
-    (echoToken->end - echoToken->start),
-    &req->buffer[echoToken->start]);
-
-  return HPJSRPC_NO_ERROR;
+  return hpjsrpc_json_token(&res->buffer, req, echoToken);
 
 } /* echo() */
 
@@ -71,9 +74,7 @@ subtract_positional (
   strntod(&req->buffer[num2Token->start],
     (num2Token->end - num2Token->start), &num2);
 
-  hpjsrpc_buffer_printf(&res->buffer, "%f", (num1 - num2));
-
-  return HPJSRPC_NO_ERROR;
+  return hpjsrpc_json_double(&res->buffer, (num1 - num2));
 
 } /* subtract_positional() */
 
@@ -102,9 +103,7 @@ subtract_named (
   strntod(&req->buffer[num2Token->start],
     (num2Token->end - num2Token->start), &num2);
 
-  hpjsrpc_buffer_printf(&res->buffer, "%f", (num1 - num2));
-
-  return HPJSRPC_NO_ERROR;
+  return hpjsrpc_json_double(&res->buffer, (num1 - num2));
 
 } /* subtract_named() */
 
@@ -138,25 +137,41 @@ rpc_pow (
   num1 = atof(num1Buf);
   num2 = atof(num2Buf);
 
-  hpjsrpc_buffer_printf(&res->buffer, "\"pow(%.*s, %.*s) = %8.6f\"",
-    (num1Token->end - num1Token->start), &req->buffer[num1Token->start],
-    (num2Token->end - num2Token->start), &req->buffer[num2Token->start],
-    pow(num1, num2));
-
-  return HPJSRPC_NO_ERROR;
+  return hpjsrpc_json_double(&res->buffer, pow(num1, num2));
 
 } /* pow() */
 
 #define MY_BUF_SIZE 2048
+#define MY_SEGMENT_SIZE 512
+#define MY_MAX_BODY_SIZE (1024 * 1024)
 static char g_input[MY_BUF_SIZE];
-static char g_output[MY_BUF_SIZE];
+
+/* Streams the reply to stdout as segments fill, behind a ">> " marker */
+static HPJSRPC_RETURN
+print_sink (
+  void                       *ctx,
+  const struct iovec         *iov,
+  size_t                      iov_count
+) {
+  static int  stdout_fd = STDOUT_FILENO;
+  bool       *is_started = (bool *) ctx;
+
+  if (false == *is_started) {
+    printf(">> ");
+    fflush(stdout);
+    *is_started = true;
+  }
+
+  return hpjsrpc_sink_fd(&stdout_fd, iov, iov_count);
+
+} /* print_sink() */
 
 int
 main (int argc, const char ** const argv) {
   HPJSRPC_RETURN      rc;
   hpjsrpc_engine_t   *hpjsrpc;
-  hpjsrpc_request_t   req;
-  hpjsrpc_response_t  res;
+  hpjsrpc_context_t  *ctx;
+  bool                is_started = false;
 
   rc = hpjsrpc_new(&hpjsrpc);
   if (HPJSRPC_NO_ERROR != rc) {
@@ -171,35 +186,60 @@ main (int argc, const char ** const argv) {
     return 1;
   }
 
-  size_t status = fread(g_input, 1, sizeof(g_input),  stdin);
-  if (status == 0) {
-    fprintf(stderr, "fread(): errno=%d\n", errno);
+  rc = hpjsrpc_start_workers(hpjsrpc, 2, MY_BUF_SIZE);
+  if (HPJSRPC_NO_ERROR != rc) {
+    fprintf(stderr, "Failed to start RPC engine workers\n");
     return 1;
   }
 
-  req.engine = hpjsrpc;
-  req.tokens = calloc(sizeof(jsmntok_t), 1024);
-  req.max_token_count = 1024;
-  rc = rpc_parse_request(g_input, status, &req);
+  /* One context per serving thread; this example has just the one */
+  rc = hpjsrpc_context_new(&ctx, hpjsrpc, 1024, MY_SEGMENT_SIZE, 0, 0);
   if (HPJSRPC_NO_ERROR != rc) {
-    fprintf(stderr, "Failed to parse (rc = %d)\n", rc);
+    fprintf(stderr, "Failed to create RPC context\n");
     return 1;
   }
 
-  res.buffer.data = (uint8_t *) g_output;
-  res.buffer.size_in_bytes = 0;
-  res.buffer.capacity_in_bytes = MY_BUF_SIZE;
+  /*
+   * With --stdio, serve Content-Length framed messages on stdin/stdout
+   * until end of input, as a language server would; otherwise handle the
+   * one request (or batch) on stdin.
+   */
+  if (1 < argc && 0 == strcmp(argv[1], "--stdio")) {
+    hpjsrpc_stream_t *stream;
+
+    rc = hpjsrpc_stream_new(&stream, MY_BUF_SIZE, MY_MAX_BODY_SIZE);
+    if (HPJSRPC_NO_ERROR != rc) {
+      fprintf(stderr, "Failed to create stream framer\n");
+      return 1;
+    }
+    rc = hpjsrpc_stream_serve(stream, ctx, STDIN_FILENO, STDOUT_FILENO);
+    if (HPJSRPC_NO_ERROR != rc) {
+      fprintf(stderr, "%s\n", hpjsrpc_error_string(rc));
+    }
+    hpjsrpc_stream_destroy(stream);
+    goto L_done;
+  }
+
+  hpjsrpc_buffer_set_sink(&hpjsrpc_context_response(ctx)->buffer,
+    print_sink, &is_started);
+
+  size_t status = fread(g_input, 1, sizeof(g_input),  stdin);
+  if (status == 0) {
+    fprintf(stderr, "fread(): errno=%d\n", errno);
+    return 1;
+  }
 
-  rc = rpc_process_request(&req, &res);
+  rc = hpjsrpc_context_process(ctx, g_input, status);
 
-  if (res.buffer.size_in_bytes > 0) {
-    printf(">> %s\n", g_output);
+  if (is_started) {
+    printf("\n");
   } else {
     printf(">> no reply\n");
   }
   printf("%s\n", hpjsrpc_error_string(rc));
 
-  free(req.tokens);
+L_done:
+  hpjsrpc_context_destroy(ctx);
   rc = hpjsrpc_destroy(hpjsrpc);
   if (HPJSRPC_NO_ERROR != rc) {
     fprintf(stderr, "Failed to initialize RPC engine\n");
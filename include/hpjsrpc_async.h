@@ -0,0 +1,103 @@
+
+#ifndef HPJSRPC_ASYNC_H
+#define	HPJSRPC_ASYNC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "libhpjsrpc.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Deferred replies.
+ *
+ * A method that would otherwise block (on disk, a subprocess, another
+ * service) calls hpjsrpc_defer() and returns its result, HPJSRPC_PENDING.
+ * rpc_process_request() then returns HPJSRPC_PENDING with an empty
+ * response, and the calling thread moves on. The engine keeps the id and
+ * the reply envelope in an hpjsrpc_pending_t.
+ *
+ * Later, any thread writes the result through hpjsrpc_pending_buffer() and
+ * calls hpjsrpc_pending_complete(). The finished reply is queued on the
+ * completion queue given at defer time. Queues deliver in completion order,
+ * not request order. The consumer sends hpjsrpc_pending_response() and
+ * hands the reply back with hpjsrpc_pending_release().
+ *
+ * Replies inside a batch cannot be deferred, since the batch is answered
+ * as a single array. Neither can replies to a buffer whose sink already
+ * flushed bytes.
+ */
+
+typedef struct hpjsrpc_pending_t hpjsrpc_pending_t;
+typedef struct hpjsrpc_completion_queue_t hpjsrpc_completion_queue_t;
+
+/*
+ * Deferred replies are written to segments of segment_size_in_bytes drawn
+ * from a pool owned by the queue, of which at most max_segments are held
+ * (0 for no bound). The queue must outlive every reply deferred onto it.
+ */
+HPJSRPC_RETURN hpjsrpc_completion_queue_new (
+  hpjsrpc_completion_queue_t  **pptr,
+  size_t                        segment_size_in_bytes,
+  size_t                        max_segments);
+
+/* Releases queued replies; replies still in flight must complete first */
+HPJSRPC_RETURN hpjsrpc_completion_queue_destroy (
+  hpjsrpc_completion_queue_t   *queue);
+
+/*
+ * Returns an eventfd that becomes readable when replies are queued, for
+ * use with poll()/epoll. Read it to reset it, then pop until NULL.
+ */
+int hpjsrpc_completion_queue_fd (const hpjsrpc_completion_queue_t *queue);
+
+/* Returns the oldest completed reply, or NULL if there is none */
+hpjsrpc_pending_t *hpjsrpc_completion_queue_pop (
+  hpjsrpc_completion_queue_t   *queue);
+
+/* Like hpjsrpc_completion_queue_pop(), but blocks until a reply arrives */
+hpjsrpc_pending_t *hpjsrpc_completion_queue_wait (
+  hpjsrpc_completion_queue_t   *queue);
+
+/*
+ * Called by a method: takes the reply over, to be completed onto queue.
+ * tag is handed back with the reply (e.g. the connection to answer on).
+ * Returns HPJSRPC_PENDING, which the method returns in turn; on any other
+ * result nothing was deferred and the method must answer as usual.
+ */
+HPJSRPC_RETURN hpjsrpc_defer (
+  hpjsrpc_request_t            *req,
+  hpjsrpc_response_t           *res,
+  hpjsrpc_completion_queue_t   *queue,
+  void                         *tag,
+  hpjsrpc_pending_t           **pptr);
+
+/* Buffer for the result value, with the JSON writer positioned at it */
+hpjsrpc_buffer_t *hpjsrpc_pending_buffer (hpjsrpc_pending_t *pending);
+
+/*
+ * Finishes the reply, or replaces it by an error reply if rc is not
+ * HPJSRPC_NO_ERROR, and queues it. Safe from any thread. Notifications are
+ * not queued but released right away. HPJSRPC_RPC_ERROR_EXPIRED queues the
+ * reply empty, as nobody waits for it any more. Either way pending must not
+ * be used again by the completing thread.
+ */
+HPJSRPC_RETURN hpjsrpc_pending_complete (hpjsrpc_pending_t *pending,
+  HPJSRPC_RETURN rc);
+
+hpjsrpc_response_t *hpjsrpc_pending_response (hpjsrpc_pending_t *pending);
+void *hpjsrpc_pending_tag (const hpjsrpc_pending_t *pending);
+
+/* Hands a delivered reply back, dropping its segments */
+HPJSRPC_RETURN hpjsrpc_pending_release (hpjsrpc_pending_t *pending);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_ASYNC_H */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,254 @@
+
+#ifndef HPJSRPC_CLIENT_H
+#define	HPJSRPC_CLIENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "libhpjsrpc.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Pipelined client, one request per line (newline-delimited JSON), for
+ * the TCP server or anything else speaking that framing on a stream.
+ *
+ * Calls are written with the JSON writer (hpjsrpc_json.h) into a chained
+ * buffer and queued; replies are tokenized with jsmn. Ids come from a
+ * counter, and each call in flight waits in an open-addressed table keyed
+ * by its integer id, so replies may come back in any order and any number
+ * of calls may be outstanding up to max_in_flight. A reply completes its
+ * call through the callback the call was made with.
+ *
+ * Queued calls go out together, in one writev(), once max_batch of them
+ * are queued, or on hpjsrpc_client_flush() and hpjsrpc_client_poll(). With
+ * max_batch 1 every call is written as it is made.
+ *
+ * Replies are read and callbacks run only from hpjsrpc_client_poll(), in
+ * the caller's thread; a client is used by one thread at a time. Callbacks
+ * may make further calls.
+ */
+
+#ifndef HPJSRPC_CLIENT_DEFAULT_IN_FLIGHT
+# define HPJSRPC_CLIENT_DEFAULT_IN_FLIGHT     1024
+#endif
+
+#ifndef HPJSRPC_CLIENT_DEFAULT_REPLY_SIZE
+# define HPJSRPC_CLIENT_DEFAULT_REPLY_SIZE    65536
+#endif
+
+#ifndef HPJSRPC_CLIENT_DEFAULT_TOKENS
+# define HPJSRPC_CLIENT_DEFAULT_TOKENS        1024
+#endif
+
+typedef struct hpjsrpc_client_t hpjsrpc_client_t;
+
+typedef struct {
+  uint64_t                        id;
+  /*
+   * HPJSRPC_NO_ERROR once a reply arrived, result or error;
+   * HPJSRPC_PARSE_ERROR_NOMEM or HPJSRPC_PARSE_ERROR_INVAL if it arrived
+   * but did not parse, with more than max_token_count tokens or malformed,
+   * only json then set; HPJSRPC_CLOSED if the connection was lost first,
+   * the rest then unset.
+   */
+  HPJSRPC_RETURN                  rc;
+  bool                            is_error;
+  /* The error object's code, for an error reply */
+  int64_t                         error_code;
+  /* The reply line, its tokens and the result (or error object) token */
+  const char                     *json;
+  size_t                          json_length;
+  const jsmntok_t                *tokens;
+  const jsmntok_t                *value;
+} hpjsrpc_client_reply_t;
+
+typedef void (*hpjsrpc_client_callback_t) (void *arg,
+  const hpjsrpc_client_reply_t *reply);
+
+typedef struct {
+  /* Calls awaiting a reply at once (0 for the default) */
+  size_t                          max_in_flight;
+  /* Calls queued before they are written together (0 or 1: each at once) */
+  size_t                          max_batch;
+  /* Longest reply line; a longer one closes the client (0: the default) */
+  size_t                          max_reply_in_bytes;
+  /*
+   * Tokens a reply may parse into (0 for the default). A reply that does
+   * not parse fails its calls if its ids can still be found, and the
+   * client otherwise.
+   */
+  size_t                          max_token_count;
+  /* Request buffer segments (0 for 4096) */
+  size_t                          segment_size_in_bytes;
+} hpjsrpc_client_config_t;
+
+/* Takes over fd, a connected stream socket or other two-way stream */
+HPJSRPC_RETURN hpjsrpc_client_new (
+  hpjsrpc_client_t                     **pptr,
+  int                                    fd,
+  const hpjsrpc_client_config_t         *config);
+
+/* Connects to a numeric IPv4 or IPv6 address over TCP */
+HPJSRPC_RETURN hpjsrpc_client_connect (
+  hpjsrpc_client_t                     **pptr,
+  const char                            *address,
+  uint16_t                               port,
+  const hpjsrpc_client_config_t         *config);
+
+/*
+ * Closes the connection; calls still in flight complete with
+ * HPJSRPC_CLOSED first.
+ */
+HPJSRPC_RETURN hpjsrpc_client_destroy (hpjsrpc_client_t *client);
+
+/*
+ * Queues a call of method with params, a JSON array or object written out
+ * (NULL for none), and returns its id in *id (may be NULL). At
+ * max_in_flight this first waits for replies, completing other calls;
+ * from inside a callback it fails with HPJSRPC_RPC_ERROR_OUTOFRESBUF
+ * instead. HPJSRPC_CLOSED once the connection is lost.
+ */
+HPJSRPC_RETURN hpjsrpc_client_call (
+  hpjsrpc_client_t                      *client,
+  const char                            *method,
+  const char                            *params,
+  size_t                                 params_length,
+  hpjsrpc_client_callback_t              callback,
+  void                                  *arg,
+  uint64_t                              *id);
+
+/* Queues a notification; it takes no id and gets no reply */
+HPJSRPC_RETURN hpjsrpc_client_notify (
+  hpjsrpc_client_t                      *client,
+  const char                            *method,
+  const char                            *params,
+  size_t                                 params_length);
+
+/* Writes the queued calls out, waiting while the socket is full */
+HPJSRPC_RETURN hpjsrpc_client_flush (hpjsrpc_client_t *client);
+
+/*
+ * Flushes, then waits up to timeout_ms (-1: no limit, 0: not at all) for
+ * replies and completes every call whose reply has arrived. *completed
+ * (may be NULL) counts them.
+ */
+HPJSRPC_RETURN hpjsrpc_client_poll (
+  hpjsrpc_client_t                      *client,
+  int                                    timeout_ms,
+  size_t                                *completed);
+
+/* Calls made and not completed yet */
+size_t hpjsrpc_client_outstanding (const hpjsrpc_client_t *client);
+
+/* For callers that wait in a loop of their own: readable means replies */
+int hpjsrpc_client_fd (const hpjsrpc_client_t *client);
+
+/* True once the connection is lost; every call then fails */
+bool hpjsrpc_client_is_closed (const hpjsrpc_client_t *client);
+
+/*
+ * Forgets a call in flight without completing it; its reply, should one
+ * come, is dropped. The request may already be on the wire, so the server
+ * may still run it. False if the call was not in flight.
+ */
+bool hpjsrpc_client_cancel (hpjsrpc_client_t *client, uint64_t id);
+
+/*
+ * Client pools.
+ *
+ * An hpjsrpc_client_pool_t spreads calls over connection_count clients of
+ * one server, each call going to the connection with the fewest calls in
+ * flight. Connections that close are skipped from then on.
+ *
+ * Calls made idempotent may be hedged. If the reply is not back after the
+ * hedge delay, a duplicate goes to a second connection. The first reply
+ * completes the call, and the other leg is cancelled (see
+ * hpjsrpc_client_cancel()). The delay tracks hedge_percentile of recent
+ * call latencies, so about one call in twenty is hedged at the default
+ * 95th percentile, but never more than hedge_budget_percent of all calls.
+ * An idempotent call whose connection closes is resent at once.
+ *
+ * Like a client, a pool is used by one thread at a time, and callbacks run
+ * from hpjsrpc_client_pool_poll() only.
+ */
+
+#ifndef HPJSRPC_CLIENT_POOL_SAMPLES
+# define HPJSRPC_CLIENT_POOL_SAMPLES          512
+#endif
+
+typedef struct hpjsrpc_client_pool_t hpjsrpc_client_pool_t;
+
+typedef struct {
+  /* 0 for 2 */
+  size_t                          connection_count;
+  /* Each connection's */
+  hpjsrpc_client_config_t         client;
+  /* Calls in flight over all connections (0: all the clients take) */
+  size_t                          max_in_flight;
+  /* Latency percentile the hedge delay follows (0 for 95) */
+  uint32_t                        hedge_percentile;
+  /* Lower bound on the delay, and the delay until it is known (0: 1ms) */
+  uint64_t                        hedge_delay_in_us;
+  /* Hedges per 100 calls at most (0 for 10) */
+  uint32_t                        hedge_budget_percent;
+} hpjsrpc_client_pool_config_t;
+
+typedef struct {
+  uint64_t                        calls;
+  uint64_t                        hedges;
+  /* Calls the hedge answered first */
+  uint64_t                        hedge_wins;
+  uint64_t                        hedge_delay_in_ns;
+} hpjsrpc_client_pool_stats_t;
+
+/* Connects every client to a numeric IPv4 or IPv6 address over TCP */
+HPJSRPC_RETURN hpjsrpc_client_pool_new (
+  hpjsrpc_client_pool_t                **pptr,
+  const char                            *address,
+  uint16_t                               port,
+  const hpjsrpc_client_pool_config_t    *config);
+
+/* Destroys the clients; calls in flight complete with HPJSRPC_CLOSED */
+HPJSRPC_RETURN hpjsrpc_client_pool_destroy (hpjsrpc_client_pool_t *pool);
+
+/*
+ * Like hpjsrpc_client_call(), with ids of the pool's own. Idempotent calls
+ * may run twice on the server and are the only ones hedged.
+ */
+HPJSRPC_RETURN hpjsrpc_client_pool_call (
+  hpjsrpc_client_pool_t                 *pool,
+  const char                            *method,
+  const char                            *params,
+  size_t                                 params_length,
+  bool                                   is_idempotent,
+  hpjsrpc_client_callback_t              callback,
+  void                                  *arg,
+  uint64_t                              *id);
+
+/* Writes the calls queued on every connection out */
+HPJSRPC_RETURN hpjsrpc_client_pool_flush (hpjsrpc_client_pool_t *pool);
+
+/*
+ * Like hpjsrpc_client_poll(), over every connection. Hedges fall due only
+ * while polling, so callers with calls in flight should keep polling.
+ */
+HPJSRPC_RETURN hpjsrpc_client_pool_poll (
+  hpjsrpc_client_pool_t                 *pool,
+  int                                    timeout_ms,
+  size_t                                *completed);
+
+size_t hpjsrpc_client_pool_outstanding (const hpjsrpc_client_pool_t *pool);
+
+void hpjsrpc_client_pool_stats (const hpjsrpc_client_pool_t *pool,
+  hpjsrpc_client_pool_stats_t *stats);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_CLIENT_H */
+/* vi: set et sw=2 ts=2: */
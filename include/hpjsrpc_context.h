@@ -0,0 +1,179 @@
+
+#ifndef HPJSRPC_CONTEXT_H
+#define	HPJSRPC_CONTEXT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "libhpjsrpc.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Threading model.
+ *
+ * An hpjsrpc_engine_t is a registry: the method tree, the pre-rendered
+ * response templates and (optionally) the batch worker pool. Once methods
+ * are registered and workers started the registry is never written to
+ * again while requests are processed, and may be shared by any number of
+ * threads. Registering methods, starting or stopping workers, changing
+ * admission or timing settings and destroying the engine must not overlap
+ * with request processing.
+ *
+ * Everything a request writes lives in an hpjsrpc_context_t: the token
+ * arena, the request and response, a private response segment pool and
+ * scratch memory for methods. A context belongs to one thread at a time and
+ * is reused from request to request, so the steady state allocates nothing
+ * and, with none of the features below in use, shares no written cache
+ * lines between threads.
+ *
+ * Features that only work engine-wide do write shared counters, with
+ * atomics kept on cache lines apart from the registry:
+ * - batch fan-out onto the engine's worker pool;
+ * - admission control (hpjsrpc_set_admission()), two or three atomic
+ *   updates per request, and per-method limits, two per call;
+ * - deadline statistics, written only for requests dropped or cancelled
+ *   because of their deadline.
+ */
+
+/*
+ * max_token_count bounds the size of a request (see jsmn_parse());
+ * segment_size_in_bytes sizes the response segments, of which at most
+ * max_segments are held (0 for no bound). scratch_size_in_bytes may be 0.
+ */
+HPJSRPC_RETURN hpjsrpc_context_new (
+  hpjsrpc_context_t           **pptr,
+  hpjsrpc_engine_t             *engine,
+  size_t                        max_token_count,
+  size_t                        segment_size_in_bytes,
+  size_t                        max_segments,
+  size_t                        scratch_size_in_bytes);
+HPJSRPC_RETURN hpjsrpc_context_destroy (hpjsrpc_context_t *ctx);
+
+/*
+ * Context pools.
+ *
+ * Servers that pick up a context per connection or per request draw them
+ * from an hpjsrpc_context_pool_t instead of creating them. A recycled
+ * context keeps its token arena, scratch memory and some free response
+ * segments, so handing it out again allocates nothing.
+ *
+ * Each thread keeps up to HPJSRPC_CONTEXT_CACHE_SIZE recycled contexts of
+ * one pool to itself, taken and returned without locking. Past that they
+ * overflow to the pool's shared list, which keeps retained_contexts and
+ * frees the rest. Response segments work the same way: each context keeps
+ * retained_segments_per_context free segments, the pool's shared segment
+ * list keeps retained_segments, and the surplus is freed. Memory taken
+ * during a load spike is therefore given back once the spike is over.
+ */
+
+#ifndef HPJSRPC_CONTEXT_CACHE_SIZE
+# define HPJSRPC_CONTEXT_CACHE_SIZE       4
+#endif
+
+typedef struct hpjsrpc_context_pool_t hpjsrpc_context_pool_t;
+
+typedef struct {
+  /* Per context, see hpjsrpc_context_new() */
+  size_t                          max_token_count;
+  size_t                          segment_size_in_bytes;
+  size_t                          max_segments;
+  size_t                          scratch_size_in_bytes;
+  /* Bounds on what is kept for reuse */
+  size_t                          retained_segments_per_context;
+  size_t                          retained_segments;
+  size_t                          retained_contexts;
+} hpjsrpc_context_pool_config_t;
+
+HPJSRPC_RETURN hpjsrpc_context_pool_new (
+  hpjsrpc_context_pool_t                **pptr,
+  hpjsrpc_engine_t                       *engine,
+  const hpjsrpc_context_pool_config_t    *config);
+
+/*
+ * Frees every context the pool handed out, recycled or not; none may be in
+ * use any more.
+ */
+HPJSRPC_RETURN hpjsrpc_context_pool_destroy (hpjsrpc_context_pool_t *pool);
+
+HPJSRPC_RETURN hpjsrpc_context_acquire (hpjsrpc_context_pool_t *pool,
+  hpjsrpc_context_t **pptr);
+
+/*
+ * Releases the context's response, detaches its sink and gives it back to
+ * its pool. hpjsrpc_context_destroy() may be used instead to drop an
+ * acquired context for good.
+ */
+HPJSRPC_RETURN hpjsrpc_context_recycle (hpjsrpc_context_t *ctx);
+
+/*
+ * Parses and processes one request (or batch). Requests that fail to parse
+ * get a JSON-RPC parse error reply. The reply is left in the context's
+ * response, and any references it holds into buffer stay valid until the
+ * next call or until the response is released.
+ */
+HPJSRPC_RETURN hpjsrpc_context_process (
+  hpjsrpc_context_t            *ctx,
+  const char                   *buffer,
+  size_t                        buffer_length_in_bytes);
+
+/*
+ * For the next request processed only: when it was received, which
+ * "deadline_ms" counts from (0 for when it is processed), and when its
+ * caller stops waiting as the transport was told (0 for no deadline). See
+ * hpjsrpc_request_expired().
+ */
+void hpjsrpc_context_set_deadline (
+  hpjsrpc_context_t            *ctx,
+  uint64_t                      received_ns,
+  uint64_t                      deadline_ns);
+
+hpjsrpc_request_t *hpjsrpc_context_request (hpjsrpc_context_t *ctx);
+hpjsrpc_response_t *hpjsrpc_context_response (hpjsrpc_context_t *ctx);
+
+/*
+ * Request arena.
+ *
+ * hpjsrpc_request_alloc() hands methods memory for decoded strings,
+ * temporary arrays and the like, bump-allocated from chunks of
+ * HPJSRPC_ARENA_CHUNK_SIZE owned by the request's context. Nothing is freed
+ * individually: everything is reclaimed at once when the context takes its
+ * next request or is recycled, so the reply may reference arena memory.
+ * Allocations above a quarter chunk get a block of their own, freed at the
+ * same time. Resetting the arena is constant time: the first chunk starts
+ * over and later ones are kept for reuse. A recycled context keeps up to
+ * HPJSRPC_ARENA_RETAINED_CHUNKS of those.
+ *
+ * align must be a power of two, or 0 for the alignment malloc() gives.
+ * Returns NULL on failure, and for requests without a context (batch
+ * elements run on an engine worker).
+ */
+
+#ifndef HPJSRPC_ARENA_CHUNK_SIZE
+# define HPJSRPC_ARENA_CHUNK_SIZE         4096
+#endif
+
+#ifndef HPJSRPC_ARENA_RETAINED_CHUNKS
+# define HPJSRPC_ARENA_RETAINED_CHUNKS    4
+#endif
+
+void *hpjsrpc_request_alloc (hpjsrpc_request_t *req, size_t size_in_bytes,
+  size_t align);
+
+/*
+ * Scratch memory for methods, reached through req->context. It is valid for
+ * the duration of the call only. Batch elements run on an engine worker see
+ * a NULL req->context and must not rely on scratch memory.
+ */
+void *hpjsrpc_context_scratch (hpjsrpc_context_t *ctx,
+  size_t *size_in_bytes);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_CONTEXT_H */
+/* vi: set et sw=2 ts=2: */
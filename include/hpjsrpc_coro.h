@@ -0,0 +1,107 @@
+
+#ifndef HPJSRPC_CORO_H
+#define	HPJSRPC_CORO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "libhpjsrpc.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Coroutine execution mode.
+ *
+ * An hpjsrpc_scheduler_t runs each submitted request on a coroutine with a
+ * stack of its own, so methods can be written in blocking style: where a
+ * method would block, it calls hpjsrpc_await() and the scheduler moves on
+ * to other requests until the descriptor is ready or the timeout expires.
+ *
+ * A scheduler belongs to one thread, which drives it with
+ * hpjsrpc_scheduler_run(). Every coroutine carries an hpjsrpc_context_t
+ * (see hpjsrpc_context.h). Coroutines, their contexts and their stacks are
+ * pooled and reused. Each stack sits above a PROT_NONE guard page, so an
+ * overflow faults instead of corrupting memory.
+ *
+ * Outside a coroutine, hpjsrpc_await() just blocks in poll(). The same
+ * method therefore also works from rpc_process_request() or on a batch
+ * worker.
+ *
+ * Requests with a deadline (see hpjsrpc_request_expired()) are filed on a
+ * timer wheel with a slot per millisecond when they first suspend, so
+ * filing, completing and expiring them is O(1) however many are in flight.
+ * A request still suspended when its deadline passes is cancelled: its
+ * await returns -1 with errno ECANCELED, as does any later one, and the
+ * method is expected to give up. Whatever it answers is delivered as usual.
+ */
+
+#ifndef HPJSRPC_CORO_DEFAULT_STACK_SIZE
+# define HPJSRPC_CORO_DEFAULT_STACK_SIZE  (64 * 1024)
+#endif
+
+typedef struct hpjsrpc_scheduler_t hpjsrpc_scheduler_t;
+
+/*
+ * Called on the scheduler thread once a request has finished. res holds the
+ * reply (empty for notifications) and is only valid during the call.
+ */
+typedef void (*hpjsrpc_coro_done_t) (void *tag, hpjsrpc_response_t *res,
+  HPJSRPC_RETURN rc);
+
+typedef struct {
+  /* Usable stack per coroutine; rounded up to whole pages */
+  size_t                          stack_size_in_bytes;
+  /* Most requests in flight at once; hpjsrpc_scheduler_submit() fails beyond */
+  size_t                          max_coroutines;
+  /* Per-coroutine context, see hpjsrpc_context_new() */
+  size_t                          max_token_count;
+  size_t                          segment_size_in_bytes;
+  size_t                          scratch_size_in_bytes;
+  hpjsrpc_coro_done_t             done;
+} hpjsrpc_scheduler_config_t;
+
+HPJSRPC_RETURN hpjsrpc_scheduler_new (
+  hpjsrpc_scheduler_t                 **pptr,
+  hpjsrpc_engine_t                     *engine,
+  const hpjsrpc_scheduler_config_t     *config);
+
+/* Must not be called while requests are suspended */
+HPJSRPC_RETURN hpjsrpc_scheduler_destroy (hpjsrpc_scheduler_t *sched);
+
+/*
+ * Starts a request on a fresh coroutine and runs it up to its first await
+ * (or to completion). buffer must stay valid until done is called for tag.
+ */
+HPJSRPC_RETURN hpjsrpc_scheduler_submit (
+  hpjsrpc_scheduler_t          *sched,
+  const char                   *buffer,
+  size_t                        buffer_length_in_bytes,
+  void                         *tag);
+
+/*
+ * Waits up to timeout_ms (-1 for no limit) for awaited descriptors and
+ * timers, and resumes the coroutines concerned. Returns the number of
+ * requests still suspended.
+ */
+size_t hpjsrpc_scheduler_run (hpjsrpc_scheduler_t *sched, int timeout_ms);
+
+size_t hpjsrpc_scheduler_suspended (const hpjsrpc_scheduler_t *sched);
+
+/*
+ * Suspends the calling method until fd is ready for events (POLLIN,
+ * POLLOUT, ...) or timeout_ms expires (-1 for no limit). Pass fd -1 to just
+ * sleep. Returns the events that occurred, 0 on timeout or -1 on error,
+ * errno ECANCELED once the request is cancelled for its deadline, or
+ * EINVAL for fd -1 with no timeout, inside a coroutine or not.
+ */
+int hpjsrpc_await (int fd, short events, int timeout_ms);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_CORO_H */
+/* vi: set et sw=2 ts=2: */
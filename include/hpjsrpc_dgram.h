@@ -0,0 +1,86 @@
+
+#ifndef HPJSRPC_DGRAM_H
+#define	HPJSRPC_DGRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_context.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Datagram server, UDP or Unix datagram sockets, one request (or batch)
+ * per datagram. Meant for fire-and-forget traffic such as telemetry
+ * notifications, though requests with an id are answered.
+ *
+ * Like the TCP server (see hpjsrpc_server.h) it runs a thread per shard,
+ * optionally pinned, each with a context pool of its own; UDP shards have
+ * a socket each on the same port (SO_REUSEPORT), Unix shards share one.
+ *
+ * A shard receives up to HPJSRPC_DGRAM_BATCH datagrams with one recvmmsg()
+ * into a buffer array set up front, a slot per datagram, and each request
+ * is parsed where it landed. The replies of a batch, notifications having
+ * none, go back with one sendmmsg(), each gathered straight from its
+ * response segments. Datagram semantics hold throughout: datagrams longer
+ * than max_datagram_size_in_bytes, replies to Unix senders without an
+ * address, and replies the socket has no room for are dropped.
+ */
+
+#ifndef HPJSRPC_DGRAM_BATCH
+# define HPJSRPC_DGRAM_BATCH              64
+#endif
+
+#ifndef HPJSRPC_DGRAM_DEFAULT_DATAGRAM_SIZE
+# define HPJSRPC_DGRAM_DEFAULT_DATAGRAM_SIZE  8192
+#endif
+
+typedef struct hpjsrpc_dgram_t hpjsrpc_dgram_t;
+
+typedef struct {
+  /* UDP: numeric IPv4 or IPv6 address to bind; NULL for any */
+  const char                     *address;
+  /* UDP: 0 picks a free port, see hpjsrpc_dgram_port() */
+  uint16_t                        port;
+  /* Binds a Unix datagram socket here instead, replacing any file there */
+  const char                     *unix_path;
+  /* 0 for one shard per CPU the process may run on */
+  size_t                          shard_count;
+  bool                            pin_shards;
+  /* Longest datagram taken (0 for the default) */
+  size_t                          max_datagram_size_in_bytes;
+  /* SO_RCVBUF and SO_SNDBUF (0 leaves the system default) */
+  size_t                          socket_buffer_size_in_bytes;
+  /* Per-datagram contexts, pooled per shard */
+  hpjsrpc_context_pool_config_t   context;
+} hpjsrpc_dgram_config_t;
+
+/* Creates the shards and binds their sockets; nothing runs yet */
+HPJSRPC_RETURN hpjsrpc_dgram_new (
+  hpjsrpc_dgram_t                      **pptr,
+  hpjsrpc_engine_t                      *engine,
+  const hpjsrpc_dgram_config_t          *config);
+
+/* Stops the server if it is running, closes and unlinks its sockets */
+HPJSRPC_RETURN hpjsrpc_dgram_destroy (hpjsrpc_dgram_t *dgram);
+
+/* Starts one thread per shard and returns */
+HPJSRPC_RETURN hpjsrpc_dgram_start (hpjsrpc_dgram_t *dgram);
+
+/* Joins the shard threads; datagrams still queued stay in the sockets */
+HPJSRPC_RETURN hpjsrpc_dgram_stop (hpjsrpc_dgram_t *dgram);
+
+/* UDP only; 0 for Unix sockets */
+uint16_t hpjsrpc_dgram_port (const hpjsrpc_dgram_t *dgram);
+size_t hpjsrpc_dgram_shard_count (const hpjsrpc_dgram_t *dgram);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_DGRAM_H */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,152 @@
+
+#ifndef HPJSRPC_JSON_H
+#define	HPJSRPC_JSON_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "libhpjsrpc.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Streaming JSON writer over hpjsrpc_buffer_t.
+ *
+ * Separating commas are inserted automatically, based on a bit per nesting
+ * level recording whether that level already holds a value. Errors are
+ * sticky: once anything fails to fit, every later call is a no-op that
+ * returns HPJSRPC_RPC_ERROR_OUTOFRESBUF, and the buffer holds only whole
+ * values written before the overflow. The buffer is kept NUL terminated.
+ *
+ * Buffers must be reset with hpjsrpc_buffer_rewind() before first use.
+ */
+
+/*
+ * Reserves len bytes (plus a terminator) at the end of the buffer, moving a
+ * chained buffer on to a fresh segment if need be. Otherwise latches the
+ * overflow flag and returns NULL.
+ */
+static inline uint8_t *
+hpjsrpc_json_reserve (hpjsrpc_buffer_t *buf, size_t len) {
+  bool fits = (len < (buf->capacity_in_bytes - buf->size_in_bytes))
+    & !buf->json_overflow;
+  if (__builtin_expect(!fits, 0)) {
+    return hpjsrpc_buffer_grow(buf, len);
+  }
+  return (buf->data + buf->size_in_bytes);
+}
+
+static inline void
+hpjsrpc_json_commit (hpjsrpc_buffer_t *buf, size_t len) {
+  buf->size_in_bytes += len;
+  buf->data[buf->size_in_bytes] = 0;
+}
+
+/*
+ * Returns 1 if a comma must precede the next value at the current level, and
+ * records that the level now holds a value.
+ */
+static inline size_t
+hpjsrpc_json_separator (hpjsrpc_buffer_t *buf) {
+  uint64_t bit = ((uint64_t) 1 << buf->json_depth);
+  size_t   sep = (size_t) (((buf->json_has_value & bit) != 0)
+    & !buf->json_after_key);
+  buf->json_has_value |= bit;
+  buf->json_after_key = false;
+  return sep;
+}
+
+HPJSRPC_RETURN hpjsrpc_json_raw_slow (hpjsrpc_buffer_t *buf,
+  const void *json, size_t len, size_t sep);
+
+/* Writes an optional comma followed by len bytes of pre-rendered JSON */
+static inline HPJSRPC_RETURN
+hpjsrpc_json_raw (hpjsrpc_buffer_t *buf, const void *json, size_t len) {
+  size_t   sep = hpjsrpc_json_separator(buf);
+  uint8_t *p = ((sep + len) < (buf->capacity_in_bytes - buf->size_in_bytes))
+    ? (buf->data + buf->size_in_bytes) : NULL;
+  if (__builtin_expect(NULL == p || buf->json_overflow, 0)) {
+    return hpjsrpc_json_raw_slow(buf, json, len, sep);
+  }
+  /* Unconditional store; overwritten below when no comma is due */
+  p[0] = ',';
+  memcpy((p + sep), json, len);
+  hpjsrpc_json_commit(buf, (sep + len));
+  return HPJSRPC_NO_ERROR;
+}
+
+static inline HPJSRPC_RETURN
+hpjsrpc_json_null (hpjsrpc_buffer_t *buf) {
+  return hpjsrpc_json_raw(buf, "null", 4);
+}
+
+static inline HPJSRPC_RETURN
+hpjsrpc_json_bool (hpjsrpc_buffer_t *buf, bool value) {
+  return (value) ? hpjsrpc_json_raw(buf, "true", 4)
+    : hpjsrpc_json_raw(buf, "false", 5);
+}
+
+HPJSRPC_RETURN hpjsrpc_json_begin_object (hpjsrpc_buffer_t *buf);
+HPJSRPC_RETURN hpjsrpc_json_end_object (hpjsrpc_buffer_t *buf);
+HPJSRPC_RETURN hpjsrpc_json_begin_array (hpjsrpc_buffer_t *buf);
+HPJSRPC_RETURN hpjsrpc_json_end_array (hpjsrpc_buffer_t *buf);
+
+/* Writes "key": -- the next value written belongs to this key */
+HPJSRPC_RETURN hpjsrpc_json_key (hpjsrpc_buffer_t *buf, const char *key,
+  size_t len);
+
+/* Writes a string value, escaping quotes, backslashes and control bytes */
+HPJSRPC_RETURN hpjsrpc_json_string (hpjsrpc_buffer_t *buf, const char *str,
+  size_t len);
+
+/* Writes a string value whose contents are already valid escaped JSON */
+HPJSRPC_RETURN hpjsrpc_json_string_raw (hpjsrpc_buffer_t *buf,
+  const char *str, size_t len);
+
+HPJSRPC_RETURN hpjsrpc_json_int (hpjsrpc_buffer_t *buf, int64_t value);
+
+/* Non-finite values have no JSON representation and are written as null */
+HPJSRPC_RETURN hpjsrpc_json_double (hpjsrpc_buffer_t *buf, double value);
+
+/*
+ * Like hpjsrpc_json_raw(), but a long value written to a chained buffer is
+ * referenced in place rather than copied; see hpjsrpc_buffer_append_ref().
+ */
+HPJSRPC_RETURN hpjsrpc_json_raw_ref (hpjsrpc_buffer_t *buf, const void *json,
+  size_t len);
+
+/*
+ * Writes a value verbatim from the request buffer (strings keep their quotes
+ * and escapes), by reference where hpjsrpc_json_raw_ref() allows. The
+ * request buffer must then outlive the response, see hpjsrpc_response_t.
+ */
+HPJSRPC_RETURN hpjsrpc_json_token (hpjsrpc_buffer_t *buf,
+  const hpjsrpc_request_t *req, const jsmntok_t *token);
+
+/*
+ * Positions the writer after an object key at the given depth, for callers
+ * that emitted the enclosing JSON themselves (e.g. from a template).
+ */
+static inline void
+hpjsrpc_json_expect_value (hpjsrpc_buffer_t *buf, uint32_t depth) {
+  buf->json_depth = depth;
+  buf->json_has_value |= ((uint64_t) 1 << depth);
+  buf->json_after_key = true;
+}
+
+static inline HPJSRPC_RETURN
+hpjsrpc_json_status (const hpjsrpc_buffer_t *buf) {
+  return (buf->json_overflow) ? HPJSRPC_RPC_ERROR_OUTOFRESBUF
+    : HPJSRPC_NO_ERROR;
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_JSON_H */
+/* vi: set et sw=2 ts=2: */
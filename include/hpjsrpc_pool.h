@@ -0,0 +1,74 @@
+
+#ifndef HPJSRPC_POOL_H
+#define	HPJSRPC_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_segment.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+#define HPJSRPC_POOL_MAX_WORKERS          64
+#define HPJSRPC_POOL_DEQUE_CAPACITY       1024
+
+typedef struct hpjsrpc_pool_t hpjsrpc_pool_t;
+
+/*
+ * A task is handed the index of the thread running it. Pool workers are
+ * numbered [0..worker_count); a submitting thread that helps drain the
+ * deques while it waits runs tasks as index worker_count.
+ */
+typedef void (*hpjsrpc_task_func) (void *arg, size_t worker_index);
+
+typedef struct {
+  hpjsrpc_task_func               func;
+  void                           *arg;
+} hpjsrpc_task_t;
+
+HPJSRPC_RETURN hpjsrpc_pool_new (
+  hpjsrpc_pool_t              **pptr,
+  size_t                        worker_count,
+  size_t                        segment_capacity_in_bytes);
+HPJSRPC_RETURN hpjsrpc_pool_destroy (hpjsrpc_pool_t *pool);
+
+size_t hpjsrpc_pool_worker_count (const hpjsrpc_pool_t *pool);
+
+/*
+ * Segments of segment_capacity_in_bytes that tasks write their replies
+ * into, for callers without a segment pool of their own. Shared by every
+ * batch on the pool, from any number of threads.
+ */
+hpjsrpc_segment_pool_t *hpjsrpc_pool_segments (hpjsrpc_pool_t *pool);
+
+/*
+ * Queues a task on the deque of the given worker (modulo worker_count).
+ * Returns false if the deque is full, in which case the caller should run
+ * the task inline.
+ */
+bool hpjsrpc_pool_submit (hpjsrpc_pool_t *pool, size_t worker_hint,
+  hpjsrpc_task_t task);
+
+/*
+ * Steals and runs a single queued task on the calling thread. Returns false
+ * if every deque was empty.
+ */
+bool hpjsrpc_pool_help (hpjsrpc_pool_t *pool);
+
+/*
+ * Blocks until *remaining reaches zero, stealing work while any is queued.
+ * Tasks must call hpjsrpc_pool_complete() once on the same counter.
+ */
+void hpjsrpc_pool_wait (hpjsrpc_pool_t *pool, size_t *remaining);
+void hpjsrpc_pool_complete (hpjsrpc_pool_t *pool, size_t *remaining);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_POOL_H */
+/* vi: set et sw=2 ts=2: */
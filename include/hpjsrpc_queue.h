@@ -0,0 +1,62 @@
+
+#ifndef HPJSRPC_QUEUE_H
+#define	HPJSRPC_QUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "libhpjsrpc.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bounded lock-free multi-producer/multi-consumer ring of pointers, for
+ * handing contexts from I/O threads to method workers and replies back.
+ *
+ * Each slot carries a sequence number that tells producers and consumers
+ * whose turn it is (D. Vyukov's bounded MPMC queue). The producer and
+ * consumer positions live on cache lines of their own. Batch operations
+ * claim a run of slots with a single compare-and-swap, so the one contended
+ * atomic is paid once per batch rather than once per item.
+ *
+ * Nothing blocks: a full queue fails a push and an empty one fails a pop.
+ * Callers add their own wakeup (eventfd, futex, condition variable) where
+ * they need to sleep.
+ */
+
+#ifndef HPJSRPC_CACHE_LINE_SIZE
+# define HPJSRPC_CACHE_LINE_SIZE          64
+#endif
+
+typedef struct hpjsrpc_queue_t hpjsrpc_queue_t;
+
+/* capacity is rounded up to a power of two */
+HPJSRPC_RETURN hpjsrpc_queue_new (hpjsrpc_queue_t **pptr, size_t capacity);
+HPJSRPC_RETURN hpjsrpc_queue_destroy (hpjsrpc_queue_t *queue);
+
+size_t hpjsrpc_queue_capacity (const hpjsrpc_queue_t *queue);
+
+bool hpjsrpc_queue_push (hpjsrpc_queue_t *queue, void *item);
+bool hpjsrpc_queue_pop (hpjsrpc_queue_t *queue, void **item);
+
+/*
+ * Push (pop) up to count items, in order, and return how many were. Fewer
+ * than count means the queue filled up (ran dry) along the way.
+ */
+size_t hpjsrpc_queue_push_batch (hpjsrpc_queue_t *queue,
+  void * const *items, size_t count);
+size_t hpjsrpc_queue_pop_batch (hpjsrpc_queue_t *queue, void **items,
+  size_t count);
+
+/* Approximate; exact only while no other thread uses the queue */
+size_t hpjsrpc_queue_size (const hpjsrpc_queue_t *queue);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_QUEUE_H */
+/* vi: set et sw=2 ts=2: */
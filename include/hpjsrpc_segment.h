@@ -0,0 +1,165 @@
+
+#ifndef HPJSRPC_SEGMENT_H
+#define	HPJSRPC_SEGMENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "libhpjsrpc.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Chained response buffers.
+ *
+ * A chained hpjsrpc_buffer_t writes into fixed-size segments drawn from a
+ * hpjsrpc_segment_pool_t. When the current segment cannot hold the next
+ * write, it is sealed and a fresh one is linked behind it; bytes already
+ * written are never moved. data/size_in_bytes/capacity_in_bytes always
+ * describe the tail segment, so the JSON writer works unchanged.
+ *
+ * The finished response is handed out as an iovec array for writev() or
+ * sendmsg(). Fixed (caller supplied) buffers report a single iovec.
+ */
+
+/*
+ * Slices shorter than this are copied rather than referenced; below it an
+ * extra iovec entry costs more than the memcpy it saves.
+ */
+#ifndef HPJSRPC_SEGMENT_REF_MIN_BYTES
+# define HPJSRPC_SEGMENT_REF_MIN_BYTES    256
+#endif
+
+/* Most iovec entries handed to a sink in one call */
+#ifndef HPJSRPC_SINK_MAX_IOVECS
+# define HPJSRPC_SINK_MAX_IOVECS          64
+#endif
+
+/*
+ * A chain holds two kinds of segment: pool chunks that own their bytes, and
+ * reference nodes (ref != NULL) that point at bytes living elsewhere, most
+ * often in the request buffer. Reference nodes carry no payload.
+ */
+struct hpjsrpc_segment_t {
+  hpjsrpc_segment_t              *next;
+  /* Bytes used; kept current for sealed segments and references only */
+  size_t                          size_in_bytes;
+  const uint8_t                  *ref;
+  uint8_t                         data[];
+};
+
+/*
+ * segment_size_in_bytes is the usable size of each chunk. max_segments
+ * bounds the number of chunks in use at once (0 for no bound); a write that
+ * needs a chunk beyond the bound fails with HPJSRPC_RPC_ERROR_OUTOFRESBUF.
+ * Released chunks are kept for reuse. Pools are safe to share between
+ * threads.
+ */
+HPJSRPC_RETURN hpjsrpc_segment_pool_new (
+  hpjsrpc_segment_pool_t      **pptr,
+  size_t                        segment_size_in_bytes,
+  size_t                        max_segments);
+HPJSRPC_RETURN hpjsrpc_segment_pool_destroy (hpjsrpc_segment_pool_t *pool);
+
+size_t hpjsrpc_segment_pool_segment_size (const hpjsrpc_segment_pool_t *pool);
+
+/*
+ * Bounded retention. A pool keeps at most max_retained released chunks (and
+ * as many reference nodes); beyond that, chunks go to parent, or back to
+ * the heap if parent is NULL or full too. An empty pool refills from parent
+ * before allocating. This lets small per-thread pools sit in front of a
+ * shared one, and lets memory taken during a spike be returned. parent must
+ * have the same segment size and outlive pool. Set before pool is used.
+ */
+HPJSRPC_RETURN hpjsrpc_segment_pool_set_retention (
+  hpjsrpc_segment_pool_t       *pool,
+  hpjsrpc_segment_pool_t       *parent,
+  size_t                        max_retained);
+
+hpjsrpc_segment_t *hpjsrpc_segment_acquire (hpjsrpc_segment_pool_t *pool);
+void hpjsrpc_segment_release (hpjsrpc_segment_pool_t *pool,
+  hpjsrpc_segment_t *segment);
+
+/* Turns buf into an (empty) chained buffer over pool */
+HPJSRPC_RETURN hpjsrpc_buffer_init_chained (hpjsrpc_buffer_t *buf,
+  hpjsrpc_segment_pool_t *pool);
+
+/* Returns every segment of a chained buffer to its pool */
+void hpjsrpc_buffer_release (hpjsrpc_buffer_t *buf);
+
+/* Total bytes written, across all segments */
+size_t hpjsrpc_buffer_length (const hpjsrpc_buffer_t *buf);
+
+/* Number of iovec entries hpjsrpc_buffer_iovec() needs */
+size_t hpjsrpc_buffer_iovec_count (const hpjsrpc_buffer_t *buf);
+
+/*
+ * Fills up to iov_count entries describing the buffer contents, skipping
+ * empty segments, and returns the number filled.
+ */
+size_t hpjsrpc_buffer_iovec (const hpjsrpc_buffer_t *buf, struct iovec *iov,
+  size_t iov_count);
+
+/* Same, for the contents from byte offset on; for resuming partial writes */
+size_t hpjsrpc_buffer_iovec_at (const hpjsrpc_buffer_t *buf, size_t offset,
+  struct iovec *iov, size_t iov_count);
+
+/*
+ * Appends a reference to len bytes at bytes, which must stay valid and
+ * unchanged until the buffer is released or rewound. Fixed buffers, and
+ * slices below HPJSRPC_SEGMENT_REF_MIN_BYTES, are copied instead.
+ */
+HPJSRPC_RETURN hpjsrpc_buffer_append_ref (hpjsrpc_buffer_t *buf,
+  const void *bytes, size_t len);
+
+/*
+ * Materializes the buffer contents (owned and referenced) into dst, followed
+ * by a NUL terminator. Returns the content length; nothing is copied if
+ * dst cannot hold it plus the terminator.
+ */
+size_t hpjsrpc_buffer_copy_out (const hpjsrpc_buffer_t *buf, void *dst,
+  size_t capacity_in_bytes);
+
+/*
+ * Moves every segment of src onto the end of dst without copying; src is
+ * left empty. Both buffers must be chained over the same pool.
+ */
+HPJSRPC_RETURN hpjsrpc_buffer_splice (hpjsrpc_buffer_t *dst,
+  hpjsrpc_buffer_t *src);
+
+/*
+ * Streaming.
+ *
+ * A chained buffer with a sink does not stage the whole response: whenever
+ * the tail segment fills, every segment before the new tail is passed to
+ * the sink and returned to the pool, so memory held per response is bounded
+ * by the segment size rather than the result size. rpc_process_request()
+ * flushes the remainder before returning, so the envelope prefix goes out
+ * first and the closing brace last.
+ *
+ * Bytes that reached the sink cannot be taken back. If a method fails after
+ * that, no error reply is possible; the engine drops what is left and
+ * returns HPJSRPC_RPC_ERROR_SINK, and the caller should abandon the stream.
+ * The sink must consume all bytes, or fail with HPJSRPC_RPC_ERROR_SINK; a
+ * failure is sticky until hpjsrpc_buffer_set_sink() is called again.
+ */
+HPJSRPC_RETURN hpjsrpc_buffer_set_sink (hpjsrpc_buffer_t *buf,
+  hpjsrpc_sink_t sink, void *ctx);
+
+/* Passes everything written so far, tail included, to the sink */
+HPJSRPC_RETURN hpjsrpc_buffer_flush (hpjsrpc_buffer_t *buf);
+
+/* Sink writing to the blocking file descriptor pointed to by ctx (int *) */
+HPJSRPC_RETURN hpjsrpc_sink_fd (void *ctx, const struct iovec *iov,
+  size_t iov_count);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_SEGMENT_H */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,162 @@
+
+#ifndef HPJSRPC_SERVER_H
+#define	HPJSRPC_SERVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_context.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * TCP server, one request per line (newline-delimited JSON), or one per
+ * HTTP/1.1 POST.
+ *
+ * The server is sharded thread-per-core. Each shard is a thread with its
+ * own listening socket, epoll instance, connections and context pool, and
+ * nothing on the request path is shared between shards. The listening
+ * sockets are bound to the same port with SO_REUSEPORT, so the kernel
+ * spreads incoming connections across shards, and a connection stays on
+ * the shard that accepted it. Shards may be pinned to one CPU each.
+ *
+ * In busy-poll mode shards spin on epoll instead of sleeping in it, and ask
+ * the kernel to busy-poll their sockets (SO_BUSY_POLL). This trades a
+ * fully used CPU per shard for lower wakeup latency.
+ *
+ * Connections are non-blocking and level-triggered. Line boundaries are
+ * found with a vector scan over the read buffer, and every complete line
+ * in it is processed before anything is written, so a client pipelining
+ * requests pays no round trip per request. Each request in flight has a
+ * context of its own (see hpjsrpc_context.h). Replies stay in their
+ * context's segments, may reference the request bytes, and queue up until
+ * they are written, several at a time, with one writev(). A last line
+ * without a newline is processed when the peer shuts down its end.
+ *
+ * Backpressure: while a connection has max_pipeline replies queued, or
+ * max_output_in_bytes of reply bytes unwritten, the server stops reading
+ * from it. The peer then sees TCP flow control instead of the server
+ * buffering without bound.
+ *
+ * Deadlines (see hpjsrpc_request_expired()) count from the event loop
+ * iteration that read a request in. Requests held back by backpressure thus
+ * age while they wait, and those whose deadline passed meanwhile are
+ * dropped unanswered when their turn comes.
+ *
+ * The io_uring backend replaces epoll and the read/writev calls: accepts
+ * and receives are multishot, the kernel receives into a ring of buffers
+ * provided by the shard, and requests are parsed right where they landed.
+ * Only a request that straddles two of those buffers is copied, to a
+ * buffer of the connection's own. A buffer goes back to the ring once every
+ * reply that may reference it is written. Each connection has one sendmsg()
+ * in flight, and everything queued while handling a batch of completions
+ * is submitted with one system call. Backpressure cancels the receive. It
+ * needs Linux 5.19 or later; hpjsrpc_server_new() fails without it.
+ *
+ * HTTP: the request line and the Content-Length, Connection,
+ * Transfer-Encoding and Deadline-Ms (milliseconds, as "deadline_ms")
+ * headers are parsed where they were received, and the body is handed to
+ * the engine in place; a request must fit the read buffer, head and body.
+ * Connections are kept alive and requests pipelined as HTTP/1.1 has it,
+ * and each reply goes out as a head rendered into the request arena plus
+ * the response segments, in one write. Results of at least
+ * http_chunked_in_bytes are sent chunked, a chunk per segment, the chunk
+ * framing referencing the segments rather than copying them. Other methods
+ * than POST, other paths than http_path, chunked request bodies and
+ * malformed or oversized requests get an error status and the connection
+ * is closed. Notifications, and requests dropped for their deadline, are
+ * answered with 204 No Content.
+ *
+ * Methods must not defer their reply (hpjsrpc_defer()); the server has no
+ * completion queue to collect it from.
+ */
+
+#ifndef HPJSRPC_SERVER_DEFAULT_PIPELINE
+# define HPJSRPC_SERVER_DEFAULT_PIPELINE  64
+#endif
+
+#ifndef HPJSRPC_SERVER_DEFAULT_URING_ENTRIES
+# define HPJSRPC_SERVER_DEFAULT_URING_ENTRIES      256
+#endif
+
+#ifndef HPJSRPC_SERVER_DEFAULT_URING_BUFFERS
+# define HPJSRPC_SERVER_DEFAULT_URING_BUFFERS      256
+#endif
+
+#ifndef HPJSRPC_SERVER_DEFAULT_URING_BUFFER_SIZE
+# define HPJSRPC_SERVER_DEFAULT_URING_BUFFER_SIZE  16384
+#endif
+
+typedef struct hpjsrpc_server_t hpjsrpc_server_t;
+
+typedef enum {
+  HPJSRPC_SERVER_EPOLL = 0,
+  HPJSRPC_SERVER_IO_URING
+} hpjsrpc_server_backend_t;
+
+typedef enum {
+  HPJSRPC_SERVER_NDJSON = 0,
+  HPJSRPC_SERVER_HTTP
+} hpjsrpc_server_protocol_t;
+
+typedef struct {
+  /* Numeric IPv4 or IPv6 address to listen on; NULL for any */
+  const char                     *address;
+  /* 0 picks a free port, see hpjsrpc_server_port() */
+  uint16_t                        port;
+  /* 0 for one shard per CPU the process may run on */
+  size_t                          shard_count;
+  /* Pin shard i to the i-th CPU the process may run on */
+  bool                            pin_shards;
+  bool                            busy_poll;
+  /* Per shard; further connections are closed on accept (0 for no bound) */
+  size_t                          max_connections;
+  /* Longest request accepted; longer ones close the connection */
+  size_t                          read_buffer_size_in_bytes;
+  hpjsrpc_server_protocol_t       protocol;
+  /* HTTP: the only path served, NULL for any; must outlive the server */
+  const char                     *http_path;
+  /* HTTP: results this long or longer are sent chunked (0: never) */
+  size_t                          http_chunked_in_bytes;
+  /* Replies queued per connection (0 for the default) */
+  size_t                          max_pipeline;
+  /* Unwritten reply bytes per connection before reading stops (0: none) */
+  size_t                          max_output_in_bytes;
+  /* Per-request contexts, pooled per shard */
+  hpjsrpc_context_pool_config_t   context;
+  hpjsrpc_server_backend_t        backend;
+  /* io_uring only, per shard (0 for the defaults) */
+  unsigned                        uring_entries;
+  /* Receive buffers provided to the kernel; a power of two up to 32768 */
+  unsigned                        uring_buffer_count;
+  size_t                          uring_buffer_size_in_bytes;
+} hpjsrpc_server_config_t;
+
+/* Creates the shards and binds their sockets; nothing runs yet */
+HPJSRPC_RETURN hpjsrpc_server_new (
+  hpjsrpc_server_t                     **pptr,
+  hpjsrpc_engine_t                      *engine,
+  const hpjsrpc_server_config_t         *config);
+
+/* Stops the server if it is running, then closes everything */
+HPJSRPC_RETURN hpjsrpc_server_destroy (hpjsrpc_server_t *server);
+
+/* Starts one thread per shard and returns */
+HPJSRPC_RETURN hpjsrpc_server_start (hpjsrpc_server_t *server);
+
+/* Closes all connections and joins the shard threads */
+HPJSRPC_RETURN hpjsrpc_server_stop (hpjsrpc_server_t *server);
+
+uint16_t hpjsrpc_server_port (const hpjsrpc_server_t *server);
+size_t hpjsrpc_server_shard_count (const hpjsrpc_server_t *server);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_SERVER_H */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,129 @@
+
+#ifndef HPJSRPC_SHM_H
+#define	HPJSRPC_SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_context.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Shared-memory transport, for a client on the same host.
+ *
+ * A channel is one memfd region holding two single-producer/single-consumer
+ * rings: requests from the client to the server and replies back. One side
+ * creates the channel with hpjsrpc_shm_new() and hands the descriptor from
+ * hpjsrpc_shm_fd() to the other (fork, SCM_RIGHTS, /proc/<pid>/fd), which
+ * maps it with hpjsrpc_shm_attach(). Each message is stored contiguously,
+ * so the server parses requests in place in the shared region and copies
+ * each reply into the reply ring once; nothing goes through the kernel
+ * while both sides are busy.
+ *
+ * A side waiting for a message (or for room in a full ring) polls the ring
+ * spin_count times, then flags itself idle and sleeps on a futex in the
+ * region. The other side only makes the wake-up system call when it sees
+ * that flag, so a busy pair trades messages without any.
+ *
+ * Replies come back in request order. Notifications get none. A client that
+ * sends more than the reply ring holds without reading replies stalls both
+ * sides; read replies as they come, or bound the requests in flight. A
+ * reply longer than half the reply ring closes the channel.
+ *
+ * The peer is trusted: it can change a request while the server parses it.
+ * Records are still checked against the ring and against what the peer has
+ * published; one that does not fit marks the ring corrupt and closes the
+ * channel, and the call that found it fails with HPJSRPC_ASSERTION_ERROR.
+ * Each side of a channel is used by one thread at a time.
+ */
+
+#ifndef HPJSRPC_SHM_DEFAULT_RING_SIZE
+# define HPJSRPC_SHM_DEFAULT_RING_SIZE    (1u << 20)
+#endif
+
+#ifndef HPJSRPC_SHM_DEFAULT_SPIN_COUNT
+# define HPJSRPC_SHM_DEFAULT_SPIN_COUNT   1024
+#endif
+
+typedef struct hpjsrpc_shm_t hpjsrpc_shm_t;
+
+typedef struct {
+  /* Rounded up to a power of two (0 for the default); messages up to half */
+  size_t                          request_ring_size_in_bytes;
+  size_t                          response_ring_size_in_bytes;
+  /* Polls before sleeping (0 for the default) */
+  unsigned                        spin_count;
+} hpjsrpc_shm_config_t;
+
+/* Creates a channel in a new memfd region */
+HPJSRPC_RETURN hpjsrpc_shm_new (
+  hpjsrpc_shm_t                        **pptr,
+  const hpjsrpc_shm_config_t            *config);
+
+/* Maps the channel behind fd; the caller keeps fd (0 spins the default) */
+HPJSRPC_RETURN hpjsrpc_shm_attach (
+  hpjsrpc_shm_t                        **pptr,
+  int                                    fd,
+  unsigned                               spin_count);
+
+/* Unmaps the region; the side that created it also closes its fd */
+HPJSRPC_RETURN hpjsrpc_shm_destroy (hpjsrpc_shm_t *shm);
+
+/* The memfd behind the channel, for passing to the peer */
+int hpjsrpc_shm_fd (const hpjsrpc_shm_t *shm);
+
+/*
+ * Closes the channel for both sides and wakes the peer; calls waiting on
+ * it, or made afterwards, return HPJSRPC_CLOSED.
+ */
+void hpjsrpc_shm_close (hpjsrpc_shm_t *shm);
+
+/* -- Client side -- */
+
+/* Queues a request, waiting while the request ring is full */
+HPJSRPC_RETURN hpjsrpc_shm_send (
+  hpjsrpc_shm_t                         *shm,
+  const void                            *request,
+  size_t                                 length_in_bytes);
+
+/*
+ * Waits for the next reply and points *reply at it, NUL-terminated, in the
+ * shared region. It stays there, and is returned again, until
+ * hpjsrpc_shm_consume().
+ */
+HPJSRPC_RETURN hpjsrpc_shm_receive (
+  hpjsrpc_shm_t                         *shm,
+  const char                           **reply,
+  size_t                                *length_in_bytes);
+
+/* Gives the received reply's space back to the server */
+void hpjsrpc_shm_consume (hpjsrpc_shm_t *shm);
+
+/* -- Server side -- */
+
+/*
+ * Processes the requests queued right now with ctx, one at a time, without
+ * waiting for more; *processed (may be NULL) counts them. For servers that
+ * poll several channels from one loop.
+ */
+HPJSRPC_RETURN hpjsrpc_shm_process (
+  hpjsrpc_shm_t                         *shm,
+  hpjsrpc_context_t                     *ctx,
+  size_t                                *processed);
+
+/* Processes requests as they come until the channel is closed */
+HPJSRPC_RETURN hpjsrpc_shm_serve (
+  hpjsrpc_shm_t                         *shm,
+  hpjsrpc_context_t                     *ctx);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_SHM_H */
+/* vi: set et sw=2 ts=2: */
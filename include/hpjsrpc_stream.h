@@ -0,0 +1,101 @@
+
+#ifndef HPJSRPC_STREAM_H
+#define	HPJSRPC_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_context.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Content-Length framing over a byte stream, as language servers use on
+ * pipes: each message is a header block, "Content-Length: <n>" and
+ * optionally other headers, each ending in CRLF, then an empty line, then
+ * n bytes of body.
+ *
+ * The framer owns a read buffer. The caller reads into the space that
+ * hpjsrpc_stream_space() offers, however much arrives, and reports it with
+ * hpjsrpc_stream_commit(). hpjsrpc_stream_next() then hands out one
+ * complete body after another, where it lies in the buffer, until the
+ * buffer holds no further complete message. Header lines are scanned once:
+ * a header split across reads resumes where the last scan stopped.
+ *
+ * Bodies are never copied to be joined. When a read would run past the end
+ * of the buffer, the unconsumed bytes (at most one message) are moved to
+ * its start; a body longer than the buffer grows it, up to the largest
+ * message allowed.
+ *
+ * hpjsrpc_stream_serve() runs the whole loop between two file descriptors,
+ * stdin and stdout for instance, and frames the replies the same way.
+ */
+
+#ifndef HPJSRPC_STREAM_MAX_HEAD
+# define HPJSRPC_STREAM_MAX_HEAD          1024
+#endif
+
+typedef struct hpjsrpc_stream_t hpjsrpc_stream_t;
+
+/*
+ * buffer_size_in_bytes is the initial read buffer; max_body_in_bytes bounds
+ * a message body, larger ones fail the stream.
+ */
+HPJSRPC_RETURN hpjsrpc_stream_new (
+  hpjsrpc_stream_t                     **pptr,
+  size_t                                 buffer_size_in_bytes,
+  size_t                                 max_body_in_bytes);
+HPJSRPC_RETURN hpjsrpc_stream_destroy (hpjsrpc_stream_t *stream);
+
+/*
+ * Where the next read goes, and how much fits there (0 only if the buffer
+ * had to grow and could not). Invalidates the bodies handed out so far.
+ */
+void *hpjsrpc_stream_space (hpjsrpc_stream_t *stream,
+  size_t *available_in_bytes);
+
+/* Accounts for length bytes read into the space */
+void hpjsrpc_stream_commit (hpjsrpc_stream_t *stream, size_t length_in_bytes);
+
+/*
+ * Hands out the next complete body. HPJSRPC_PARSE_ERROR_PART if more bytes
+ * are needed first, HPJSRPC_PARSE_ERROR_INVAL for a malformed or oversized
+ * header block or body; the stream cannot be resynchronised after that.
+ */
+HPJSRPC_RETURN hpjsrpc_stream_next (
+  hpjsrpc_stream_t                      *stream,
+  const char                           **body,
+  size_t                                *length_in_bytes);
+
+/* True between messages: nothing of a next one has arrived */
+bool hpjsrpc_stream_is_idle (const hpjsrpc_stream_t *stream);
+
+/*
+ * Writes the "Content-Length: <n>\r\n\r\n" header for a body of length
+ * bytes into dst, which must hold HPJSRPC_STREAM_MAX_HEAD bytes; returns
+ * the header length.
+ */
+size_t hpjsrpc_stream_header (char *dst, size_t length_in_bytes);
+
+/*
+ * Reads messages from in_fd and processes each with ctx, writing every
+ * reply framed to out_fd, until end of input; both blocking. The response
+ * buffer of ctx must have no sink, as the body length goes first. Returns
+ * HPJSRPC_NO_ERROR at end of input between messages.
+ */
+HPJSRPC_RETURN hpjsrpc_stream_serve (
+  hpjsrpc_stream_t                      *stream,
+  hpjsrpc_context_t                     *ctx,
+  int                                    in_fd,
+  int                                    out_fd);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_STREAM_H */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,109 @@
+
+#ifndef HPJSRPC_TIMING_H
+#define	HPJSRPC_TIMING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Stage timers.
+ *
+ * rpc_parse_request() and rpc_process_request() time the stages a request
+ * goes through (hpjsrpc_stage_t) into hpjsrpc_request_t.stat_ns, in
+ * nanoseconds. On x86-64 with an invariant TSC the clock is the time-stamp
+ * counter: rdtsc where a stage begins and rdtscp where it ends, each
+ * fenced so that the stage's own instructions stay in between, and a scale
+ * to nanoseconds calibrated once against CLOCK_MONOTONIC_RAW. Elsewhere the
+ * clock is CLOCK_MONOTONIC_RAW itself.
+ *
+ * At compile time, HPJSRPC_TIMING 0 takes stage timing out altogether; the
+ * stat fields then stay 0 and nothing is left to cost anything. Compiled
+ * in, hpjsrpc_set_timing() picks per engine between off, every request,
+ * and one request in N on each thread; a request left out costs a
+ * countdown and a few tests. rpc_parse_request() decides, so a request is
+ * timed whole or not at all.
+ */
+
+#ifndef HPJSRPC_TIMING
+# define HPJSRPC_TIMING                   1
+#endif
+
+typedef enum {
+  /* Tokenizing, in rpc_parse_request() */
+  HPJSRPC_STAGE_PARSE = 0,
+  /* Checking the envelope */
+  HPJSRPC_STAGE_VALIDATE,
+  /* Finding the method */
+  HPJSRPC_STAGE_LOOKUP,
+  /* Running it, its result written out included */
+  HPJSRPC_STAGE_INVOKE,
+  /* Finishing the reply, error replies, and the flush to a sink */
+  HPJSRPC_STAGE_WRITE,
+  HPJSRPC_STAGE_COUNT
+} hpjsrpc_stage_t;
+
+/* Nanoseconds are (ticks * mult) >> 32 */
+typedef struct {
+  uint64_t                        mult;
+  bool                            is_tsc;
+} hpjsrpc_timing_clock_t;
+
+extern hpjsrpc_timing_clock_t hpjsrpc_timing_clock;
+
+/*
+ * Picks the clock and calibrates it, taking a couple of milliseconds the
+ * first time and nothing after; safe from any thread. Engines call it.
+ */
+void hpjsrpc_timing_calibrate (void);
+
+/* CLOCK_MONOTONIC_RAW in nanoseconds, the clock without a TSC */
+uint64_t hpjsrpc_timing_raw_ns (void);
+
+/* Ticks where a stage begins; nothing after it starts earlier */
+static inline uint64_t
+hpjsrpc_timing_begin (void) {
+#if defined(__x86_64__)
+  if (__builtin_expect(hpjsrpc_timing_clock.is_tsc, 1)) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc\n\tlfence" : "=a" (lo), "=d" (hi)
+      :: "memory");
+    return (((uint64_t) hi << 32) | lo);
+  }
+#endif
+  return hpjsrpc_timing_raw_ns();
+}
+
+/* Ticks where a stage ends, once everything before it has executed */
+static inline uint64_t
+hpjsrpc_timing_end (void) {
+#if defined(__x86_64__)
+  if (__builtin_expect(hpjsrpc_timing_clock.is_tsc, 1)) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtscp\n\tlfence" : "=a" (lo), "=d" (hi)
+      :: "rcx", "memory");
+    return (((uint64_t) hi << 32) | lo);
+  }
+#endif
+  return hpjsrpc_timing_raw_ns();
+}
+
+static inline uint64_t
+hpjsrpc_timing_ns (uint64_t ticks) {
+#if defined(__x86_64__)
+  return (uint64_t) (((unsigned __int128) ticks * hpjsrpc_timing_clock.mult)
+    >> 32);
+#else
+  return ticks;
+#endif
+}
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* HPJSRPC_TIMING_H */
+/* vi: set et sw=2 ts=2: */
@@ -2,13 +2,15 @@
 #ifndef HPJSRPC_H
 #define	HPJSRPC_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
 
 #include "art.h"
 #include "jsmn.h"
-#include "tictoc.h"
+#include "hpjsrpc_timing.h"
 
 #ifdef	__cplusplus
 "C" {
@@ -47,6 +49,16 @@ typedef enum {
   HPJSRPC_RPC_ERROR_OUTOFRESBUF = -32011,
   /* Assertion */
   HPJSRPC_ASSERTION_ERROR = -32012,
+  /* Response sink failed, or the response broke off after a partial flush */
+  HPJSRPC_RPC_ERROR_SINK = -32013,
+  /* The transport was closed, by this side or by the peer */
+  HPJSRPC_CLOSED = -32014,
+  /* Over an admission limit, see hpjsrpc_set_admission() */
+  HPJSRPC_RPC_ERROR_BUSY = -32015,
+  /* Deadline passed before the request ran, see hpjsrpc_request_expired() */
+  HPJSRPC_RPC_ERROR_EXPIRED = -32016,
+  /* Method deferred its reply, see hpjsrpc_defer() */
+  HPJSRPC_PENDING = 1,
 
   // -- These are reserved JSONRPC code values
   /* The JSON sent is not a valid Request object */
@@ -59,22 +71,83 @@ typedef enum {
   JSONRPC_20_INTERNALERROR        = -32603,
   /* Invalid JSON was received by the server. Error while parsing JSON text */
   JSONRPC_20_PARSE_ERROR          = -32700,
+  /* From the implementation-defined server errors: overloaded, retry later */
+  JSONRPC_20_SERVER_BUSY          = -32099,
 } HPJSRPC_RETURN;
 
 typedef struct hpjsrpc_engine_t hpjsrpc_engine_t;
 typedef struct hpjsrpc_method_t hpjsrpc_method_t;
 typedef struct hpjsrpc_request_t hpjsrpc_request_t;
 typedef struct hpjsrpc_response_t hpjsrpc_response_t;
+typedef struct hpjsrpc_context_t hpjsrpc_context_t;
+
+#define HPJSRPC_JSON_MAX_DEPTH            64
+
+typedef struct hpjsrpc_segment_t hpjsrpc_segment_t;
+typedef struct hpjsrpc_segment_pool_t hpjsrpc_segment_pool_t;
+
+struct iovec;
+
+/* Receives flushed response bytes, see hpjsrpc_buffer_set_sink() */
+typedef HPJSRPC_RETURN (*hpjsrpc_sink_t) (void *ctx, const struct iovec *iov,
+  size_t iov_count);
 
 typedef struct {
   uint8_t                        *data;
   size_t                          size_in_bytes;
   size_t                          capacity_in_bytes;
+  /* JSON writer state, see hpjsrpc_json.h; bit n set = level n has a value */
+  uint64_t                        json_has_value;
+  uint32_t                        json_depth;
+  bool                            json_after_key;
+  bool                            json_overflow;
+  /* Chained mode, see hpjsrpc_segment.h; NULL for a fixed caller buffer */
+  hpjsrpc_segment_pool_t         *segment_pool;
+  hpjsrpc_segment_t              *head_segment;
+  hpjsrpc_segment_t              *tail_segment;
+  /* Streaming mode, see hpjsrpc_segment.h; NULL sink to stage everything */
+  hpjsrpc_sink_t                  sink;
+  void                           *sink_ctx;
+  size_t                          sink_flushed_in_bytes;
+  bool                            sink_failed;
 } hpjsrpc_buffer_t;
 
+void hpjsrpc_buffer_rewind_chained (hpjsrpc_buffer_t *buf);
+uint8_t *hpjsrpc_buffer_grow (hpjsrpc_buffer_t *buf, size_t len);
+HPJSRPC_RETURN hpjsrpc_buffer_append_slow (hpjsrpc_buffer_t *buf,
+  const void *bytes, size_t len);
+
+/*
+ * Resets a buffer to empty. Fixed buffers must have segment_pool set to
+ * NULL (e.g. by zero initialization) before the first rewind.
+ */
 static inline void
 hpjsrpc_buffer_rewind (hpjsrpc_buffer_t *buf) {
   buf->size_in_bytes = 0;
+  buf->json_has_value = 0;
+  buf->json_depth = 0;
+  buf->json_after_key = false;
+  buf->json_overflow = false;
+  buf->sink_flushed_in_bytes = 0;
+  if (NULL != buf->segment_pool) {
+    hpjsrpc_buffer_rewind_chained(buf);
+  }
+}
+
+/*
+ * Appends raw bytes, keeping the buffer NUL terminated. For a fixed buffer
+ * nothing is written if the bytes (plus terminator) do not fit; a chained
+ * buffer spreads them over as many segments as needed.
+ */
+static inline HPJSRPC_RETURN
+hpjsrpc_buffer_append (hpjsrpc_buffer_t *buf, const void *bytes, size_t len) {
+  if (__builtin_expect(len >= (buf->capacity_in_bytes - buf->size_in_bytes), 0)) {
+    return hpjsrpc_buffer_append_slow(buf, bytes, len);
+  }
+  memcpy(buf->data + buf->size_in_bytes, bytes, len);
+  buf->size_in_bytes += len;
+  buf->data[buf->size_in_bytes] = 0;
+  return HPJSRPC_NO_ERROR;
 }
 
 static inline HPJSRPC_RETURN
@@ -85,11 +158,14 @@ hpjsrpc_buffer_printf (hpjsrpc_buffer_t *buf, char *format, ...) {
   int len = vsnprintf((char *)(buf->data + buf->size_in_bytes),
     avail_size_in_bytes, format, args);
   va_end(args);
-  if (len >= avail_size_in_bytes) {
+  if (len < 0 || (size_t) len >= avail_size_in_bytes) {
+    /* Drop the truncated output rather than leave it behind */
+    if (0 < avail_size_in_bytes) {
+      buf->data[buf->size_in_bytes] = 0;
+    }
     return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
   }
   buf->size_in_bytes += len;
-  va_end(args);
   return HPJSRPC_NO_ERROR;
 }
 
@@ -102,12 +178,22 @@ struct hpjsrpc_method_t {
   bool                            is_notification;
   size_t                          param_count;
   jsmntype_t                      param[MAX_PARAMS];
+  /* May run on an engine worker thread when it appears inside a batch */
+  bool                            is_thread_safe;
+  /*
+   * Calls in progress at once, deferred ones until they complete (0 for no
+   * limit). Calls over it are answered "server busy" without running.
+   */
+  size_t                          max_concurrency;
 };
 
 struct hpjsrpc_request_t {
   hpjsrpc_engine_t               *engine;
+  /* Owning context, see hpjsrpc_context.h; NULL if assembled by hand */
+  hpjsrpc_context_t              *context;
   const char                     *buffer;
   jsmntok_t                      *tokens;
+  int                             root_token;
   const jsmntok_t                *versionToken;
   const jsmntok_t                *methodToken;
   const jsmntok_t                *paramsToken;
@@ -117,16 +203,57 @@ struct hpjsrpc_request_t {
   size_t                          buffer_length_in_bytes;
   const hpjsrpc_method_t         *method;
   bool                            is_notification;
-  uint64_t                        stat_validate_request_time;
-  uint64_t                        stat_validate_method_time;
-  uint64_t                        stat_invoke_method_time;
-  uint64_t                        stat_process_request_time;
+  /* Admission slots held, see hpjsrpc_set_admission(); internal */
+  uint32_t                        admission;
+  /*
+   * CLOCK_MONOTONIC times (see hpjsrpc_clock_ns()), 0 if unknown: when the
+   * transport received the request, and when its caller stops waiting.
+   * Set before processing; rpc_process_request() clears both when done.
+   */
+  uint64_t                        received_ns;
+  uint64_t                        deadline_ns;
+  /*
+   * Nanoseconds per stage, and in rpc_process_request() all told, for a
+   * request sampled by rpc_parse_request() (see hpjsrpc_set_timing());
+   * 0 otherwise.
+   */
+  bool                            is_timed;
+  uint64_t                        stat_ns[HPJSRPC_STAGE_COUNT];
+  uint64_t                        stat_total_ns;
 };
 
 struct hpjsrpc_response_t {
   hpjsrpc_buffer_t                buffer;
+  /*
+   * A chained response may reference bytes of the request buffer instead of
+   * copying them. If set, release_request is called by
+   * hpjsrpc_response_release() once those references are gone, which is
+   * when the request buffer may be reused.
+   */
+  void                          (*release_request) (void *ctx);
+  void                           *release_request_ctx;
 };
 
+/*
+ * Heap hooks. Engines, contexts, pools and the buffers they hand out are
+ * allocated through these, so an embedder can substitute its own allocator
+ * or count calls, e.g. to check that steady-state request handling does not
+ * allocate. Set them before creating anything; memory must be freed by the
+ * allocator that allocated it. The method tree and cache-aligned queues
+ * still use the C library directly.
+ */
+typedef struct {
+  void                         *(*malloc_fn) (size_t size_in_bytes);
+  void                          (*free_fn) (void *ptr);
+} hpjsrpc_allocator_t;
+
+/* NULL restores malloc() and free() */
+HPJSRPC_RETURN hpjsrpc_set_allocator (const hpjsrpc_allocator_t *allocator);
+
+void *hpjsrpc_malloc (size_t size_in_bytes);
+void *hpjsrpc_calloc (size_t count, size_t size_in_bytes);
+void hpjsrpc_free (void *ptr);
+
 HPJSRPC_RETURN rpc_register_methods (
   hpjsrpc_engine_t             *engine,
   const hpjsrpc_method_t       *methods,
@@ -137,11 +264,172 @@ HPJSRPC_RETURN hpjsrpc_init (hpjsrpc_engine_t *pptr);
 HPJSRPC_RETURN hpjsrpc_done (hpjsrpc_engine_t *pptr);
 HPJSRPC_RETURN hpjsrpc_destroy (hpjsrpc_engine_t *pptr);
 
+/*
+ * Stage timing (see hpjsrpc_timing.h): sample_every 0 turns it off, 1
+ * times every request, as engines do by default, and N one request in N
+ * on each thread. HPJSRPC_ASSERTION_ERROR for anything but 0 when built
+ * with HPJSRPC_TIMING 0.
+ */
+HPJSRPC_RETURN hpjsrpc_set_timing (
+  hpjsrpc_engine_t                     *engine,
+  uint32_t                              sample_every);
+
+/*
+ * Admission control.
+ *
+ * Caps the requests an engine works on at once, so that overload is turned
+ * away cheaply instead of queueing until every reply is late. A request
+ * over a limit is answered with a pre-rendered JSONRPC_20_SERVER_BUSY
+ * error once its envelope is validated, before the method is looked up,
+ * let alone run with its params. Notifications over a limit are dropped.
+ *
+ * max_concurrency bounds requests in progress, batch elements counted one
+ * by one. A deferred reply (see hpjsrpc_defer()) leaves that count for the
+ * pending count, bounded by max_pending; while it is reached, new requests
+ * are turned away so the backlog behind slow backends stops growing.
+ *
+ * With target_latency_in_us set, the concurrency limit adapts (additive
+ * increase, multiplicative decrease) between min_concurrency and
+ * max_concurrency: each request processed slower than the target cuts it
+ * by a tenth, at most once per limit's worth of requests, and requests
+ * within the target raise it by one per limit's worth while it is in use.
+ *
+ * Per-method limits are set with hpjsrpc_method_t.max_concurrency and work
+ * with admission control on or off.
+ */
+typedef struct {
+  /* Requests in progress at once (0 for no limit) */
+  size_t                          max_concurrency;
+  /* Deferred replies outstanding at once (0 for no limit) */
+  size_t                          max_pending;
+  /* Adapts the concurrency limit to this latency (0: a fixed limit) */
+  uint64_t                        target_latency_in_us;
+  /* Floor of the adaptive limit (0 for 1) */
+  size_t                          min_concurrency;
+} hpjsrpc_admission_config_t;
+
+typedef struct {
+  size_t                          in_progress;
+  size_t                          pending;
+  /* The concurrency limit now in force; 0 if there is none */
+  size_t                          limit;
+  uint64_t                        rejected;
+} hpjsrpc_admission_stats_t;
+
+/*
+ * NULL turns admission control off. Set before requests are processed; an
+ * adaptive limit needs max_concurrency, where it starts.
+ */
+HPJSRPC_RETURN hpjsrpc_set_admission (
+  hpjsrpc_engine_t                     *engine,
+  const hpjsrpc_admission_config_t     *config);
+HPJSRPC_RETURN hpjsrpc_admission_stats (
+  const hpjsrpc_engine_t               *engine,
+  hpjsrpc_admission_stats_t            *stats);
+
+/*
+ * Deferred replies keep their admission slots: hpjsrpc_defer() takes them
+ * over from the request, and they are handed back on completion.
+ */
+uint32_t rpc_admission_defer (hpjsrpc_request_t *req);
+void rpc_admission_release (
+  const hpjsrpc_engine_t               *engine,
+  const hpjsrpc_method_t               *method,
+  uint32_t                              admission);
+
+/*
+ * Deadlines.
+ *
+ * A request may carry a deadline past which nobody waits for its reply.
+ * Transports that are told one set deadline_ns, e.g. the HTTP server from
+ * a Deadline-Ms header (see hpjsrpc_context_set_deadline()). A request may
+ * also bring its own in the reserved envelope member "deadline_ms", in
+ * milliseconds from when it was received:
+ *
+ *   {"jsonrpc":"2.0","method":"sum","params":[1,2],"id":1,"deadline_ms":50}
+ *
+ * The earlier of the two applies; a deadline_ms that is not a
+ * non-negative integer is ignored.
+ *
+ * A request whose deadline has passed by the time it is dispatched is
+ * dropped, after its envelope is validated and before admission control:
+ * it is neither run nor answered, as if it were a notification. Methods
+ * that take long can poll hpjsrpc_request_expired() and give up early by
+ * returning HPJSRPC_RPC_ERROR_EXPIRED, which drops the reply the same way.
+ * Under the coroutine scheduler (see hpjsrpc_coro.h) a request that is
+ * suspended when its deadline passes is cancelled: its await ends with
+ * ECANCELED, and so does any further one.
+ */
+typedef struct {
+  /* Dropped before dispatch */
+  uint64_t                        expired;
+  /* Cancelled while in progress */
+  uint64_t                        cancelled;
+} hpjsrpc_deadline_stats_t;
+
+/* CLOCK_MONOTONIC in nanoseconds, the clock deadlines are kept in */
+uint64_t hpjsrpc_clock_ns (void);
+
+/* True once the deadline has passed; a single test for requests without */
+static inline bool
+hpjsrpc_request_expired (const hpjsrpc_request_t *req) {
+  return (0 != req->deadline_ns && hpjsrpc_clock_ns() >= req->deadline_ns);
+}
+
+HPJSRPC_RETURN hpjsrpc_deadline_stats (
+  const hpjsrpc_engine_t               *engine,
+  hpjsrpc_deadline_stats_t             *stats);
+
+/* Counts a request cancelled in progress, for executors that cancel */
+void rpc_deadline_cancelled (const hpjsrpc_engine_t *engine);
+
+/*
+ * Starts a work-stealing pool on which thread-safe elements of a batch
+ * request are executed concurrently, from any number of calling threads at
+ * once. Each element writes its reply into a chain of its own; for fixed
+ * response buffers the chain's segments are of segment_capacity_in_bytes.
+ */
+HPJSRPC_RETURN hpjsrpc_start_workers (
+  hpjsrpc_engine_t             *engine,
+  size_t                        worker_count,
+  size_t                        segment_capacity_in_bytes);
+HPJSRPC_RETURN hpjsrpc_stop_workers (hpjsrpc_engine_t *engine);
+
 HPJSRPC_RETURN rpc_parse_request (
   const char * const      buffer,
   size_t                  buffer_length_in_bytes,
   hpjsrpc_request_t      *req);
 
+/*
+ * Writes the reply for a request that failed before it could be processed,
+ * typically with the error returned by rpc_parse_request().
+ */
+HPJSRPC_RETURN rpc_process_error (
+  hpjsrpc_request_t      *req,
+  hpjsrpc_response_t     *res,
+  HPJSRPC_RETURN          rc);
+
+/*
+ * Reply assembly for replies written outside rpc_process_request(), such as
+ * deferred ones. id is the JSON text of the request id (quotes included for
+ * strings), or NULL for a null id. rpc_write_result_head() leaves the writer
+ * positioned at the result value; the caller closes the reply with
+ * hpjsrpc_json_end_object(). rpc_write_error() maps rc as the engine does.
+ */
+HPJSRPC_RETURN rpc_write_result_head (
+  hpjsrpc_buffer_t       *buf,
+  const void             *id,
+  size_t                  id_length_in_bytes);
+HPJSRPC_RETURN rpc_write_error (
+  const hpjsrpc_engine_t *engine,
+  hpjsrpc_buffer_t       *buf,
+  HPJSRPC_RETURN          rc,
+  const void             *id,
+  size_t                  id_length_in_bytes);
+
+/* Drops the response segments, then releases the request it refers to */
+HPJSRPC_RETURN hpjsrpc_response_release (hpjsrpc_response_t *res);
+
 const char *hpjsrpc_error_string (HPJSRPC_RETURN rc);
 HPJSRPC_RETURN rpc_process_request (hpjsrpc_request_t *req, hpjsrpc_response_t *res);
 
@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "hpjsrpc_async.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_segment.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+/* Ids up to this size are kept inline; longer ones go to the heap */
+#define PENDING_INLINE_ID_BYTES           32
+
+struct hpjsrpc_pending_t {
+  hpjsrpc_pending_t              *next;
+  const hpjsrpc_engine_t         *engine;
+  /* Admission slots held until completion, see hpjsrpc_set_admission() */
+  const hpjsrpc_method_t         *method;
+  uint32_t                        admission;
+  hpjsrpc_completion_queue_t     *queue;
+  hpjsrpc_response_t              res;
+  void                           *tag;
+  bool                            is_notification;
+  bool                            has_id;
+  uint8_t                        *id;
+  size_t                          id_length_in_bytes;
+  uint8_t                         id_inline[PENDING_INLINE_ID_BYTES];
+};
+
+struct hpjsrpc_completion_queue_t {
+  pthread_mutex_t                 lock;
+  pthread_cond_t                  ready;
+  hpjsrpc_pending_t              *head;
+  hpjsrpc_pending_t              *tail;
+  hpjsrpc_segment_pool_t         *segment_pool;
+  int                             event_fd;
+};
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_completion_queue_new (
+  hpjsrpc_completion_queue_t  **pptr,
+  size_t                        segment_size_in_bytes,
+  size_t                        max_segments
+) {
+  hpjsrpc_completion_queue_t *queue;
+
+  if (NULL == pptr) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  queue = hpjsrpc_calloc(1, sizeof(*queue));
+  if (NULL == queue) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_segment_pool_new(&queue->segment_pool,
+      segment_size_in_bytes, max_segments)) {
+    hpjsrpc_free(queue);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  queue->event_fd = eventfd(0, (EFD_NONBLOCK | EFD_CLOEXEC));
+  if (0 > queue->event_fd) {
+    hpjsrpc_segment_pool_destroy(queue->segment_pool);
+    hpjsrpc_free(queue);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->ready, NULL);
+
+  *pptr = queue;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_completion_queue_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_completion_queue_destroy (hpjsrpc_completion_queue_t *queue) {
+  hpjsrpc_pending_t *pending;
+
+  if (NULL == queue) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  while (NULL != (pending = hpjsrpc_completion_queue_pop(queue))) {
+    hpjsrpc_pending_release(pending);
+  }
+
+  close(queue->event_fd);
+  pthread_cond_destroy(&queue->ready);
+  pthread_mutex_destroy(&queue->lock);
+  hpjsrpc_segment_pool_destroy(queue->segment_pool);
+  hpjsrpc_free(queue);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_completion_queue_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+hpjsrpc_completion_queue_fd (const hpjsrpc_completion_queue_t *queue) {
+  return queue->event_fd;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static hpjsrpc_pending_t *
+queue_take (hpjsrpc_completion_queue_t *queue) {
+  hpjsrpc_pending_t *pending = queue->head;
+
+  if (NULL != pending) {
+    queue->head = pending->next;
+    if (NULL == queue->head) {
+      queue->tail = NULL;
+    }
+    pending->next = NULL;
+  }
+
+  return pending;
+
+} /* queue_take() */
+
+/* ------------------------------------------------------------------------- */
+
+hpjsrpc_pending_t *
+hpjsrpc_completion_queue_pop (hpjsrpc_completion_queue_t *queue) {
+  hpjsrpc_pending_t *pending;
+
+  pthread_mutex_lock(&queue->lock);
+  pending = queue_take(queue);
+  pthread_mutex_unlock(&queue->lock);
+
+  return pending;
+
+} /* hpjsrpc_completion_queue_pop() */
+
+/* ------------------------------------------------------------------------- */
+
+hpjsrpc_pending_t *
+hpjsrpc_completion_queue_wait (hpjsrpc_completion_queue_t *queue) {
+  hpjsrpc_pending_t *pending;
+
+  pthread_mutex_lock(&queue->lock);
+  while (NULL == queue->head) {
+    pthread_cond_wait(&queue->ready, &queue->lock);
+  }
+  pending = queue_take(queue);
+  pthread_mutex_unlock(&queue->lock);
+
+  return pending;
+
+} /* hpjsrpc_completion_queue_wait() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+queue_push (
+  hpjsrpc_completion_queue_t   *queue,
+  hpjsrpc_pending_t            *pending
+) {
+  uint64_t one = 1;
+
+  pending->next = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  if (NULL != queue->tail) {
+    queue->tail->next = pending;
+  } else {
+    queue->head = pending;
+  }
+  queue->tail = pending;
+  pthread_cond_signal(&queue->ready);
+  pthread_mutex_unlock(&queue->lock);
+
+  /* Can only fail on counter overflow, when the fd is readable anyway */
+  if (sizeof(one) != write(queue->event_fd, &one, sizeof(one))) {
+    return;
+  }
+
+} /* queue_push() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+pending_free (hpjsrpc_pending_t *pending) {
+  hpjsrpc_buffer_release(&pending->res.buffer);
+  if (pending->id != pending->id_inline) {
+    hpjsrpc_free(pending->id);
+  }
+  hpjsrpc_free(pending);
+}
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_defer (
+  hpjsrpc_request_t            *req,
+  hpjsrpc_response_t           *res,
+  hpjsrpc_completion_queue_t   *queue,
+  void                         *tag,
+  hpjsrpc_pending_t           **pptr
+) {
+  hpjsrpc_pending_t *pending;
+
+  if (NULL == req || NULL == res || NULL == queue || NULL == pptr) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  /* Batches are answered as a whole; streamed replies are partly sent */
+  if (0 != req->root_token || 0 < res->buffer.sink_flushed_in_bytes) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pending = hpjsrpc_calloc(1, sizeof(*pending));
+  if (unlikely(NULL == pending)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pending->engine = req->engine;
+  pending->queue = queue;
+  pending->tag = tag;
+  pending->is_notification = req->is_notification;
+  pending->id = pending->id_inline;
+  hpjsrpc_buffer_init_chained(&pending->res.buffer, queue->segment_pool);
+  hpjsrpc_buffer_rewind(&pending->res.buffer);
+
+  /* The request buffer will be gone by completion time; copy the id */
+  if (NULL != req->idToken) {
+    const jsmntok_t *token = &req->tokens[req->idToken->first_child];
+    const char      *start = &req->buffer[token->start];
+    size_t           len = (size_t) (token->end - token->start);
+
+    if (JSMN_STRING == token->type) {
+      start--;
+      len += 2;
+    }
+    if (PENDING_INLINE_ID_BYTES < len) {
+      pending->id = hpjsrpc_malloc(len);
+      if (unlikely(NULL == pending->id)) {
+        pending->id = pending->id_inline;
+        pending_free(pending);
+        return HPJSRPC_ASSERTION_ERROR;
+      }
+    }
+    memcpy(pending->id, start, len);
+    pending->id_length_in_bytes = len;
+    pending->has_id = true;
+  }
+
+  if (!pending->is_notification && HPJSRPC_NO_ERROR
+      != rpc_write_result_head(&pending->res.buffer,
+        (pending->has_id) ? pending->id : NULL, pending->id_length_in_bytes)) {
+    pending_free(pending);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pending->method = req->method;
+  pending->admission = rpc_admission_defer(req);
+  *pptr = pending;
+
+  return HPJSRPC_PENDING;
+
+} /* hpjsrpc_defer() */
+
+/* ------------------------------------------------------------------------- */
+
+hpjsrpc_buffer_t *
+hpjsrpc_pending_buffer (hpjsrpc_pending_t *pending) {
+  return &pending->res.buffer;
+}
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_pending_complete (
+  hpjsrpc_pending_t    *pending,
+  HPJSRPC_RETURN        rc
+) {
+  hpjsrpc_buffer_t *buf;
+
+  if (NULL == pending) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  /* The call is over, whenever the reply goes out */
+  if (0 != pending->admission) {
+    rpc_admission_release(pending->engine, pending->method,
+      pending->admission);
+    pending->admission = 0;
+  }
+
+  if (pending->is_notification) {
+    pending_free(pending);
+    return HPJSRPC_NO_ERROR;
+  }
+
+  buf = &pending->res.buffer;
+  if (HPJSRPC_NO_ERROR == rc) {
+    hpjsrpc_json_end_object(buf);
+    rc = hpjsrpc_json_status(buf);
+  }
+
+  if (HPJSRPC_RPC_ERROR_EXPIRED == rc) {
+    /* Nobody waits for it: delivered empty, so the call is still over */
+    hpjsrpc_buffer_rewind(buf);
+    rc = HPJSRPC_NO_ERROR;
+  } else if (HPJSRPC_NO_ERROR != rc) {
+    hpjsrpc_buffer_rewind(buf);
+    if (HPJSRPC_NO_ERROR != rpc_write_error(pending->engine, buf, rc,
+        (pending->has_id) ? pending->id : NULL, pending->id_length_in_bytes)) {
+      /* Delivered empty, so the consumer still learns the call is over */
+      hpjsrpc_buffer_rewind(buf);
+      rc = HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+    } else {
+      rc = HPJSRPC_NO_ERROR;
+    }
+  }
+
+  queue_push(pending->queue, pending);
+
+  return rc;
+
+} /* hpjsrpc_pending_complete() */
+
+/* ------------------------------------------------------------------------- */
+
+hpjsrpc_response_t *
+hpjsrpc_pending_response (hpjsrpc_pending_t *pending) {
+  return &pending->res;
+}
+
+/* ------------------------------------------------------------------------- */
+
+void *
+hpjsrpc_pending_tag (const hpjsrpc_pending_t *pending) {
+  return pending->tag;
+}
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_pending_release (hpjsrpc_pending_t *pending) {
+
+  if (NULL == pending) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pending_free(pending);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_pending_release() */
+/* vi: set et sw=2 ts=2: */
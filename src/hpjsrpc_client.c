@@ -0,0 +1,1613 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "hpjsrpc_client.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_segment.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define CLIENT_DEFAULT_SEGMENT_SIZE       4096
+/* iovec entries gathered per write */
+#define CLIENT_WRITE_IOVECS               64
+
+/* A call in flight; id 0 marks a free slot */
+typedef struct {
+  uint64_t                        id;
+  hpjsrpc_client_callback_t       callback;
+  void                           *arg;
+} client_call_t;
+
+struct hpjsrpc_client_t {
+  int                             fd;
+  bool                            is_socket;
+  hpjsrpc_client_config_t         config;
+  uint64_t                        next_id;
+  /* Open addressing with linear probing, keyed by id & call_mask */
+  client_call_t                  *calls;
+  size_t                          call_mask;
+  size_t                          outstanding;
+  /* Queued calls; bytes before out_offset are written */
+  hpjsrpc_segment_pool_t         *segments;
+  hpjsrpc_buffer_t                out;
+  size_t                          out_offset;
+  size_t                          queued;
+  /* Reply lines; [in_start, in_length) is unconsumed */
+  char                           *in;
+  size_t                          in_start;
+  size_t                          in_length;
+  size_t                          in_scanned;
+  jsmntok_t                      *tokens;
+  bool                            is_closed;
+  bool                            is_dispatching;
+};
+
+static HPJSRPC_RETURN client_flush (hpjsrpc_client_t *client,
+  size_t *completed);
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Ids are handed out in sequence, so the low bits alone spread the calls
+ * in flight over the table without collisions for as long as none of them
+ * lags max_in_flight ids or more behind.
+ */
+static inline size_t
+client_slot (
+  const hpjsrpc_client_t *client,
+  uint64_t                id
+) {
+  size_t slot = (size_t) (id & client->call_mask);
+
+  while (0 != client->calls[slot].id && id != client->calls[slot].id) {
+    slot = ((slot + 1) & client->call_mask);
+  }
+
+  return slot;
+
+} /* client_slot() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Frees a slot, shifting later entries of its probe run back into it */
+static void
+client_remove (
+  hpjsrpc_client_t     *client,
+  size_t                slot
+) {
+  size_t mask = client->call_mask;
+  size_t next = slot;
+
+  client->calls[slot].id = 0;
+  for (;;) {
+    size_t home;
+
+    next = ((next + 1) & mask);
+    if (0 == client->calls[next].id) {
+      break;
+    }
+    /* Entries whose home lies cyclically in (slot, next] stay put */
+    home = (size_t) (client->calls[next].id & mask);
+    if (((next - home) & mask) >= ((next - slot) & mask)) {
+      client->calls[slot] = client->calls[next];
+      client->calls[next].id = 0;
+      slot = next;
+    }
+  }
+  client->outstanding--;
+
+} /* client_remove() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Completes every call in flight with HPJSRPC_CLOSED */
+static void
+client_fail (hpjsrpc_client_t *client) {
+  hpjsrpc_client_reply_t reply;
+
+  client->is_closed = true;
+
+  memset(&reply, 0, sizeof(reply));
+  reply.rc = HPJSRPC_CLOSED;
+  for (size_t ii = 0; ii <= client->call_mask; ++ii) {
+    client_call_t call = client->calls[ii];
+
+    if (0 == call.id) {
+      continue;
+    }
+    client->calls[ii].id = 0;
+    client->outstanding--;
+    reply.id = call.id;
+    call.callback(call.arg, &reply);
+  }
+
+} /* client_fail() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_new (
+  hpjsrpc_client_t                     **pptr,
+  int                                    fd,
+  const hpjsrpc_client_config_t         *config
+) {
+  hpjsrpc_client_t *client;
+  size_t            table_size = 2;
+  int               type;
+  socklen_t         type_length = sizeof(type);
+
+  if (NULL == pptr || 0 > fd || NULL == config) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  client = hpjsrpc_calloc(1, sizeof(*client));
+  if (NULL == client) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  client->fd = fd;
+  client->config = *config;
+  client->next_id = 1;
+  if (0 == client->config.max_in_flight) {
+    client->config.max_in_flight = HPJSRPC_CLIENT_DEFAULT_IN_FLIGHT;
+  }
+  if (0 == client->config.max_batch) {
+    client->config.max_batch = 1;
+  }
+  if (0 == client->config.max_reply_in_bytes) {
+    client->config.max_reply_in_bytes = HPJSRPC_CLIENT_DEFAULT_REPLY_SIZE;
+  }
+  if (0 == client->config.max_token_count) {
+    client->config.max_token_count = HPJSRPC_CLIENT_DEFAULT_TOKENS;
+  }
+  if (0 == client->config.segment_size_in_bytes) {
+    client->config.segment_size_in_bytes = CLIENT_DEFAULT_SEGMENT_SIZE;
+  }
+
+  /* At most half full, which keeps probe runs short */
+  while (table_size < (2 * client->config.max_in_flight)) {
+    table_size <<= 1;
+  }
+  client->call_mask = (table_size - 1);
+
+  client->calls = hpjsrpc_calloc(table_size, sizeof(*client->calls));
+  client->in = hpjsrpc_malloc(client->config.max_reply_in_bytes);
+  client->tokens = hpjsrpc_calloc(client->config.max_token_count,
+    sizeof(*client->tokens));
+  if (NULL == client->calls || NULL == client->in || NULL == client->tokens
+      || HPJSRPC_NO_ERROR != hpjsrpc_segment_pool_new(&client->segments,
+        client->config.segment_size_in_bytes, 0)
+      || HPJSRPC_NO_ERROR != hpjsrpc_buffer_init_chained(&client->out,
+        client->segments)) {
+    client->fd = -1;
+    hpjsrpc_client_destroy(client);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  hpjsrpc_buffer_rewind(&client->out);
+
+  /* Sockets are written with MSG_NOSIGNAL, anything else with writev() */
+  client->is_socket = (0 == getsockopt(fd, SOL_SOCKET, SO_TYPE, &type,
+    &type_length));
+  fcntl(fd, F_SETFL, (fcntl(fd, F_GETFL) | O_NONBLOCK));
+
+  *pptr = client;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_client_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_connect (
+  hpjsrpc_client_t                     **pptr,
+  const char                            *address,
+  uint16_t                               port,
+  const hpjsrpc_client_config_t         *config
+) {
+  struct addrinfo  hints;
+  struct addrinfo *ai;
+  char             service[8];
+  int              fd;
+  int              one = 1;
+
+  if (NULL == pptr || NULL == address || NULL == config) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = (AI_NUMERICHOST | AI_NUMERICSERV);
+  snprintf(service, sizeof(service), "%u", (unsigned) port);
+  if (0 != getaddrinfo(address, service, &hints, &ai)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  fd = socket(ai->ai_family, (SOCK_STREAM | SOCK_CLOEXEC), 0);
+  if (0 > fd || 0 != connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+    freeaddrinfo(ai);
+    if (0 <= fd) {
+      close(fd);
+    }
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  freeaddrinfo(ai);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_client_new(pptr, fd, config)) {
+    close(fd);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_client_connect() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_destroy (hpjsrpc_client_t *client) {
+
+  if (NULL == client) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (NULL != client->calls) {
+    client_fail(client);
+  }
+  if (0 <= client->fd) {
+    close(client->fd);
+  }
+  if (NULL != client->segments) {
+    hpjsrpc_buffer_release(&client->out);
+    hpjsrpc_segment_pool_destroy(client->segments);
+  }
+  hpjsrpc_free(client->tokens);
+  hpjsrpc_free(client->in);
+  hpjsrpc_free(client->calls);
+  hpjsrpc_free(client);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_client_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_client_outstanding (const hpjsrpc_client_t *client) {
+  return client->outstanding;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int
+hpjsrpc_client_fd (const hpjsrpc_client_t *client) {
+  return client->fd;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Parses an optionally signed decimal integer token; false if it is not */
+static bool
+client_token_int (
+  const char           *json,
+  const jsmntok_t      *token,
+  int64_t              *value
+) {
+  const char *pp = &json[token->start];
+  const char *end = &json[token->end];
+  bool        is_negative = false;
+  uint64_t    magnitude = 0;
+
+  if (JSMN_PRIMITIVE != token->type || pp == end) {
+    return false;
+  }
+  if ('-' == *pp) {
+    is_negative = true;
+    ++pp;
+  }
+  if (pp == end || (end - pp) > 18) {
+    return false;
+  }
+  for (; pp < end; ++pp) {
+    if ('0' > *pp || '9' < *pp) {
+      return false;
+    }
+    magnitude = (magnitude * 10) + (uint64_t) (*pp - '0');
+  }
+
+  *value = (is_negative) ? -(int64_t) magnitude : (int64_t) magnitude;
+  return true;
+
+} /* client_token_int() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Value token of key in the object at index, or NULL */
+static const jsmntok_t *
+client_member (
+  const char           *json,
+  const jsmntok_t      *tokens,
+  int                   index,
+  const char           *key,
+  size_t                key_length
+) {
+  int member;
+
+  if (JSMN_OBJECT != tokens[index].type || 0 == tokens[index].size) {
+    return NULL;
+  }
+
+  for (member = tokens[index].first_child; -1 != member;
+      member = tokens[member].next_sibling) {
+    const jsmntok_t *name = &tokens[member];
+
+    if ((size_t) (name->end - name->start) == key_length
+        && 0 == memcmp(&json[name->start], key, key_length)
+        && 1 == name->size) {
+      return &tokens[name->first_child];
+    }
+  }
+
+  return NULL;
+
+} /* client_member() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Completes the call the reply object at index answers. Replies nobody
+ * waits for (unknown or string ids, a call already completed) are
+ * dropped. Returns 1 if a call completed.
+ */
+static size_t
+client_complete (
+  hpjsrpc_client_t     *client,
+  const char           *json,
+  size_t                json_length,
+  int                   index
+) {
+  const jsmntok_t        *tokens = client->tokens;
+  const jsmntok_t        *id_token;
+  hpjsrpc_client_reply_t  reply;
+  client_call_t           call;
+  int64_t                 id;
+  size_t                  slot;
+
+  id_token = client_member(json, tokens, index, "id", 2);
+  if (NULL == id_token || !client_token_int(json, id_token, &id) || 0 >= id) {
+    return 0;
+  }
+
+  slot = client_slot(client, (uint64_t) id);
+  if (0 == client->calls[slot].id) {
+    return 0;
+  }
+  call = client->calls[slot];
+  client_remove(client, slot);
+
+  memset(&reply, 0, sizeof(reply));
+  reply.id = call.id;
+  reply.rc = HPJSRPC_NO_ERROR;
+  reply.json = json;
+  reply.json_length = json_length;
+  reply.tokens = tokens;
+  reply.value = client_member(json, tokens, index, "result", 6);
+  if (NULL == reply.value) {
+    reply.value = client_member(json, tokens, index, "error", 5);
+    reply.is_error = true;
+    if (NULL != reply.value) {
+      const jsmntok_t *code = client_member(json, tokens,
+        (int) (reply.value - tokens), "code", 4);
+      if (NULL != code) {
+        client_token_int(json, code, &reply.error_code);
+      }
+    }
+  }
+
+  call.callback(call.arg, &reply);
+
+  return 1;
+
+} /* client_complete() */
+
+/* ------------------------------------------------------------------------- */
+
+/* The first index from ii on that is not a space or a tab */
+static inline size_t
+client_skip_space (const char *line, size_t length, size_t ii) {
+
+  while (ii < length && (' ' == line[ii] || '\t' == line[ii])) {
+    ++ii;
+  }
+
+  return ii;
+
+} /* client_skip_space() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Looks for the ids of a reply line jsmn could not parse, skipping strings
+ * and nested values the way a tokenizer would: the "id" member of the
+ * reply object, or of each reply object of a batch. An id counts only if
+ * a comma or the end of its object follows, so that a line cut short does
+ * not give away a wrong one. With failure set, completes each call found
+ * with it. True if every reply object in the line gave its id away.
+ */
+static bool
+client_scan_ids (
+  hpjsrpc_client_t                     *client,
+  const char                           *line,
+  size_t                                length,
+  const hpjsrpc_client_reply_t         *failure,
+  size_t                               *completed
+) {
+  size_t depth = 0;
+  size_t objects = 0;
+  size_t ids = 0;
+  size_t ii = 0;
+  bool   is_batch = false;
+  bool   is_object = false;
+
+  while (ii < length) {
+    char   c = line[ii++];
+    size_t start;
+
+    if ('{' == c || '[' == c) {
+      ++depth;
+      if (1 == depth) {
+        is_batch = ('[' == c);
+      }
+      if (depth == ((is_batch) ? 2 : 1)) {
+        is_object = ('{' == c);
+        objects += (is_object) ? 1 : 0;
+      }
+      continue;
+    }
+    if ('}' == c || ']' == c) {
+      depth -= (0 < depth) ? 1 : 0;
+      continue;
+    }
+    if ('"' != c) {
+      continue;
+    }
+
+    start = ii;
+    while (ii < length && '"' != line[ii]) {
+      ii += ('\\' == line[ii]) ? 2 : 1;
+    }
+    if (ii >= length) {
+      return false;
+    }
+    if (!is_object || depth != ((is_batch) ? 2 : 1) || 2 != (ii - start)
+        || 0 != memcmp(&line[start], "id", 2)) {
+      ++ii;
+      continue;
+    }
+
+    /* A key "id" of a reply object: its value must be a whole integer */
+    ii = client_skip_space(line, length, (ii + 1));
+    if (ii < length && ':' == line[ii]) {
+      uint64_t id = 0;
+      size_t   digits = 0;
+
+      for (ii = client_skip_space(line, length, (ii + 1));
+          ii < length && '0' <= line[ii] && '9' >= line[ii]; ++ii) {
+        id = (id * 10) + (uint64_t) (line[ii] - '0');
+        ++digits;
+      }
+      ii = client_skip_space(line, length, ii);
+      if (0 == digits || 18 < digits || 0 == id || ii == length
+          || (',' != line[ii] && '}' != line[ii])) {
+        continue;
+      }
+      ++ids;
+
+      if (NULL != failure) {
+        size_t slot = client_slot(client, id);
+
+        if (0 != client->calls[slot].id) {
+          client_call_t           call = client->calls[slot];
+          hpjsrpc_client_reply_t  reply = *failure;
+
+          client_remove(client, slot);
+          reply.id = call.id;
+          call.callback(call.arg, &reply);
+          ++*completed;
+        }
+      }
+    }
+  }
+
+  return (0 < objects && objects == ids);
+
+} /* client_scan_ids() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * A reply line jsmn could not parse, with too many tokens or malformed.
+ * The calls it answers fail with rc if it gives all their ids away.
+ * Otherwise there is no telling which calls it answered, nor whether the
+ * lines after it are framed right, so every call fails and the connection
+ * is closed.
+ */
+static size_t
+client_complete_failed (
+  hpjsrpc_client_t     *client,
+  const char           *line,
+  size_t                length,
+  HPJSRPC_RETURN        rc
+) {
+  hpjsrpc_client_reply_t  failure;
+  size_t                  completed = 0;
+
+  if (!client_scan_ids(client, line, length, NULL, NULL)) {
+    if (client->is_socket) {
+      shutdown(client->fd, SHUT_RDWR);
+    }
+    completed = client->outstanding;
+    client_fail(client);
+    return completed;
+  }
+
+  memset(&failure, 0, sizeof(failure));
+  failure.rc = rc;
+  failure.json = line;
+  failure.json_length = length;
+  client_scan_ids(client, line, length, &failure, &completed);
+
+  return completed;
+
+} /* client_complete_failed() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Completes the calls one reply line answers; a batch reply may hold many */
+static size_t
+client_complete_line (
+  hpjsrpc_client_t     *client,
+  const char           *line,
+  size_t                length
+) {
+  jsmn_parser parser;
+  int         token_count;
+  size_t      completed = 0;
+
+  jsmn_init(&parser);
+  token_count = jsmn_parse(&parser, line, length, client->tokens,
+    (unsigned int) client->config.max_token_count);
+  if (0 > token_count) {
+    return client_complete_failed(client, line, length,
+      (JSMN_ERROR_NOMEM == token_count)
+        ? HPJSRPC_PARSE_ERROR_NOMEM : HPJSRPC_PARSE_ERROR_INVAL);
+  }
+  if (0 == token_count) {
+    return 0;
+  }
+
+  if (JSMN_ARRAY != client->tokens[0].type) {
+    return client_complete(client, line, length, 0);
+  }
+
+  if (0 < client->tokens[0].size) {
+    for (int element = client->tokens[0].first_child; -1 != element;
+        element = client->tokens[element].next_sibling) {
+      completed += client_complete(client, line, length, element);
+    }
+  }
+
+  return completed;
+
+} /* client_complete_line() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Completes the calls answered by every whole line read so far */
+static size_t
+client_dispatch (hpjsrpc_client_t *client) {
+  size_t completed = 0;
+
+  client->is_dispatching = true;
+  while (!client->is_closed) {
+    char   *line = &client->in[client->in_start];
+    char   *newline = memchr(&client->in[client->in_scanned], '\n',
+      (client->in_length - client->in_scanned));
+    size_t  length;
+
+    if (NULL == newline) {
+      client->in_scanned = client->in_length;
+      break;
+    }
+
+    length = (size_t) (newline - line);
+    client->in_start = client->in_scanned =
+      (size_t) (newline + 1 - client->in);
+    if (0 < length && '\r' == line[length - 1]) {
+      --length;
+    }
+    if (0 < length) {
+      completed += client_complete_line(client, line, length);
+    }
+  }
+  client->is_dispatching = false;
+
+  return completed;
+
+} /* client_dispatch() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Reads what the socket has into the reply buffer. Returns false, having
+ * failed the client, on end of stream, an error or an overlong line.
+ */
+static bool
+client_read (hpjsrpc_client_t *client) {
+  size_t  capacity = client->config.max_reply_in_bytes;
+  ssize_t got;
+
+  if (0 < client->in_start) {
+    memmove(client->in, &client->in[client->in_start],
+      (client->in_length - client->in_start));
+    client->in_length -= client->in_start;
+    client->in_scanned -= client->in_start;
+    client->in_start = 0;
+  }
+
+  if (client->in_length == capacity) {
+    client_fail(client);
+    return false;
+  }
+
+  do {
+    got = read(client->fd, &client->in[client->in_length],
+      (capacity - client->in_length));
+  } while (0 > got && EINTR == errno);
+
+  if (0 > got && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+    return true;
+  }
+  if (0 >= got) {
+    client_fail(client);
+    return false;
+  }
+  client->in_length += (size_t) got;
+
+  return true;
+
+} /* client_read() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Writes the queued calls. While the socket is full it waits for room, and
+ * reads and completes replies meanwhile, unless inside a callback: a
+ * server blocked on writing replies nobody reads would never make room.
+ */
+static HPJSRPC_RETURN
+client_flush (
+  hpjsrpc_client_t     *client,
+  size_t               *completed
+) {
+
+  for (;;) {
+    struct iovec  iov[CLIENT_WRITE_IOVECS];
+    struct msghdr msg;
+    size_t        iov_count;
+    ssize_t       written;
+
+    if (client->is_closed) {
+      return HPJSRPC_CLOSED;
+    }
+
+    iov_count = hpjsrpc_buffer_iovec_at(&client->out, client->out_offset,
+      iov, CLIENT_WRITE_IOVECS);
+    if (0 == iov_count) {
+      break;
+    }
+
+    if (client->is_socket) {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iov_count;
+      written = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+    } else {
+      written = writev(client->fd, iov, (int) iov_count);
+    }
+
+    if (0 <= written) {
+      client->out_offset += (size_t) written;
+      continue;
+    }
+    if (EINTR == errno) {
+      continue;
+    }
+    if (EAGAIN == errno || EWOULDBLOCK == errno) {
+      struct pollfd pfd;
+
+      pfd.fd = client->fd;
+      pfd.events = (short) (POLLOUT | ((client->is_dispatching) ? 0 : POLLIN));
+      if (0 > poll(&pfd, 1, -1) && EINTR != errno) {
+        client_fail(client);
+        return HPJSRPC_CLOSED;
+      }
+      if (0 != (pfd.revents & POLLIN) && client_read(client)) {
+        *completed += client_dispatch(client);
+      }
+      continue;
+    }
+
+    client_fail(client);
+    return HPJSRPC_CLOSED;
+  }
+
+  hpjsrpc_buffer_rewind(&client->out);
+  client->out_offset = 0;
+  client->queued = 0;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* client_flush() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Appends one request line; id 0 makes it a notification */
+static HPJSRPC_RETURN
+client_write (
+  hpjsrpc_client_t     *client,
+  const char           *method,
+  const char           *params,
+  size_t                params_length,
+  uint64_t              id
+) {
+  hpjsrpc_buffer_t *buf = &client->out;
+
+  /* Each line is a top-level value of its own, without a separator */
+  buf->json_has_value = 0;
+  buf->json_depth = 0;
+  buf->json_after_key = false;
+
+  hpjsrpc_json_begin_object(buf);
+  hpjsrpc_json_key(buf, "jsonrpc", 7);
+  hpjsrpc_json_string_raw(buf, "2.0", 3);
+  hpjsrpc_json_key(buf, "method", 6);
+  hpjsrpc_json_string(buf, method, strlen(method));
+  if (NULL != params) {
+    hpjsrpc_json_key(buf, "params", 6);
+    hpjsrpc_json_raw(buf, params, params_length);
+  }
+  if (0 != id) {
+    hpjsrpc_json_key(buf, "id", 2);
+    hpjsrpc_json_int(buf, (int64_t) id);
+  }
+  hpjsrpc_json_end_object(buf);
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_json_status(buf)) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+  if (HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(buf, "\n", 1)) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+
+  client->queued++;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* client_write() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Written out once a batch is queued; callbacks leave that to poll() */
+static HPJSRPC_RETURN
+client_queued (hpjsrpc_client_t *client) {
+  size_t completed = 0;
+
+  if (client->queued < client->config.max_batch || client->is_dispatching) {
+    return HPJSRPC_NO_ERROR;
+  }
+
+  return client_flush(client, &completed);
+
+} /* client_queued() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_call (
+  hpjsrpc_client_t                      *client,
+  const char                            *method,
+  const char                            *params,
+  size_t                                 params_length,
+  hpjsrpc_client_callback_t              callback,
+  void                                  *arg,
+  uint64_t                              *id
+) {
+  HPJSRPC_RETURN rc;
+  uint64_t       call_id;
+  size_t         slot;
+
+  if (NULL == client || NULL == method || NULL == callback) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  while (client->outstanding >= client->config.max_in_flight) {
+    if (client->is_dispatching) {
+      return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+    }
+    rc = hpjsrpc_client_poll(client, -1, NULL);
+    if (HPJSRPC_NO_ERROR != rc) {
+      return rc;
+    }
+  }
+  if (client->is_closed) {
+    return HPJSRPC_CLOSED;
+  }
+
+  /* In the table before it is written, as a flush may complete it */
+  call_id = client->next_id++;
+  slot = client_slot(client, call_id);
+  client->calls[slot].id = call_id;
+  client->calls[slot].callback = callback;
+  client->calls[slot].arg = arg;
+  client->outstanding++;
+
+  /* A partial line cannot be taken back, so that ends the client */
+  rc = client_write(client, method, params, params_length, call_id);
+  if (HPJSRPC_NO_ERROR != rc) {
+    client_remove(client, slot);
+    client_fail(client);
+    return rc;
+  }
+  if (NULL != id) {
+    *id = call_id;
+  }
+
+  /* Should the write fail, the callback reports it */
+  client_queued(client);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_client_call() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_notify (
+  hpjsrpc_client_t                      *client,
+  const char                            *method,
+  const char                            *params,
+  size_t                                 params_length
+) {
+  HPJSRPC_RETURN rc;
+
+  if (NULL == client || NULL == method) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  if (client->is_closed) {
+    return HPJSRPC_CLOSED;
+  }
+
+  rc = client_write(client, method, params, params_length, 0);
+  if (HPJSRPC_NO_ERROR != rc) {
+    client_fail(client);
+    return rc;
+  }
+
+  return client_queued(client);
+
+} /* hpjsrpc_client_notify() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_flush (hpjsrpc_client_t *client) {
+  size_t completed = 0;
+
+  if (NULL == client) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  return client_flush(client, &completed);
+
+} /* hpjsrpc_client_flush() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_poll (
+  hpjsrpc_client_t                      *client,
+  int                                    timeout_ms,
+  size_t                                *completed
+) {
+  HPJSRPC_RETURN rc;
+  size_t         count = 0;
+
+  if (NULL == client || client->is_dispatching) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  rc = client_flush(client, &count);
+  if (HPJSRPC_NO_ERROR == rc && client_read(client)) {
+    count += client_dispatch(client);
+
+    if (0 == count && 0 != timeout_ms && 0 < client->outstanding) {
+      struct pollfd pfd;
+
+      pfd.fd = client->fd;
+      pfd.events = POLLIN;
+      if (0 < poll(&pfd, 1, timeout_ms) && client_read(client)) {
+        count += client_dispatch(client);
+      }
+    }
+
+    /* Calls made by the callbacks */
+    if (!client->is_closed) {
+      rc = client_flush(client, &count);
+    }
+  }
+
+  if (NULL != completed) {
+    *completed = count;
+  }
+
+  return (client->is_closed) ? HPJSRPC_CLOSED : rc;
+
+} /* hpjsrpc_client_poll() */
+
+/* ------------------------------------------------------------------------- */
+
+bool
+hpjsrpc_client_is_closed (const hpjsrpc_client_t *client) {
+  return client->is_closed;
+}
+
+/* ------------------------------------------------------------------------- */
+
+bool
+hpjsrpc_client_cancel (
+  hpjsrpc_client_t     *client,
+  uint64_t              id
+) {
+  size_t slot;
+
+  if (NULL == client || 0 == id) {
+    return false;
+  }
+
+  slot = client_slot(client, id);
+  if (0 == client->calls[slot].id) {
+    return false;
+  }
+  client_remove(client, slot);
+
+  return true;
+
+} /* hpjsrpc_client_cancel() */
+
+/* ------------------------------------------------------------------------- */
+/* Client pools                                                              */
+/* ------------------------------------------------------------------------- */
+
+/* Latencies between recomputations of the hedge delay */
+#define POOL_DELAY_INTERVAL               64
+
+typedef struct pool_call_t pool_call_t;
+
+/* A call sent on one connection; client NULL once it completed */
+typedef struct {
+  pool_call_t                    *call;
+  hpjsrpc_client_t               *client;
+  uint64_t                        id;
+} pool_leg_t;
+
+struct pool_call_t {
+  hpjsrpc_client_pool_t          *pool;
+  uint64_t                        id;
+  hpjsrpc_client_callback_t       callback;
+  void                           *arg;
+  uint64_t                        start_ns;
+  /* The original, then the hedge */
+  pool_leg_t                      legs[2];
+  /* Idempotent calls keep their request for the hedge */
+  char                           *method;
+  char                           *params;
+  size_t                          params_length;
+  /* Calls not hedged yet, oldest first; also the free list */
+  bool                            is_queued;
+  uint64_t                        hedge_ns;
+  pool_call_t                    *prev;
+  pool_call_t                    *next;
+};
+
+struct hpjsrpc_client_pool_t {
+  hpjsrpc_client_pool_config_t    config;
+  hpjsrpc_client_t              **clients;
+  struct pollfd                  *pfds;
+  pool_call_t                    *calls;
+  pool_call_t                    *free_calls;
+  pool_call_t                    *hedge_head;
+  pool_call_t                    *hedge_tail;
+  uint64_t                        next_id;
+  size_t                          outstanding;
+  bool                            is_polling;
+  bool                            is_closing;
+  /* Recent latencies, a ring, and the delay they give */
+  uint64_t                       *samples;
+  uint64_t                       *sorted;
+  size_t                          sample_count;
+  size_t                          sample_next;
+  size_t                          samples_since;
+  uint64_t                        hedge_delay_ns;
+  hpjsrpc_client_pool_stats_t     stats;
+};
+
+/* ------------------------------------------------------------------------- */
+
+static int
+pool_sample_compare (const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Adds a latency, recomputing the hedge delay every so often */
+static void
+pool_sample (
+  hpjsrpc_client_pool_t        *pool,
+  uint64_t                      latency_ns
+) {
+  uint64_t floor_ns = (pool->config.hedge_delay_in_us * 1000);
+  size_t   rank;
+
+  pool->samples[pool->sample_next] = latency_ns;
+  pool->sample_next = ((pool->sample_next + 1) % HPJSRPC_CLIENT_POOL_SAMPLES);
+  if (pool->sample_count < HPJSRPC_CLIENT_POOL_SAMPLES) {
+    pool->sample_count++;
+  }
+  if (++pool->samples_since < POOL_DELAY_INTERVAL) {
+    return;
+  }
+  pool->samples_since = 0;
+
+  memcpy(pool->sorted, pool->samples,
+    (pool->sample_count * sizeof(*pool->sorted)));
+  qsort(pool->sorted, pool->sample_count, sizeof(*pool->sorted),
+    pool_sample_compare);
+  rank = ((pool->sample_count * pool->config.hedge_percentile) / 100);
+  if (rank >= pool->sample_count) {
+    rank = (pool->sample_count - 1);
+  }
+  pool->hedge_delay_ns = (pool->sorted[rank] > floor_ns)
+    ? pool->sorted[rank] : floor_ns;
+
+} /* pool_sample() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+pool_unqueue (
+  hpjsrpc_client_pool_t        *pool,
+  pool_call_t                  *call
+) {
+
+  if (!call->is_queued) {
+    return;
+  }
+  if (NULL != call->prev) {
+    call->prev->next = call->next;
+  } else {
+    pool->hedge_head = call->next;
+  }
+  if (NULL != call->next) {
+    call->next->prev = call->prev;
+  } else {
+    pool->hedge_tail = call->prev;
+  }
+  call->is_queued = false;
+
+} /* pool_unqueue() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Returns a completed call to the free list */
+static void
+pool_release (
+  hpjsrpc_client_pool_t        *pool,
+  pool_call_t                  *call
+) {
+
+  pool_unqueue(pool, call);
+  hpjsrpc_free(call->method);
+  call->method = NULL;
+  call->params = NULL;
+  call->id = 0;
+  call->next = pool->free_calls;
+  pool->free_calls = call;
+  pool->outstanding--;
+
+} /* pool_release() */
+
+/* ------------------------------------------------------------------------- */
+
+/* The open connection with the fewest calls in flight, other than except */
+static hpjsrpc_client_t *
+pool_pick (
+  const hpjsrpc_client_pool_t  *pool,
+  const hpjsrpc_client_t       *except
+) {
+  hpjsrpc_client_t *best = NULL;
+
+  for (size_t ii = 0; ii < pool->config.connection_count; ++ii) {
+    hpjsrpc_client_t *client = pool->clients[ii];
+
+    if (client == except || client->is_closed) {
+      continue;
+    }
+    if (NULL == best || client->outstanding < best->outstanding) {
+      best = client;
+    }
+  }
+
+  return best;
+
+} /* pool_pick() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Completes the call with the first reply of either leg */
+static void
+pool_leg_done (
+  void                         *arg,
+  const hpjsrpc_client_reply_t *reply
+) {
+  pool_leg_t                *leg = arg;
+  pool_call_t               *call = leg->call;
+  hpjsrpc_client_pool_t     *pool = call->pool;
+  pool_leg_t                *other = &call->legs[(leg == &call->legs[0])];
+  hpjsrpc_client_reply_t     copy;
+  hpjsrpc_client_callback_t  callback = call->callback;
+  void                      *callback_arg = call->arg;
+
+  leg->client = NULL;
+
+  if (HPJSRPC_CLOSED == reply->rc) {
+    /* The other leg may still answer */
+    if (NULL != other->client) {
+      return;
+    }
+    /* Not hedged yet, so resend it elsewhere now */
+    if (call->is_queued && !pool->is_closing) {
+      pool_unqueue(pool, call);
+      call->hedge_ns = 0;
+      call->prev = NULL;
+      call->next = pool->hedge_head;
+      if (NULL != pool->hedge_head) {
+        pool->hedge_head->prev = call;
+      } else {
+        pool->hedge_tail = call;
+      }
+      pool->hedge_head = call;
+      call->is_queued = true;
+      return;
+    }
+  } else {
+    if (NULL != other->client) {
+      hpjsrpc_client_cancel(other->client, other->id);
+      other->client = NULL;
+    }
+    if (leg == &call->legs[1]) {
+      pool->stats.hedge_wins++;
+    }
+    pool_sample(pool, (hpjsrpc_clock_ns() - call->start_ns));
+  }
+
+  copy = *reply;
+  copy.id = call->id;
+  /* Released first, so the callback may reuse it */
+  pool_release(pool, call);
+  callback(callback_arg, &copy);
+
+} /* pool_leg_done() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Sends the hedges that fell due by now_ns */
+static void
+pool_hedge (
+  hpjsrpc_client_pool_t        *pool,
+  uint64_t                      now_ns
+) {
+  pool_call_t *call;
+
+  while (NULL != (call = pool->hedge_head) && call->hedge_ns <= now_ns) {
+    hpjsrpc_client_t       *client;
+    bool                    is_failover = (NULL == call->legs[0].client);
+    hpjsrpc_client_reply_t  reply;
+
+    pool_unqueue(pool, call);
+
+    /* Over budget, only calls whose connection closed are resent */
+    if (!is_failover && (pool->stats.hedges * 100)
+        >= (pool->stats.calls * pool->config.hedge_budget_percent)) {
+      continue;
+    }
+
+    /* Hedging onto a connection with no room would only wait */
+    client = pool_pick(pool, call->legs[0].client);
+    if (NULL != client
+        && client->outstanding < client->config.max_in_flight) {
+      call->legs[1].client = client;
+      if (HPJSRPC_NO_ERROR == hpjsrpc_client_call(client, call->method,
+          call->params, call->params_length, pool_leg_done, &call->legs[1],
+          &call->legs[1].id)) {
+        if (!is_failover) {
+          pool->stats.hedges++;
+        }
+        hpjsrpc_client_flush(client);
+        continue;
+      }
+      call->legs[1].client = NULL;
+    }
+
+    if (is_failover) {
+      memset(&reply, 0, sizeof(reply));
+      reply.rc = HPJSRPC_CLOSED;
+      pool_leg_done(&call->legs[0], &reply);
+    }
+  }
+
+} /* pool_hedge() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_pool_new (
+  hpjsrpc_client_pool_t               **pptr,
+  const char                           *address,
+  uint16_t                              port,
+  const hpjsrpc_client_pool_config_t   *config
+) {
+  hpjsrpc_client_pool_t *pool;
+  size_t                 client_in_flight;
+
+  if (NULL == pptr || NULL == address || NULL == config) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pool = hpjsrpc_calloc(1, sizeof(*pool));
+  if (NULL == pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  pool->config = *config;
+  pool->next_id = 1;
+  if (0 == pool->config.connection_count) {
+    pool->config.connection_count = 2;
+  }
+  client_in_flight = (0 == pool->config.client.max_in_flight)
+    ? HPJSRPC_CLIENT_DEFAULT_IN_FLIGHT : pool->config.client.max_in_flight;
+  if (0 == pool->config.max_in_flight) {
+    pool->config.max_in_flight =
+      (client_in_flight * pool->config.connection_count);
+  }
+  if (0 == pool->config.hedge_percentile) {
+    pool->config.hedge_percentile = 95;
+  }
+  if (0 == pool->config.hedge_delay_in_us) {
+    pool->config.hedge_delay_in_us = 1000;
+  }
+  if (0 == pool->config.hedge_budget_percent) {
+    pool->config.hedge_budget_percent = 10;
+  }
+  pool->hedge_delay_ns = (pool->config.hedge_delay_in_us * 1000);
+
+  pool->clients = hpjsrpc_calloc(pool->config.connection_count,
+    sizeof(*pool->clients));
+  pool->pfds = hpjsrpc_calloc(pool->config.connection_count,
+    sizeof(*pool->pfds));
+  pool->calls = hpjsrpc_calloc(pool->config.max_in_flight,
+    sizeof(*pool->calls));
+  pool->samples = hpjsrpc_calloc(HPJSRPC_CLIENT_POOL_SAMPLES,
+    sizeof(*pool->samples));
+  pool->sorted = hpjsrpc_calloc(HPJSRPC_CLIENT_POOL_SAMPLES,
+    sizeof(*pool->sorted));
+  if (NULL == pool->clients || NULL == pool->pfds || NULL == pool->calls
+      || NULL == pool->samples || NULL == pool->sorted) {
+    hpjsrpc_client_pool_destroy(pool);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  for (size_t ii = pool->config.max_in_flight; ii-- > 0;) {
+    pool_call_t *call = &pool->calls[ii];
+
+    call->pool = pool;
+    call->legs[0].call = call;
+    call->legs[1].call = call;
+    call->next = pool->free_calls;
+    pool->free_calls = call;
+  }
+
+  for (size_t ii = 0; ii < pool->config.connection_count; ++ii) {
+    if (HPJSRPC_NO_ERROR != hpjsrpc_client_connect(&pool->clients[ii],
+        address, port, &pool->config.client)) {
+      hpjsrpc_client_pool_destroy(pool);
+      return HPJSRPC_ASSERTION_ERROR;
+    }
+  }
+
+  *pptr = pool;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_client_pool_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_pool_destroy (hpjsrpc_client_pool_t *pool) {
+
+  if (NULL == pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pool->is_closing = true;
+  if (NULL != pool->clients) {
+    for (size_t ii = 0; ii < pool->config.connection_count; ++ii) {
+      if (NULL != pool->clients[ii]) {
+        hpjsrpc_client_destroy(pool->clients[ii]);
+      }
+    }
+  }
+  hpjsrpc_free(pool->sorted);
+  hpjsrpc_free(pool->samples);
+  hpjsrpc_free(pool->calls);
+  hpjsrpc_free(pool->pfds);
+  hpjsrpc_free(pool->clients);
+  hpjsrpc_free(pool);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_client_pool_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_pool_call (
+  hpjsrpc_client_pool_t                 *pool,
+  const char                            *method,
+  const char                            *params,
+  size_t                                 params_length,
+  bool                                   is_idempotent,
+  hpjsrpc_client_callback_t              callback,
+  void                                  *arg,
+  uint64_t                              *id
+) {
+  hpjsrpc_client_t *client;
+  pool_call_t      *call;
+  HPJSRPC_RETURN    rc;
+
+  if (NULL == pool || NULL == method || NULL == callback) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  while (NULL == pool->free_calls) {
+    if (pool->is_polling) {
+      return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+    }
+    rc = hpjsrpc_client_pool_poll(pool, -1, NULL);
+    if (HPJSRPC_NO_ERROR != rc) {
+      return rc;
+    }
+  }
+
+  client = pool_pick(pool, NULL);
+  if (NULL == client) {
+    return HPJSRPC_CLOSED;
+  }
+  if (pool->is_polling && client->outstanding >= client->config.max_in_flight) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+
+  call = pool->free_calls;
+  call->id = pool->next_id;
+  call->callback = callback;
+  call->arg = arg;
+  call->start_ns = hpjsrpc_clock_ns();
+  call->legs[0].client = NULL;
+  call->legs[1].client = NULL;
+
+  /* A hedge resends the request, so it is kept */
+  if (is_idempotent && 1 < pool->config.connection_count) {
+    size_t method_length = strlen(method);
+
+    call->method = hpjsrpc_malloc(method_length + 1 + params_length);
+    if (NULL == call->method) {
+      call->id = 0;
+      return HPJSRPC_ASSERTION_ERROR;
+    }
+    memcpy(call->method, method, (method_length + 1));
+    if (NULL != params) {
+      call->params = &call->method[method_length + 1];
+      memcpy(call->params, params, params_length);
+    }
+    call->params_length = params_length;
+  }
+
+  pool->free_calls = call->next;
+  pool->outstanding++;
+  pool->next_id++;
+  pool->stats.calls++;
+  if (NULL != id) {
+    *id = call->id;
+  }
+
+  /*
+   * Queued for its hedge first: should the write fail, the connection
+   * closing completes the leg, and the call is resent at once.
+   */
+  if (NULL != call->method) {
+    call->hedge_ns = (call->start_ns + pool->hedge_delay_ns);
+    call->prev = pool->hedge_tail;
+    call->next = NULL;
+    if (NULL != pool->hedge_tail) {
+      pool->hedge_tail->next = call;
+    } else {
+      pool->hedge_head = call;
+    }
+    pool->hedge_tail = call;
+    call->is_queued = true;
+  }
+
+  call->legs[0].client = client;
+  rc = hpjsrpc_client_call(client, method, params, params_length,
+    pool_leg_done, &call->legs[0], &call->legs[0].id);
+  if (HPJSRPC_NO_ERROR != rc) {
+    pool_release(pool, call);
+    return rc;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_client_pool_call() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_pool_flush (hpjsrpc_client_pool_t *pool) {
+  HPJSRPC_RETURN rc = HPJSRPC_CLOSED;
+
+  if (NULL == pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  /* Fine as long as one connection is */
+  for (size_t ii = 0; ii < pool->config.connection_count; ++ii) {
+    if (!pool->clients[ii]->is_closed
+        && HPJSRPC_NO_ERROR == hpjsrpc_client_flush(pool->clients[ii])) {
+      rc = HPJSRPC_NO_ERROR;
+    }
+  }
+
+  return rc;
+
+} /* hpjsrpc_client_pool_flush() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Completes what every open connection has replies for, without waiting */
+static size_t
+pool_collect (hpjsrpc_client_pool_t *pool) {
+  size_t completed = 0;
+
+  for (size_t ii = 0; ii < pool->config.connection_count; ++ii) {
+    size_t count = 0;
+
+    if (!pool->clients[ii]->is_closed) {
+      hpjsrpc_client_poll(pool->clients[ii], 0, &count);
+      completed += count;
+    }
+  }
+
+  return completed;
+
+} /* pool_collect() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_client_pool_poll (
+  hpjsrpc_client_pool_t                 *pool,
+  int                                    timeout_ms,
+  size_t                                *completed
+) {
+  size_t   count;
+  uint64_t now_ns;
+
+  if (NULL == pool || pool->is_polling) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pool->is_polling = true;
+  now_ns = hpjsrpc_clock_ns();
+  pool_hedge(pool, now_ns);
+  count = pool_collect(pool);
+
+  if (0 == count && 0 != timeout_ms && 0 < pool->outstanding) {
+    uint64_t        wait_ns = (0 > timeout_ms)
+      ? UINT64_MAX : ((uint64_t) timeout_ms * 1000000ull);
+    struct timespec ts;
+    size_t          nfds = 0;
+
+    /* Woken in time for the next hedge */
+    if (NULL != pool->hedge_head) {
+      uint64_t due_ns = (pool->hedge_head->hedge_ns > now_ns)
+        ? (pool->hedge_head->hedge_ns - now_ns) : 0;
+      if (due_ns < wait_ns) {
+        wait_ns = due_ns;
+      }
+    }
+    ts.tv_sec = (time_t) (wait_ns / 1000000000ull);
+    ts.tv_nsec = (long) (wait_ns % 1000000000ull);
+
+    for (size_t ii = 0; ii < pool->config.connection_count; ++ii) {
+      if (!pool->clients[ii]->is_closed
+          && 0 < pool->clients[ii]->outstanding) {
+        pool->pfds[nfds].fd = pool->clients[ii]->fd;
+        pool->pfds[nfds].events = POLLIN;
+        nfds++;
+      }
+    }
+
+    if (0 < ppoll(pool->pfds, nfds, (UINT64_MAX == wait_ns) ? NULL : &ts,
+        NULL)) {
+      count += pool_collect(pool);
+    }
+    pool_hedge(pool, hpjsrpc_clock_ns());
+  }
+  pool->is_polling = false;
+
+  if (NULL != completed) {
+    *completed = count;
+  }
+
+  return (NULL == pool_pick(pool, NULL)) ? HPJSRPC_CLOSED : HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_client_pool_poll() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_client_pool_outstanding (const hpjsrpc_client_pool_t *pool) {
+  return pool->outstanding;
+}
+
+/* ------------------------------------------------------------------------- */
+
+void
+hpjsrpc_client_pool_stats (
+  const hpjsrpc_client_pool_t   *pool,
+  hpjsrpc_client_pool_stats_t   *stats
+) {
+  *stats = pool->stats;
+  stats->hedge_delay_in_ns = pool->hedge_delay_ns;
+}
+
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,558 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_segment.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+/* What malloc() guarantees on the platforms we target */
+#define ARENA_DEFAULT_ALIGN               (2 * sizeof(void *))
+
+/*
+ * Request arena chunk. The header is two words, so data starts as aligned
+ * as the allocator's blocks. Dedicated (big) allocations use the same
+ * header with size_in_bytes 0.
+ */
+typedef struct arena_chunk_t arena_chunk_t;
+struct arena_chunk_t {
+  arena_chunk_t                  *next;
+  size_t                          size_in_bytes;
+  uint8_t                         data[];
+};
+
+typedef struct {
+  /* Chunks in use, the current one first; the last is kept for good */
+  arena_chunk_t                  *chunks;
+  size_t                          offset;
+  /* Chunks in use past the kept one: how many, and the oldest of them */
+  size_t                          extra_count;
+  arena_chunk_t                  *extra_oldest;
+  arena_chunk_t                  *spare;
+  size_t                          spare_count;
+  arena_chunk_t                  *big;
+} context_arena_t;
+
+struct hpjsrpc_context_t {
+  hpjsrpc_request_t               req;
+  hpjsrpc_response_t              res;
+  hpjsrpc_segment_pool_t         *segment_pool;
+  uint8_t                        *scratch;
+  size_t                          scratch_size_in_bytes;
+  context_arena_t                 arena;
+  /* Pooled contexts only: every context of the pool, and the idle ones */
+  hpjsrpc_context_pool_t         *owner;
+  hpjsrpc_context_t              *prev;
+  hpjsrpc_context_t              *next;
+  hpjsrpc_context_t              *next_idle;
+};
+
+struct hpjsrpc_context_pool_t {
+  pthread_mutex_t                 lock;
+  uint64_t                        id;
+  hpjsrpc_engine_t               *engine;
+  hpjsrpc_context_pool_config_t   config;
+  hpjsrpc_segment_pool_t         *segment_pool;
+  hpjsrpc_context_t              *contexts;
+  hpjsrpc_context_t              *idle;
+  size_t                          idle_count;
+};
+
+/*
+ * Per-thread front of one pool at a time, found by id rather than pointer
+ * so that a cache left behind by a destroyed pool is never mistaken for a
+ * live one. Contexts in it stay on their pool's list, so they are freed
+ * with the pool even if the thread has exited.
+ */
+typedef struct {
+  uint64_t                        pool_id;
+  size_t                          count;
+  hpjsrpc_context_t              *items[HPJSRPC_CONTEXT_CACHE_SIZE];
+} context_cache_t;
+
+static __thread context_cache_t context_cache;
+static uint64_t context_pool_next_id = 0;
+
+/* ------------------------------------------------------------------------- */
+
+static void
+arena_free_list (arena_chunk_t *chunk) {
+  while (NULL != chunk) {
+    arena_chunk_t *next = chunk->next;
+    hpjsrpc_free(chunk);
+    chunk = next;
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Makes everything allocated from the arena available again, in constant
+ * time: the kept chunk starts over and any chunks taken past it go to the
+ * spare list in one splice. Big allocations are freed.
+ */
+static void
+arena_reset (context_arena_t *arena) {
+
+  if (unlikely(0 != arena->extra_count)) {
+    arena_chunk_t *kept = arena->extra_oldest->next;
+
+    arena->extra_oldest->next = arena->spare;
+    arena->spare = arena->chunks;
+    arena->spare_count += arena->extra_count;
+    arena->chunks = kept;
+    arena->extra_count = 0;
+    arena->extra_oldest = NULL;
+  }
+  arena->offset = 0;
+
+  if (unlikely(NULL != arena->big)) {
+    arena_free_list(arena->big);
+    arena->big = NULL;
+  }
+
+} /* arena_reset() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Frees spare chunks beyond HPJSRPC_ARENA_RETAINED_CHUNKS, so that a
+ * context gives back what a request spike took once it is recycled.
+ */
+static void
+arena_trim (context_arena_t *arena) {
+
+  while (unlikely(HPJSRPC_ARENA_RETAINED_CHUNKS < arena->spare_count)) {
+    arena_chunk_t *chunk = arena->spare;
+
+    arena->spare = chunk->next;
+    arena->spare_count--;
+    hpjsrpc_free(chunk);
+  }
+
+} /* arena_trim() */
+
+/* ------------------------------------------------------------------------- */
+
+void *
+hpjsrpc_request_alloc (
+  hpjsrpc_request_t            *req,
+  size_t                        size_in_bytes,
+  size_t                        align
+) {
+  context_arena_t *arena;
+  arena_chunk_t   *chunk;
+  uintptr_t        start;
+
+  if (0 == align) {
+    align = ARENA_DEFAULT_ALIGN;
+  }
+  if (unlikely(NULL == req || NULL == req->context || 0 != (align & (align - 1))
+      || (SIZE_MAX / 2) < size_in_bytes || (SIZE_MAX / 2) < align)) {
+    return NULL;
+  }
+
+  arena = &req->context->arena;
+  chunk = arena->chunks;
+  if (likely(NULL != chunk)) {
+    start = ((uintptr_t) &chunk->data[arena->offset] + (align - 1))
+      & ~((uintptr_t) (align - 1));
+    if (likely((start + size_in_bytes)
+        <= (uintptr_t) &chunk->data[chunk->size_in_bytes])) {
+      arena->offset = (size_t) ((start + size_in_bytes)
+        - (uintptr_t) chunk->data);
+      return (void *) start;
+    }
+  }
+
+  /* Too big to share a chunk: give it a block of its own */
+  if (unlikely((size_in_bytes + align)
+      > (HPJSRPC_ARENA_CHUNK_SIZE / 4))) {
+    chunk = hpjsrpc_malloc(sizeof(*chunk) + size_in_bytes + align);
+    if (NULL == chunk) {
+      return NULL;
+    }
+    chunk->size_in_bytes = 0;
+    chunk->next = arena->big;
+    arena->big = chunk;
+    start = ((uintptr_t) chunk->data + (align - 1))
+      & ~((uintptr_t) (align - 1));
+    return (void *) start;
+  }
+
+  chunk = arena->spare;
+  if (NULL != chunk) {
+    arena->spare = chunk->next;
+    arena->spare_count--;
+  } else {
+    chunk = hpjsrpc_malloc(sizeof(*chunk) + HPJSRPC_ARENA_CHUNK_SIZE);
+    if (NULL == chunk) {
+      return NULL;
+    }
+    chunk->size_in_bytes = HPJSRPC_ARENA_CHUNK_SIZE;
+  }
+  if (NULL != arena->chunks) {
+    if (0 == arena->extra_count) {
+      arena->extra_oldest = chunk;
+    }
+    arena->extra_count++;
+  }
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+
+  start = ((uintptr_t) chunk->data + (align - 1))
+    & ~((uintptr_t) (align - 1));
+  arena->offset = (size_t) ((start + size_in_bytes)
+    - (uintptr_t) chunk->data);
+
+  return (void *) start;
+
+} /* hpjsrpc_request_alloc() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+context_free (hpjsrpc_context_t *ctx) {
+  hpjsrpc_response_release(&ctx->res);
+  arena_reset(&ctx->arena);
+  arena_free_list(ctx->arena.chunks);
+  arena_free_list(ctx->arena.spare);
+  hpjsrpc_segment_pool_destroy(ctx->segment_pool);
+  hpjsrpc_free(ctx->scratch);
+  hpjsrpc_free(ctx->req.tokens);
+  hpjsrpc_free(ctx);
+}
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_context_new (
+  hpjsrpc_context_t           **pptr,
+  hpjsrpc_engine_t             *engine,
+  size_t                        max_token_count,
+  size_t                        segment_size_in_bytes,
+  size_t                        max_segments,
+  size_t                        scratch_size_in_bytes
+) {
+  hpjsrpc_context_t *ctx;
+
+  if (NULL == pptr || NULL == engine || 0 == max_token_count) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  ctx = hpjsrpc_calloc(1, sizeof(*ctx));
+  if (NULL == ctx) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  ctx->req.tokens = hpjsrpc_calloc(max_token_count, sizeof(*ctx->req.tokens));
+  if (NULL == ctx->req.tokens) {
+    goto L_error;
+  }
+  ctx->req.engine = engine;
+  ctx->req.context = ctx;
+  ctx->req.max_token_count = max_token_count;
+
+  if (0 < scratch_size_in_bytes) {
+    ctx->scratch = hpjsrpc_malloc(scratch_size_in_bytes);
+    if (NULL == ctx->scratch) {
+      goto L_error;
+    }
+    ctx->scratch_size_in_bytes = scratch_size_in_bytes;
+  }
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_segment_pool_new(&ctx->segment_pool,
+      segment_size_in_bytes, max_segments)) {
+    goto L_error;
+  }
+  hpjsrpc_buffer_init_chained(&ctx->res.buffer, ctx->segment_pool);
+
+  *pptr = ctx;
+
+  return HPJSRPC_NO_ERROR;
+
+L_error:
+  hpjsrpc_free(ctx->scratch);
+  hpjsrpc_free(ctx->req.tokens);
+  hpjsrpc_free(ctx);
+  return HPJSRPC_ASSERTION_ERROR;
+
+} /* hpjsrpc_context_new() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+context_pool_unlink (
+  hpjsrpc_context_pool_t       *pool,
+  hpjsrpc_context_t            *ctx
+) {
+  if (NULL != ctx->prev) {
+    ctx->prev->next = ctx->next;
+  } else {
+    pool->contexts = ctx->next;
+  }
+  if (NULL != ctx->next) {
+    ctx->next->prev = ctx->prev;
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_context_destroy (hpjsrpc_context_t *ctx) {
+
+  if (NULL == ctx) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (NULL != ctx->owner) {
+    pthread_mutex_lock(&ctx->owner->lock);
+    context_pool_unlink(ctx->owner, ctx);
+    pthread_mutex_unlock(&ctx->owner->lock);
+  }
+
+  context_free(ctx);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_context_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_context_pool_new (
+  hpjsrpc_context_pool_t                **pptr,
+  hpjsrpc_engine_t                       *engine,
+  const hpjsrpc_context_pool_config_t    *config
+) {
+  hpjsrpc_context_pool_t *pool;
+
+  if (NULL == pptr || NULL == engine || NULL == config
+      || 0 == config->max_token_count) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pool = hpjsrpc_calloc(1, sizeof(*pool));
+  if (NULL == pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_segment_pool_new(&pool->segment_pool,
+      config->segment_size_in_bytes, 0)) {
+    hpjsrpc_free(pool);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  hpjsrpc_segment_pool_set_retention(pool->segment_pool, NULL,
+    config->retained_segments);
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->id = __atomic_add_fetch(&context_pool_next_id, 1, __ATOMIC_RELAXED);
+  pool->engine = engine;
+  pool->config = *config;
+
+  *pptr = pool;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_context_pool_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_context_pool_destroy (hpjsrpc_context_pool_t *pool) {
+
+  if (NULL == pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  /* Other threads' caches go stale; the id keeps them from being used */
+  if (context_cache.pool_id == pool->id) {
+    context_cache.pool_id = 0;
+    context_cache.count = 0;
+  }
+
+  while (NULL != pool->contexts) {
+    hpjsrpc_context_t *next = pool->contexts->next;
+    context_free(pool->contexts);
+    pool->contexts = next;
+  }
+
+  hpjsrpc_segment_pool_destroy(pool->segment_pool);
+  pthread_mutex_destroy(&pool->lock);
+  hpjsrpc_free(pool);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_context_pool_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_context_acquire (
+  hpjsrpc_context_pool_t       *pool,
+  hpjsrpc_context_t           **pptr
+) {
+  const hpjsrpc_context_pool_config_t *config;
+  hpjsrpc_context_t                   *ctx = NULL;
+
+  if (NULL == pool || NULL == pptr) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (likely(context_cache.pool_id == pool->id && 0 < context_cache.count)) {
+    *pptr = context_cache.items[--context_cache.count];
+    return HPJSRPC_NO_ERROR;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  ctx = pool->idle;
+  if (NULL != ctx) {
+    pool->idle = ctx->next_idle;
+    pool->idle_count--;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (NULL != ctx) {
+    ctx->next_idle = NULL;
+    *pptr = ctx;
+    return HPJSRPC_NO_ERROR;
+  }
+
+  config = &pool->config;
+  if (HPJSRPC_NO_ERROR != hpjsrpc_context_new(&ctx, pool->engine,
+      config->max_token_count, config->segment_size_in_bytes,
+      config->max_segments, config->scratch_size_in_bytes)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  hpjsrpc_segment_pool_set_retention(ctx->segment_pool, pool->segment_pool,
+    config->retained_segments_per_context);
+
+  ctx->owner = pool;
+  pthread_mutex_lock(&pool->lock);
+  ctx->next = pool->contexts;
+  if (NULL != ctx->next) {
+    ctx->next->prev = ctx;
+  }
+  pool->contexts = ctx;
+  pthread_mutex_unlock(&pool->lock);
+
+  *pptr = ctx;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_context_acquire() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_context_recycle (hpjsrpc_context_t *ctx) {
+  hpjsrpc_context_pool_t *pool;
+
+  if (NULL == ctx || NULL == ctx->owner) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pool = ctx->owner;
+  hpjsrpc_response_release(&ctx->res);
+  arena_reset(&ctx->arena);
+  arena_trim(&ctx->arena);
+  hpjsrpc_buffer_set_sink(&ctx->res.buffer, NULL, NULL);
+  ctx->res.release_request = NULL;
+  ctx->res.release_request_ctx = NULL;
+
+  /* An empty cache may switch pools; a full one for another pool may not */
+  if (context_cache.pool_id != pool->id && 0 == context_cache.count) {
+    context_cache.pool_id = pool->id;
+  }
+  if (likely(context_cache.pool_id == pool->id
+      && HPJSRPC_CONTEXT_CACHE_SIZE > context_cache.count)) {
+    context_cache.items[context_cache.count++] = ctx;
+    return HPJSRPC_NO_ERROR;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->idle_count < pool->config.retained_contexts) {
+    ctx->next_idle = pool->idle;
+    pool->idle = ctx;
+    pool->idle_count++;
+    ctx = NULL;
+  } else {
+    context_pool_unlink(pool, ctx);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (NULL != ctx) {
+    context_free(ctx);
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_context_recycle() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_context_process (
+  hpjsrpc_context_t            *ctx,
+  const char                   *buffer,
+  size_t                        buffer_length_in_bytes
+) {
+  HPJSRPC_RETURN rc;
+
+  /* The previous reply may still reference the previous request */
+  hpjsrpc_response_release(&ctx->res);
+  arena_reset(&ctx->arena);
+
+  rc = rpc_parse_request(buffer, buffer_length_in_bytes, &ctx->req);
+  if (unlikely(HPJSRPC_NO_ERROR != rc)) {
+    return rpc_process_error(&ctx->req, &ctx->res, rc);
+  }
+
+  return rpc_process_request(&ctx->req, &ctx->res);
+
+} /* hpjsrpc_context_process() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+hpjsrpc_context_set_deadline (
+  hpjsrpc_context_t            *ctx,
+  uint64_t                      received_ns,
+  uint64_t                      deadline_ns
+) {
+  ctx->req.received_ns = received_ns;
+  ctx->req.deadline_ns = deadline_ns;
+}
+
+/* ------------------------------------------------------------------------- */
+
+hpjsrpc_request_t *
+hpjsrpc_context_request (hpjsrpc_context_t *ctx) {
+  return &ctx->req;
+}
+
+/* ------------------------------------------------------------------------- */
+
+hpjsrpc_response_t *
+hpjsrpc_context_response (hpjsrpc_context_t *ctx) {
+  return &ctx->res;
+}
+
+/* ------------------------------------------------------------------------- */
+
+void *
+hpjsrpc_context_scratch (
+  hpjsrpc_context_t            *ctx,
+  size_t                       *size_in_bytes
+) {
+  if (NULL != size_in_bytes) {
+    *size_in_bytes = ctx->scratch_size_in_bytes;
+  }
+  return ctx->scratch;
+}
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,654 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+
+#include "hpjsrpc_coro.h"
+#include "hpjsrpc_context.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define CORO_NO_TIMER                     SIZE_MAX
+#define CORO_EPOLL_BATCH                  64
+/* Deadline wheel: a power of two of slots, each a tick long */
+#define CORO_WHEEL_SLOTS                  256
+#define CORO_WHEEL_TICK_NS                1000000ull
+
+typedef struct hpjsrpc_coro_t hpjsrpc_coro_t;
+
+struct hpjsrpc_coro_t {
+  hpjsrpc_coro_t                 *next;
+  ucontext_t                      uc;
+  /* Mapping base; the guard page comes first, the stack above it */
+  uint8_t                        *mapping;
+  size_t                          mapping_size_in_bytes;
+  hpjsrpc_context_t              *ctx;
+  const char                     *buffer;
+  size_t                          buffer_length_in_bytes;
+  void                           *tag;
+  HPJSRPC_RETURN                  rc;
+  bool                            is_done;
+  /* Await state */
+  int                             wait_fd;
+  int                             revents;
+  uint64_t                        deadline_ns;
+  size_t                          timer_index;
+  /* Request deadline, see wheel_insert() */
+  hpjsrpc_coro_t                 *wheel_prev;
+  hpjsrpc_coro_t                 *wheel_next;
+  uint64_t                        wheel_tick;
+  bool                            is_wheeled;
+  bool                            is_cancelled;
+};
+
+struct hpjsrpc_scheduler_t {
+  hpjsrpc_engine_t               *engine;
+  hpjsrpc_scheduler_config_t      config;
+  size_t                          page_size_in_bytes;
+  ucontext_t                      loop_uc;
+  hpjsrpc_coro_t                 *current;
+  hpjsrpc_coro_t                 *free_list;
+  size_t                          coroutine_count;
+  size_t                          suspended_count;
+  int                             epoll_fd;
+  /* Binary min-heap of awaiting coroutines, by deadline */
+  hpjsrpc_coro_t                **timers;
+  size_t                          timer_count;
+  /*
+   * Hashed timer wheel of the requests in flight that have a deadline. A
+   * slot lists the deadlines due on its tick, in any revolution of the
+   * wheel; wheel_tick is the last tick expired.
+   */
+  hpjsrpc_coro_t                 *wheel[CORO_WHEEL_SLOTS];
+  uint64_t                        wheel_tick;
+  size_t                          wheel_count;
+};
+
+/* The scheduler whose coroutine is running on this thread, if any */
+static __thread hpjsrpc_scheduler_t *current_scheduler;
+
+/* ------------------------------------------------------------------------- */
+
+static void
+timer_swap (
+  hpjsrpc_scheduler_t  *sched,
+  size_t                a,
+  size_t                b
+) {
+  hpjsrpc_coro_t *tmp = sched->timers[a];
+  sched->timers[a] = sched->timers[b];
+  sched->timers[b] = tmp;
+  sched->timers[a]->timer_index = a;
+  sched->timers[b]->timer_index = b;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void
+timer_sift (
+  hpjsrpc_scheduler_t  *sched,
+  size_t                ii
+) {
+  while (0 < ii && sched->timers[ii]->deadline_ns
+      < sched->timers[(ii - 1) / 2]->deadline_ns) {
+    timer_swap(sched, ii, (ii - 1) / 2);
+    ii = (ii - 1) / 2;
+  }
+
+  for (;;) {
+    size_t left = (2 * ii) + 1;
+    size_t least = ii;
+
+    if (left < sched->timer_count && sched->timers[left]->deadline_ns
+        < sched->timers[least]->deadline_ns) {
+      least = left;
+    }
+    if ((left + 1) < sched->timer_count && sched->timers[left + 1]->deadline_ns
+        < sched->timers[least]->deadline_ns) {
+      least = left + 1;
+    }
+    if (least == ii) {
+      break;
+    }
+    timer_swap(sched, ii, least);
+    ii = least;
+  }
+
+} /* timer_sift() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+timer_remove (
+  hpjsrpc_scheduler_t  *sched,
+  hpjsrpc_coro_t       *coro
+) {
+  size_t ii = coro->timer_index;
+
+  if (CORO_NO_TIMER == ii) {
+    return;
+  }
+
+  coro->timer_index = CORO_NO_TIMER;
+  if (ii != --sched->timer_count) {
+    sched->timers[ii] = sched->timers[sched->timer_count];
+    sched->timers[ii]->timer_index = ii;
+    timer_sift(sched, ii);
+  }
+
+} /* timer_remove() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Files a request under the tick its deadline falls in. Deadlines pile up
+ * far more than await timeouts, so they get O(1) insertion and removal in
+ * exchange for tick granularity; expiry may come up to a tick late.
+ */
+static void
+wheel_insert (
+  hpjsrpc_scheduler_t  *sched,
+  hpjsrpc_coro_t       *coro,
+  uint64_t              deadline_ns
+) {
+  uint64_t         tick = ((deadline_ns + CORO_WHEEL_TICK_NS - 1)
+                     / CORO_WHEEL_TICK_NS);
+  hpjsrpc_coro_t **slot;
+
+  if (0 == sched->wheel_count) {
+    sched->wheel_tick = (hpjsrpc_clock_ns() / CORO_WHEEL_TICK_NS);
+  }
+  /* Ticks already expired are not visited again */
+  if (tick <= sched->wheel_tick) {
+    tick = (sched->wheel_tick + 1);
+  }
+
+  slot = &sched->wheel[tick & (CORO_WHEEL_SLOTS - 1)];
+  coro->wheel_tick = tick;
+  coro->wheel_prev = NULL;
+  coro->wheel_next = *slot;
+  if (NULL != *slot) {
+    (*slot)->wheel_prev = coro;
+  }
+  *slot = coro;
+  coro->is_wheeled = true;
+  sched->wheel_count++;
+
+} /* wheel_insert() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+wheel_remove (
+  hpjsrpc_scheduler_t  *sched,
+  hpjsrpc_coro_t       *coro
+) {
+
+  if (NULL != coro->wheel_prev) {
+    coro->wheel_prev->wheel_next = coro->wheel_next;
+  } else {
+    sched->wheel[coro->wheel_tick & (CORO_WHEEL_SLOTS - 1)] = coro->wheel_next;
+  }
+  if (NULL != coro->wheel_next) {
+    coro->wheel_next->wheel_prev = coro->wheel_prev;
+  }
+  coro->wheel_prev = NULL;
+  coro->wheel_next = NULL;
+  coro->is_wheeled = false;
+  sched->wheel_count--;
+
+} /* wheel_remove() */
+
+/* ------------------------------------------------------------------------- */
+
+/* When the next slot holding a deadline comes up; the wheel is not empty */
+static uint64_t
+wheel_next_ns (const hpjsrpc_scheduler_t *sched) {
+  uint64_t tick = (sched->wheel_tick + 1);
+
+  while (NULL == sched->wheel[tick & (CORO_WHEEL_SLOTS - 1)]) {
+    tick++;
+  }
+
+  return (tick * CORO_WHEEL_TICK_NS);
+
+} /* wheel_next_ns() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+coro_main (void) {
+  hpjsrpc_scheduler_t *sched = current_scheduler;
+  hpjsrpc_coro_t      *coro = sched->current;
+
+  coro->rc = hpjsrpc_context_process(coro->ctx, coro->buffer,
+    coro->buffer_length_in_bytes);
+  coro->is_done = true;
+
+  /* Returning switches to uc_link, i.e. back into coro_resume() */
+
+} /* coro_main() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+coro_free (hpjsrpc_coro_t *coro) {
+  if (NULL != coro->ctx) {
+    hpjsrpc_context_destroy(coro->ctx);
+  }
+  if (NULL != coro->mapping) {
+    munmap(coro->mapping, coro->mapping_size_in_bytes);
+  }
+  hpjsrpc_free(coro);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static hpjsrpc_coro_t *
+coro_acquire (hpjsrpc_scheduler_t *sched) {
+  hpjsrpc_coro_t *coro = sched->free_list;
+
+  if (NULL != coro) {
+    sched->free_list = coro->next;
+    return coro;
+  }
+
+  if (sched->coroutine_count >= sched->config.max_coroutines) {
+    return NULL;
+  }
+
+  coro = hpjsrpc_calloc(1, sizeof(*coro));
+  if (NULL == coro) {
+    return NULL;
+  }
+
+  coro->mapping_size_in_bytes = (sched->config.stack_size_in_bytes
+    + sched->page_size_in_bytes);
+  coro->mapping = mmap(NULL, coro->mapping_size_in_bytes,
+    (PROT_READ | PROT_WRITE), (MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK),
+    -1, 0);
+  if (MAP_FAILED == coro->mapping) {
+    coro->mapping = NULL;
+    goto L_error;
+  }
+
+  /* Stacks grow down, so the guard page goes at the bottom */
+  if (0 != mprotect(coro->mapping, sched->page_size_in_bytes, PROT_NONE)) {
+    goto L_error;
+  }
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_context_new(&coro->ctx, sched->engine,
+      sched->config.max_token_count, sched->config.segment_size_in_bytes, 0,
+      sched->config.scratch_size_in_bytes)) {
+    coro->ctx = NULL;
+    goto L_error;
+  }
+
+  sched->coroutine_count++;
+
+  return coro;
+
+L_error:
+  coro_free(coro);
+  return NULL;
+
+} /* coro_acquire() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+coro_resume (
+  hpjsrpc_scheduler_t  *sched,
+  hpjsrpc_coro_t       *coro
+) {
+  hpjsrpc_scheduler_t *outer = current_scheduler;
+
+  current_scheduler = sched;
+  sched->current = coro;
+  swapcontext(&sched->loop_uc, &coro->uc);
+  sched->current = NULL;
+  current_scheduler = outer;
+
+  if (coro->is_done) {
+    if (NULL != sched->config.done) {
+      sched->config.done(coro->tag, hpjsrpc_context_response(coro->ctx),
+        coro->rc);
+    }
+    hpjsrpc_response_release(hpjsrpc_context_response(coro->ctx));
+    if (coro->is_wheeled) {
+      wheel_remove(sched, coro);
+    }
+    coro->next = sched->free_list;
+    sched->free_list = coro;
+  }
+
+} /* coro_resume() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_scheduler_new (
+  hpjsrpc_scheduler_t                 **pptr,
+  hpjsrpc_engine_t                     *engine,
+  const hpjsrpc_scheduler_config_t     *config
+) {
+  hpjsrpc_scheduler_t *sched;
+  long                 page_size = sysconf(_SC_PAGESIZE);
+
+  if (NULL == pptr || NULL == engine || NULL == config
+      || 0 == config->max_coroutines || 0 >= page_size) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  sched = hpjsrpc_calloc(1, sizeof(*sched));
+  if (NULL == sched) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  sched->engine = engine;
+  sched->config = *config;
+  sched->page_size_in_bytes = (size_t) page_size;
+  if (0 == sched->config.stack_size_in_bytes) {
+    sched->config.stack_size_in_bytes = HPJSRPC_CORO_DEFAULT_STACK_SIZE;
+  }
+  sched->config.stack_size_in_bytes = ((sched->config.stack_size_in_bytes
+    + sched->page_size_in_bytes - 1) & ~(sched->page_size_in_bytes - 1));
+
+  sched->timers = hpjsrpc_calloc(config->max_coroutines,
+    sizeof(*sched->timers));
+  sched->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (NULL == sched->timers || 0 > sched->epoll_fd) {
+    if (0 <= sched->epoll_fd) {
+      close(sched->epoll_fd);
+    }
+    hpjsrpc_free(sched->timers);
+    hpjsrpc_free(sched);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  *pptr = sched;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_scheduler_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_scheduler_destroy (hpjsrpc_scheduler_t *sched) {
+
+  if (NULL == sched || 0 != sched->suspended_count) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  while (NULL != sched->free_list) {
+    hpjsrpc_coro_t *next = sched->free_list->next;
+    coro_free(sched->free_list);
+    sched->free_list = next;
+  }
+
+  close(sched->epoll_fd);
+  hpjsrpc_free(sched->timers);
+  hpjsrpc_free(sched);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_scheduler_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_scheduler_submit (
+  hpjsrpc_scheduler_t          *sched,
+  const char                   *buffer,
+  size_t                        buffer_length_in_bytes,
+  void                         *tag
+) {
+  hpjsrpc_coro_t *coro;
+
+  if (NULL == sched || NULL == buffer) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  coro = coro_acquire(sched);
+  if (unlikely(NULL == coro)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  coro->buffer = buffer;
+  coro->buffer_length_in_bytes = buffer_length_in_bytes;
+  coro->tag = tag;
+  coro->rc = HPJSRPC_NO_ERROR;
+  coro->is_done = false;
+  coro->wait_fd = -1;
+  coro->timer_index = CORO_NO_TIMER;
+  coro->is_wheeled = false;
+  coro->is_cancelled = false;
+
+  getcontext(&coro->uc);
+  coro->uc.uc_stack.ss_sp = (coro->mapping + sched->page_size_in_bytes);
+  coro->uc.uc_stack.ss_size = sched->config.stack_size_in_bytes;
+  coro->uc.uc_link = &sched->loop_uc;
+  makecontext(&coro->uc, coro_main, 0);
+
+  coro_resume(sched, coro);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_scheduler_submit() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Resumes a coroutine whose await is over, having dropped its registrations */
+static void
+coro_wake (
+  hpjsrpc_scheduler_t  *sched,
+  hpjsrpc_coro_t       *coro,
+  int                   revents
+) {
+  if (0 <= coro->wait_fd) {
+    epoll_ctl(sched->epoll_fd, EPOLL_CTL_DEL, coro->wait_fd, NULL);
+    coro->wait_fd = -1;
+  }
+  timer_remove(sched, coro);
+
+  coro->revents = revents;
+  sched->suspended_count--;
+  coro_resume(sched, coro);
+
+} /* coro_wake() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Cancels the requests whose deadline passed by now_ns. Only the slots of
+ * the ticks elapsed are visited, each once at most.
+ */
+static void
+wheel_expire (
+  hpjsrpc_scheduler_t  *sched,
+  uint64_t              now_ns
+) {
+  uint64_t        now_tick = (now_ns / CORO_WHEEL_TICK_NS);
+  uint64_t        steps;
+  hpjsrpc_coro_t *expired = NULL;
+
+  if (now_tick <= sched->wheel_tick) {
+    return;
+  }
+  steps = (now_tick - sched->wheel_tick);
+  if (CORO_WHEEL_SLOTS < steps) {
+    steps = CORO_WHEEL_SLOTS;
+  }
+
+  for (uint64_t tick = (now_tick - steps + 1); tick <= now_tick; ++tick) {
+    hpjsrpc_coro_t *coro = sched->wheel[tick & (CORO_WHEEL_SLOTS - 1)];
+
+    while (NULL != coro) {
+      hpjsrpc_coro_t *next = coro->wheel_next;
+
+      if (coro->wheel_tick <= now_tick) {
+        wheel_remove(sched, coro);
+        coro->next = expired;
+        expired = coro;
+      }
+      coro = next;
+    }
+  }
+  sched->wheel_tick = now_tick;
+
+  /* Resumed only once the wheel is settled, as they may change it */
+  while (NULL != expired) {
+    hpjsrpc_coro_t *coro = expired;
+
+    expired = coro->next;
+    coro->next = NULL;
+    coro->is_cancelled = true;
+    rpc_deadline_cancelled(sched->engine);
+    coro_wake(sched, coro, 0);
+  }
+
+} /* wheel_expire() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_scheduler_run (
+  hpjsrpc_scheduler_t          *sched,
+  int                           timeout_ms
+) {
+  struct epoll_event  events[CORO_EPOLL_BATCH];
+  int                 count;
+  uint64_t            now;
+
+  if (0 == sched->suspended_count) {
+    return 0;
+  }
+
+  if (0 < sched->timer_count || 0 < sched->wheel_count) {
+    uint64_t deadline = (0 < sched->wheel_count)
+      ? wheel_next_ns(sched) : UINT64_MAX;
+    int      wait_ms;
+
+    if (0 < sched->timer_count && sched->timers[0]->deadline_ns < deadline) {
+      deadline = sched->timers[0]->deadline_ns;
+    }
+    now = hpjsrpc_clock_ns();
+    wait_ms = (deadline <= now) ? 0
+      : (int) (((deadline - now) + 999999) / 1000000);
+    if (0 > timeout_ms || wait_ms < timeout_ms) {
+      timeout_ms = wait_ms;
+    }
+  }
+
+  count = epoll_wait(sched->epoll_fd, events, CORO_EPOLL_BATCH, timeout_ms);
+  for (int ii = 0; ii < count; ++ii) {
+    hpjsrpc_coro_t *coro = (hpjsrpc_coro_t *) events[ii].data.ptr;
+    /* epoll and poll share their event bits on Linux */
+    coro_wake(sched, coro, (int) events[ii].events);
+  }
+
+  now = hpjsrpc_clock_ns();
+  while (0 < sched->timer_count && sched->timers[0]->deadline_ns <= now) {
+    coro_wake(sched, sched->timers[0], 0);
+  }
+  if (0 < sched->wheel_count) {
+    wheel_expire(sched, now);
+  }
+
+  return sched->suspended_count;
+
+} /* hpjsrpc_scheduler_run() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_scheduler_suspended (const hpjsrpc_scheduler_t *sched) {
+  return sched->suspended_count;
+}
+
+/* ------------------------------------------------------------------------- */
+
+int
+hpjsrpc_await (
+  int                   fd,
+  short                 events,
+  int                   timeout_ms
+) {
+  hpjsrpc_scheduler_t *sched = current_scheduler;
+  hpjsrpc_coro_t      *coro;
+
+  /* Nothing to wait for and no end to the wait */
+  if (0 > fd && 0 > timeout_ms) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (NULL == sched || NULL == sched->current) {
+    struct pollfd pfd = { fd, events, 0 };
+    int           rc;
+
+    do {
+      rc = poll(&pfd, 1, timeout_ms);
+    } while (0 > rc && EINTR == errno);
+
+    return (0 < rc) ? pfd.revents : rc;
+  }
+
+  coro = sched->current;
+
+  if (coro->is_cancelled) {
+    errno = ECANCELED;
+    return -1;
+  }
+
+  if (0 <= fd) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = ((uint32_t) events | EPOLLONESHOT);
+    ev.data.ptr = coro;
+    if (0 != epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+      /* Regular files cannot be polled and are always ready */
+      return (EPERM == errno) ? events : -1;
+    }
+    coro->wait_fd = fd;
+  }
+
+  if (0 <= timeout_ms) {
+    coro->deadline_ns = hpjsrpc_clock_ns()
+      + ((uint64_t) timeout_ms * 1000000ull);
+    coro->timer_index = sched->timer_count++;
+    sched->timers[coro->timer_index] = coro;
+    timer_sift(sched, coro->timer_index);
+  }
+
+  if (!coro->is_wheeled) {
+    uint64_t deadline_ns = hpjsrpc_context_request(coro->ctx)->deadline_ns;
+
+    if (0 != deadline_ns) {
+      wheel_insert(sched, coro, deadline_ns);
+    }
+  }
+
+  sched->suspended_count++;
+  swapcontext(&coro->uc, &sched->loop_uc);
+
+  if (coro->is_cancelled) {
+    errno = ECANCELED;
+    return -1;
+  }
+
+  return coro->revents;
+
+} /* hpjsrpc_await() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,559 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "hpjsrpc_dgram.h"
+#include "hpjsrpc_segment.h"
+
+/* iovec entries a reply is gathered from; longer chains are copied */
+#define DGRAM_REPLY_IOVECS                16
+
+typedef struct {
+  hpjsrpc_dgram_t                *dgram;
+  pthread_t                       thread;
+  int                             cpu;
+  int                             fd;
+  hpjsrpc_context_pool_t         *contexts;
+  /* HPJSRPC_DGRAM_BATCH slots of max_datagram_size_in_bytes */
+  uint8_t                        *buffers;
+  struct mmsghdr                  in[HPJSRPC_DGRAM_BATCH];
+  struct iovec                    in_iov[HPJSRPC_DGRAM_BATCH];
+  struct sockaddr_storage         peers[HPJSRPC_DGRAM_BATCH];
+  struct mmsghdr                  out[HPJSRPC_DGRAM_BATCH];
+  struct iovec                    out_iov[HPJSRPC_DGRAM_BATCH]
+                                         [DGRAM_REPLY_IOVECS];
+  hpjsrpc_context_t              *replies[HPJSRPC_DGRAM_BATCH];
+} dgram_shard_t;
+
+struct hpjsrpc_dgram_t {
+  hpjsrpc_engine_t               *engine;
+  hpjsrpc_dgram_config_t          config;
+  char                           *unix_path;
+  int                             unix_fd;
+  uint16_t                        port;
+  /* Readable while stopping; shared by all shards */
+  int                             wake_fd;
+  size_t                          shard_count;
+  dgram_shard_t                 **shards;
+  bool                            is_running;
+  bool                            is_stopping;
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* Creates a non-blocking datagram socket bound to addr */
+static int
+dgram_socket (
+  const hpjsrpc_dgram_config_t *config,
+  const struct sockaddr        *addr,
+  socklen_t                     addr_length
+) {
+  int fd;
+  int one = 1;
+
+  fd = socket(addr->sa_family, (SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC), 0);
+  if (0 > fd) {
+    return -1;
+  }
+
+  if (0 < config->socket_buffer_size_in_bytes) {
+    int size = (INT32_MAX < config->socket_buffer_size_in_bytes)
+      ? INT32_MAX : (int) config->socket_buffer_size_in_bytes;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  }
+
+  if ((AF_UNIX != addr->sa_family
+        && 0 != setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)))
+      || 0 != bind(fd, addr, addr_length)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+
+} /* dgram_socket() */
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+shard_new (
+  hpjsrpc_dgram_t              *dgram,
+  dgram_shard_t               **pptr
+) {
+  size_t         slot_size = dgram->config.max_datagram_size_in_bytes;
+  dgram_shard_t *shard;
+
+  shard = hpjsrpc_calloc(1, sizeof(*shard));
+  if (NULL == shard) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  shard->dgram = dgram;
+  shard->cpu = -1;
+  shard->fd = -1;
+  *pptr = shard;
+
+  shard->buffers = hpjsrpc_malloc(HPJSRPC_DGRAM_BATCH * slot_size);
+  if (NULL == shard->buffers) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  /* The receive side never changes but for what recvmmsg() fills in */
+  for (size_t ii = 0; ii < HPJSRPC_DGRAM_BATCH; ++ii) {
+    shard->in_iov[ii].iov_base = &shard->buffers[ii * slot_size];
+    shard->in_iov[ii].iov_len = slot_size;
+    shard->in[ii].msg_hdr.msg_iov = &shard->in_iov[ii];
+    shard->in[ii].msg_hdr.msg_iovlen = 1;
+    shard->in[ii].msg_hdr.msg_name = &shard->peers[ii];
+  }
+
+  return hpjsrpc_context_pool_new(&shard->contexts, dgram->engine,
+    &dgram->config.context);
+
+} /* shard_new() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+shard_destroy (dgram_shard_t *shard) {
+
+  if (NULL != shard->contexts) {
+    hpjsrpc_context_pool_destroy(shard->contexts);
+  }
+  if (0 <= shard->fd && shard->fd != shard->dgram->unix_fd) {
+    close(shard->fd);
+  }
+  hpjsrpc_free(shard->buffers);
+  hpjsrpc_free(shard);
+
+} /* shard_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_dgram_new (
+  hpjsrpc_dgram_t                      **pptr,
+  hpjsrpc_engine_t                      *engine,
+  const hpjsrpc_dgram_config_t          *config
+) {
+  hpjsrpc_dgram_t          *dgram;
+  struct addrinfo           hints;
+  struct addrinfo          *ai = NULL;
+  struct sockaddr_storage   addr;
+  socklen_t                 addr_length;
+  cpu_set_t                 cpus;
+  char                      port[8];
+  int                       cpu = 0;
+
+  if (NULL == pptr || NULL == engine || NULL == config) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  dgram = hpjsrpc_calloc(1, sizeof(*dgram));
+  if (NULL == dgram) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  dgram->engine = engine;
+  dgram->config = *config;
+  dgram->config.address = NULL;
+  dgram->config.unix_path = NULL;
+  dgram->unix_fd = -1;
+  if (0 == dgram->config.max_datagram_size_in_bytes) {
+    dgram->config.max_datagram_size_in_bytes =
+      HPJSRPC_DGRAM_DEFAULT_DATAGRAM_SIZE;
+  }
+
+  dgram->wake_fd = eventfd(0, (EFD_NONBLOCK | EFD_CLOEXEC));
+  if (0 > dgram->wake_fd) {
+    goto L_error;
+  }
+
+  CPU_ZERO(&cpus);
+  if (0 != sched_getaffinity(0, sizeof(cpus), &cpus)) {
+    CPU_SET(0, &cpus);
+  }
+  dgram->shard_count = config->shard_count;
+  if (0 == dgram->shard_count) {
+    dgram->shard_count = (size_t) CPU_COUNT(&cpus);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  if (NULL != config->unix_path) {
+    struct sockaddr_un *sun = (struct sockaddr_un *) &addr;
+    size_t              path_length = strlen(config->unix_path);
+
+    if (sizeof(sun->sun_path) <= path_length) {
+      goto L_error;
+    }
+    dgram->unix_path = hpjsrpc_malloc(path_length + 1);
+    if (NULL == dgram->unix_path) {
+      goto L_error;
+    }
+    memcpy(dgram->unix_path, config->unix_path, (path_length + 1));
+
+    sun->sun_family = AF_UNIX;
+    memcpy(sun->sun_path, config->unix_path, path_length);
+    addr_length = (socklen_t) sizeof(*sun);
+    unlink(dgram->unix_path);
+    dgram->unix_fd = dgram_socket(&dgram->config,
+      (const struct sockaddr *) &addr, addr_length);
+    if (0 > dgram->unix_fd) {
+      goto L_error;
+    }
+  } else {
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = (AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV);
+    snprintf(port, sizeof(port), "%u", (unsigned) config->port);
+    if (0 != getaddrinfo(config->address, port, &hints, &ai)
+        || sizeof(addr) < ai->ai_addrlen) {
+      goto L_error;
+    }
+    memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+    addr_length = ai->ai_addrlen;
+  }
+
+  dgram->shards = hpjsrpc_calloc(dgram->shard_count,
+    sizeof(*dgram->shards));
+  if (NULL == dgram->shards) {
+    goto L_error;
+  }
+
+  for (size_t ii = 0; ii < dgram->shard_count; ++ii) {
+    dgram_shard_t *shard;
+
+    if (HPJSRPC_NO_ERROR != shard_new(dgram, &dgram->shards[ii])) {
+      goto L_error;
+    }
+    shard = dgram->shards[ii];
+
+    if (config->pin_shards) {
+      while (!CPU_ISSET(cpu, &cpus)) {
+        cpu = ((cpu + 1) % CPU_SETSIZE);
+      }
+      shard->cpu = cpu;
+      cpu = ((cpu + 1) % CPU_SETSIZE);
+    }
+
+    if (0 <= dgram->unix_fd) {
+      shard->fd = dgram->unix_fd;
+      continue;
+    }
+
+    shard->fd = dgram_socket(&dgram->config,
+      (const struct sockaddr *) &addr, addr_length);
+    if (0 > shard->fd) {
+      goto L_error;
+    }
+
+    /* The other shards join the port the first one was given */
+    if (0 == ii) {
+      addr_length = sizeof(addr);
+      if (0 != getsockname(shard->fd, (struct sockaddr *) &addr,
+          &addr_length)) {
+        goto L_error;
+      }
+      dgram->port = ntohs((AF_INET6 == addr.ss_family)
+        ? ((struct sockaddr_in6 *) &addr)->sin6_port
+        : ((struct sockaddr_in *) &addr)->sin_port);
+    }
+  }
+
+  if (NULL != ai) {
+    freeaddrinfo(ai);
+  }
+  *pptr = dgram;
+
+  return HPJSRPC_NO_ERROR;
+
+L_error:
+  if (NULL != ai) {
+    freeaddrinfo(ai);
+  }
+  hpjsrpc_dgram_destroy(dgram);
+  return HPJSRPC_ASSERTION_ERROR;
+
+} /* hpjsrpc_dgram_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_dgram_destroy (hpjsrpc_dgram_t *dgram) {
+
+  if (NULL == dgram) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  hpjsrpc_dgram_stop(dgram);
+
+  if (NULL != dgram->shards) {
+    for (size_t ii = 0; ii < dgram->shard_count; ++ii) {
+      if (NULL != dgram->shards[ii]) {
+        shard_destroy(dgram->shards[ii]);
+      }
+    }
+    hpjsrpc_free(dgram->shards);
+  }
+  if (0 <= dgram->unix_fd) {
+    close(dgram->unix_fd);
+    unlink(dgram->unix_path);
+  }
+  if (0 <= dgram->wake_fd) {
+    close(dgram->wake_fd);
+  }
+  hpjsrpc_free(dgram->unix_path);
+  hpjsrpc_free(dgram);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_dgram_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+uint16_t
+hpjsrpc_dgram_port (const hpjsrpc_dgram_t *dgram) {
+  return dgram->port;
+}
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_dgram_shard_count (const hpjsrpc_dgram_t *dgram) {
+  return dgram->shard_count;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Processes datagram index of the batch just received; queues its reply as
+ * the next outgoing message, gathered from the response segments. Returns
+ * false if there is nothing to send back.
+ */
+static bool
+shard_dispatch (
+  dgram_shard_t        *shard,
+  size_t                index,
+  size_t                reply_index
+) {
+  struct mmsghdr    *in = &shard->in[index];
+  struct msghdr     *out = &shard->out[reply_index].msg_hdr;
+  struct iovec      *iov = shard->out_iov[reply_index];
+  hpjsrpc_context_t *ctx;
+  hpjsrpc_buffer_t  *buf;
+  size_t             length;
+  size_t             iov_count;
+
+  /* A cut datagram cannot parse; an empty one has nothing to parse */
+  if (0 != (in->msg_hdr.msg_flags & MSG_TRUNC) || 0 == in->msg_len) {
+    return false;
+  }
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_context_acquire(shard->contexts, &ctx)) {
+    return false;
+  }
+  hpjsrpc_context_process(ctx, (const char *) shard->in_iov[index].iov_base,
+    in->msg_len);
+
+  buf = &hpjsrpc_context_response(ctx)->buffer;
+  length = hpjsrpc_buffer_length(buf);
+  /* An unbound Unix sender has no address to reply to */
+  if (0 == length || sizeof(sa_family_t) >= in->msg_hdr.msg_namelen) {
+    hpjsrpc_context_recycle(ctx);
+    return false;
+  }
+
+  iov_count = hpjsrpc_buffer_iovec(buf, iov, DGRAM_REPLY_IOVECS);
+  if (DGRAM_REPLY_IOVECS == iov_count
+      && DGRAM_REPLY_IOVECS < hpjsrpc_buffer_iovec_count(buf)) {
+    /* Too many segments to gather: one copy, into the request arena */
+    void *flat = hpjsrpc_request_alloc(hpjsrpc_context_request(ctx),
+      (length + 1), 1);
+
+    if (NULL == flat) {
+      hpjsrpc_context_recycle(ctx);
+      return false;
+    }
+    hpjsrpc_buffer_copy_out(buf, flat, (length + 1));
+    iov[0].iov_base = flat;
+    iov[0].iov_len = length;
+    iov_count = 1;
+  }
+
+  memset(out, 0, sizeof(*out));
+  out->msg_name = in->msg_hdr.msg_name;
+  out->msg_namelen = in->msg_hdr.msg_namelen;
+  out->msg_iov = iov;
+  out->msg_iovlen = iov_count;
+  shard->replies[reply_index] = ctx;
+
+  return true;
+
+} /* shard_dispatch() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Handles a received batch and sends its replies back in one go */
+static void
+shard_handle (
+  dgram_shard_t        *shard,
+  size_t                count
+) {
+  size_t reply_count = 0;
+  size_t sent = 0;
+
+  for (size_t ii = 0; ii < count; ++ii) {
+    if (shard_dispatch(shard, ii, reply_count)) {
+      ++reply_count;
+    }
+  }
+
+  while (sent < reply_count) {
+    int rc = sendmmsg(shard->fd, &shard->out[sent],
+      (unsigned) (reply_count - sent), 0);
+
+    if (0 > rc) {
+      if (EINTR == errno) {
+        continue;
+      }
+      /* The first reply failed (no room, too long, peer gone): drop it */
+      rc = 1;
+    }
+    sent += (size_t) rc;
+  }
+
+  for (size_t ii = 0; ii < reply_count; ++ii) {
+    hpjsrpc_context_recycle(shard->replies[ii]);
+  }
+
+} /* shard_handle() */
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+shard_main (void *arg) {
+  dgram_shard_t   *shard = arg;
+  hpjsrpc_dgram_t *dgram = shard->dgram;
+  struct pollfd    fds[2];
+
+  fds[0].fd = shard->fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = dgram->wake_fd;
+  fds[1].events = POLLIN;
+
+  while (!__atomic_load_n(&dgram->is_stopping, __ATOMIC_ACQUIRE)) {
+    int count;
+
+    for (size_t ii = 0; ii < HPJSRPC_DGRAM_BATCH; ++ii) {
+      shard->in[ii].msg_hdr.msg_namelen = sizeof(shard->peers[ii]);
+    }
+
+    count = recvmmsg(shard->fd, shard->in, HPJSRPC_DGRAM_BATCH, 0, NULL);
+    if (0 < count) {
+      shard_handle(shard, (size_t) count);
+      continue;
+    }
+
+    /* Drained: sleep until there is more, or until stop() */
+    if (0 > poll(fds, 2, -1) && EINTR != errno) {
+      break;
+    }
+  }
+
+  return NULL;
+
+} /* shard_main() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_dgram_start (hpjsrpc_dgram_t *dgram) {
+  uint64_t drained;
+  size_t   started;
+
+  if (NULL == dgram || dgram->is_running) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  __atomic_store_n(&dgram->is_stopping, false, __ATOMIC_RELEASE);
+  if (sizeof(drained) != read(dgram->wake_fd, &drained, sizeof(drained))) {
+    /* Not readable: never stopped yet */
+  }
+
+  for (started = 0; started < dgram->shard_count; ++started) {
+    dgram_shard_t  *shard = dgram->shards[started];
+    pthread_attr_t  attr;
+    int             rc;
+
+    pthread_attr_init(&attr);
+    if (0 <= shard->cpu) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(shard->cpu, &cpus);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    rc = pthread_create(&shard->thread, &attr, shard_main, shard);
+    pthread_attr_destroy(&attr);
+    if (0 != rc) {
+      break;
+    }
+  }
+
+  dgram->is_running = true;
+
+  if (started < dgram->shard_count) {
+    /* Join what did start */
+    size_t shard_count = dgram->shard_count;
+    dgram->shard_count = started;
+    hpjsrpc_dgram_stop(dgram);
+    dgram->shard_count = shard_count;
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_dgram_start() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_dgram_stop (hpjsrpc_dgram_t *dgram) {
+  uint64_t one = 1;
+
+  if (NULL == dgram) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (!dgram->is_running) {
+    return HPJSRPC_NO_ERROR;
+  }
+
+  __atomic_store_n(&dgram->is_stopping, true, __ATOMIC_RELEASE);
+  /* Left readable, so it wakes every shard */
+  if (sizeof(one) != write(dgram->wake_fd, &one, sizeof(one))) {
+    /* Only fails when already readable */
+  }
+  for (size_t ii = 0; ii < dgram->shard_count; ++ii) {
+    pthread_join(dgram->shards[ii]->thread, NULL);
+  }
+
+  dgram->is_running = false;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_dgram_stop() */
+/* vi: set et sw=2 ts=2: */
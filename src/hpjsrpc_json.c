@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_segment.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+/* Below this much room in the tail segment, escaping goes through append */
+#define JSON_ESCAPE_MIN_ROOM              16
+
+/*
+ * After a clean run shorter than JSON_ESCAPE_DENSE_RUN, the next (up to)
+ * JSON_ESCAPE_DENSE_BYTES are escaped a byte at a time: in escape-heavy
+ * text a vector scan per escape costs more than it finds.
+ */
+#define JSON_ESCAPE_DENSE_RUN             8
+#define JSON_ESCAPE_DENSE_BYTES           32
+
+/*
+ * Escape class of each byte: 0 copies through, 'u' is written as \u00XX and
+ * anything else is written as a backslash followed by that character.
+ */
+static const uint8_t json_escape_table[256] = {
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  0x00, 0x00, '"', 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, '\\', 0x00, 0x00, 0x00,
+};
+
+static const char json_hex_digits[16] = "0123456789abcdef";
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_json_raw_slow (
+  hpjsrpc_buffer_t     *buf,
+  const void           *json,
+  size_t                len,
+  size_t                sep
+) {
+
+  /* Only a chained buffer can take a value bigger than what is left */
+  if (buf->json_overflow || NULL == buf->segment_pool
+      || HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(buf, ",", sep)
+      || HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(buf, json, len)) {
+    buf->json_overflow = true;
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_json_raw_slow() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_json_raw_ref (
+  hpjsrpc_buffer_t     *buf,
+  const void           *json,
+  size_t                len
+) {
+  size_t sep;
+
+  if (NULL == buf->segment_pool || HPJSRPC_SEGMENT_REF_MIN_BYTES > len) {
+    return hpjsrpc_json_raw(buf, json, len);
+  }
+
+  sep = hpjsrpc_json_separator(buf);
+  if (buf->json_overflow
+      || HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(buf, ",", sep)
+      || HPJSRPC_NO_ERROR != hpjsrpc_buffer_append_ref(buf, json, len)) {
+    buf->json_overflow = true;
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_json_raw_ref() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_json_token (
+  hpjsrpc_buffer_t             *buf,
+  const hpjsrpc_request_t      *req,
+  const jsmntok_t              *token
+) {
+  const char *start = &req->buffer[token->start];
+  size_t      len = (size_t) (token->end - token->start);
+
+  /* jsmn string tokens exclude the quotes, which sit on either side */
+  if (JSMN_STRING == token->type) {
+    start--;
+    len += 2;
+  }
+
+  return hpjsrpc_json_raw_ref(buf, start, len);
+
+} /* hpjsrpc_json_token() */
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+json_open (
+  hpjsrpc_buffer_t     *buf,
+  char                  bracket
+) {
+  size_t   sep = hpjsrpc_json_separator(buf);
+  uint8_t *p;
+
+  if (unlikely((HPJSRPC_JSON_MAX_DEPTH - 1) <= buf->json_depth)) {
+    buf->json_overflow = true;
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+
+  p = hpjsrpc_json_reserve(buf, (sep + 1));
+  if (unlikely(NULL == p)) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+
+  p[0] = ',';
+  p[sep] = bracket;
+  hpjsrpc_json_commit(buf, (sep + 1));
+
+  buf->json_depth++;
+  buf->json_has_value &= ~((uint64_t) 1 << buf->json_depth);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* json_open() */
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+json_close (
+  hpjsrpc_buffer_t     *buf,
+  char                  bracket
+) {
+  uint8_t *p;
+
+  if (unlikely(0 == buf->json_depth)) {
+    buf->json_overflow = true;
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  p = hpjsrpc_json_reserve(buf, 1);
+  if (unlikely(NULL == p)) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+
+  p[0] = bracket;
+  hpjsrpc_json_commit(buf, 1);
+  buf->json_depth--;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* json_close() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_json_begin_object (hpjsrpc_buffer_t *buf) {
+  return json_open(buf, '{');
+}
+
+HPJSRPC_RETURN
+hpjsrpc_json_end_object (hpjsrpc_buffer_t *buf) {
+  return json_close(buf, '}');
+}
+
+HPJSRPC_RETURN
+hpjsrpc_json_begin_array (hpjsrpc_buffer_t *buf) {
+  return json_open(buf, '[');
+}
+
+HPJSRPC_RETURN
+hpjsrpc_json_end_array (hpjsrpc_buffer_t *buf) {
+  return json_close(buf, ']');
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns the length of the leading run of str that needs no escaping. The
+ * vector loops flag '"', '\\' and bytes <= 0x1f (via an unsigned max against
+ * 0x1f) 32 or 16 bytes at a time; the table finishes off the tail.
+ */
+static inline size_t
+json_clean_run (
+  const uint8_t        *str,
+  size_t                len
+) {
+  size_t ii = 0;
+
+#if defined(__AVX2__)
+  const __m256i quote32 = _mm256_set1_epi8('"');
+  const __m256i bslash32 = _mm256_set1_epi8('\\');
+  const __m256i ctrl32 = _mm256_set1_epi8(0x1f);
+
+  for (; (ii + 32) <= len; ii += 32) {
+    __m256i  v = _mm256_loadu_si256((const __m256i *) &str[ii]);
+    __m256i  m = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, quote32),
+        _mm256_cmpeq_epi8(v, bslash32)),
+      _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl32), ctrl32));
+    uint32_t mask = (uint32_t) _mm256_movemask_epi8(m);
+    if (0 != mask) {
+      return (ii + (size_t) __builtin_ctz(mask));
+    }
+  }
+#endif
+
+#if defined(__SSE2__)
+  const __m128i quote16 = _mm_set1_epi8('"');
+  const __m128i bslash16 = _mm_set1_epi8('\\');
+  const __m128i ctrl16 = _mm_set1_epi8(0x1f);
+
+  for (; (ii + 16) <= len; ii += 16) {
+    __m128i  v = _mm_loadu_si128((const __m128i *) &str[ii]);
+    __m128i  m = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, quote16), _mm_cmpeq_epi8(v, bslash16)),
+      _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl16), ctrl16));
+    uint32_t mask = (uint32_t) _mm_movemask_epi8(m);
+    if (0 != mask) {
+      return (ii + (size_t) __builtin_ctz(mask));
+    }
+  }
+#endif
+
+  while (ii < len && 0 == json_escape_table[str[ii]]) {
+    ++ii;
+  }
+
+  return ii;
+
+} /* json_clean_run() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Writes one escape sequence at p, returning its length */
+static inline size_t
+json_escape_byte (uint8_t *p, uint8_t c) {
+  uint8_t esc = json_escape_table[c];
+
+  if ('u' == esc) {
+    memcpy(p, "\\u00", 4);
+    p[4] = json_hex_digits[c >> 4];
+    p[5] = json_hex_digits[c & 0x0f];
+    return 6;
+  }
+  p[0] = '\\';
+  p[1] = esc;
+  return 2;
+
+} /* json_escape_byte() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Escapes as much of str as fits in the tail segment, straight into it:
+ * one bounds test per clean run or escape instead of a reserve each.
+ * Returns the input bytes consumed, 0 when the segment is nearly full.
+ */
+static size_t
+json_put_escaped_direct (
+  hpjsrpc_buffer_t     *buf,
+  const uint8_t        *str,
+  size_t                len
+) {
+  size_t   room = (buf->capacity_in_bytes - buf->size_in_bytes);
+  uint8_t *p = (buf->data + buf->size_in_bytes);
+  uint8_t *end;
+  size_t   ii = 0;
+
+  if (room < JSON_ESCAPE_MIN_ROOM || buf->json_overflow) {
+    return 0;
+  }
+  /* The terminator stays out of it */
+  end = (p + room - 1);
+
+  while (ii < len) {
+    size_t limit = (size_t) (end - p);
+    size_t run = json_clean_run(&str[ii], ((len - ii) < limit)
+      ? (len - ii) : limit);
+    /* Short runs, the rule in escape-heavy text, as one fixed-size copy */
+    if (run <= 16 && 16 <= limit && 16 <= (len - ii)) {
+      memcpy(p, &str[ii], 16);
+    } else {
+      memcpy(p, &str[ii], run);
+    }
+    p += run;
+    ii += run;
+    if (ii == len || 6 > (size_t) (end - p)) {
+      break;
+    }
+    p += json_escape_byte(p, str[ii]);
+    ++ii;
+
+    if (run < JSON_ESCAPE_DENSE_RUN) {
+      size_t dense = ((size_t) (end - p) / 6);
+      size_t stop;
+
+      if (dense > JSON_ESCAPE_DENSE_BYTES) {
+        dense = JSON_ESCAPE_DENSE_BYTES;
+      }
+      stop = ((len - ii) < dense) ? len : (ii + dense);
+      for (; ii < stop; ++ii) {
+        if (0 == json_escape_table[str[ii]]) {
+          *p++ = str[ii];
+        } else {
+          p += json_escape_byte(p, str[ii]);
+        }
+      }
+    }
+  }
+  buf->size_in_bytes = (size_t) (p - buf->data);
+
+  return ii;
+
+} /* json_put_escaped_direct() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Writes the escaped body of a string (without quotes). Clean runs are
+ * copied in bulk; on overflow the caller rolls the buffer back.
+ */
+static bool
+json_put_escaped (
+  hpjsrpc_buffer_t     *buf,
+  const uint8_t        *str,
+  size_t                len
+) {
+  size_t ii = 0;
+
+  while (ii < len) {
+    size_t   run;
+    uint8_t *p;
+
+    /* Near the end of a segment, one run and escape at a time */
+    run = json_put_escaped_direct(buf, &str[ii], (len - ii));
+    if (0 != run) {
+      ii += run;
+      continue;
+    }
+
+    run = ii;
+
+    ii += json_clean_run(&str[ii], (len - ii));
+
+    if (ii > run && unlikely(HPJSRPC_NO_ERROR
+        != hpjsrpc_buffer_append(buf, &str[run], (ii - run)))) {
+      return false;
+    }
+
+    if (ii == len) {
+      break;
+    }
+
+    p = hpjsrpc_json_reserve(buf, ('u' == json_escape_table[str[ii]]) ? 6 : 2);
+    if (unlikely(NULL == p)) {
+      return false;
+    }
+    buf->size_in_bytes += json_escape_byte(p, str[ii]);
+    ++ii;
+  }
+
+  return true;
+
+} /* json_put_escaped() */
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+json_write_string (
+  hpjsrpc_buffer_t     *buf,
+  const char           *str,
+  size_t                len,
+  bool                  is_key,
+  bool                  is_escaped
+) {
+  size_t              start = buf->size_in_bytes;
+  hpjsrpc_segment_t  *start_segment = buf->tail_segment;
+  size_t              start_flushed = buf->sink_flushed_in_bytes;
+  size_t              sep = hpjsrpc_json_separator(buf);
+  uint8_t            *p;
+
+  p = hpjsrpc_json_reserve(buf, (sep + 1));
+  if (unlikely(NULL == p)) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+  p[0] = ',';
+  p[sep] = '"';
+  buf->size_in_bytes += (sep + 1);
+
+  if (is_escaped) {
+    if (unlikely(HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(buf, str, len))) {
+      goto L_overflow;
+    }
+  } else if (!json_put_escaped(buf, (const uint8_t *) str, len)) {
+    goto L_overflow;
+  }
+
+  p = hpjsrpc_json_reserve(buf, (is_key) ? 2 : 1);
+  if (unlikely(NULL == p)) {
+    goto L_overflow;
+  }
+  p[0] = '"';
+  p[1] = ':';
+  hpjsrpc_json_commit(buf, (is_key) ? 2 : 1);
+
+  buf->json_after_key = is_key;
+
+  return HPJSRPC_NO_ERROR;
+
+L_overflow:
+  /* A chained buffer that moved on to a new segment is not rolled back */
+  if (start_segment == buf->tail_segment
+      && start_flushed == buf->sink_flushed_in_bytes) {
+    buf->size_in_bytes = start;
+    buf->data[start] = 0;
+  }
+  buf->json_overflow = true;
+  return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+
+} /* json_write_string() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_json_key (
+  hpjsrpc_buffer_t     *buf,
+  const char           *key,
+  size_t                len
+) {
+  return json_write_string(buf, key, len, true, false);
+}
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_json_string (
+  hpjsrpc_buffer_t     *buf,
+  const char           *str,
+  size_t                len
+) {
+  return json_write_string(buf, str, len, false, false);
+}
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_json_string_raw (
+  hpjsrpc_buffer_t     *buf,
+  const char           *str,
+  size_t                len
+) {
+  return json_write_string(buf, str, len, false, true);
+}
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_json_int (
+  hpjsrpc_buffer_t     *buf,
+  int64_t               value
+) {
+  char      digits[20];
+  char     *p = &digits[sizeof(digits)];
+  uint64_t  magnitude = (value < 0) ? (0 - (uint64_t) value) : (uint64_t) value;
+
+  do {
+    *--p = (char) ('0' + (magnitude % 10));
+    magnitude /= 10;
+  } while (0 != magnitude);
+
+  if (value < 0) {
+    *--p = '-';
+  }
+
+  return hpjsrpc_json_raw(buf, p, (size_t) (&digits[sizeof(digits)] - p));
+
+} /* hpjsrpc_json_int() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_json_double (
+  hpjsrpc_buffer_t     *buf,
+  double                value
+) {
+  char  digits[32];
+  int   len;
+
+  if (unlikely(!isfinite(value))) {
+    return hpjsrpc_json_null(buf);
+  }
+
+  /* Integral values (the common case for counts and ids) skip formatting */
+  if ((-9007199254740992.0 < value) && (value < 9007199254740992.0)
+      && (value == (double) (int64_t) value)) {
+    return hpjsrpc_json_int(buf, (int64_t) value);
+  }
+
+  /* Shortest of the two precisions that round-trips */
+  len = snprintf(digits, sizeof(digits), "%.15g", value);
+  if (strtod(digits, NULL) != value) {
+    len = snprintf(digits, sizeof(digits), "%.17g", value);
+  }
+
+  return hpjsrpc_json_raw(buf, digits, (size_t) len);
+
+} /* hpjsrpc_json_double() */
+/* vi: set et sw=2 ts=2: */
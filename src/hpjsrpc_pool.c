@@ -0,0 +1,402 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "hpjsrpc_pool.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+/*
+ * A worker that finds work queued but cannot take it (every deque holding
+ * some is locked, or its task is being popped) yields this many times, then
+ * sleeps on the wake condition for up to POOL_PARK_NS at a time.
+ */
+#define POOL_YIELD_ROUNDS                 16
+#define POOL_PARK_NS                      100000
+
+/*
+ * Each worker owns a deque. The owner pushes and pops at the tail, thieves
+ * take from the head, so a worker drains its own batch elements in LIFO
+ * order (cache-warm) while idle workers pick off the oldest ones.
+ */
+typedef struct {
+  pthread_mutex_t                 lock;
+  size_t                          head;
+  size_t                          tail;
+  hpjsrpc_task_t                  tasks[HPJSRPC_POOL_DEQUE_CAPACITY];
+} hpjsrpc_deque_t;
+
+typedef struct {
+  hpjsrpc_pool_t                 *pool;
+  size_t                          index;
+} hpjsrpc_worker_arg_t;
+
+struct hpjsrpc_pool_t {
+  size_t                          worker_count;
+  pthread_t                      *threads;
+  hpjsrpc_worker_arg_t           *worker_args;
+  hpjsrpc_deque_t                *deques;
+  hpjsrpc_segment_pool_t         *segments;
+  /* Tasks queued, counted before they are pushed: never below the truth */
+  size_t                          pending;
+  bool                            stopping;
+  pthread_mutex_t                 lock;
+  pthread_cond_t                  wake;
+  pthread_mutex_t                 done_lock;
+  pthread_cond_t                  done;
+};
+
+/* ------------------------------------------------------------------------- */
+
+static bool
+deque_push (
+  hpjsrpc_deque_t      *dq,
+  hpjsrpc_task_t        task
+) {
+  bool pushed = false;
+
+  pthread_mutex_lock(&dq->lock);
+  if (likely((dq->tail - dq->head) < HPJSRPC_POOL_DEQUE_CAPACITY)) {
+    dq->tasks[dq->tail++ % HPJSRPC_POOL_DEQUE_CAPACITY] = task;
+    pushed = true;
+  }
+  pthread_mutex_unlock(&dq->lock);
+
+  return pushed;
+
+} /* deque_push() */
+
+/* ------------------------------------------------------------------------- */
+
+static bool
+deque_pop (
+  hpjsrpc_deque_t      *dq,
+  hpjsrpc_task_t       *task
+) {
+  bool popped = false;
+
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail != dq->head) {
+    *task = dq->tasks[--dq->tail % HPJSRPC_POOL_DEQUE_CAPACITY];
+    popped = true;
+  }
+  pthread_mutex_unlock(&dq->lock);
+
+  return popped;
+
+} /* deque_pop() */
+
+/* ------------------------------------------------------------------------- */
+
+static bool
+deque_steal (
+  hpjsrpc_deque_t      *dq,
+  hpjsrpc_task_t       *task
+) {
+  bool stolen = false;
+
+  /* Don't contend with a busy owner; another victim will do */
+  if (0 != pthread_mutex_trylock(&dq->lock)) {
+    return false;
+  }
+  if (dq->tail != dq->head) {
+    *task = dq->tasks[dq->head++ % HPJSRPC_POOL_DEQUE_CAPACITY];
+    stolen = true;
+  }
+  pthread_mutex_unlock(&dq->lock);
+
+  return stolen;
+
+} /* deque_steal() */
+
+/* ------------------------------------------------------------------------- */
+
+static bool
+pool_take (
+  hpjsrpc_pool_t       *pool,
+  size_t                self,
+  hpjsrpc_task_t       *task
+) {
+  if (self < pool->worker_count && deque_pop(&pool->deques[self], task)) {
+    goto L_taken;
+  }
+
+  for (size_t ii = 1; ii <= pool->worker_count; ++ii) {
+    size_t victim = (self + ii) % pool->worker_count;
+    if (deque_steal(&pool->deques[victim], task)) {
+      goto L_taken;
+    }
+  }
+
+  return false;
+
+L_taken:
+  __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+  return true;
+
+} /* pool_take() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Sleeps on the wake condition for at most POOL_PARK_NS */
+static void
+pool_park (hpjsrpc_pool_t *pool) {
+  struct timespec until;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_nsec += POOL_PARK_NS;
+  if (1000000000L <= until.tv_nsec) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000L;
+  }
+  pthread_cond_timedwait(&pool->wake, &pool->lock, &until);
+
+} /* pool_park() */
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+pool_worker_main (void *arg) {
+  hpjsrpc_worker_arg_t *wa = (hpjsrpc_worker_arg_t *) arg;
+  hpjsrpc_pool_t       *pool = wa->pool;
+  hpjsrpc_task_t        task;
+  size_t                misses = 0;
+
+  for (;;) {
+    if (pool_take(pool, wa->index, &task)) {
+      misses = 0;
+      task.func(task.arg, wa->index);
+      continue;
+    }
+
+    /* Work is queued that another thread holds: back off, don't spin */
+    if (0 == __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE)) {
+      misses = 0;
+    } else if (POOL_YIELD_ROUNDS > ++misses) {
+      sched_yield();
+      continue;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (0 != misses && !pool->stopping) {
+      pool_park(pool);
+      misses = 0;
+    }
+    while (0 == __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE)
+        && !pool->stopping) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->stopping) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  return NULL;
+
+} /* pool_worker_main() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_pool_new (
+  hpjsrpc_pool_t              **pptr,
+  size_t                        worker_count,
+  size_t                        segment_capacity_in_bytes
+) {
+  hpjsrpc_pool_t *pool;
+  size_t          started = 0;
+
+  if (NULL == pptr || 0 == worker_count
+      || HPJSRPC_POOL_MAX_WORKERS < worker_count
+      || 0 == segment_capacity_in_bytes) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pool = hpjsrpc_calloc(1, sizeof(*pool));
+  if (NULL == pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pool->worker_count = worker_count;
+  pool->threads = hpjsrpc_calloc(worker_count, sizeof(*pool->threads));
+  pool->worker_args = hpjsrpc_calloc(worker_count, sizeof(*pool->worker_args));
+  pool->deques = hpjsrpc_calloc(worker_count, sizeof(*pool->deques));
+  if (NULL == pool->threads || NULL == pool->worker_args
+      || NULL == pool->deques
+      || HPJSRPC_NO_ERROR != hpjsrpc_segment_pool_new(&pool->segments,
+        segment_capacity_in_bytes, 0)) {
+    goto L_error;
+  }
+
+  for (size_t ii = 0; ii < worker_count; ++ii) {
+    pthread_mutex_init(&pool->deques[ii].lock, NULL);
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_mutex_init(&pool->done_lock, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (started = 0; started < worker_count; ++started) {
+    pool->worker_args[started].pool = pool;
+    pool->worker_args[started].index = started;
+    if (0 != pthread_create(&pool->threads[started], NULL, pool_worker_main,
+        &pool->worker_args[started])) {
+      pool->worker_count = started;
+      hpjsrpc_pool_destroy(pool);
+      return HPJSRPC_ASSERTION_ERROR;
+    }
+  }
+
+  *pptr = pool;
+
+  return HPJSRPC_NO_ERROR;
+
+L_error:
+  if (NULL != pool->segments) {
+    hpjsrpc_segment_pool_destroy(pool->segments);
+  }
+  hpjsrpc_free(pool->deques);
+  hpjsrpc_free(pool->worker_args);
+  hpjsrpc_free(pool->threads);
+  hpjsrpc_free(pool);
+  return HPJSRPC_ASSERTION_ERROR;
+
+} /* hpjsrpc_pool_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_pool_destroy (hpjsrpc_pool_t *pool) {
+
+  if (NULL == pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t ii = 0; ii < pool->worker_count; ++ii) {
+    pthread_join(pool->threads[ii], NULL);
+  }
+
+  for (size_t ii = 0; ii < pool->worker_count; ++ii) {
+    pthread_mutex_destroy(&pool->deques[ii].lock);
+  }
+
+  pthread_cond_destroy(&pool->done);
+  pthread_mutex_destroy(&pool->done_lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+
+  hpjsrpc_segment_pool_destroy(pool->segments);
+  hpjsrpc_free(pool->deques);
+  hpjsrpc_free(pool->worker_args);
+  hpjsrpc_free(pool->threads);
+  hpjsrpc_free(pool);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_pool_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_pool_worker_count (const hpjsrpc_pool_t *pool) {
+  return pool->worker_count;
+}
+
+/* ------------------------------------------------------------------------- */
+
+hpjsrpc_segment_pool_t *
+hpjsrpc_pool_segments (hpjsrpc_pool_t *pool) {
+  return pool->segments;
+}
+
+/* ------------------------------------------------------------------------- */
+
+bool
+hpjsrpc_pool_submit (
+  hpjsrpc_pool_t       *pool,
+  size_t                worker_hint,
+  hpjsrpc_task_t        task
+) {
+  /* Counted first, so the worker that takes it cannot count it off early */
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+  if (!deque_push(&pool->deques[worker_hint % pool->worker_count], task)) {
+    __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+    return false;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pthread_cond_signal(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  return true;
+
+} /* hpjsrpc_pool_submit() */
+
+/* ------------------------------------------------------------------------- */
+
+bool
+hpjsrpc_pool_help (hpjsrpc_pool_t *pool) {
+  hpjsrpc_task_t task;
+
+  if (!pool_take(pool, pool->worker_count, &task)) {
+    return false;
+  }
+
+  task.func(task.arg, pool->worker_count);
+  return true;
+
+} /* hpjsrpc_pool_help() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+hpjsrpc_pool_wait (
+  hpjsrpc_pool_t       *pool,
+  size_t               *remaining
+) {
+  while (0 != __atomic_load_n(remaining, __ATOMIC_ACQUIRE)) {
+    if (hpjsrpc_pool_help(pool)) {
+      continue;
+    }
+
+    /* Everything is in flight on workers; sleep until the last one lands */
+    pthread_mutex_lock(&pool->done_lock);
+    while (0 != __atomic_load_n(remaining, __ATOMIC_ACQUIRE)) {
+      pthread_cond_wait(&pool->done, &pool->done_lock);
+    }
+    pthread_mutex_unlock(&pool->done_lock);
+  }
+
+} /* hpjsrpc_pool_wait() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+hpjsrpc_pool_complete (
+  hpjsrpc_pool_t       *pool,
+  size_t               *remaining
+) {
+  if (0 == __atomic_sub_fetch(remaining, 1, __ATOMIC_ACQ_REL)) {
+    pthread_mutex_lock(&pool->done_lock);
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->done_lock);
+  }
+
+} /* hpjsrpc_pool_complete() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hpjsrpc_queue.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define QUEUE_ALIGNED   __attribute__((aligned(HPJSRPC_CACHE_LINE_SIZE)))
+
+/*
+ * A slot is free for the producer claiming position p when its sequence
+ * equals p, and holds an item for the consumer claiming p when it equals
+ * p + 1. Consuming sets it to p + capacity, handing it to the next lap.
+ */
+typedef struct {
+  size_t                          sequence;
+  void                           *item;
+} queue_slot_t;
+
+struct hpjsrpc_queue_t {
+  size_t                          enqueue_position QUEUE_ALIGNED;
+  size_t                          dequeue_position QUEUE_ALIGNED;
+  queue_slot_t                   *slots QUEUE_ALIGNED;
+  size_t                          mask;
+};
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_queue_new (
+  hpjsrpc_queue_t             **pptr,
+  size_t                        capacity
+) {
+  hpjsrpc_queue_t *queue;
+  size_t           size = 2;
+
+  if (NULL == pptr || 0 == capacity || (SIZE_MAX / 2) < capacity) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  while (size < capacity) {
+    size <<= 1;
+  }
+
+  if (0 != posix_memalign((void **) &queue, HPJSRPC_CACHE_LINE_SIZE,
+      sizeof(*queue))) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  memset(queue, 0, sizeof(*queue));
+
+  if (0 != posix_memalign((void **) &queue->slots, HPJSRPC_CACHE_LINE_SIZE,
+      (size * sizeof(*queue->slots)))) {
+    free(queue);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  for (size_t ii = 0; ii < size; ++ii) {
+    queue->slots[ii].sequence = ii;
+    queue->slots[ii].item = NULL;
+  }
+  queue->mask = (size - 1);
+
+  *pptr = queue;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_queue_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_queue_destroy (hpjsrpc_queue_t *queue) {
+
+  if (NULL == queue) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  free(queue->slots);
+  free(queue);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_queue_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_queue_capacity (const hpjsrpc_queue_t *queue) {
+  return (queue->mask + 1);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Claims up to count consecutive slots at *position whose sequence is
+ * position + lag (0 for producers, 1 for consumers), with one CAS. Returns
+ * the number claimed, and the first claimed position in *start. count must
+ * not be 0.
+ */
+static inline size_t
+queue_claim (
+  hpjsrpc_queue_t      *queue,
+  size_t               *position,
+  size_t                lag,
+  size_t                count,
+  size_t               *start
+) {
+  size_t pos = __atomic_load_n(position, __ATOMIC_RELAXED);
+
+  for (;;) {
+    size_t   claimed = 0;
+    intptr_t diff = 0;
+
+    while (claimed < count) {
+      size_t sequence = __atomic_load_n(
+        &queue->slots[(pos + claimed) & queue->mask].sequence, __ATOMIC_ACQUIRE);
+      diff = (intptr_t) (sequence - (pos + claimed + lag));
+      if (0 != diff) {
+        break;
+      }
+      ++claimed;
+    }
+
+    if (0 == claimed) {
+      /* Behind: the queue is full (empty). Ahead: pos went stale */
+      if (0 > diff) {
+        return 0;
+      }
+      pos = __atomic_load_n(position, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    if (likely(__atomic_compare_exchange_n(position, &pos, (pos + claimed),
+        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {
+      *start = pos;
+      return claimed;
+    }
+  }
+
+} /* queue_claim() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_queue_push_batch (
+  hpjsrpc_queue_t      *queue,
+  void * const         *items,
+  size_t                count
+) {
+  size_t start;
+  size_t claimed;
+
+  /* queue_claim() would take claiming nothing for a stale position */
+  if (0 == count) {
+    return 0;
+  }
+
+  claimed = queue_claim(queue, &queue->enqueue_position, 0, count, &start);
+
+  for (size_t ii = 0; ii < claimed; ++ii) {
+    queue_slot_t *slot = &queue->slots[(start + ii) & queue->mask];
+    slot->item = items[ii];
+    __atomic_store_n(&slot->sequence, (start + ii + 1), __ATOMIC_RELEASE);
+  }
+
+  return claimed;
+
+} /* hpjsrpc_queue_push_batch() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_queue_pop_batch (
+  hpjsrpc_queue_t      *queue,
+  void                **items,
+  size_t                count
+) {
+  size_t start;
+  size_t claimed;
+
+  if (0 == count) {
+    return 0;
+  }
+
+  claimed = queue_claim(queue, &queue->dequeue_position, 1, count, &start);
+
+  for (size_t ii = 0; ii < claimed; ++ii) {
+    queue_slot_t *slot = &queue->slots[(start + ii) & queue->mask];
+    items[ii] = slot->item;
+    __atomic_store_n(&slot->sequence, (start + ii + queue->mask + 1),
+      __ATOMIC_RELEASE);
+  }
+
+  return claimed;
+
+} /* hpjsrpc_queue_pop_batch() */
+
+/* ------------------------------------------------------------------------- */
+
+bool
+hpjsrpc_queue_push (
+  hpjsrpc_queue_t      *queue,
+  void                 *item
+) {
+  return (1 == hpjsrpc_queue_push_batch(queue, &item, 1));
+}
+
+/* ------------------------------------------------------------------------- */
+
+bool
+hpjsrpc_queue_pop (
+  hpjsrpc_queue_t      *queue,
+  void                **item
+) {
+  return (1 == hpjsrpc_queue_pop_batch(queue, item, 1));
+}
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_queue_size (const hpjsrpc_queue_t *queue) {
+  size_t enqueued = __atomic_load_n(&queue->enqueue_position,
+    __ATOMIC_RELAXED);
+  size_t dequeued = __atomic_load_n(&queue->dequeue_position,
+    __ATOMIC_RELAXED);
+
+  return (enqueued >= dequeued) ? (enqueued - dequeued) : 0;
+}
+/* vi: set et sw=2 ts=2: */
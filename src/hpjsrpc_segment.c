@@ -0,0 +1,830 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "hpjsrpc_segment.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#ifndef IOV_MAX
+# define IOV_MAX    1024
+#endif
+
+struct hpjsrpc_segment_pool_t {
+  pthread_mutex_t                 lock;
+  hpjsrpc_segment_t              *free_list;
+  hpjsrpc_segment_t              *ref_free_list;
+  size_t                          free_count;
+  size_t                          ref_free_count;
+  size_t                          segment_size_in_bytes;
+  size_t                          max_segments;
+  /* Chunks handed out and not yet released */
+  size_t                          used_segments;
+  size_t                          max_retained;
+  hpjsrpc_segment_pool_t         *parent;
+};
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_segment_pool_new (
+  hpjsrpc_segment_pool_t      **pptr,
+  size_t                        segment_size_in_bytes,
+  size_t                        max_segments
+) {
+  hpjsrpc_segment_pool_t *pool;
+
+  /* Room for at least one byte of payload plus the NUL terminator */
+  if (NULL == pptr || 2 > segment_size_in_bytes) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pool = hpjsrpc_calloc(1, sizeof(*pool));
+  if (NULL == pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pool->segment_size_in_bytes = segment_size_in_bytes;
+  pool->max_segments = max_segments;
+  pool->max_retained = SIZE_MAX;
+
+  *pptr = pool;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_segment_pool_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_segment_pool_destroy (hpjsrpc_segment_pool_t *pool) {
+
+  if (NULL == pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  while (NULL != pool->free_list) {
+    hpjsrpc_segment_t *next = pool->free_list->next;
+    hpjsrpc_free(pool->free_list);
+    pool->free_list = next;
+  }
+
+  while (NULL != pool->ref_free_list) {
+    hpjsrpc_segment_t *next = pool->ref_free_list->next;
+    hpjsrpc_free(pool->ref_free_list);
+    pool->ref_free_list = next;
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  hpjsrpc_free(pool);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_segment_pool_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_segment_pool_segment_size (const hpjsrpc_segment_pool_t *pool) {
+  return pool->segment_size_in_bytes;
+}
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_segment_pool_set_retention (
+  hpjsrpc_segment_pool_t       *pool,
+  hpjsrpc_segment_pool_t       *parent,
+  size_t                        max_retained
+) {
+
+  if (NULL == pool || pool == parent || (NULL != parent
+      && parent->segment_size_in_bytes != pool->segment_size_in_bytes)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->parent = parent;
+  pool->max_retained = max_retained;
+  pthread_mutex_unlock(&pool->lock);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_segment_pool_set_retention() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Takes a free chunk from pool or, failing that, from its ancestors */
+static hpjsrpc_segment_t *
+segment_pool_take (hpjsrpc_segment_pool_t *pool) {
+  hpjsrpc_segment_t *segment = NULL;
+
+  while (NULL != pool && NULL == segment) {
+    pthread_mutex_lock(&pool->lock);
+    segment = pool->free_list;
+    if (NULL != segment) {
+      pool->free_list = segment->next;
+      pool->free_count--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pool = pool->parent;
+  }
+
+  return segment;
+
+} /* segment_pool_take() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Keeps a free chunk in pool or its ancestors, or frees it if all are full */
+static void
+segment_pool_store (
+  hpjsrpc_segment_pool_t       *pool,
+  hpjsrpc_segment_t            *segment
+) {
+  while (NULL != pool) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count < pool->max_retained) {
+      segment->next = pool->free_list;
+      pool->free_list = segment;
+      pool->free_count++;
+      pthread_mutex_unlock(&pool->lock);
+      return;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pool = pool->parent;
+  }
+
+  hpjsrpc_free(segment);
+
+} /* segment_pool_store() */
+
+/* ------------------------------------------------------------------------- */
+
+hpjsrpc_segment_t *
+hpjsrpc_segment_acquire (hpjsrpc_segment_pool_t *pool) {
+  hpjsrpc_segment_t *segment = NULL;
+  bool               is_reserved = false;
+
+  pthread_mutex_lock(&pool->lock);
+  if (0 == pool->max_segments || pool->used_segments < pool->max_segments) {
+    pool->used_segments++;
+    is_reserved = true;
+    segment = pool->free_list;
+    if (likely(NULL != segment)) {
+      pool->free_list = segment->next;
+      pool->free_count--;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (unlikely(!is_reserved)) {
+    return NULL;
+  }
+
+  if (NULL == segment) {
+    segment = segment_pool_take(pool->parent);
+  }
+  if (NULL == segment) {
+    segment = hpjsrpc_malloc(sizeof(*segment) + pool->segment_size_in_bytes);
+  }
+
+  if (unlikely(NULL == segment)) {
+    pthread_mutex_lock(&pool->lock);
+    pool->used_segments--;
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+  }
+
+  segment->next = NULL;
+  segment->size_in_bytes = 0;
+  segment->ref = NULL;
+
+  return segment;
+
+} /* hpjsrpc_segment_acquire() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Reference nodes are header-only and do not count against max_segments */
+static hpjsrpc_segment_t *
+segment_acquire_ref (hpjsrpc_segment_pool_t *pool) {
+  hpjsrpc_segment_t *segment;
+
+  pthread_mutex_lock(&pool->lock);
+  segment = pool->ref_free_list;
+  if (likely(NULL != segment)) {
+    pool->ref_free_list = segment->next;
+    pool->ref_free_count--;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (NULL == segment) {
+    segment = hpjsrpc_malloc(sizeof(*segment));
+  }
+  if (likely(NULL != segment)) {
+    segment->next = NULL;
+  }
+
+  return segment;
+
+} /* segment_acquire_ref() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+hpjsrpc_segment_release (
+  hpjsrpc_segment_pool_t       *pool,
+  hpjsrpc_segment_t            *segment
+) {
+  pthread_mutex_lock(&pool->lock);
+  if (NULL != segment->ref) {
+    if (pool->ref_free_count < pool->max_retained) {
+      segment->next = pool->ref_free_list;
+      pool->ref_free_list = segment;
+      pool->ref_free_count++;
+      segment = NULL;
+    }
+  } else {
+    pool->used_segments--;
+    if (pool->free_count < pool->max_retained) {
+      segment->next = pool->free_list;
+      pool->free_list = segment;
+      pool->free_count++;
+      segment = NULL;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  /* Past the retention bound: hand the chunk up, or give it back */
+  if (NULL != segment) {
+    if (NULL != segment->ref) {
+      hpjsrpc_free(segment);
+    } else {
+      segment_pool_store(pool->parent, segment);
+    }
+  }
+
+} /* hpjsrpc_segment_release() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+buffer_set_tail (
+  hpjsrpc_buffer_t     *buf,
+  hpjsrpc_segment_t    *segment
+) {
+  buf->tail_segment = segment;
+  if (NULL == segment || NULL != segment->ref) {
+    buf->data = NULL;
+    buf->size_in_bytes = 0;
+    buf->capacity_in_bytes = 0;
+    return;
+  }
+  buf->data = segment->data;
+  buf->size_in_bytes = segment->size_in_bytes;
+  buf->capacity_in_bytes = buf->segment_pool->segment_size_in_bytes;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Records the tail's size and links segment behind it */
+static void
+buffer_link (
+  hpjsrpc_buffer_t     *buf,
+  hpjsrpc_segment_t    *segment
+) {
+  if (NULL != buf->tail_segment) {
+    if (NULL == buf->tail_segment->ref) {
+      buf->tail_segment->size_in_bytes = buf->size_in_bytes;
+    }
+    buf->tail_segment->next = segment;
+  } else {
+    buf->head_segment = segment;
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static inline size_t
+segment_length (
+  const hpjsrpc_buffer_t       *buf,
+  const hpjsrpc_segment_t      *segment
+) {
+  return (segment == buf->tail_segment && NULL == segment->ref)
+    ? buf->size_in_bytes : segment->size_in_bytes;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Hands the segments from the head up to (not including) stop to the sink,
+ * releasing them once written. With stop NULL the tail goes out as well; an
+ * owned tail is then kept, empty, for the writes still to come.
+ */
+static HPJSRPC_RETURN
+buffer_sink_until (
+  hpjsrpc_buffer_t     *buf,
+  hpjsrpc_segment_t    *stop
+) {
+  struct iovec       iov[HPJSRPC_SINK_MAX_IOVECS];
+  hpjsrpc_segment_t *segment = buf->head_segment;
+  size_t             count = 0;
+  size_t             length = 0;
+
+  if (unlikely(buf->sink_failed)) {
+    return HPJSRPC_RPC_ERROR_SINK;
+  }
+
+  while (segment != stop) {
+    hpjsrpc_segment_t *next = segment->next;
+    size_t             seg_length = segment_length(buf, segment);
+
+    if (0 < seg_length) {
+      iov[count].iov_base = (NULL != segment->ref)
+        ? (void *) segment->ref : (void *) segment->data;
+      iov[count].iov_len = seg_length;
+      count++;
+      length += seg_length;
+    }
+
+    if (HPJSRPC_SINK_MAX_IOVECS == count || next == stop) {
+      if (0 < count && unlikely(HPJSRPC_NO_ERROR
+          != buf->sink(buf->sink_ctx, iov, count))) {
+        /* Sticky: a stream with a hole in it is beyond repair */
+        buf->sink_failed = true;
+        return HPJSRPC_RPC_ERROR_SINK;
+      }
+      buf->sink_flushed_in_bytes += length;
+      count = 0;
+      length = 0;
+
+      while (buf->head_segment != next) {
+        hpjsrpc_segment_t *done = buf->head_segment;
+
+        if (done == buf->tail_segment) {
+          if (NULL != done->ref) {
+            hpjsrpc_segment_release(buf->segment_pool, done);
+            buf->head_segment = NULL;
+            buffer_set_tail(buf, NULL);
+          } else {
+            done->size_in_bytes = 0;
+            buf->size_in_bytes = 0;
+            buf->data[0] = 0;
+          }
+          break;
+        }
+
+        buf->head_segment = done->next;
+        hpjsrpc_segment_release(buf->segment_pool, done);
+      }
+    }
+
+    segment = next;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* buffer_sink_until() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_buffer_init_chained (
+  hpjsrpc_buffer_t             *buf,
+  hpjsrpc_segment_pool_t       *pool
+) {
+
+  if (NULL == buf || NULL == pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  memset(buf, 0, sizeof(*buf));
+  buf->segment_pool = pool;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_buffer_init_chained() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+hpjsrpc_buffer_release (hpjsrpc_buffer_t *buf) {
+  hpjsrpc_segment_t *segment;
+
+  if (NULL == buf->segment_pool) {
+    return;
+  }
+
+  segment = buf->head_segment;
+  while (NULL != segment) {
+    hpjsrpc_segment_t *next = segment->next;
+    hpjsrpc_segment_release(buf->segment_pool, segment);
+    segment = next;
+  }
+
+  buf->head_segment = NULL;
+  buffer_set_tail(buf, NULL);
+
+} /* hpjsrpc_buffer_release() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Keeps the first segment, so a chained buffer reused across requests only
+ * goes back to the pool for responses that outgrow it.
+ */
+void
+hpjsrpc_buffer_rewind_chained (hpjsrpc_buffer_t *buf) {
+  hpjsrpc_segment_t *head = buf->head_segment;
+
+  if (NULL == head || NULL != head->ref) {
+    hpjsrpc_buffer_release(buf);
+    return;
+  }
+
+  buf->head_segment = head->next;
+  hpjsrpc_buffer_release(buf);
+
+  head->next = NULL;
+  head->size_in_bytes = 0;
+  buf->head_segment = head;
+  buffer_set_tail(buf, head);
+
+} /* hpjsrpc_buffer_rewind_chained() */
+
+/* ------------------------------------------------------------------------- */
+
+uint8_t *
+hpjsrpc_buffer_grow (
+  hpjsrpc_buffer_t     *buf,
+  size_t                len
+) {
+  hpjsrpc_segment_t *segment;
+
+  if (buf->json_overflow || NULL == buf->segment_pool
+      || len >= buf->segment_pool->segment_size_in_bytes) {
+    goto L_overflow;
+  }
+
+  segment = hpjsrpc_segment_acquire(buf->segment_pool);
+  if (unlikely(NULL == segment)) {
+    goto L_overflow;
+  }
+
+  buffer_link(buf, segment);
+  buffer_set_tail(buf, segment);
+  buf->data[0] = 0;
+
+  /* Streaming: only the fresh tail stays behind */
+  if (NULL != buf->sink
+      && unlikely(HPJSRPC_NO_ERROR != buffer_sink_until(buf, segment))) {
+    goto L_overflow;
+  }
+
+  return buf->data;
+
+L_overflow:
+  buf->json_overflow = true;
+  return NULL;
+
+} /* hpjsrpc_buffer_grow() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_buffer_append_slow (
+  hpjsrpc_buffer_t     *buf,
+  const void           *bytes,
+  size_t                len
+) {
+  const uint8_t *src = (const uint8_t *) bytes;
+
+  if (NULL == buf->segment_pool) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+
+  for (;;) {
+    size_t avail = (buf->capacity_in_bytes - buf->size_in_bytes);
+    size_t chunk = (0 < avail) ? (avail - 1) : 0;
+
+    if (len < avail) {
+      memcpy(buf->data + buf->size_in_bytes, src, len);
+      buf->size_in_bytes += len;
+      buf->data[buf->size_in_bytes] = 0;
+      return HPJSRPC_NO_ERROR;
+    }
+
+    if (0 < chunk) {
+      memcpy(buf->data + buf->size_in_bytes, src, chunk);
+      buf->size_in_bytes += chunk;
+      src += chunk;
+      len -= chunk;
+    }
+
+    if (NULL == hpjsrpc_buffer_grow(buf, 1)) {
+      return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+    }
+  }
+
+} /* hpjsrpc_buffer_append_slow() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_buffer_length (const hpjsrpc_buffer_t *buf) {
+  size_t length = 0;
+
+  if (NULL == buf->segment_pool) {
+    return buf->size_in_bytes;
+  }
+
+  for (const hpjsrpc_segment_t *segment = buf->head_segment
+      ; NULL != segment
+      ; segment = segment->next) {
+    length += segment_length(buf, segment);
+  }
+
+  return length;
+
+} /* hpjsrpc_buffer_length() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_buffer_iovec_count (const hpjsrpc_buffer_t *buf) {
+  size_t count = 0;
+
+  if (NULL == buf->segment_pool) {
+    return (0 < buf->size_in_bytes) ? 1 : 0;
+  }
+
+  for (const hpjsrpc_segment_t *segment = buf->head_segment
+      ; NULL != segment
+      ; segment = segment->next) {
+    count += (0 < segment_length(buf, segment));
+  }
+
+  return count;
+
+} /* hpjsrpc_buffer_iovec_count() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_buffer_iovec_at (
+  const hpjsrpc_buffer_t       *buf,
+  size_t                        offset,
+  struct iovec                 *iov,
+  size_t                        iov_count
+) {
+  size_t filled = 0;
+
+  if (NULL == buf->segment_pool) {
+    if (offset < buf->size_in_bytes && 0 < iov_count) {
+      iov[0].iov_base = &buf->data[offset];
+      iov[0].iov_len = (buf->size_in_bytes - offset);
+      filled++;
+    }
+    return filled;
+  }
+
+  for (const hpjsrpc_segment_t *segment = buf->head_segment
+      ; NULL != segment && filled < iov_count
+      ; segment = segment->next) {
+    const uint8_t *bytes = (NULL != segment->ref)
+      ? segment->ref : segment->data;
+    size_t         length = segment_length(buf, segment);
+
+    if (offset >= length) {
+      offset -= length;
+      continue;
+    }
+    iov[filled].iov_base = (void *) &bytes[offset];
+    iov[filled].iov_len = (length - offset);
+    offset = 0;
+    filled++;
+  }
+
+  return filled;
+
+} /* hpjsrpc_buffer_iovec_at() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_buffer_iovec (
+  const hpjsrpc_buffer_t       *buf,
+  struct iovec                 *iov,
+  size_t                        iov_count
+) {
+  return hpjsrpc_buffer_iovec_at(buf, 0, iov, iov_count);
+}
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_buffer_append_ref (
+  hpjsrpc_buffer_t     *buf,
+  const void           *bytes,
+  size_t                len
+) {
+  hpjsrpc_segment_t *segment;
+
+  if (NULL == buf->segment_pool || HPJSRPC_SEGMENT_REF_MIN_BYTES > len) {
+    return hpjsrpc_buffer_append(buf, bytes, len);
+  }
+
+  if (buf->json_overflow) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+
+  segment = segment_acquire_ref(buf->segment_pool);
+  if (unlikely(NULL == segment)) {
+    buf->json_overflow = true;
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+  segment->ref = (const uint8_t *) bytes;
+  segment->size_in_bytes = len;
+
+  /* The next write starts a fresh chunk behind the reference */
+  buffer_link(buf, segment);
+  buffer_set_tail(buf, segment);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_buffer_append_ref() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_buffer_copy_out (
+  const hpjsrpc_buffer_t       *buf,
+  void                         *dst,
+  size_t                        capacity_in_bytes
+) {
+  size_t   length = hpjsrpc_buffer_length(buf);
+  uint8_t *p = (uint8_t *) dst;
+
+  if (length >= capacity_in_bytes) {
+    return length;
+  }
+
+  if (NULL == buf->segment_pool) {
+    memcpy(p, buf->data, length);
+    p += length;
+  } else {
+    for (const hpjsrpc_segment_t *segment = buf->head_segment
+        ; NULL != segment
+        ; segment = segment->next) {
+      size_t seg_length = segment_length(buf, segment);
+      memcpy(p, (NULL != segment->ref) ? segment->ref : segment->data,
+        seg_length);
+      p += seg_length;
+    }
+  }
+  *p = 0;
+
+  return length;
+
+} /* hpjsrpc_buffer_copy_out() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_buffer_splice (
+  hpjsrpc_buffer_t             *dst,
+  hpjsrpc_buffer_t             *src
+) {
+
+  if (NULL == dst->segment_pool || dst->segment_pool != src->segment_pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (NULL == src->head_segment) {
+    return HPJSRPC_NO_ERROR;
+  }
+
+  if (NULL == src->tail_segment->ref) {
+    src->tail_segment->size_in_bytes = src->size_in_bytes;
+  }
+
+  buffer_link(dst, src->head_segment);
+  buffer_set_tail(dst, src->tail_segment);
+
+  src->head_segment = NULL;
+  buffer_set_tail(src, NULL);
+
+  if (NULL != dst->sink && unlikely(HPJSRPC_NO_ERROR
+      != buffer_sink_until(dst, dst->tail_segment))) {
+    dst->json_overflow = true;
+    return HPJSRPC_RPC_ERROR_SINK;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_buffer_splice() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_buffer_set_sink (
+  hpjsrpc_buffer_t     *buf,
+  hpjsrpc_sink_t        sink,
+  void                 *ctx
+) {
+
+  if (NULL == buf || NULL == buf->segment_pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  buf->sink = sink;
+  buf->sink_ctx = ctx;
+  buf->sink_flushed_in_bytes = 0;
+  buf->sink_failed = false;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_buffer_set_sink() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_buffer_flush (hpjsrpc_buffer_t *buf) {
+
+  if (NULL == buf->segment_pool || NULL == buf->sink) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (HPJSRPC_NO_ERROR != buffer_sink_until(buf, NULL)) {
+    buf->json_overflow = true;
+    return HPJSRPC_RPC_ERROR_SINK;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_buffer_flush() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_sink_fd (
+  void                 *ctx,
+  const struct iovec   *iov,
+  size_t                iov_count
+) {
+  int     fd = *(const int *) ctx;
+  size_t  ii = 0;
+  size_t  offset = 0;
+
+  for (;;) {
+    ssize_t written;
+    size_t  left;
+
+    while (ii < iov_count && offset == iov[ii].iov_len) {
+      ++ii;
+      offset = 0;
+    }
+    if (ii == iov_count) {
+      break;
+    }
+
+    /* Finish a partially written entry before going back to writev() */
+    if (0 != offset) {
+      written = write(fd, ((const uint8_t *) iov[ii].iov_base + offset),
+        (iov[ii].iov_len - offset));
+    } else {
+      written = writev(fd, &iov[ii],
+        (int) (((iov_count - ii) < IOV_MAX) ? (iov_count - ii) : IOV_MAX));
+    }
+    if (0 > written) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return HPJSRPC_RPC_ERROR_SINK;
+    }
+
+    for (left = (size_t) written; 0 < left; ) {
+      size_t rest = (iov[ii].iov_len - offset);
+      if (left < rest) {
+        offset += left;
+        break;
+      }
+      left -= rest;
+      ++ii;
+      offset = 0;
+    }
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_sink_fd() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,2591 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+#if defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+# endif
+#endif
+
+#include "hpjsrpc_server.h"
+#include "hpjsrpc_segment.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#ifndef IOV_MAX
+# define IOV_MAX    1024
+#endif
+
+#ifndef SO_BUSY_POLL
+# define SO_BUSY_POLL                     46
+#endif
+
+/* Multishot accept and receive, and provided buffer rings: Linux 5.19 */
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) \
+    && defined(__NR_io_uring_setup)
+# define SERVER_HAVE_IO_URING
+#endif
+
+#define SERVER_EPOLL_BATCH                64
+#define SERVER_BUSY_POLL_USEC             50
+/* iovec entries gathered per writev() */
+#define SERVER_WRITE_IOVECS               256
+/* Unread input discarded before closing a connection that asked for it */
+#define SERVER_LINGER_BYTES               65536
+
+typedef struct server_conn_t server_conn_t;
+typedef struct server_shard_t server_shard_t;
+typedef struct server_uring_t server_uring_t;
+
+/*
+ * A reply is head (HTTP only) followed by body, which is the response of
+ * ctx or, for a chunked reply, a chain referencing it. Canned replies have
+ * neither ctx nor body.
+ */
+typedef struct {
+  hpjsrpc_context_t              *ctx;
+  const uint8_t                  *head;
+  size_t                          head_length;
+  hpjsrpc_buffer_t               *body;
+  bool                            is_chunked;
+  size_t                          length_in_bytes;
+} server_reply_t;
+
+/* One request found in the input */
+typedef struct {
+  /* Bytes it takes in the stream */
+  size_t                          length;
+  /* NULL with no canned reply either, for a blank line to skip */
+  const uint8_t                  *body;
+  size_t                          body_length;
+  /* HTTP: sent instead of processing the request, then closing */
+  const char                     *canned;
+  size_t                          canned_length;
+  bool                            is_keep_alive;
+  bool                            is_http10;
+  /* HTTP: Deadline-Ms */
+  bool                            has_deadline;
+  uint64_t                        deadline_ms;
+} server_frame_t;
+
+/* The HTTP request head, as slices of the bytes received */
+typedef struct {
+  const uint8_t                  *method;
+  size_t                          method_length;
+  const uint8_t                  *target;
+  size_t                          target_length;
+  int                             minor_version;
+  size_t                          content_length;
+  bool                            has_content_length;
+  bool                            has_transfer_encoding;
+  bool                            is_keep_alive;
+  bool                            has_deadline;
+  uint64_t                        deadline_ms;
+} server_http_head_t;
+
+struct server_conn_t {
+  server_conn_t                  *prev;
+  server_conn_t                  *next;
+  int                             fd;
+  uint32_t                        events;
+  bool                            is_eof;
+  /* The socket took less than offered; wait for EPOLLOUT */
+  bool                            is_blocked;
+  /* Connection: close was asked for; nothing after it is processed */
+  bool                            is_last;
+  /* Loop time of the last read, when the requests read count as received */
+  uint64_t                        received_ns;
+  /*
+   * Request bytes being processed. Requests before in_start have been.
+   * Replies may reference processed requests, so bytes are only reused
+   * once the replies concerned are out.
+   *
+   * With epoll, in is the connection's own buffer. With io_uring it is the
+   * provided buffer the kernel received into, and buffer only collects
+   * requests that straddle two of those.
+   */
+  uint8_t                        *buffer;
+  uint8_t                        *in;
+  size_t                          in_start;
+  size_t                          in_length;
+  /*
+   * How far the request at in_start is known to be incomplete: the bytes
+   * holding no newline, or the offset of the first unterminated HTTP head
+   * line. frame_length is the whole HTTP request once its head is in.
+   */
+  size_t                          frame_scanned;
+  size_t                          frame_length;
+  /*
+   * Replies not yet written, oldest first, each in the context of its
+   * request. out_offset bytes of the oldest are already out. Replies are
+   * numbered as queued (queued_seq) and written (written_seq).
+   */
+  server_reply_t                 *replies;
+  size_t                          reply_head;
+  size_t                          reply_count;
+  size_t                          out_offset;
+  size_t                          out_pending_in_bytes;
+  uint64_t                        queued_seq;
+  uint64_t                        written_seq;
+#if defined(SERVER_HAVE_IO_URING)
+  /*
+   * Provided buffers held: received and waiting (held_*), being processed
+   * (current), and processed but possibly referenced by a reply that is
+   * not written yet (retired_*). The lists are linked through the ring's
+   * per-buffer next array.
+   */
+  int32_t                         held_head;
+  int32_t                         held_tail;
+  int32_t                         current;
+  int32_t                         retired_head;
+  int32_t                         retired_tail;
+  size_t                          carry_length;
+  uint64_t                        carry_release_seq;
+  unsigned                        inflight;
+  bool                            is_recv_armed;
+  bool                            is_recv_cancelled;
+  bool                            is_sending;
+  bool                            is_closing;
+  bool                            is_starved;
+  server_conn_t                  *next_starved;
+  struct msghdr                   send_msg;
+  struct iovec                   *send_iov;
+#endif
+};
+
+/*
+ * Shards are allocated one by one, so no two share a cache line; they are
+ * touched by their own thread only once running.
+ */
+struct server_shard_t {
+  hpjsrpc_server_t               *server;
+  pthread_t                       thread;
+  int                             cpu;
+  int                             epoll_fd;
+  int                             listen_fd;
+  int                             wake_fd;
+  hpjsrpc_context_pool_t         *contexts;
+  server_conn_t                  *connections;
+  size_t                          connection_count;
+  server_uring_t                 *uring;
+  /* Taken once per batch of events, see hpjsrpc_clock_ns() */
+  uint64_t                        now_ns;
+};
+
+struct hpjsrpc_server_t {
+  hpjsrpc_engine_t               *engine;
+  hpjsrpc_server_config_t         config;
+  uint16_t                        port;
+  size_t                          shard_count;
+  server_shard_t                **shards;
+  bool                            is_running;
+  bool                            is_stopping;
+};
+
+/* ------------------------------------------------------------------------- */
+
+#if defined(SERVER_HAVE_IO_URING)
+
+/*
+ * What a completion is for sits in the low bits of its user_data, next to
+ * the connection when there is one.
+ */
+#define URING_OP_ACCEPT                   1
+#define URING_OP_WAKE                     2
+#define URING_OP_RECV                     3
+#define URING_OP_SEND                     4
+#define URING_OP_CANCEL                   5
+#define URING_OP_SHARD_CANCEL             6
+#define URING_OP_MASK                     7
+
+#define URING_BUFFER_GROUP                0
+
+/*
+ * A ring per shard, used by the shard thread only. It is created disabled
+ * and enabled by that thread, which makes it the only submitter.
+ */
+struct server_uring_t {
+  int                             fd;
+  void                           *rings;
+  size_t                          rings_size;
+  struct io_uring_sqe            *sqes;
+  size_t                          sqes_size;
+  unsigned                       *sq_head;
+  unsigned                       *sq_tail;
+  unsigned                        sq_mask;
+  unsigned                        sq_entries;
+  /* Prepared but not yet published to the kernel */
+  unsigned                        sq_local_tail;
+  unsigned                        sq_submitted;
+  unsigned                       *cq_head;
+  unsigned                       *cq_tail;
+  unsigned                        cq_mask;
+  struct io_uring_cqe            *cqes;
+  /* Receive buffers, and the ring they are provided to the kernel in */
+  struct io_uring_buf_ring       *buf_ring;
+  size_t                          buf_ring_size;
+  uint16_t                        buf_ring_tail;
+  unsigned                        buffer_count;
+  size_t                          buffer_size;
+  uint8_t                        *buffers;
+  size_t                          buffers_size;
+  /* Per buffer while a connection holds it, see server_conn_t */
+  int32_t                        *buf_next;
+  uint32_t                       *buf_length;
+  uint64_t                       *buf_release_seq;
+  /* Received into and not provided again yet */
+  unsigned                        buffers_taken;
+  /* Connections whose receive ran out of buffers */
+  server_conn_t                  *starved;
+  bool                            is_accept_armed;
+  bool                            is_wake_armed;
+};
+
+/* ------------------------------------------------------------------------- */
+
+static void
+uring_destroy (server_uring_t *ring) {
+
+  if (0 <= ring->fd) {
+    close(ring->fd);
+  }
+  if (NULL != ring->rings) {
+    munmap(ring->rings, ring->rings_size);
+  }
+  if (NULL != ring->sqes) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (NULL != ring->buf_ring) {
+    munmap(ring->buf_ring, ring->buf_ring_size);
+  }
+  if (NULL != ring->buffers) {
+    munmap(ring->buffers, ring->buffers_size);
+  }
+  hpjsrpc_free(ring->buf_next);
+  hpjsrpc_free(ring->buf_length);
+  hpjsrpc_free(ring->buf_release_seq);
+  hpjsrpc_free(ring);
+
+} /* uring_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Provides a receive buffer to the kernel (again) */
+static inline void
+uring_buffer_return (
+  server_uring_t       *ring,
+  int32_t               bid
+) {
+  struct io_uring_buf *buf =
+    &ring->buf_ring->bufs[ring->buf_ring_tail & (ring->buffer_count - 1)];
+
+  buf->addr = (uint64_t) (uintptr_t) &ring->buffers[
+    (size_t) bid * ring->buffer_size];
+  buf->len = (uint32_t) ring->buffer_size;
+  buf->bid = (uint16_t) bid;
+  ring->buffers_taken--;
+  ring->buf_ring_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_ring_tail,
+    __ATOMIC_RELEASE);
+
+} /* uring_buffer_return() */
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+uring_map (size_t size) {
+  void *ptr = mmap(NULL, size, (PROT_READ | PROT_WRITE),
+    (MAP_PRIVATE | MAP_ANONYMOUS), -1, 0);
+  return (MAP_FAILED == ptr) ? NULL : ptr;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+uring_new (
+  server_uring_t                     **pptr,
+  const hpjsrpc_server_config_t       *config
+) {
+  server_uring_t          *ring;
+  struct io_uring_params   params;
+  struct io_uring_buf_reg  reg;
+  size_t                   sq_size;
+  size_t                   cq_size;
+  void                    *ptr;
+
+  if (0 == config->uring_buffer_count || 32768 < config->uring_buffer_count
+      || 0 != (config->uring_buffer_count & (config->uring_buffer_count - 1))
+      || UINT32_MAX < config->uring_buffer_size_in_bytes) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  ring = hpjsrpc_calloc(1, sizeof(*ring));
+  if (NULL == ring) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_R_DISABLED;
+#if defined(IORING_SETUP_DEFER_TASKRUN)
+  /* Completion work then runs when the shard asks for completions */
+  params.flags |= (IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+#endif
+  ring->fd = (int) syscall(__NR_io_uring_setup, config->uring_entries,
+    &params);
+  if (0 > ring->fd && EINVAL == errno) {
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_R_DISABLED;
+    ring->fd = (int) syscall(__NR_io_uring_setup, config->uring_entries,
+      &params);
+  }
+  if (0 > ring->fd || 0 == (params.features & IORING_FEAT_SINGLE_MMAP)) {
+    goto L_error;
+  }
+
+  sq_size = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+  cq_size = params.cq_off.cqes
+    + (params.cq_entries * sizeof(struct io_uring_cqe));
+  ring->rings_size = (sq_size > cq_size) ? sq_size : cq_size;
+  ptr = mmap(NULL, ring->rings_size, (PROT_READ | PROT_WRITE),
+    (MAP_SHARED | MAP_POPULATE), ring->fd, IORING_OFF_SQ_RING);
+  if (MAP_FAILED == ptr) {
+    goto L_error;
+  }
+  ring->rings = ptr;
+
+  ring->sqes_size = (params.sq_entries * sizeof(struct io_uring_sqe));
+  ptr = mmap(NULL, ring->sqes_size, (PROT_READ | PROT_WRITE),
+    (MAP_SHARED | MAP_POPULATE), ring->fd, IORING_OFF_SQES);
+  if (MAP_FAILED == ptr) {
+    goto L_error;
+  }
+  ring->sqes = ptr;
+
+  ring->sq_head = (unsigned *) ((uint8_t *) ring->rings + params.sq_off.head);
+  ring->sq_tail = (unsigned *) ((uint8_t *) ring->rings + params.sq_off.tail);
+  ring->sq_mask =
+    *(unsigned *) ((uint8_t *) ring->rings + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_local_tail = ring->sq_submitted = *ring->sq_tail;
+  ring->cq_head = (unsigned *) ((uint8_t *) ring->rings + params.cq_off.head);
+  ring->cq_tail = (unsigned *) ((uint8_t *) ring->rings + params.cq_off.tail);
+  ring->cq_mask =
+    *(unsigned *) ((uint8_t *) ring->rings + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)
+    ((uint8_t *) ring->rings + params.cq_off.cqes);
+
+  /* Submission queue entries are used in order, so the array is fixed */
+  {
+    unsigned *array =
+      (unsigned *) ((uint8_t *) ring->rings + params.sq_off.array);
+    for (unsigned ii = 0; ii < params.sq_entries; ++ii) {
+      array[ii] = ii;
+    }
+  }
+
+  ring->buffer_count = config->uring_buffer_count;
+  ring->buffer_size = config->uring_buffer_size_in_bytes;
+  ring->buf_ring_size = (ring->buffer_count * sizeof(struct io_uring_buf));
+  ring->buffers_size = (ring->buffer_count * ring->buffer_size);
+  ring->buf_ring = uring_map(ring->buf_ring_size);
+  ring->buffers = uring_map(ring->buffers_size);
+  ring->buf_next = hpjsrpc_calloc(ring->buffer_count,
+    sizeof(*ring->buf_next));
+  ring->buf_length = hpjsrpc_calloc(ring->buffer_count,
+    sizeof(*ring->buf_length));
+  ring->buf_release_seq = hpjsrpc_calloc(ring->buffer_count,
+    sizeof(*ring->buf_release_seq));
+  if (NULL == ring->buf_ring || NULL == ring->buffers
+      || NULL == ring->buf_next || NULL == ring->buf_length
+      || NULL == ring->buf_release_seq) {
+    goto L_error;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+  reg.ring_entries = ring->buffer_count;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (0 != syscall(__NR_io_uring_register, ring->fd,
+      IORING_REGISTER_PBUF_RING, &reg, 1)) {
+    goto L_error;
+  }
+  ring->buffers_taken = ring->buffer_count;
+  for (unsigned ii = 0; ii < ring->buffer_count; ++ii) {
+    uring_buffer_return(ring, (int32_t) ii);
+  }
+
+  *pptr = ring;
+
+  return HPJSRPC_NO_ERROR;
+
+L_error:
+  uring_destroy(ring);
+  return HPJSRPC_ASSERTION_ERROR;
+
+} /* uring_new() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Submits what was prepared and collects completions, waiting for at least
+ * wait_count of them.
+ */
+static void
+uring_enter (
+  server_uring_t       *ring,
+  unsigned              wait_count
+) {
+  unsigned to_submit = (ring->sq_local_tail - ring->sq_submitted);
+  long     rc;
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+  do {
+    rc = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_count,
+      IORING_ENTER_GETEVENTS, NULL, 0);
+  } while (0 > rc && EINTR == errno);
+
+  if (0 < rc) {
+    ring->sq_submitted += (unsigned) rc;
+  }
+
+} /* uring_enter() */
+
+/* ------------------------------------------------------------------------- */
+
+static struct io_uring_sqe *
+uring_sqe (
+  server_uring_t       *ring,
+  uint8_t               opcode,
+  int                   fd,
+  void                 *ptr,
+  uintptr_t             op
+) {
+  struct io_uring_sqe *sqe;
+
+  /* Full: hand the kernel what there is before preparing more */
+  while (ring->sq_local_tail - __atomic_load_n(ring->sq_head,
+      __ATOMIC_ACQUIRE) == ring->sq_entries) {
+    uring_enter(ring, 0);
+  }
+
+  sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+  ring->sq_local_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = ((uint64_t) (uintptr_t) ptr | op);
+
+  return sqe;
+
+} /* uring_sqe() */
+
+#endif /* SERVER_HAVE_IO_URING */
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+shard_listen (
+  server_shard_t               *shard,
+  const struct sockaddr        *addr,
+  socklen_t                     addr_length
+) {
+  struct epoll_event ev;
+  int                one = 1;
+
+  shard->listen_fd = socket(addr->sa_family,
+    (SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC), 0);
+  if (0 > shard->listen_fd) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  setsockopt(shard->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (0 != setsockopt(shard->listen_fd, SOL_SOCKET, SO_REUSEPORT, &one,
+      sizeof(one))
+      || 0 != bind(shard->listen_fd, addr, addr_length)
+      || 0 != listen(shard->listen_fd, SOMAXCONN)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (HPJSRPC_SERVER_IO_URING == shard->server->config.backend) {
+    /* io_uring waits for connections itself, and would not on O_NONBLOCK */
+    return (0 == fcntl(shard->listen_fd, F_SETFL, 0))
+      ? HPJSRPC_NO_ERROR : HPJSRPC_ASSERTION_ERROR;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &shard->listen_fd;
+  if (0 != epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->listen_fd, &ev)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* shard_listen() */
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+shard_new (
+  hpjsrpc_server_t             *server,
+  server_shard_t              **pptr
+) {
+  server_shard_t     *shard;
+  struct epoll_event  ev;
+
+  shard = hpjsrpc_calloc(1, sizeof(*shard));
+  if (NULL == shard) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  shard->server = server;
+  shard->cpu = -1;
+  shard->listen_fd = -1;
+  shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  shard->wake_fd = eventfd(0, (EFD_NONBLOCK | EFD_CLOEXEC));
+  *pptr = shard;
+
+  if (0 > shard->epoll_fd || 0 > shard->wake_fd) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &shard->wake_fd;
+  if (0 != epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->wake_fd, &ev)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  return hpjsrpc_context_pool_new(&shard->contexts, server->engine,
+    &server->config.context);
+
+} /* shard_new() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+shard_destroy (server_shard_t *shard) {
+
+  if (NULL != shard->contexts) {
+    hpjsrpc_context_pool_destroy(shard->contexts);
+  }
+  if (0 <= shard->listen_fd) {
+    close(shard->listen_fd);
+  }
+  if (0 <= shard->wake_fd) {
+    close(shard->wake_fd);
+  }
+  if (0 <= shard->epoll_fd) {
+    close(shard->epoll_fd);
+  }
+  hpjsrpc_free(shard);
+
+} /* shard_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_server_new (
+  hpjsrpc_server_t                     **pptr,
+  hpjsrpc_engine_t                      *engine,
+  const hpjsrpc_server_config_t         *config
+) {
+  hpjsrpc_server_t         *server;
+  struct addrinfo           hints;
+  struct addrinfo          *ai = NULL;
+  struct sockaddr_storage   addr;
+  socklen_t                 addr_length;
+  cpu_set_t                 cpus;
+  char                      port[8];
+  int                       cpu = 0;
+
+  if (NULL == pptr || NULL == engine || NULL == config
+      || 0 == config->read_buffer_size_in_bytes) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  server = hpjsrpc_calloc(1, sizeof(*server));
+  if (NULL == server) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  server->engine = engine;
+  server->config = *config;
+  server->config.address = NULL;
+  if (0 == server->config.max_pipeline) {
+    server->config.max_pipeline = HPJSRPC_SERVER_DEFAULT_PIPELINE;
+  }
+  if (0 == server->config.uring_entries) {
+    server->config.uring_entries = HPJSRPC_SERVER_DEFAULT_URING_ENTRIES;
+  }
+  if (0 == server->config.uring_buffer_count) {
+    server->config.uring_buffer_count = HPJSRPC_SERVER_DEFAULT_URING_BUFFERS;
+  }
+  if (0 == server->config.uring_buffer_size_in_bytes) {
+    server->config.uring_buffer_size_in_bytes =
+      HPJSRPC_SERVER_DEFAULT_URING_BUFFER_SIZE;
+  }
+
+  if (HPJSRPC_SERVER_IO_URING == config->backend) {
+#if defined(SERVER_HAVE_IO_URING)
+    server_uring_t *probe;
+
+    /* Fail here rather than on start if the kernel is too old */
+    if (HPJSRPC_NO_ERROR != uring_new(&probe, &server->config)) {
+      goto L_error;
+    }
+    uring_destroy(probe);
+#else
+    goto L_error;
+#endif
+  }
+
+  CPU_ZERO(&cpus);
+  if (0 != sched_getaffinity(0, sizeof(cpus), &cpus)) {
+    CPU_SET(0, &cpus);
+  }
+  server->shard_count = config->shard_count;
+  if (0 == server->shard_count) {
+    server->shard_count = (size_t) CPU_COUNT(&cpus);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = (AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV);
+  snprintf(port, sizeof(port), "%u", (unsigned) config->port);
+  if (0 != getaddrinfo(config->address, port, &hints, &ai)
+      || sizeof(addr) < ai->ai_addrlen) {
+    goto L_error;
+  }
+  memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+  addr_length = ai->ai_addrlen;
+
+  server->shards = hpjsrpc_calloc(server->shard_count,
+    sizeof(*server->shards));
+  if (NULL == server->shards) {
+    goto L_error;
+  }
+
+  for (size_t ii = 0; ii < server->shard_count; ++ii) {
+    server_shard_t *shard;
+
+    if (HPJSRPC_NO_ERROR != shard_new(server, &server->shards[ii])) {
+      goto L_error;
+    }
+    shard = server->shards[ii];
+
+    if (config->pin_shards) {
+      while (!CPU_ISSET(cpu, &cpus)) {
+        cpu = ((cpu + 1) % CPU_SETSIZE);
+      }
+      shard->cpu = cpu;
+      cpu = ((cpu + 1) % CPU_SETSIZE);
+    }
+
+    if (HPJSRPC_NO_ERROR != shard_listen(shard,
+        (const struct sockaddr *) &addr, addr_length)) {
+      goto L_error;
+    }
+
+    /* The other shards join the port the first one was given */
+    if (0 == ii) {
+      addr_length = sizeof(addr);
+      if (0 != getsockname(shard->listen_fd, (struct sockaddr *) &addr,
+          &addr_length)) {
+        goto L_error;
+      }
+      server->port = ntohs((AF_INET6 == addr.ss_family)
+        ? ((struct sockaddr_in6 *) &addr)->sin6_port
+        : ((struct sockaddr_in *) &addr)->sin_port);
+    }
+  }
+
+  freeaddrinfo(ai);
+  *pptr = server;
+
+  return HPJSRPC_NO_ERROR;
+
+L_error:
+  if (NULL != ai) {
+    freeaddrinfo(ai);
+  }
+  hpjsrpc_server_destroy(server);
+  return HPJSRPC_ASSERTION_ERROR;
+
+} /* hpjsrpc_server_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_server_destroy (hpjsrpc_server_t *server) {
+
+  if (NULL == server) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  hpjsrpc_server_stop(server);
+
+  if (NULL != server->shards) {
+    for (size_t ii = 0; ii < server->shard_count; ++ii) {
+      if (NULL != server->shards[ii]) {
+        shard_destroy(server->shards[ii]);
+      }
+    }
+    hpjsrpc_free(server->shards);
+  }
+  hpjsrpc_free(server);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_server_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+uint16_t
+hpjsrpc_server_port (const hpjsrpc_server_t *server) {
+  return server->port;
+}
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_server_shard_count (const hpjsrpc_server_t *server) {
+  return server->shard_count;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void
+server_reply_free (server_reply_t *reply) {
+
+  if (reply->is_chunked) {
+    hpjsrpc_buffer_release(reply->body);
+  }
+  if (NULL != reply->ctx) {
+    hpjsrpc_context_recycle(reply->ctx);
+  }
+
+} /* server_reply_free() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+conn_free (
+  server_shard_t       *shard,
+  server_conn_t        *conn
+) {
+  if (NULL != conn->prev) {
+    conn->prev->next = conn->next;
+  } else {
+    shard->connections = conn->next;
+  }
+  if (NULL != conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  shard->connection_count--;
+
+  if (conn->is_last) {
+    /*
+     * Closing with input unread resets the connection, which may take the
+     * last reply with it; read off what has arrived first.
+     */
+    uint8_t discard[4096];
+    size_t  budget = SERVER_LINGER_BYTES;
+
+    shutdown(conn->fd, SHUT_WR);
+    while (0 < budget) {
+      ssize_t got = recv(conn->fd, discard, sizeof(discard), MSG_DONTWAIT);
+      if (0 >= got) {
+        break;
+      }
+      budget -= ((size_t) got < budget) ? (size_t) got : budget;
+    }
+  }
+  close(conn->fd);
+  while (0 < conn->reply_count) {
+    server_reply_free(&conn->replies[conn->reply_head]);
+    conn->reply_head = ((conn->reply_head + 1)
+      % shard->server->config.max_pipeline);
+    conn->reply_count--;
+  }
+#if defined(SERVER_HAVE_IO_URING)
+  hpjsrpc_free(conn->send_iov);
+#endif
+  hpjsrpc_free(conn->replies);
+  hpjsrpc_free(conn->buffer);
+  hpjsrpc_free(conn);
+
+} /* conn_free() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Sets up a connection for an accepted socket; NULL if it was refused */
+static server_conn_t *
+shard_add_conn (
+  server_shard_t       *shard,
+  int                   fd
+) {
+  const hpjsrpc_server_config_t *config = &shard->server->config;
+  server_conn_t                 *conn;
+  int                            one = 1;
+  int                            busy_poll_usec = SERVER_BUSY_POLL_USEC;
+
+  if (0 < config->max_connections
+      && shard->connection_count >= config->max_connections) {
+    close(fd);
+    return NULL;
+  }
+
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (config->busy_poll) {
+    /* Needs CAP_NET_ADMIN beyond net.core.busy_read; best effort */
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usec,
+      sizeof(busy_poll_usec));
+  }
+
+  conn = hpjsrpc_calloc(1, sizeof(*conn));
+  if (NULL == conn) {
+    close(fd);
+    return NULL;
+  }
+  conn->fd = fd;
+  conn->buffer = hpjsrpc_malloc(config->read_buffer_size_in_bytes);
+  conn->in = conn->buffer;
+  conn->replies = hpjsrpc_calloc(config->max_pipeline,
+    sizeof(*conn->replies));
+#if defined(SERVER_HAVE_IO_URING)
+  conn->held_head = conn->held_tail = -1;
+  conn->retired_head = conn->retired_tail = -1;
+  conn->current = -1;
+  if (NULL != shard->uring) {
+    conn->in = NULL;
+    conn->send_iov = hpjsrpc_calloc(SERVER_WRITE_IOVECS,
+      sizeof(*conn->send_iov));
+    if (NULL == conn->send_iov) {
+      hpjsrpc_free(conn->replies);
+      conn->replies = NULL;
+    }
+  }
+#endif
+  if (NULL == conn->buffer || NULL == conn->replies) {
+    hpjsrpc_free(conn->replies);
+    hpjsrpc_free(conn->buffer);
+    hpjsrpc_free(conn);
+    close(fd);
+    return NULL;
+  }
+
+  conn->next = shard->connections;
+  if (NULL != conn->next) {
+    conn->next->prev = conn;
+  }
+  shard->connections = conn;
+  shard->connection_count++;
+
+  return conn;
+
+} /* shard_add_conn() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Consumes the wake event, which would otherwise outlive a stop() */
+static void
+shard_drain_wake (server_shard_t *shard) {
+  uint64_t count;
+
+  if (sizeof(count) != read(shard->wake_fd, &count, sizeof(count))) {
+    /* Nothing was pending */
+  }
+
+} /* shard_drain_wake() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Offset of the first newline in bytes, or len if there is none */
+static inline size_t
+server_find_newline (
+  const uint8_t        *bytes,
+  size_t                len
+) {
+  size_t ii = 0;
+
+#if defined(__AVX2__)
+  const __m256i newline32 = _mm256_set1_epi8('\n');
+
+  for (; (ii + 32) <= len; ii += 32) {
+    __m256i  v = _mm256_loadu_si256((const __m256i *) &bytes[ii]);
+    uint32_t mask = (uint32_t) _mm256_movemask_epi8(
+      _mm256_cmpeq_epi8(v, newline32));
+    if (0 != mask) {
+      return (ii + (size_t) __builtin_ctz(mask));
+    }
+  }
+#endif
+
+#if defined(__SSE2__)
+  const __m128i newline16 = _mm_set1_epi8('\n');
+
+  for (; (ii + 16) <= len; ii += 16) {
+    __m128i  v = _mm_loadu_si128((const __m128i *) &bytes[ii]);
+    uint32_t mask = (uint32_t) _mm_movemask_epi8(
+      _mm_cmpeq_epi8(v, newline16));
+    if (0 != mask) {
+      return (ii + (size_t) __builtin_ctz(mask));
+    }
+  }
+#endif
+
+  while (ii < len && '\n' != bytes[ii]) {
+    ++ii;
+  }
+
+  return ii;
+
+} /* server_find_newline() */
+
+
+/* ------------------------------------------------------------------------- */
+
+static inline bool
+conn_is_backlogged (
+  const hpjsrpc_server_config_t   *config,
+  const server_conn_t             *conn
+) {
+  return (conn->reply_count == config->max_pipeline)
+    || (0 < config->max_output_in_bytes
+      && conn->out_pending_in_bytes >= config->max_output_in_bytes);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Fills iov with the unwritten reply bytes, oldest first */
+static size_t
+conn_gather (
+  server_shard_t       *shard,
+  server_conn_t        *conn,
+  struct iovec         *iov,
+  size_t               *offered
+) {
+  size_t max_pipeline = shard->server->config.max_pipeline;
+  size_t iov_count = 0;
+  size_t offset = conn->out_offset;
+
+  *offered = 0;
+  for (size_t ii = 0; ii < conn->reply_count
+      && SERVER_WRITE_IOVECS > iov_count; ++ii) {
+    server_reply_t *reply =
+      &conn->replies[(conn->reply_head + ii) % max_pipeline];
+    size_t          filled = 0;
+
+    if (offset < reply->head_length) {
+      iov[iov_count].iov_base = (void *) &reply->head[offset];
+      iov[iov_count].iov_len = (reply->head_length - offset);
+      filled = 1;
+      offset = 0;
+    } else {
+      offset -= reply->head_length;
+    }
+    if (NULL != reply->body && SERVER_WRITE_IOVECS > iov_count + filled) {
+      filled += hpjsrpc_buffer_iovec_at(reply->body, offset,
+        &iov[iov_count + filled], (SERVER_WRITE_IOVECS - iov_count - filled));
+    }
+
+    for (size_t jj = 0; jj < filled; ++jj) {
+      *offered += iov[iov_count + jj].iov_len;
+    }
+    iov_count += filled;
+    offset = 0;
+  }
+
+  return iov_count;
+
+} /* conn_gather() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Accounts for written bytes, recycling the replies that are out */
+static void
+conn_retire (
+  server_shard_t       *shard,
+  server_conn_t        *conn,
+  size_t                written
+) {
+  size_t max_pipeline = shard->server->config.max_pipeline;
+
+  conn->out_pending_in_bytes -= written;
+  written += conn->out_offset;
+  while (0 < conn->reply_count) {
+    server_reply_t *reply = &conn->replies[conn->reply_head];
+    if (written < reply->length_in_bytes) {
+      break;
+    }
+    written -= reply->length_in_bytes;
+    server_reply_free(reply);
+    conn->reply_head = ((conn->reply_head + 1) % max_pipeline);
+    conn->reply_count--;
+    conn->written_seq++;
+  }
+  conn->out_offset = written;
+
+} /* conn_retire() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Replies sent instead of processing a request; the connection then closes */
+static const char server_http_400[] = "HTTP/1.1 400 Bad Request\r\n"
+  "Content-Length: 0\r\nConnection: close\r\n\r\n";
+static const char server_http_404[] = "HTTP/1.1 404 Not Found\r\n"
+  "Content-Length: 0\r\nConnection: close\r\n\r\n";
+static const char server_http_405[] = "HTTP/1.1 405 Method Not Allowed\r\n"
+  "Allow: POST\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char server_http_411[] = "HTTP/1.1 411 Length Required\r\n"
+  "Content-Length: 0\r\nConnection: close\r\n\r\n";
+static const char server_http_413[] = "HTTP/1.1 413 Payload Too Large\r\n"
+  "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+/* Longest reply head rendered */
+#define SERVER_HTTP_HEAD_MAX              160
+
+#define SERVER_PUT(p, literal) \
+  (memcpy((p), (literal), (sizeof(literal) - 1)), (p) + sizeof(literal) - 1)
+
+/* ------------------------------------------------------------------------- */
+
+static uint8_t *
+server_put_number (
+  uint8_t              *p,
+  size_t                value,
+  unsigned              base
+) {
+  uint8_t digits[24];
+  size_t  count = 0;
+
+  do {
+    digits[count++] = (uint8_t) "0123456789abcdef"[value % base];
+    value /= base;
+  } while (0 != value);
+
+  while (0 < count) {
+    *p++ = digits[--count];
+  }
+
+  return p;
+
+} /* server_put_number() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Case-insensitive comparison with a lower-case name or token */
+static bool
+server_http_is (
+  const uint8_t        *bytes,
+  size_t                len,
+  const char           *lower
+) {
+  size_t ii;
+
+  for (ii = 0; ii < len && '\0' != lower[ii]; ++ii) {
+    uint8_t c = bytes[ii];
+    if ('A' <= c && 'Z' >= c) {
+      c = (uint8_t) (c + ('a' - 'A'));
+    }
+    if (c != (uint8_t) lower[ii]) {
+      return false;
+    }
+  }
+
+  return (ii == len && '\0' == lower[ii]);
+
+} /* server_http_is() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Trims optional white space off both ends of a header value */
+static void
+server_http_trim (
+  const uint8_t       **bytes,
+  size_t               *len
+) {
+  while (0 < *len && (' ' == **bytes || '\t' == **bytes)) {
+    (*bytes)++;
+    (*len)--;
+  }
+  while (0 < *len && (' ' == (*bytes)[*len - 1]
+      || '\t' == (*bytes)[*len - 1])) {
+    (*len)--;
+  }
+
+} /* server_http_trim() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Parses a complete request head, blank line included, into slices of it.
+ * Returns -1 if it is malformed.
+ */
+static int
+server_http_parse_head (
+  const uint8_t                *bytes,
+  size_t                        len,
+  server_http_head_t           *head
+) {
+  const uint8_t *line = bytes;
+  const uint8_t *end = &bytes[len];
+  const uint8_t *space;
+  size_t         line_length;
+  bool           has_close = false;
+  bool           has_keep_alive = false;
+
+  memset(head, 0, sizeof(*head));
+
+  /* Request line: method SP target SP HTTP/1.x */
+  line_length = server_find_newline(line, (size_t) (end - line));
+  if (0 < line_length && '\r' == line[line_length - 1]) {
+    line_length--;
+  }
+  space = memchr(line, ' ', line_length);
+  if (NULL == space || space == line) {
+    return -1;
+  }
+  head->method = line;
+  head->method_length = (size_t) (space - line);
+  head->target = (space + 1);
+  space = memchr(head->target, ' ',
+    (line_length - head->method_length - 1));
+  if (NULL == space || space == head->target
+      || (sizeof("HTTP/1.x") - 1) != (size_t) (&line[line_length] - space - 1)
+      || 0 != memcmp((space + 1), "HTTP/1.", (sizeof("HTTP/1.") - 1))
+      || ('0' != space[8] && '1' != space[8])) {
+    return -1;
+  }
+  head->target_length = (size_t) (space - head->target);
+  head->minor_version = (space[8] - '0');
+  line += server_find_newline(line, (size_t) (end - line)) + 1;
+
+  /* Header fields, up to the blank line */
+  for (;;) {
+    const uint8_t *colon;
+    const uint8_t *value;
+    size_t         value_length;
+
+    line_length = server_find_newline(line, (size_t) (end - line));
+    if (0 < line_length && '\r' == line[line_length - 1]) {
+      line_length--;
+    }
+    if (0 == line_length) {
+      break;
+    }
+
+    colon = memchr(line, ':', line_length);
+    if (NULL == colon || colon == line) {
+      return -1;
+    }
+    value = (colon + 1);
+    value_length = (size_t) (&line[line_length] - value);
+    server_http_trim(&value, &value_length);
+
+    if (server_http_is(line, (size_t) (colon - line), "content-length")) {
+      size_t content_length = 0;
+
+      if (0 == value_length) {
+        return -1;
+      }
+      for (size_t ii = 0; ii < value_length; ++ii) {
+        if ('0' > value[ii] || '9' < value[ii]
+            || (SIZE_MAX - 9) / 10 < content_length) {
+          return -1;
+        }
+        content_length = (content_length * 10) + (size_t) (value[ii] - '0');
+      }
+      if (head->has_content_length && content_length != head->content_length) {
+        return -1;
+      }
+      head->content_length = content_length;
+      head->has_content_length = true;
+    } else if (server_http_is(line, (size_t) (colon - line),
+        "deadline-ms")) {
+      uint64_t deadline_ms = 0;
+      size_t   ii;
+
+      /* Ignored unless a sane number of milliseconds, like "deadline_ms" */
+      for (ii = 0; ii < value_length && 12 > ii
+          && '0' <= value[ii] && '9' >= value[ii]; ++ii) {
+        deadline_ms = (deadline_ms * 10) + (uint64_t) (value[ii] - '0');
+      }
+      if (0 < ii && ii == value_length) {
+        head->deadline_ms = deadline_ms;
+        head->has_deadline = true;
+      }
+    } else if (server_http_is(line, (size_t) (colon - line),
+        "transfer-encoding")) {
+      head->has_transfer_encoding = true;
+    } else if (server_http_is(line, (size_t) (colon - line), "connection")) {
+      while (0 < value_length) {
+        const uint8_t *comma = memchr(value, ',', value_length);
+        const uint8_t *token = value;
+        size_t         token_length = (NULL != comma)
+          ? (size_t) (comma - value) : value_length;
+
+        value += token_length;
+        value_length -= token_length;
+        if (0 < value_length) {
+          value++;
+          value_length--;
+        }
+        server_http_trim(&token, &token_length);
+        has_close |= server_http_is(token, token_length, "close");
+        has_keep_alive |= server_http_is(token, token_length, "keep-alive");
+      }
+    }
+
+    line += server_find_newline(line, (size_t) (end - line)) + 1;
+  }
+
+  head->is_keep_alive = !has_close
+    && (1 == head->minor_version || has_keep_alive);
+
+  return 0;
+
+} /* server_http_parse_head() */
+
+/* ------------------------------------------------------------------------- */
+
+static inline int
+server_frame_canned (
+  server_frame_t       *frame,
+  const char           *canned,
+  size_t                canned_length,
+  size_t                length
+) {
+  memset(frame, 0, sizeof(*frame));
+  frame->length = length;
+  frame->canned = canned;
+  frame->canned_length = canned_length;
+  return 1;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Finds the request at the start of bytes. Returns 1 and fills frame if it
+ * is complete, 0 if more bytes are needed; conn keeps track of how far it
+ * got, so bytes already looked at are not scanned again.
+ */
+static int
+conn_frame_line (
+  server_conn_t        *conn,
+  const uint8_t        *bytes,
+  size_t                len,
+  server_frame_t       *frame
+) {
+  size_t newline = conn->frame_scanned + server_find_newline(
+    &bytes[conn->frame_scanned], (len - conn->frame_scanned));
+
+  if (newline == len) {
+    /* Once the peer has shut down, an unterminated last line still counts */
+    if (!conn->is_eof || 0 == len) {
+      conn->frame_scanned = len;
+      return 0;
+    }
+  }
+  conn->frame_scanned = 0;
+
+  memset(frame, 0, sizeof(*frame));
+  frame->length = (newline < len) ? (newline + 1) : len;
+  frame->body_length = newline;
+  if (0 < newline && '\r' == bytes[newline - 1]) {
+    frame->body_length--;
+  }
+  frame->body = (0 < frame->body_length) ? bytes : NULL;
+  frame->is_keep_alive = true;
+
+  return 1;
+
+} /* conn_frame_line() */
+
+/* ------------------------------------------------------------------------- */
+
+static int
+conn_frame_http (
+  server_shard_t       *shard,
+  server_conn_t        *conn,
+  const uint8_t        *bytes,
+  size_t                len,
+  server_frame_t       *frame
+) {
+  const hpjsrpc_server_config_t *config = &shard->server->config;
+  server_http_head_t             head;
+  size_t                         pos = conn->frame_scanned;
+  size_t                         head_length;
+
+  /* The head is in, the body not yet */
+  if (len < conn->frame_length) {
+    return 0;
+  }
+
+  for (;;) {
+    size_t start = pos;
+    size_t newline = pos + server_find_newline(&bytes[pos], (len - pos));
+
+    if (newline == len) {
+      conn->frame_scanned = pos;
+      return 0;
+    }
+    pos = (newline + 1);
+    if (newline == start || (newline == start + 1 && '\r' == bytes[start])) {
+      if (0 == start) {
+        /* A blank line between requests, which is to be ignored */
+        conn->frame_scanned = 0;
+        memset(frame, 0, sizeof(*frame));
+        frame->length = pos;
+        frame->is_keep_alive = true;
+        return 1;
+      }
+      break;
+    }
+  }
+  head_length = pos;
+
+  if (0 != server_http_parse_head(bytes, head_length, &head)) {
+    return server_frame_canned(frame, server_http_400,
+      (sizeof(server_http_400) - 1), len);
+  }
+  if (head.has_transfer_encoding) {
+    return server_frame_canned(frame, server_http_411,
+      (sizeof(server_http_411) - 1), len);
+  }
+  if (config->read_buffer_size_in_bytes - head_length < head.content_length
+      || config->read_buffer_size_in_bytes < head_length) {
+    return server_frame_canned(frame, server_http_413,
+      (sizeof(server_http_413) - 1), len);
+  }
+  if (4 != head.method_length || 0 != memcmp(head.method, "POST", 4)) {
+    return server_frame_canned(frame, server_http_405,
+      (sizeof(server_http_405) - 1), len);
+  }
+  if (NULL != config->http_path) {
+    const uint8_t *query = memchr(head.target, '?', head.target_length);
+    size_t         path_length = (NULL != query)
+      ? (size_t) (query - head.target) : head.target_length;
+
+    if (path_length != strlen(config->http_path)
+        || 0 != memcmp(head.target, config->http_path, path_length)) {
+      return server_frame_canned(frame, server_http_404,
+        (sizeof(server_http_404) - 1), len);
+    }
+  }
+
+  if (len - head_length < head.content_length) {
+    /* Parsed again once the body is in; heads are short */
+    conn->frame_scanned = 0;
+    conn->frame_length = (head_length + head.content_length);
+    return 0;
+  }
+  conn->frame_scanned = 0;
+  conn->frame_length = 0;
+
+  memset(frame, 0, sizeof(*frame));
+  frame->length = (head_length + head.content_length);
+  frame->body = &bytes[head_length];
+  frame->body_length = head.content_length;
+  frame->is_keep_alive = head.is_keep_alive;
+  frame->is_http10 = (0 == head.minor_version);
+  frame->has_deadline = head.has_deadline;
+  frame->deadline_ms = head.deadline_ms;
+
+  return 1;
+
+} /* conn_frame_http() */
+
+/* ------------------------------------------------------------------------- */
+
+static inline int
+conn_frame (
+  server_shard_t       *shard,
+  server_conn_t        *conn,
+  const uint8_t        *bytes,
+  size_t                len,
+  server_frame_t       *frame
+) {
+  if (HPJSRPC_SERVER_HTTP == shard->server->config.protocol) {
+    return conn_frame_http(shard, conn, bytes, len, frame);
+  }
+  return conn_frame_line(conn, bytes, len, frame);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Chunked copy of body: a chunk per segment, the chunk framing in the
+ * chain's own segments and the payload referenced. NULL if it cannot be.
+ */
+static hpjsrpc_buffer_t *
+server_http_chunk (
+  hpjsrpc_request_t            *req,
+  const hpjsrpc_buffer_t       *body
+) {
+  hpjsrpc_buffer_t *chunked;
+  size_t            length = hpjsrpc_buffer_length(body);
+  size_t            offset = 0;
+  HPJSRPC_RETURN    rc = HPJSRPC_NO_ERROR;
+
+  if (NULL == body->segment_pool) {
+    return NULL;
+  }
+  chunked = hpjsrpc_request_alloc(req, sizeof(*chunked), 0);
+  if (NULL == chunked) {
+    return NULL;
+  }
+  memset(chunked, 0, sizeof(*chunked));
+  if (HPJSRPC_NO_ERROR != hpjsrpc_buffer_init_chained(chunked,
+      body->segment_pool)) {
+    return NULL;
+  }
+
+  while (offset < length && HPJSRPC_NO_ERROR == rc) {
+    struct iovec iov[16];
+    size_t       filled = hpjsrpc_buffer_iovec_at(body, offset, iov, 16);
+
+    if (0 == filled) {
+      break;
+    }
+    for (size_t ii = 0; ii < filled && HPJSRPC_NO_ERROR == rc; ++ii) {
+      uint8_t  line[32];
+      uint8_t *p = line;
+
+      if (0 < offset) {
+        p = SERVER_PUT(p, "\r\n");
+      }
+      p = server_put_number(p, iov[ii].iov_len, 16);
+      p = SERVER_PUT(p, "\r\n");
+      rc = hpjsrpc_buffer_append(chunked, line, (size_t) (p - line));
+      if (HPJSRPC_NO_ERROR == rc) {
+        rc = hpjsrpc_buffer_append_ref(chunked, iov[ii].iov_base,
+          iov[ii].iov_len);
+      }
+      offset += iov[ii].iov_len;
+    }
+  }
+  if (HPJSRPC_NO_ERROR == rc) {
+    rc = hpjsrpc_buffer_append(chunked, "\r\n0\r\n\r\n",
+      (sizeof("\r\n0\r\n\r\n") - 1));
+  }
+
+  if (HPJSRPC_NO_ERROR != rc) {
+    hpjsrpc_buffer_release(chunked);
+    return NULL;
+  }
+
+  return chunked;
+
+} /* server_http_chunk() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Renders the reply head into the request arena */
+static int
+server_http_reply (
+  const hpjsrpc_server_config_t *config,
+  const server_frame_t          *frame,
+  server_reply_t                *reply
+) {
+  hpjsrpc_request_t *req = hpjsrpc_context_request(reply->ctx);
+  hpjsrpc_buffer_t  *buf = &hpjsrpc_context_response(reply->ctx)->buffer;
+  size_t             length = hpjsrpc_buffer_length(buf);
+  uint8_t           *head = hpjsrpc_request_alloc(req, SERVER_HTTP_HEAD_MAX, 1);
+  uint8_t           *p = head;
+
+  if (NULL == head) {
+    return -1;
+  }
+
+  reply->body = buf;
+  if (0 == length) {
+    /* Notifications have no reply, but HTTP wants one */
+    p = SERVER_PUT(p, "HTTP/1.1 204 No Content\r\n");
+    reply->body = NULL;
+  } else {
+    p = SERVER_PUT(p, "HTTP/1.1 200 OK\r\n"
+      "Content-Type: application/json\r\n");
+    if (0 < config->http_chunked_in_bytes
+        && config->http_chunked_in_bytes <= length && !frame->is_http10
+        && NULL != (reply->body = server_http_chunk(req, buf))) {
+      p = SERVER_PUT(p, "Transfer-Encoding: chunked\r\n");
+      reply->is_chunked = true;
+    } else {
+      reply->body = buf;
+      p = SERVER_PUT(p, "Content-Length: ");
+      p = server_put_number(p, length, 10);
+      p = SERVER_PUT(p, "\r\n");
+    }
+  }
+  if (!frame->is_keep_alive) {
+    p = SERVER_PUT(p, "Connection: close\r\n");
+  } else if (frame->is_http10) {
+    p = SERVER_PUT(p, "Connection: keep-alive\r\n");
+  }
+  p = SERVER_PUT(p, "\r\n");
+
+  reply->head = head;
+  reply->head_length = (size_t) (p - head);
+
+  return 0;
+
+} /* server_http_reply() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Processes one request and queues its reply; -1 on failure */
+static int
+conn_dispatch (
+  server_shard_t       *shard,
+  server_conn_t        *conn,
+  const server_frame_t *frame
+) {
+  const hpjsrpc_server_config_t *config = &shard->server->config;
+  server_reply_t                 reply;
+
+  memset(&reply, 0, sizeof(reply));
+
+  if (NULL != frame->canned) {
+    reply.head = (const uint8_t *) frame->canned;
+    reply.head_length = frame->canned_length;
+  } else if (NULL == frame->body) {
+    /* Blank line */
+    return 0;
+  } else {
+    hpjsrpc_buffer_t *buf;
+
+    if (HPJSRPC_NO_ERROR != hpjsrpc_context_acquire(shard->contexts,
+        &reply.ctx)) {
+      return -1;
+    }
+    hpjsrpc_context_set_deadline(reply.ctx, conn->received_ns,
+      (frame->has_deadline)
+        ? (conn->received_ns + (frame->deadline_ms * 1000000ull)) : 0);
+    hpjsrpc_context_process(reply.ctx, (const char *) frame->body,
+      frame->body_length);
+
+    buf = &hpjsrpc_context_response(reply.ctx)->buffer;
+    if (HPJSRPC_SERVER_HTTP == config->protocol) {
+      if (0 > server_http_reply(config, frame, &reply)) {
+        hpjsrpc_context_recycle(reply.ctx);
+        return -1;
+      }
+    } else if (0 == hpjsrpc_buffer_length(buf)) {
+      hpjsrpc_context_recycle(reply.ctx);
+      return 0;
+    } else if (HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(buf, "\n", 1)) {
+      hpjsrpc_context_recycle(reply.ctx);
+      return -1;
+    } else {
+      reply.body = buf;
+    }
+  }
+
+  reply.length_in_bytes = reply.head_length
+    + ((NULL != reply.body) ? hpjsrpc_buffer_length(reply.body) : 0);
+  conn->replies[(conn->reply_head + conn->reply_count)
+    % config->max_pipeline] = reply;
+  conn->out_pending_in_bytes += reply.length_in_bytes;
+  conn->reply_count++;
+  conn->queued_seq++;
+
+  if (!frame->is_keep_alive) {
+    conn->is_last = true;
+    conn->is_eof = true;
+  }
+
+  return 0;
+
+} /* conn_dispatch() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Processes complete requests, queueing their replies, until the input runs
+ * out (returns 0) or the connection is backlogged (returns 1). Pipelined
+ * requests are all handled before anything is written. Returns -1 if the
+ * connection has to be closed.
+ */
+static int
+conn_process (
+  server_shard_t       *shard,
+  server_conn_t        *conn
+) {
+  const hpjsrpc_server_config_t *config = &shard->server->config;
+
+  while (!conn_is_backlogged(config, conn)) {
+    server_frame_t frame;
+    int            rc;
+
+    if (conn->is_last) {
+      return 0;
+    }
+    rc = conn_frame(shard, conn, &conn->in[conn->in_start],
+      (conn->in_length - conn->in_start), &frame);
+    if (0 >= rc) {
+      return rc;
+    }
+    conn->in_start += frame.length;
+    if (0 > conn_dispatch(shard, conn, &frame)) {
+      return -1;
+    }
+  }
+
+  return 1;
+
+} /* conn_process() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Writes as much of the queued replies as the socket takes, gathering
+ * several replies per writev(). Returns -1 on error.
+ */
+static int
+conn_flush (
+  server_shard_t       *shard,
+  server_conn_t        *conn
+) {
+
+  conn->is_blocked = false;
+
+  while (0 < conn->reply_count) {
+    struct iovec iov[SERVER_WRITE_IOVECS];
+    size_t       offered;
+    size_t       iov_count = conn_gather(shard, conn, iov, &offered);
+    ssize_t      written;
+
+    written = writev(conn->fd, iov,
+      (int) ((IOV_MAX < iov_count) ? IOV_MAX : iov_count));
+    if (0 > written) {
+      if (EINTR == errno) {
+        continue;
+      }
+      if (EAGAIN == errno || EWOULDBLOCK == errno) {
+        conn->is_blocked = true;
+        return 0;
+      }
+      return -1;
+    }
+
+    if ((size_t) written < offered) {
+      /* The socket is full; waiting for EPOLLOUT saves a failing writev() */
+      conn->is_blocked = true;
+    }
+
+    conn_retire(shard, conn, (size_t) written);
+
+    if (conn->is_blocked) {
+      return 0;
+    }
+  }
+
+  return 0;
+
+} /* conn_flush() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Reads once into the free end of the input buffer; -1 on a broken line */
+static int
+conn_read (
+  server_shard_t       *shard,
+  server_conn_t        *conn
+) {
+  size_t  capacity = shard->server->config.read_buffer_size_in_bytes;
+  ssize_t got;
+
+  if (0 == conn->reply_count && 0 < conn->in_start) {
+    memmove(conn->in, &conn->in[conn->in_start],
+      (conn->in_length - conn->in_start));
+    conn->in_length -= conn->in_start;
+    conn->in_start = 0;
+  }
+
+  if (conn->in_length == capacity) {
+    /* A line that fills the whole buffer can never complete */
+    return (0 == conn->in_start) ? -1 : 0;
+  }
+
+  do {
+    got = read(conn->fd, &conn->in[conn->in_length],
+      (capacity - conn->in_length));
+  } while (0 > got && EINTR == errno);
+
+  if (0 > got) {
+    return (EAGAIN == errno || EWOULDBLOCK == errno) ? 0 : -1;
+  }
+  if (0 == got) {
+    /* Half-closed: answer what has arrived, then close */
+    conn->is_eof = true;
+    return 0;
+  }
+  conn->in_length += (size_t) got;
+  conn->received_ns = shard->now_ns;
+
+  return 0;
+
+} /* conn_read() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Stops reading while the connection is backlogged, or while the input
+ * buffer is full and cannot be compacted yet; that pushes back on the peer
+ * through TCP flow control. Watches for writability while blocked.
+ */
+static void
+conn_watch (
+  server_shard_t       *shard,
+  server_conn_t        *conn
+) {
+  const hpjsrpc_server_config_t *config = &shard->server->config;
+  uint32_t                       events = 0;
+  struct epoll_event             ev;
+
+  if (!conn->is_eof && !conn_is_backlogged(config, conn)
+      && (conn->in_length < config->read_buffer_size_in_bytes
+        || 0 == conn->reply_count)) {
+    events |= EPOLLIN;
+  }
+  if (conn->is_blocked) {
+    events |= EPOLLOUT;
+  }
+
+  if (events != conn->events) {
+    ev.events = events;
+    ev.data.ptr = conn;
+    epoll_ctl(shard->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->events = events;
+  }
+
+} /* conn_watch() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+conn_ready (
+  server_shard_t       *shard,
+  server_conn_t        *conn,
+  uint32_t              events
+) {
+
+  if (0 != (events & EPOLLOUT) && 0 > conn_flush(shard, conn)) {
+    goto L_close;
+  }
+
+  if (0 != (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+      && 0 != (conn->events & EPOLLIN) && 0 > conn_read(shard, conn)) {
+    goto L_close;
+  }
+
+  for (;;) {
+    int rc = conn_process(shard, conn);
+
+    if (0 > rc || (!conn->is_blocked && 0 < conn->reply_count
+        && 0 > conn_flush(shard, conn))) {
+      goto L_close;
+    }
+    /* Lines held back by the backlog go once the replies are out */
+    if (0 == rc || conn->is_blocked) {
+      break;
+    }
+  }
+
+  if (conn->is_eof && 0 == conn->reply_count) {
+    goto L_close;
+  }
+
+  conn_watch(shard, conn);
+  return;
+
+L_close:
+  conn_free(shard, conn);
+
+} /* conn_ready() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+shard_accept (server_shard_t *shard) {
+
+  for (;;) {
+    server_conn_t      *conn;
+    struct epoll_event  ev;
+    int                 fd;
+
+    fd = accept4(shard->listen_fd, NULL, NULL, (SOCK_NONBLOCK | SOCK_CLOEXEC));
+    if (0 > fd) {
+      if (EINTR == errno || ECONNABORTED == errno) {
+        continue;
+      }
+      return;
+    }
+
+    conn = shard_add_conn(shard, fd);
+    if (NULL == conn) {
+      continue;
+    }
+    conn->events = EPOLLIN;
+
+    ev.events = conn->events;
+    ev.data.ptr = conn;
+    if (0 != epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+      conn_free(shard, conn);
+    }
+  }
+
+} /* shard_accept() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+shard_run_epoll (server_shard_t *shard) {
+  hpjsrpc_server_t   *server = shard->server;
+  struct epoll_event  events[SERVER_EPOLL_BATCH];
+  int                 timeout_ms = (server->config.busy_poll) ? 0 : -1;
+
+  while (!__atomic_load_n(&server->is_stopping, __ATOMIC_ACQUIRE)) {
+    int count = epoll_wait(shard->epoll_fd, events, SERVER_EPOLL_BATCH,
+      timeout_ms);
+
+    if (0 < count) {
+      shard->now_ns = hpjsrpc_clock_ns();
+    }
+    for (int ii = 0; ii < count; ++ii) {
+      void *ptr = events[ii].data.ptr;
+
+      if (ptr == &shard->listen_fd) {
+        shard_accept(shard);
+      } else if (ptr == &shard->wake_fd) {
+        shard_drain_wake(shard);
+      } else {
+        conn_ready(shard, ptr, events[ii].events);
+      }
+    }
+  }
+
+  while (NULL != shard->connections) {
+    conn_free(shard, shard->connections);
+  }
+
+} /* shard_run_epoll() */
+
+/* ------------------------------------------------------------------------- */
+
+#if defined(SERVER_HAVE_IO_URING)
+
+static void
+uring_arm_recv (
+  server_uring_t       *ring,
+  server_conn_t        *conn
+) {
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_RECV, conn->fd, conn,
+    URING_OP_RECV);
+
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  conn->is_recv_armed = true;
+  conn->inflight++;
+
+} /* uring_arm_recv() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+uring_cancel_recv (
+  server_uring_t       *ring,
+  server_conn_t        *conn
+) {
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_ASYNC_CANCEL, -1,
+    conn, URING_OP_CANCEL);
+
+  sqe->addr = ((uint64_t) (uintptr_t) conn | URING_OP_RECV);
+  conn->is_recv_cancelled = true;
+  conn->inflight++;
+
+} /* uring_cancel_recv() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Sends the queued replies, several per sendmsg(), one at a time */
+static void
+uring_send (
+  server_shard_t       *shard,
+  server_conn_t        *conn
+) {
+  struct io_uring_sqe *sqe;
+  size_t               offered;
+  size_t               iov_count;
+
+  iov_count = conn_gather(shard, conn, conn->send_iov, &offered);
+  conn->send_msg.msg_iov = conn->send_iov;
+  conn->send_msg.msg_iovlen = ((IOV_MAX < iov_count) ? IOV_MAX : iov_count);
+
+  sqe = uring_sqe(shard->uring, IORING_OP_SENDMSG, conn->fd, conn,
+    URING_OP_SEND);
+  sqe->addr = (uint64_t) (uintptr_t) &conn->send_msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  conn->is_sending = true;
+  conn->inflight++;
+
+} /* uring_send() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Appends a buffer to one of the connection's lists */
+static inline void
+uring_buffer_append (
+  server_uring_t       *ring,
+  int32_t              *head,
+  int32_t              *tail,
+  int32_t               bid
+) {
+  ring->buf_next[bid] = -1;
+  if (0 > *tail) {
+    *head = bid;
+  } else {
+    ring->buf_next[*tail] = bid;
+  }
+  *tail = bid;
+
+} /* uring_buffer_append() */
+
+/* ------------------------------------------------------------------------- */
+
+static inline int32_t
+uring_buffer_pop (
+  server_uring_t       *ring,
+  int32_t              *head,
+  int32_t              *tail
+) {
+  int32_t bid = *head;
+
+  *head = ring->buf_next[bid];
+  if (0 > *head) {
+    *tail = -1;
+  }
+
+  return bid;
+
+} /* uring_buffer_pop() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Done with the current buffer; it is provided again once the replies
+ * queued so far, which may point into it, are written.
+ */
+static void
+uring_retire_current (
+  server_uring_t       *ring,
+  server_conn_t        *conn
+) {
+  ring->buf_release_seq[conn->current] = conn->queued_seq;
+  uring_buffer_append(ring, &conn->retired_head, &conn->retired_tail,
+    conn->current);
+  conn->current = -1;
+  conn->in = NULL;
+
+} /* uring_retire_current() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * The peer shut down with an unterminated line carried over: that line is
+ * the last request. Returns like uring_conn_process().
+ */
+static int
+uring_conn_finish_carry (
+  server_shard_t       *shard,
+  server_conn_t        *conn
+) {
+  server_frame_t frame;
+  int            rc;
+
+  if (conn_is_backlogged(&shard->server->config, conn)) {
+    return 1;
+  }
+
+  rc = conn_frame(shard, conn, conn->buffer, conn->carry_length, &frame);
+  if (0 >= rc) {
+    return rc;
+  }
+  conn->carry_length = 0;
+  if (0 > conn_dispatch(shard, conn, &frame)) {
+    return -1;
+  }
+  conn->carry_release_seq = conn->queued_seq;
+
+  return 0;
+
+} /* uring_conn_finish_carry() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * conn_process() over the received buffers in turn, in place. A request
+ * that starts in one buffer and ends in another is put together in the
+ * connection's buffer, which may only be overwritten once the reply to the
+ * previous request put together there is written; until then this returns
+ * 1 as if backlogged.
+ */
+static int
+uring_conn_process (
+  server_shard_t       *shard,
+  server_conn_t        *conn
+) {
+  server_uring_t                *ring = shard->uring;
+  const hpjsrpc_server_config_t *config = &shard->server->config;
+  size_t                         capacity = config->read_buffer_size_in_bytes;
+
+  for (;;) {
+    int rc;
+
+    if (conn->is_last) {
+      return 0;
+    }
+
+    if (0 > conn->current) {
+      if (0 > conn->held_head) {
+        return (conn->is_eof && 0 < conn->carry_length)
+          ? uring_conn_finish_carry(shard, conn) : 0;
+      }
+      conn->current = uring_buffer_pop(ring, &conn->held_head,
+        &conn->held_tail);
+      conn->in = &ring->buffers[(size_t) conn->current * ring->buffer_size];
+      conn->in_start = 0;
+      conn->in_length = ring->buf_length[conn->current];
+    }
+
+    if (0 < conn->carry_length) {
+      server_frame_t frame;
+      size_t         had = conn->carry_length;
+      size_t         take = (capacity - had);
+
+      if (conn_is_backlogged(config, conn)) {
+        return 1;
+      }
+
+      /* What follows the request in this buffer is processed in place */
+      if (take > conn->in_length) {
+        take = conn->in_length;
+      }
+      memcpy(&conn->buffer[had], conn->in, take);
+      conn->carry_length += take;
+      rc = conn_frame(shard, conn, conn->buffer, conn->carry_length, &frame);
+      if (0 > rc) {
+        return -1;
+      }
+      if (0 == rc) {
+        if (take < conn->in_length) {
+          return -1;
+        }
+        uring_retire_current(ring, conn);
+        continue;
+      }
+
+      conn->in_start = (frame.length - had);
+      conn->carry_length = 0;
+      if (0 > conn_dispatch(shard, conn, &frame)) {
+        return -1;
+      }
+      conn->carry_release_seq = conn->queued_seq;
+      continue;
+    }
+
+    rc = conn_process(shard, conn);
+    if (0 != rc) {
+      return rc;
+    }
+
+    if (conn->in_start < conn->in_length) {
+      size_t tail = (conn->in_length - conn->in_start);
+
+      if (conn->written_seq < conn->carry_release_seq) {
+        return 1;
+      }
+      if (tail >= capacity) {
+        return -1;
+      }
+      memcpy(conn->buffer, &conn->in[conn->in_start], tail);
+      conn->carry_length = tail;
+    }
+    uring_retire_current(ring, conn);
+  }
+
+} /* uring_conn_process() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Provides the buffers no unwritten reply may point into anymore */
+static void
+uring_conn_release (
+  server_uring_t       *ring,
+  server_conn_t        *conn,
+  bool                  is_all
+) {
+  bool is_returned = false;
+
+  while (0 <= conn->retired_head && (is_all
+      || ring->buf_release_seq[conn->retired_head] <= conn->written_seq)) {
+    uring_buffer_return(ring, uring_buffer_pop(ring, &conn->retired_head,
+      &conn->retired_tail));
+    is_returned = true;
+  }
+  if (is_all) {
+    while (0 <= conn->held_head) {
+      uring_buffer_return(ring, uring_buffer_pop(ring, &conn->held_head,
+        &conn->held_tail));
+    }
+    if (0 <= conn->current) {
+      uring_buffer_return(ring, conn->current);
+      conn->current = -1;
+    }
+    is_returned = true;
+  }
+
+  /* Receives that ran out of buffers may go again */
+  if (is_returned) {
+    while (NULL != ring->starved) {
+      server_conn_t *starved = ring->starved;
+
+      ring->starved = starved->next_starved;
+      starved->is_starved = false;
+      if (!starved->is_recv_armed && !starved->is_closing) {
+        uring_arm_recv(ring, starved);
+      }
+    }
+  }
+
+} /* uring_conn_release() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Shuts the socket down, so whatever is in flight completes, and frees the
+ * connection once nothing is.
+ */
+static void
+uring_conn_close (
+  server_shard_t       *shard,
+  server_conn_t        *conn
+) {
+  server_uring_t *ring = shard->uring;
+
+  if (!conn->is_closing) {
+    conn->is_closing = true;
+    shutdown(conn->fd, SHUT_RDWR);
+    if (conn->is_recv_armed && !conn->is_recv_cancelled) {
+      uring_cancel_recv(ring, conn);
+    }
+    if (conn->is_starved) {
+      server_conn_t **link = &ring->starved;
+      while (*link != conn) {
+        link = &(*link)->next_starved;
+      }
+      *link = conn->next_starved;
+      conn->is_starved = false;
+    }
+  }
+
+  if (0 == conn->inflight) {
+    uring_conn_release(ring, conn, true);
+    conn_free(shard, conn);
+  }
+
+} /* uring_conn_close() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Moves a connection along after a completion: processes what was received,
+ * sends, provides buffers back, and receives or stops receiving.
+ */
+static void
+uring_conn_pump (
+  server_shard_t       *shard,
+  server_conn_t        *conn
+) {
+  server_uring_t                *ring = shard->uring;
+  const hpjsrpc_server_config_t *config = &shard->server->config;
+  bool                           want_recv;
+
+  if (conn->is_closing) {
+    uring_conn_close(shard, conn);
+    return;
+  }
+
+  if (0 > uring_conn_process(shard, conn)) {
+    uring_conn_close(shard, conn);
+    return;
+  }
+
+  if (!conn->is_sending && 0 < conn->reply_count) {
+    uring_send(shard, conn);
+  }
+  uring_conn_release(ring, conn, false);
+
+  if (conn->is_eof && 0 == conn->reply_count) {
+    uring_conn_close(shard, conn);
+    return;
+  }
+
+  /* A cancelled receive is armed again once its last completion is in */
+  want_recv = (!conn->is_eof && !conn->is_starved
+    && !conn_is_backlogged(config, conn));
+  if (want_recv && !conn->is_recv_armed) {
+    uring_arm_recv(ring, conn);
+  } else if (!want_recv && conn->is_recv_armed && !conn->is_recv_cancelled
+      && !conn->is_eof) {
+    uring_cancel_recv(ring, conn);
+  }
+
+} /* uring_conn_pump() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+uring_arm_accept (server_shard_t *shard) {
+  struct io_uring_sqe *sqe = uring_sqe(shard->uring, IORING_OP_ACCEPT,
+    shard->listen_fd, NULL, URING_OP_ACCEPT);
+
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  shard->uring->is_accept_armed = true;
+
+} /* uring_arm_accept() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+uring_arm_wake (server_shard_t *shard) {
+  struct io_uring_sqe *sqe = uring_sqe(shard->uring, IORING_OP_POLL_ADD,
+    shard->wake_fd, NULL, URING_OP_WAKE);
+
+  sqe->poll32_events = POLLIN;
+  shard->uring->is_wake_armed = true;
+
+} /* uring_arm_wake() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+uring_complete (
+  server_shard_t               *shard,
+  const struct io_uring_cqe    *cqe,
+  bool                          is_stopping
+) {
+  server_uring_t *ring = shard->uring;
+  server_conn_t  *conn = (server_conn_t *) (uintptr_t)
+    (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+  bool            is_more = (0 != (cqe->flags & IORING_CQE_F_MORE));
+
+  switch (cqe->user_data & URING_OP_MASK) {
+  case URING_OP_ACCEPT:
+    if (0 <= cqe->res) {
+      if (is_stopping) {
+        close(cqe->res);
+      } else {
+        conn = shard_add_conn(shard, cqe->res);
+        if (NULL != conn) {
+          uring_arm_recv(ring, conn);
+        }
+      }
+    }
+    if (!is_more) {
+      ring->is_accept_armed = false;
+      if (!is_stopping) {
+        uring_arm_accept(shard);
+      }
+    }
+    return;
+
+  case URING_OP_WAKE:
+    shard_drain_wake(shard);
+    ring->is_wake_armed = false;
+    if (!is_stopping) {
+      uring_arm_wake(shard);
+    }
+    return;
+
+  case URING_OP_SHARD_CANCEL:
+    return;
+
+  case URING_OP_RECV:
+    if (0 != (cqe->flags & IORING_CQE_F_BUFFER)) {
+      int32_t bid = (int32_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+      ring->buffers_taken++;
+      if (0 < cqe->res && !conn->is_closing) {
+        conn->received_ns = shard->now_ns;
+        ring->buf_length[bid] = (uint32_t) cqe->res;
+        uring_buffer_append(ring, &conn->held_head, &conn->held_tail, bid);
+      } else {
+        uring_buffer_return(ring, bid);
+      }
+    }
+    if (0 == cqe->res) {
+      /* Half-closed: answer what has arrived, then close */
+      conn->is_eof = true;
+    } else if (-ENOBUFS == cqe->res) {
+      /* Unless buffers were provided since the kernel ran out */
+      if (!conn->is_starved && !conn->is_closing
+          && ring->buffers_taken == ring->buffer_count) {
+        conn->is_starved = true;
+        conn->next_starved = ring->starved;
+        ring->starved = conn;
+      }
+    }
+    if (!is_more) {
+      conn->is_recv_armed = false;
+      conn->is_recv_cancelled = false;
+      conn->inflight--;
+    }
+    if (0 > cqe->res && -ENOBUFS != cqe->res && -ECANCELED != cqe->res) {
+      uring_conn_close(shard, conn);
+      return;
+    }
+    break;
+
+  case URING_OP_SEND:
+    conn->is_sending = false;
+    conn->inflight--;
+    if (0 > cqe->res) {
+      uring_conn_close(shard, conn);
+      return;
+    }
+    conn_retire(shard, conn, (size_t) cqe->res);
+    break;
+
+  case URING_OP_CANCEL:
+    conn->inflight--;
+    break;
+
+  default:
+    return;
+  }
+
+  uring_conn_pump(shard, conn);
+
+} /* uring_complete() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+uring_reap (
+  server_shard_t       *shard,
+  bool                  is_stopping
+) {
+  server_uring_t *ring = shard->uring;
+  unsigned        head = *ring->cq_head;
+  unsigned        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+  if (head != tail) {
+    shard->now_ns = hpjsrpc_clock_ns();
+  }
+
+  while (head != tail) {
+    uring_complete(shard, &ring->cqes[head & ring->cq_mask], is_stopping);
+    head++;
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    if (head == tail) {
+      tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+  }
+
+} /* uring_reap() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+shard_run_uring (server_shard_t *shard) {
+  hpjsrpc_server_t *server = shard->server;
+  server_uring_t   *ring = shard->uring;
+  unsigned          wait_count = (server->config.busy_poll) ? 0 : 1;
+
+  /* The thread enabling the ring is the one allowed to submit */
+  if (0 != syscall(__NR_io_uring_register, ring->fd,
+      IORING_REGISTER_ENABLE_RINGS, NULL, 0)) {
+    return;
+  }
+
+  uring_arm_accept(shard);
+  uring_arm_wake(shard);
+
+  while (!__atomic_load_n(&server->is_stopping, __ATOMIC_ACQUIRE)) {
+    uring_enter(ring, wait_count);
+    uring_reap(shard, false);
+  }
+
+  for (server_conn_t *conn = shard->connections; NULL != conn; ) {
+    server_conn_t *next = conn->next;
+    uring_conn_close(shard, conn);
+    conn = next;
+  }
+  if (ring->is_accept_armed) {
+    uring_sqe(ring, IORING_OP_ASYNC_CANCEL, -1, NULL,
+      URING_OP_SHARD_CANCEL)->addr = URING_OP_ACCEPT;
+  }
+  if (ring->is_wake_armed) {
+    uring_sqe(ring, IORING_OP_ASYNC_CANCEL, -1, NULL,
+      URING_OP_SHARD_CANCEL)->addr = URING_OP_WAKE;
+  }
+
+  while (NULL != shard->connections || ring->is_accept_armed
+      || ring->is_wake_armed) {
+    uring_enter(ring, 1);
+    uring_reap(shard, true);
+  }
+
+} /* shard_run_uring() */
+
+#endif /* SERVER_HAVE_IO_URING */
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+shard_main (void *arg) {
+  server_shard_t *shard = arg;
+
+#if defined(SERVER_HAVE_IO_URING)
+  if (NULL != shard->uring) {
+    shard_run_uring(shard);
+    return NULL;
+  }
+#endif
+  shard_run_epoll(shard);
+
+  return NULL;
+
+} /* shard_main() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_server_start (hpjsrpc_server_t *server) {
+  size_t started;
+
+  if (NULL == server || server->is_running) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  __atomic_store_n(&server->is_stopping, false, __ATOMIC_RELEASE);
+
+#if defined(SERVER_HAVE_IO_URING)
+  /* A ring per run, as only the thread that enables it may submit */
+  if (HPJSRPC_SERVER_IO_URING == server->config.backend) {
+    for (size_t ii = 0; ii < server->shard_count; ++ii) {
+      if (HPJSRPC_NO_ERROR != uring_new(&server->shards[ii]->uring,
+          &server->config)) {
+        for (size_t jj = 0; jj < ii; ++jj) {
+          uring_destroy(server->shards[jj]->uring);
+          server->shards[jj]->uring = NULL;
+        }
+        return HPJSRPC_ASSERTION_ERROR;
+      }
+    }
+  }
+#endif
+
+  for (started = 0; started < server->shard_count; ++started) {
+    server_shard_t *shard = server->shards[started];
+    pthread_attr_t  attr;
+    int             rc;
+
+    pthread_attr_init(&attr);
+    if (0 <= shard->cpu) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(shard->cpu, &cpus);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+    rc = pthread_create(&shard->thread, &attr, shard_main, shard);
+    pthread_attr_destroy(&attr);
+    if (0 != rc) {
+      break;
+    }
+  }
+
+  server->is_running = true;
+
+  if (started < server->shard_count) {
+    /* Join what did start */
+    size_t shard_count = server->shard_count;
+    server->shard_count = started;
+    hpjsrpc_server_stop(server);
+    server->shard_count = shard_count;
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_server_start() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_server_stop (hpjsrpc_server_t *server) {
+  uint64_t one = 1;
+
+  if (NULL == server) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (!server->is_running) {
+    return HPJSRPC_NO_ERROR;
+  }
+
+  __atomic_store_n(&server->is_stopping, true, __ATOMIC_RELEASE);
+  for (size_t ii = 0; ii < server->shard_count; ++ii) {
+    if (sizeof(one) != write(server->shards[ii]->wake_fd, &one,
+        sizeof(one))) {
+      /* Only fails when already readable */
+    }
+  }
+  for (size_t ii = 0; ii < server->shard_count; ++ii) {
+    pthread_join(server->shards[ii]->thread, NULL);
+  }
+#if defined(SERVER_HAVE_IO_URING)
+  for (size_t ii = 0; ii < server->shard_count; ++ii) {
+    if (NULL != server->shards[ii]->uring) {
+      uring_destroy(server->shards[ii]->uring);
+      server->shards[ii]->uring = NULL;
+    }
+  }
+#endif
+
+  server->is_running = false;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_server_stop() */
+/* vi: set et sw=2 ts=2: */
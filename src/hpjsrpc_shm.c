@@ -0,0 +1,774 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "hpjsrpc_shm.h"
+#include "hpjsrpc_queue.h"
+#include "hpjsrpc_segment.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define SHM_ALIGNED         __attribute__((aligned(HPJSRPC_CACHE_LINE_SIZE)))
+#define SHM_MAGIC           UINT64_C(0x314d48534350524a)
+#define SHM_VERSION         1
+#define SHM_MIN_RING_SIZE   4096
+#define SHM_MAX_RING_SIZE   (UINT32_C(1) << 31)
+/*
+ * Every record starts with its payload length, is followed by a NUL, and
+ * is 8-byte aligned
+ */
+#define SHM_RECORD_HEADER   8
+/* A length of SHM_WRAP sends the reader back to the start of the ring */
+#define SHM_WRAP            UINT32_MAX
+
+/*
+ * One direction. Positions are byte counts modulo 2^32 into a power-of-two
+ * ring. Each side writes only its own position, so the producer's and the
+ * consumer's lines stay apart; the idle flags and wake-up futex words have
+ * lines of their own, written only around a sleep, so checking them on
+ * every message costs a read of a line that is nearly always cached.
+ */
+typedef struct {
+  uint32_t                        head SHM_ALIGNED;
+  uint32_t                        tail SHM_ALIGNED;
+  uint32_t                        is_consumer_idle SHM_ALIGNED;
+  uint32_t                        consumer_signal;
+  uint32_t                        is_producer_idle SHM_ALIGNED;
+  uint32_t                        producer_signal;
+} shm_ring_t;
+
+/* The start of the region; the request, then the reply ring data follow */
+typedef struct {
+  uint64_t                        magic;
+  uint32_t                        version;
+  uint32_t                        request_ring_size;
+  uint32_t                        response_ring_size;
+  uint32_t                        is_closed;
+  shm_ring_t                      requests SHM_ALIGNED;
+  shm_ring_t                      responses SHM_ALIGNED;
+} shm_region_t;
+
+/* A side's view of one ring; the cached positions are the peer's */
+typedef struct {
+  shm_ring_t                     *ring;
+  uint8_t                        *data;
+  uint32_t                        mask;
+  uint32_t                        cached_head;
+  uint32_t                        cached_tail;
+  /* Set for good once the peer published a record the ring cannot hold */
+  bool                            is_corrupt;
+} shm_end_t;
+
+struct hpjsrpc_shm_t {
+  shm_region_t                   *region;
+  size_t                          mapped_in_bytes;
+  /* The memfd, if this side created it; -1 otherwise */
+  int                             fd;
+  unsigned                        spin_count;
+  shm_end_t                       requests;
+  shm_end_t                       responses;
+  /* Ring bytes taken by the reply handed out by hpjsrpc_shm_receive() */
+  uint32_t                        received_advance;
+};
+
+/* ------------------------------------------------------------------------- */
+
+static inline void
+shm_relax (void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__ ("yield");
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Shared, not private, futexes: the peer may be another process */
+static inline void
+shm_futex_wait (uint32_t *word, uint32_t value) {
+  syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static inline void
+shm_futex_wake (uint32_t *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static inline bool
+shm_is_closed (const hpjsrpc_shm_t *shm) {
+  return 0 != __atomic_load_n(&shm->region->is_closed, __ATOMIC_ACQUIRE);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Bumps signal and wakes its sleeper, if idle says there is one */
+static inline void
+shm_notify (uint32_t *idle, uint32_t *signal) {
+
+  if (unlikely(0 != __atomic_load_n(idle, __ATOMIC_SEQ_CST))) {
+    __atomic_add_fetch(signal, 1, __ATOMIC_SEQ_CST);
+    shm_futex_wake(signal);
+  }
+
+} /* shm_notify() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Waits until the peer moves *position away from value, or the channel is
+ * closed. Polls first; then flags this side idle and sleeps on signal. The
+ * idle flag is set, and the position read again, with sequentially
+ * consistent ordering, as the peer publishes its position and then reads
+ * the flag: either the peer sees the flag and bumps the signal, or this
+ * side sees the new position. The signal is read before the flag is set,
+ * so a bump in between makes the futex wait return at once. May return
+ * early; callers check again.
+ */
+static void
+shm_wait (
+  hpjsrpc_shm_t        *shm,
+  const uint32_t       *position,
+  uint32_t              value,
+  uint32_t             *idle,
+  uint32_t             *signal
+) {
+  uint32_t seen;
+
+  for (unsigned ii = 0; ii < shm->spin_count; ++ii) {
+    if (value != __atomic_load_n(position, __ATOMIC_ACQUIRE)
+        || shm_is_closed(shm)) {
+      return;
+    }
+    shm_relax();
+  }
+
+  seen = __atomic_load_n(signal, __ATOMIC_SEQ_CST);
+  __atomic_store_n(idle, 1, __ATOMIC_SEQ_CST);
+  if (value == __atomic_load_n(position, __ATOMIC_SEQ_CST)
+      && !shm_is_closed(shm)) {
+    shm_futex_wait(signal, seen);
+  }
+  __atomic_store_n(idle, 0, __ATOMIC_RELAXED);
+
+} /* shm_wait() */
+
+/* ------------------------------------------------------------------------- */
+
+static inline uint32_t
+shm_record_size (size_t length_in_bytes) {
+  return (uint32_t) ((SHM_RECORD_HEADER + length_in_bytes + 8) & ~(size_t) 7);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Longest message a ring takes; half of it, so that one always fits */
+static inline size_t
+shm_max_length (const shm_end_t *end) {
+  return ((end->mask + 1) / 2 - SHM_RECORD_HEADER - 1);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Producer: finds room for a record of size bytes, contiguous, and returns
+ * where it goes; NULL if the ring is too full. A record that does not fit
+ * before the end of the ring is placed at its start, behind a wrap marker.
+ * *advance is what publishing the record moves the tail by.
+ */
+static uint8_t *
+ring_reserve (
+  shm_end_t            *end,
+  uint32_t              size,
+  uint32_t             *advance
+) {
+  uint32_t capacity = (end->mask + 1);
+  uint32_t tail = __atomic_load_n(&end->ring->tail, __ATOMIC_RELAXED);
+  uint32_t offset = (tail & end->mask);
+  uint32_t contiguous = (capacity - offset);
+  uint32_t needed = (size <= contiguous) ? size : (contiguous + size);
+
+  if ((capacity - (tail - end->cached_head)) < needed) {
+    end->cached_head = __atomic_load_n(&end->ring->head, __ATOMIC_ACQUIRE);
+    if ((capacity - (tail - end->cached_head)) < needed) {
+      return NULL;
+    }
+  }
+
+  if (size > contiguous) {
+    memcpy(&end->data[offset], &(uint32_t) { SHM_WRAP }, sizeof(uint32_t));
+    offset = 0;
+  }
+
+  *advance = needed;
+  return &end->data[offset];
+
+} /* ring_reserve() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Producer: stamps the reserved record's length and publishes it */
+static void
+ring_commit (
+  shm_end_t            *end,
+  uint8_t              *record,
+  uint32_t              length_in_bytes,
+  uint32_t              advance
+) {
+  uint32_t tail = __atomic_load_n(&end->ring->tail, __ATOMIC_RELAXED);
+
+  memcpy(record, &length_in_bytes, sizeof(length_in_bytes));
+  __atomic_store_n(&end->ring->tail, (tail + advance), __ATOMIC_SEQ_CST);
+  shm_notify(&end->ring->is_consumer_idle, &end->ring->consumer_signal);
+
+} /* ring_commit() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Consumer: points *payload at the oldest record's payload, or at NULL if
+ * the ring is empty, and returns its length; *advance is what consuming it
+ * moves the head by. The record must lie within the bytes the producer has
+ * published and within the ring; if it does not, the peer is broken, the
+ * ring is marked corrupt and this fails from then on.
+ */
+static HPJSRPC_RETURN
+ring_peek (
+  shm_end_t            *end,
+  const uint8_t       **payload,
+  uint32_t             *length_in_bytes,
+  uint32_t             *advance
+) {
+  uint32_t capacity = (end->mask + 1);
+  uint32_t head = __atomic_load_n(&end->ring->head, __ATOMIC_RELAXED);
+  uint32_t offset = (head & end->mask);
+  uint32_t skipped = 0;
+  uint32_t published;
+  uint32_t length;
+
+  *payload = NULL;
+  if (unlikely(end->is_corrupt)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (head == end->cached_tail) {
+    end->cached_tail = __atomic_load_n(&end->ring->tail, __ATOMIC_ACQUIRE);
+    if (head == end->cached_tail) {
+      return HPJSRPC_NO_ERROR;
+    }
+  }
+  published = (end->cached_tail - head);
+
+  memcpy(&length, &end->data[offset], sizeof(length));
+  if (SHM_WRAP == length) {
+    skipped = (capacity - offset);
+    offset = 0;
+    memcpy(&length, end->data, sizeof(length));
+  }
+
+  /* Lengths are checked one by one first, so that no sum can overflow */
+  if (unlikely(capacity < published || length > shm_max_length(end)
+      || (capacity - offset) < (SHM_RECORD_HEADER + length + 1)
+      || published < skipped
+      || (published - skipped) < shm_record_size(length))) {
+    end->is_corrupt = true;
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  *payload = &end->data[offset + SHM_RECORD_HEADER];
+  *length_in_bytes = length;
+  *advance = skipped + shm_record_size(length);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* ring_peek() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Consumer: frees the oldest record for the producer */
+static void
+ring_consume (
+  shm_end_t            *end,
+  uint32_t              advance
+) {
+  uint32_t head = __atomic_load_n(&end->ring->head, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&end->ring->head, (head + advance), __ATOMIC_SEQ_CST);
+  shm_notify(&end->ring->is_producer_idle, &end->ring->producer_signal);
+
+} /* ring_consume() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Reserves room for a message of length bytes, waiting for the consumer */
+static HPJSRPC_RETURN
+shm_reserve (
+  hpjsrpc_shm_t        *shm,
+  shm_end_t            *end,
+  size_t                length_in_bytes,
+  uint8_t             **record,
+  uint32_t             *advance
+) {
+  uint32_t size;
+
+  if (length_in_bytes > shm_max_length(end)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  size = shm_record_size(length_in_bytes);
+
+  for (;;) {
+    uint32_t head;
+
+    if (unlikely(shm_is_closed(shm))) {
+      return HPJSRPC_CLOSED;
+    }
+    *record = ring_reserve(end, size, advance);
+    if (likely(NULL != *record)) {
+      return HPJSRPC_NO_ERROR;
+    }
+    head = end->cached_head;
+    shm_wait(shm, &end->ring->head, head, &end->ring->is_producer_idle,
+      &end->ring->producer_signal);
+  }
+
+} /* shm_reserve() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+shm_init_end (
+  shm_end_t            *end,
+  shm_ring_t           *ring,
+  uint8_t              *data,
+  uint32_t              size
+) {
+
+  end->ring = ring;
+  end->data = data;
+  end->mask = (size - 1);
+  end->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  end->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+} /* shm_init_end() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Maps size bytes of fd and sets up a handle over them */
+static HPJSRPC_RETURN
+shm_map (
+  hpjsrpc_shm_t       **pptr,
+  int                   fd,
+  size_t                size,
+  unsigned              spin_count
+) {
+  hpjsrpc_shm_t *shm;
+  void          *base;
+
+  shm = hpjsrpc_calloc(1, sizeof(*shm));
+  if (NULL == shm) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  base = mmap(NULL, size, (PROT_READ | PROT_WRITE),
+    (MAP_SHARED | MAP_POPULATE), fd, 0);
+  if (MAP_FAILED == base) {
+    hpjsrpc_free(shm);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  shm->region = base;
+  shm->mapped_in_bytes = size;
+  shm->fd = -1;
+  shm->spin_count = (0 == spin_count)
+    ? HPJSRPC_SHM_DEFAULT_SPIN_COUNT : spin_count;
+
+  *pptr = shm;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* shm_map() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+shm_init_ends (hpjsrpc_shm_t *shm) {
+  shm_region_t *region = shm->region;
+  uint8_t      *data = (uint8_t *) (region + 1);
+
+  shm_init_end(&shm->requests, &region->requests, data,
+    region->request_ring_size);
+  shm_init_end(&shm->responses, &region->responses,
+    &data[region->request_ring_size], region->response_ring_size);
+
+} /* shm_init_ends() */
+
+/* ------------------------------------------------------------------------- */
+
+static size_t
+shm_ring_size (size_t requested) {
+  size_t size = SHM_MIN_RING_SIZE;
+
+  if (0 == requested) {
+    requested = HPJSRPC_SHM_DEFAULT_RING_SIZE;
+  }
+  while (size < requested && size < SHM_MAX_RING_SIZE) {
+    size <<= 1;
+  }
+
+  return size;
+
+} /* shm_ring_size() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_shm_new (
+  hpjsrpc_shm_t                        **pptr,
+  const hpjsrpc_shm_config_t            *config
+) {
+  hpjsrpc_shm_t *shm;
+  size_t         request_size;
+  size_t         response_size;
+  size_t         size;
+  int            fd;
+
+  if (NULL == pptr || NULL == config) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  request_size = shm_ring_size(config->request_ring_size_in_bytes);
+  response_size = shm_ring_size(config->response_ring_size_in_bytes);
+  size = sizeof(shm_region_t) + request_size + response_size;
+
+  fd = memfd_create("hpjsrpc-shm", (MFD_CLOEXEC | MFD_ALLOW_SEALING));
+  if (0 > fd) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  /* The peer must not be able to shrink the region under our feet */
+  if (0 != ftruncate(fd, (off_t) size)
+      || 0 != fcntl(fd, F_ADD_SEALS, (F_SEAL_SHRINK | F_SEAL_GROW))
+      || HPJSRPC_NO_ERROR != shm_map(&shm, fd, size, config->spin_count)) {
+    close(fd);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  shm->fd = fd;
+
+  /* The region starts zeroed: both rings empty, nobody idle */
+  shm->region->version = SHM_VERSION;
+  shm->region->request_ring_size = (uint32_t) request_size;
+  shm->region->response_ring_size = (uint32_t) response_size;
+  __atomic_store_n(&shm->region->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+  shm_init_ends(shm);
+
+  *pptr = shm;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_shm_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_shm_attach (
+  hpjsrpc_shm_t                        **pptr,
+  int                                    fd,
+  unsigned                               spin_count
+) {
+  hpjsrpc_shm_t *shm;
+  shm_region_t  *region;
+  struct stat    st;
+  size_t         request_size;
+  size_t         response_size;
+
+  if (NULL == pptr || 0 > fd || 0 != fstat(fd, &st)
+      || sizeof(shm_region_t) > (size_t) st.st_size) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  if (HPJSRPC_NO_ERROR != shm_map(&shm, fd, (size_t) st.st_size,
+      spin_count)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  region = shm->region;
+  request_size = region->request_ring_size;
+  response_size = region->response_ring_size;
+  if (SHM_MAGIC != __atomic_load_n(&region->magic, __ATOMIC_ACQUIRE)
+      || SHM_VERSION != region->version
+      || SHM_MIN_RING_SIZE > request_size
+      || SHM_MIN_RING_SIZE > response_size
+      || 0 != (request_size & (request_size - 1))
+      || 0 != (response_size & (response_size - 1))
+      || shm->mapped_in_bytes
+        < (sizeof(shm_region_t) + request_size + response_size)) {
+    hpjsrpc_shm_destroy(shm);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  shm_init_ends(shm);
+
+  *pptr = shm;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_shm_attach() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_shm_destroy (hpjsrpc_shm_t *shm) {
+
+  if (NULL == shm) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  munmap(shm->region, shm->mapped_in_bytes);
+  if (0 <= shm->fd) {
+    close(shm->fd);
+  }
+  hpjsrpc_free(shm);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_shm_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+hpjsrpc_shm_fd (const hpjsrpc_shm_t *shm) {
+  return shm->fd;
+}
+
+/* ------------------------------------------------------------------------- */
+
+void
+hpjsrpc_shm_close (hpjsrpc_shm_t *shm) {
+  shm_ring_t *rings[2] = { &shm->region->requests, &shm->region->responses };
+
+  __atomic_store_n(&shm->region->is_closed, 1, __ATOMIC_SEQ_CST);
+
+  /* Whoever is asleep, or about to be, is woken regardless of idle flags */
+  for (size_t ii = 0; ii < 2; ++ii) {
+    __atomic_add_fetch(&rings[ii]->consumer_signal, 1, __ATOMIC_SEQ_CST);
+    shm_futex_wake(&rings[ii]->consumer_signal);
+    __atomic_add_fetch(&rings[ii]->producer_signal, 1, __ATOMIC_SEQ_CST);
+    shm_futex_wake(&rings[ii]->producer_signal);
+  }
+
+} /* hpjsrpc_shm_close() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_shm_send (
+  hpjsrpc_shm_t                         *shm,
+  const void                            *request,
+  size_t                                 length_in_bytes
+) {
+  HPJSRPC_RETURN  rc;
+  uint8_t        *record;
+  uint32_t        advance;
+
+  if (NULL == shm || (NULL == request && 0 < length_in_bytes)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  rc = shm_reserve(shm, &shm->requests, length_in_bytes, &record, &advance);
+  if (HPJSRPC_NO_ERROR != rc) {
+    return rc;
+  }
+  memcpy(&record[SHM_RECORD_HEADER], request, length_in_bytes);
+  record[SHM_RECORD_HEADER + length_in_bytes] = '\0';
+  ring_commit(&shm->requests, record, (uint32_t) length_in_bytes, advance);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_shm_send() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_shm_receive (
+  hpjsrpc_shm_t                         *shm,
+  const char                           **reply,
+  size_t                                *length_in_bytes
+) {
+  shm_end_t *end;
+
+  if (NULL == shm || NULL == reply || NULL == length_in_bytes) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  end = &shm->responses;
+
+  for (;;) {
+    const uint8_t *payload;
+    uint32_t       length;
+    uint32_t       tail;
+
+    if (unlikely(HPJSRPC_NO_ERROR != ring_peek(end, &payload, &length,
+        &shm->received_advance))) {
+      hpjsrpc_shm_close(shm);
+      return HPJSRPC_ASSERTION_ERROR;
+    }
+    if (likely(NULL != payload)) {
+      *reply = (const char *) payload;
+      *length_in_bytes = length;
+      return HPJSRPC_NO_ERROR;
+    }
+    if (unlikely(shm_is_closed(shm))) {
+      return HPJSRPC_CLOSED;
+    }
+    tail = end->cached_tail;
+    shm_wait(shm, &end->ring->tail, tail, &end->ring->is_consumer_idle,
+      &end->ring->consumer_signal);
+  }
+
+} /* hpjsrpc_shm_receive() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+hpjsrpc_shm_consume (hpjsrpc_shm_t *shm) {
+
+  if (0 < shm->received_advance) {
+    ring_consume(&shm->responses, shm->received_advance);
+    shm->received_advance = 0;
+  }
+
+} /* hpjsrpc_shm_consume() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Processes one request where it lies in the request ring and copies the
+ * reply, NUL-terminated, into the reply ring. The reply may reference the
+ * request, so the request is consumed only after that copy.
+ */
+static HPJSRPC_RETURN
+shm_handle (
+  hpjsrpc_shm_t        *shm,
+  hpjsrpc_context_t    *ctx,
+  const uint8_t        *request,
+  uint32_t              length_in_bytes
+) {
+  HPJSRPC_RETURN    rc;
+  hpjsrpc_buffer_t *buf;
+  uint8_t          *record;
+  uint32_t          advance;
+  size_t            length;
+
+  hpjsrpc_context_process(ctx, (const char *) request, length_in_bytes);
+
+  buf = &hpjsrpc_context_response(ctx)->buffer;
+  length = hpjsrpc_buffer_length(buf);
+  if (0 == length) {
+    return HPJSRPC_NO_ERROR;
+  }
+
+  rc = shm_reserve(shm, &shm->responses, length, &record, &advance);
+  if (HPJSRPC_ASSERTION_ERROR == rc) {
+    /* Too long for the reply ring; the client would wait for it forever */
+    hpjsrpc_shm_close(shm);
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+  if (HPJSRPC_NO_ERROR != rc) {
+    return rc;
+  }
+  hpjsrpc_buffer_copy_out(buf, &record[SHM_RECORD_HEADER], (length + 1));
+  ring_commit(&shm->responses, record, (uint32_t) length, advance);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* shm_handle() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_shm_process (
+  hpjsrpc_shm_t                         *shm,
+  hpjsrpc_context_t                     *ctx,
+  size_t                                *processed
+) {
+  size_t count = 0;
+
+  if (NULL == shm || NULL == ctx) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  for (;;) {
+    const uint8_t  *request;
+    uint32_t        length;
+    uint32_t        advance;
+    HPJSRPC_RETURN  rc;
+
+    if (unlikely(shm_is_closed(shm))) {
+      return HPJSRPC_CLOSED;
+    }
+    if (unlikely(HPJSRPC_NO_ERROR != ring_peek(&shm->requests, &request,
+        &length, &advance))) {
+      hpjsrpc_shm_close(shm);
+      return HPJSRPC_ASSERTION_ERROR;
+    }
+    if (NULL == request) {
+      break;
+    }
+
+    rc = shm_handle(shm, ctx, request, length);
+    if (HPJSRPC_NO_ERROR != rc) {
+      return rc;
+    }
+    ring_consume(&shm->requests, advance);
+    ++count;
+  }
+
+  if (NULL != processed) {
+    *processed = count;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_shm_process() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_shm_serve (
+  hpjsrpc_shm_t                         *shm,
+  hpjsrpc_context_t                     *ctx
+) {
+  shm_end_t *end;
+
+  if (NULL == shm || NULL == ctx) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  end = &shm->requests;
+
+  for (;;) {
+    HPJSRPC_RETURN rc = hpjsrpc_shm_process(shm, ctx, NULL);
+    uint32_t       tail;
+
+    if (HPJSRPC_CLOSED == rc) {
+      return HPJSRPC_NO_ERROR;
+    }
+    if (HPJSRPC_NO_ERROR != rc) {
+      return rc;
+    }
+    tail = end->cached_tail;
+    shm_wait(shm, &end->ring->tail, tail, &end->ring->is_consumer_idle,
+      &end->ring->consumer_signal);
+  }
+
+} /* hpjsrpc_shm_serve() */
+
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "hpjsrpc_stream.h"
+#include "hpjsrpc_segment.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define STREAM_CONTENT_LENGTH   "content-length:"
+/* Reply iovecs written per call, the header included */
+#define STREAM_WRITE_IOVECS     64
+
+struct hpjsrpc_stream_t {
+  char                           *buffer;
+  size_t                          capacity;
+  size_t                          max_body_in_bytes;
+  /* Unconsumed bytes are [start, length) */
+  size_t                          start;
+  size_t                          length;
+  /* Header block: searched up to here for its end so far */
+  size_t                          scanned;
+  /* Body of the current message, once its header block is parsed */
+  bool                            is_in_body;
+  size_t                          body_start;
+  size_t                          body_length;
+  bool                            is_failed;
+};
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_stream_new (
+  hpjsrpc_stream_t                     **pptr,
+  size_t                                 buffer_size_in_bytes,
+  size_t                                 max_body_in_bytes
+) {
+  hpjsrpc_stream_t *stream;
+
+  if (NULL == pptr || HPJSRPC_STREAM_MAX_HEAD > buffer_size_in_bytes
+      || 0 == max_body_in_bytes) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  stream = hpjsrpc_calloc(1, sizeof(*stream));
+  if (NULL == stream) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  stream->buffer = hpjsrpc_malloc(buffer_size_in_bytes);
+  if (NULL == stream->buffer) {
+    hpjsrpc_free(stream);
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  stream->capacity = buffer_size_in_bytes;
+  stream->max_body_in_bytes = max_body_in_bytes;
+
+  *pptr = stream;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_stream_new() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_stream_destroy (hpjsrpc_stream_t *stream) {
+
+  if (NULL == stream) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  hpjsrpc_free(stream->buffer);
+  hpjsrpc_free(stream);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_stream_destroy() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Moves the unconsumed bytes to the start of the buffer */
+static void
+stream_compact (hpjsrpc_stream_t *stream) {
+  size_t shift = stream->start;
+
+  if (0 == shift) {
+    return;
+  }
+
+  memmove(stream->buffer, &stream->buffer[shift],
+    (stream->length - shift));
+  stream->start = 0;
+  stream->length -= shift;
+  stream->scanned -= shift;
+  stream->body_start -= (stream->is_in_body) ? shift : 0;
+
+} /* stream_compact() */
+
+/* ------------------------------------------------------------------------- */
+
+void *
+hpjsrpc_stream_space (
+  hpjsrpc_stream_t     *stream,
+  size_t               *available_in_bytes
+) {
+  size_t needed;
+
+  /*
+   * A body must end inside the buffer; a header block should have room to
+   * arrive in one read. Only then is the partial message moved down.
+   */
+  if ((stream->is_in_body)
+      ? ((stream->body_start + stream->body_length) > stream->capacity)
+      : ((stream->capacity - stream->length) < HPJSRPC_STREAM_MAX_HEAD)) {
+    stream_compact(stream);
+  }
+
+  needed = (stream->is_in_body)
+    ? (stream->body_start + stream->body_length) : (stream->length + 1);
+  if (needed > stream->capacity) {
+    size_t  capacity = (stream->is_in_body) ? needed : (2 * stream->capacity);
+    char   *grown = hpjsrpc_malloc(capacity);
+
+    /* Failing that, the read fills what is left of the buffer */
+    if (NULL != grown) {
+      memcpy(grown, stream->buffer, stream->length);
+      hpjsrpc_free(stream->buffer);
+      stream->buffer = grown;
+      stream->capacity = capacity;
+    }
+  }
+
+  *available_in_bytes = (stream->capacity - stream->length);
+  return &stream->buffer[stream->length];
+
+} /* hpjsrpc_stream_space() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+hpjsrpc_stream_commit (
+  hpjsrpc_stream_t     *stream,
+  size_t                length_in_bytes
+) {
+  stream->length += length_in_bytes;
+}
+
+/* ------------------------------------------------------------------------- */
+
+bool
+hpjsrpc_stream_is_idle (const hpjsrpc_stream_t *stream) {
+  return (!stream->is_in_body && stream->start == stream->length);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Parses the header block in [head, end), the blank line excluded, for its
+ * Content-Length. Other headers are skipped. Returns false if there is none,
+ * or if it is malformed.
+ */
+static bool
+stream_parse_head (
+  const char           *head,
+  const char           *end,
+  size_t               *content_length
+) {
+  bool has_length = false;
+
+  while (head < end) {
+    const char *eol = memchr(head, '\r', (size_t) (end - head));
+    size_t      name_length = (sizeof(STREAM_CONTENT_LENGTH) - 1);
+
+    if (NULL == eol) {
+      eol = end;
+    }
+
+    if ((size_t) (eol - head) > name_length
+        && 0 == strncasecmp(head, STREAM_CONTENT_LENGTH, name_length)) {
+      const char *pp = &head[name_length];
+      size_t      value = 0;
+
+      while (pp < eol && (' ' == *pp || '\t' == *pp)) {
+        ++pp;
+      }
+      if (pp == eol || has_length) {
+        return false;
+      }
+      for (; pp < eol && '0' <= *pp && '9' >= *pp; ++pp) {
+        if (value > ((SIZE_MAX - 9) / 10)) {
+          return false;
+        }
+        value = (value * 10) + (size_t) (*pp - '0');
+      }
+      while (pp < eol && (' ' == *pp || '\t' == *pp)) {
+        ++pp;
+      }
+      if (pp != eol) {
+        return false;
+      }
+      *content_length = value;
+      has_length = true;
+    }
+
+    /* Skip the CRLF */
+    head = eol + 2;
+  }
+
+  return has_length;
+
+} /* stream_parse_head() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_stream_next (
+  hpjsrpc_stream_t                      *stream,
+  const char                           **body,
+  size_t                                *length_in_bytes
+) {
+
+  if (unlikely(stream->is_failed)) {
+    return HPJSRPC_PARSE_ERROR_INVAL;
+  }
+
+  if (!stream->is_in_body) {
+    /* Resume the search for the blank line where it left off */
+    size_t      from = (stream->scanned > (stream->start + 3))
+      ? (stream->scanned - 3) : stream->start;
+    const char *blank = memmem(&stream->buffer[from],
+      (stream->length - from), "\r\n\r\n", 4);
+
+    if (NULL == blank) {
+      stream->scanned = stream->length;
+      if ((stream->length - stream->start) >= HPJSRPC_STREAM_MAX_HEAD) {
+        stream->is_failed = true;
+        return HPJSRPC_PARSE_ERROR_INVAL;
+      }
+      return HPJSRPC_PARSE_ERROR_PART;
+    }
+
+    if ((size_t) (blank - &stream->buffer[stream->start])
+          >= HPJSRPC_STREAM_MAX_HEAD
+        || !stream_parse_head(&stream->buffer[stream->start], (blank + 2),
+          &stream->body_length)
+        || stream->body_length > stream->max_body_in_bytes) {
+      stream->is_failed = true;
+      return HPJSRPC_PARSE_ERROR_INVAL;
+    }
+    stream->body_start = (size_t) (blank + 4 - stream->buffer);
+    stream->is_in_body = true;
+  }
+
+  if ((stream->length - stream->body_start) < stream->body_length) {
+    return HPJSRPC_PARSE_ERROR_PART;
+  }
+
+  *body = &stream->buffer[stream->body_start];
+  *length_in_bytes = stream->body_length;
+  stream->start = stream->scanned = (stream->body_start + stream->body_length);
+  stream->is_in_body = false;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_stream_next() */
+
+/* ------------------------------------------------------------------------- */
+
+size_t
+hpjsrpc_stream_header (char *dst, size_t length_in_bytes) {
+  return (size_t) snprintf(dst, HPJSRPC_STREAM_MAX_HEAD,
+    "Content-Length: %zu\r\n\r\n", length_in_bytes);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Writes the header, then the reply segments, a batch of iovecs at a time */
+static HPJSRPC_RETURN
+stream_write_reply (
+  hpjsrpc_buffer_t     *buf,
+  int                   out_fd
+) {
+  char          head[HPJSRPC_STREAM_MAX_HEAD];
+  struct iovec  iov[STREAM_WRITE_IOVECS];
+  size_t        length = hpjsrpc_buffer_length(buf);
+  size_t        offset = 0;
+  size_t        iov_count;
+
+  iov[0].iov_base = head;
+  iov[0].iov_len = hpjsrpc_stream_header(head, length);
+  iov_count = 1;
+
+  for (;;) {
+    HPJSRPC_RETURN rc;
+    size_t         filled = hpjsrpc_buffer_iovec_at(buf, offset,
+      &iov[iov_count], (STREAM_WRITE_IOVECS - iov_count));
+
+    for (size_t ii = 0; ii < filled; ++ii) {
+      offset += iov[iov_count + ii].iov_len;
+    }
+    iov_count += filled;
+
+    rc = hpjsrpc_sink_fd(&out_fd, iov, iov_count);
+    if (HPJSRPC_NO_ERROR != rc || offset >= length) {
+      return rc;
+    }
+    iov_count = 0;
+  }
+
+} /* stream_write_reply() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_stream_serve (
+  hpjsrpc_stream_t                      *stream,
+  hpjsrpc_context_t                     *ctx,
+  int                                    in_fd,
+  int                                    out_fd
+) {
+
+  if (NULL == stream || NULL == ctx) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  for (;;) {
+    HPJSRPC_RETURN  rc;
+    const char     *body;
+    size_t          length;
+    size_t          available;
+    void           *space;
+    ssize_t         got;
+
+    /* Everything already buffered is handled before reading again */
+    while (HPJSRPC_NO_ERROR == (rc = hpjsrpc_stream_next(stream, &body,
+        &length))) {
+      hpjsrpc_buffer_t *buf;
+
+      hpjsrpc_context_process(ctx, body, length);
+      buf = &hpjsrpc_context_response(ctx)->buffer;
+      if (0 < hpjsrpc_buffer_length(buf)) {
+        rc = stream_write_reply(buf, out_fd);
+        if (HPJSRPC_NO_ERROR != rc) {
+          return rc;
+        }
+      }
+    }
+    if (HPJSRPC_PARSE_ERROR_PART != rc) {
+      return rc;
+    }
+
+    space = hpjsrpc_stream_space(stream, &available);
+    do {
+      got = read(in_fd, space, available);
+    } while (0 > got && EINTR == errno);
+
+    if (0 > got) {
+      return HPJSRPC_ASSERTION_ERROR;
+    }
+    if (0 == got) {
+      return hpjsrpc_stream_is_idle(stream)
+        ? HPJSRPC_NO_ERROR : HPJSRPC_PARSE_ERROR_PART;
+    }
+    hpjsrpc_stream_commit(stream, (size_t) got);
+  }
+
+} /* hpjsrpc_stream_serve() */
+
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+# include <cpuid.h>
+#endif
+
+#include "hpjsrpc_timing.h"
+
+/* How long the TSC is measured against CLOCK_MONOTONIC_RAW */
+#define TIMING_CALIBRATION_NS             2000000ull
+
+/* Until calibrated, and for good without a TSC: nanoseconds as they are */
+hpjsrpc_timing_clock_t hpjsrpc_timing_clock = { (1ull << 32), false };
+
+static pthread_once_t timing_once = PTHREAD_ONCE_INIT;
+
+/* ------------------------------------------------------------------------- */
+
+uint64_t
+hpjsrpc_timing_raw_ns (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000ull) + (uint64_t) ts.tv_nsec;
+}
+
+/* ------------------------------------------------------------------------- */
+
+#if defined(__x86_64__)
+
+/*
+ * The TSC is only a clock if it ticks at a constant rate through frequency
+ * and power state changes, and on every core alike: an invariant TSC, with
+ * rdtscp to read it.
+ */
+static bool
+timing_has_invariant_tsc (void) {
+  unsigned eax, ebx, ecx, edx;
+
+  if (0 == __get_cpuid(0x80000000u, &eax, &ebx, &ecx, &edx)
+      || 0x80000007u > eax) {
+    return false;
+  }
+  if (0 == __get_cpuid(0x80000001u, &eax, &ebx, &ecx, &edx)
+      || 0 == (edx & (1u << 27))) {
+    return false;
+  }
+  if (0 == __get_cpuid(0x80000007u, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+
+  return (0 != (edx & (1u << 8)));
+
+} /* timing_has_invariant_tsc() */
+
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+static void
+timing_calibrate_once (void) {
+#if defined(__x86_64__)
+  uint64_t start_ns;
+  uint64_t end_ns;
+  uint64_t start_ticks;
+  uint64_t end_ticks;
+
+  if (!timing_has_invariant_tsc()) {
+    return;
+  }
+
+  /* Read back to back, so that both clocks start at the same instant */
+  hpjsrpc_timing_clock.is_tsc = true;
+  start_ticks = hpjsrpc_timing_begin();
+  start_ns = hpjsrpc_timing_raw_ns();
+  do {
+    end_ns = hpjsrpc_timing_raw_ns();
+  } while ((end_ns - start_ns) < TIMING_CALIBRATION_NS);
+  end_ticks = hpjsrpc_timing_end();
+
+  if (end_ticks <= start_ticks) {
+    hpjsrpc_timing_clock.is_tsc = false;
+    return;
+  }
+  hpjsrpc_timing_clock.mult = (uint64_t) ((((unsigned __int128)
+    (end_ns - start_ns)) << 32) / (end_ticks - start_ticks));
+#endif
+
+} /* timing_calibrate_once() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+hpjsrpc_timing_calibrate (void) {
+  pthread_once(&timing_once, timing_calibrate_once);
+}
+
+/* vi: set et sw=2 ts=2: */
@@ -1,11 +1,17 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
 
 #include "libhpjsrpc.h"
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_pool.h"
+#include "hpjsrpc_segment.h"
 #include "jsmn.h"
 
 #ifdef BRANCHLESS
@@ -17,17 +23,306 @@
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+#define RPC_TEMPLATE_CAPACITY_IN_BYTES    128
+
+/*
+ * Everything in a response but the id is constant for a given outcome, so
+ * it is rendered once and copied in. Error templates stop just short of the
+ * id, i.e. {"jsonrpc":"2.0","error":{...},"id":
+ */
+typedef struct {
+  uint8_t                         data[RPC_TEMPLATE_CAPACITY_IN_BYTES];
+  size_t                          size_in_bytes;
+} rpc_template_t;
+
+enum {
+  RPC_TEMPLATE_PARSE_ERROR = 0,
+  RPC_TEMPLATE_INVALID_REQUEST,
+  RPC_TEMPLATE_METHODNOTFOUND,
+  RPC_TEMPLATE_INVALIDPARAMS,
+  RPC_TEMPLATE_INTERNALERROR,
+  RPC_TEMPLATE_SERVER_BUSY,
+  RPC_TEMPLATE_COUNT
+};
+
+/* Admission slots a request holds, see hpjsrpc_set_admission() */
+#define RPC_ADMIT_ENGINE                  0x1u
+#define RPC_ADMIT_METHOD                  0x2u
+/* The engine slot, moved to the pending count by hpjsrpc_defer() */
+#define RPC_ADMIT_PENDING                 0x4u
+/* Held the engine slot to the end; its latency feeds an adaptive limit */
+#define RPC_ADMIT_SAMPLE                  0x8u
+
+/* The adaptive limit is kept in fixed point, to step it by 1/limit */
+#define RPC_LIMIT_SHIFT                   16
+
+/*
+ * Shared counters are kept at least a cache line away from what every
+ * request only reads, whatever the alignment of the allocation.
+ */
+#define RPC_CACHE_LINE_IN_BYTES           64
+
+typedef struct {
+  hpjsrpc_admission_config_t      config;
+  uint8_t                         pad[RPC_CACHE_LINE_IN_BYTES];
+  size_t                          in_progress;
+  size_t                          pending;
+  /* 0 for no limit */
+  uint64_t                        limit_fp;
+  /* Latencies seen since the limit was last cut */
+  uint64_t                        samples;
+  uint64_t                        rejected;
+} rpc_admission_t;
+
+/* Registered methods are copied into these, next to their own counters */
+typedef struct {
+  /* First, as requests point at it */
+  hpjsrpc_method_t                method;
+  uint8_t                         pad_before[RPC_CACHE_LINE_IN_BYTES];
+  size_t                          in_progress;
+  uint8_t                         pad_after[RPC_CACHE_LINE_IN_BYTES];
+} rpc_method_entry_t;
+
+typedef struct rpc_method_block_t rpc_method_block_t;
+
+struct rpc_method_block_t {
+  rpc_method_block_t             *next;
+  rpc_method_entry_t              entries[];
+};
+
+static const char rpc_result_prefix[] = "{\"jsonrpc\":\"2.0\",\"id\":";
+static const char rpc_result_infix[] = ",\"result\":";
+
 struct hpjsrpc_engine_t {
   art_tree                        method_tree;
   uint32_t                        method_count;
+  hpjsrpc_pool_t                 *pool;
+  rpc_template_t                  error_template[RPC_TEMPLATE_COUNT];
+  rpc_method_block_t             *method_blocks;
+  /* NULL while admission control is off */
+  rpc_admission_t                *admission;
+  /* See hpjsrpc_set_timing() */
+  uint32_t                        timing_every;
+  /* See hpjsrpc_deadline_stats(); last, and written to only on expiry */
+  uint8_t                         pad[RPC_CACHE_LINE_IN_BYTES];
+  uint64_t                        deadline_expired;
+  uint64_t                        deadline_cancelled;
 };
 
+typedef struct hpjsrpc_batch_t hpjsrpc_batch_t;
+
+typedef struct {
+  hpjsrpc_request_t               req;
+  hpjsrpc_batch_t                *batch;
+  HPJSRPC_RETURN                  rc;
+  bool                            is_submitted;
+  /* Element response, when the batch response is chained */
+  hpjsrpc_buffer_t                buffer;
+} hpjsrpc_batch_element_t;
+
+/* One per call: batches may be fanned out from many threads at once */
+struct hpjsrpc_batch_t {
+  hpjsrpc_pool_t                 *pool;
+  /* Element chains are drawn from here */
+  hpjsrpc_segment_pool_t         *segment_pool;
+  size_t                          remaining;
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* Maps an internal return code onto the JSON-RPC error code reported */
+static HPJSRPC_RETURN
+rpc_reply_code (HPJSRPC_RETURN rc) {
+  switch (rc) {
+    case HPJSRPC_PARSE_ERROR_NOMEM:
+    case HPJSRPC_PARSE_ERROR_INVAL:
+    case HPJSRPC_PARSE_ERROR_PART:
+      return JSONRPC_20_PARSE_ERROR;
+
+    //request malformed
+    case HPJSRPC_RPC_ERROR_INVALIDOUTER:
+    case HPJSRPC_RPC_ERROR_INVALIDVERSION:
+    case HPJSRPC_RPC_ERROR_INVALIDID:
+    case HPJSRPC_RPC_ERROR_INVALIDMETHOD:
+    case HPJSRPC_RPC_ERROR_INVALIDPARAMS:
+      return JSONRPC_20_INVALID_REQUEST;
+
+    case HPJSRPC_RPC_ERROR_PARAMSMISMATCH:
+      return JSONRPC_20_INVALIDPARAMS;
+
+    case HPJSRPC_RPC_ERROR_METHODNOTFOUND:
+      return JSONRPC_20_METHODNOTFOUND;
+
+    case HPJSRPC_RPC_ERROR_BUSY:
+      return JSONRPC_20_SERVER_BUSY;
+
+    /* A deferred reply is not allowed here, e.g. inside a batch */
+    case HPJSRPC_PENDING:
+    case HPJSRPC_RPC_ERROR_INSTALLMETHODS:
+    case HPJSRPC_RPC_ERROR_OUTOFRESBUF:
+    case HPJSRPC_ASSERTION_ERROR:
+    case HPJSRPC_RPC_ERROR_SINK:
+    case HPJSRPC_CLOSED:
+      return JSONRPC_20_INTERNALERROR;
+
+    /* Normally dropped unanswered; see rpc_complete_request() */
+    case HPJSRPC_RPC_ERROR_EXPIRED:
+      return JSONRPC_20_INTERNALERROR;
+
+    /* Methods may return anything; none of it may take the server down */
+    default:
+      return JSONRPC_20_INTERNALERROR;
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+
+static int
+rpc_error_template_index (HPJSRPC_RETURN return_code) {
+  switch (return_code) {
+    case JSONRPC_20_PARSE_ERROR:
+      return RPC_TEMPLATE_PARSE_ERROR;
+    case JSONRPC_20_INVALID_REQUEST:
+      return RPC_TEMPLATE_INVALID_REQUEST;
+    case JSONRPC_20_METHODNOTFOUND:
+      return RPC_TEMPLATE_METHODNOTFOUND;
+    case JSONRPC_20_INVALIDPARAMS:
+      return RPC_TEMPLATE_INVALIDPARAMS;
+    case JSONRPC_20_INTERNALERROR:
+      return RPC_TEMPLATE_INTERNALERROR;
+    case JSONRPC_20_SERVER_BUSY:
+      return RPC_TEMPLATE_SERVER_BUSY;
+    default:
+      return -1;
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Writes the error response up to (not including) the id */
+static HPJSRPC_RETURN
+rpc_render_error_head (
+  hpjsrpc_buffer_t     *buf,
+  HPJSRPC_RETURN        return_code
+) {
+  const char *message = hpjsrpc_error_string(return_code);
+
+  hpjsrpc_json_begin_object(buf);
+  hpjsrpc_json_key(buf, "jsonrpc", 7);
+  hpjsrpc_json_string_raw(buf, "2.0", 3);
+  hpjsrpc_json_key(buf, "error", 5);
+  hpjsrpc_json_begin_object(buf);
+  hpjsrpc_json_key(buf, "code", 4);
+  hpjsrpc_json_int(buf, return_code);
+  hpjsrpc_json_key(buf, "message", 7);
+  hpjsrpc_json_string(buf, message, strlen(message));
+  hpjsrpc_json_end_object(buf);
+  hpjsrpc_json_key(buf, "id", 2);
+
+  return hpjsrpc_json_status(buf);
+
+} /* rpc_render_error_head() */
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+rpc_render_templates (hpjsrpc_engine_t *engine) {
+  /* In RPC_TEMPLATE_* order */
+  static const HPJSRPC_RETURN codes[RPC_TEMPLATE_COUNT] = {
+    JSONRPC_20_PARSE_ERROR,
+    JSONRPC_20_INVALID_REQUEST,
+    JSONRPC_20_METHODNOTFOUND,
+    JSONRPC_20_INVALIDPARAMS,
+    JSONRPC_20_INTERNALERROR,
+    JSONRPC_20_SERVER_BUSY,
+  };
+
+  for (int ii = 0; ii < RPC_TEMPLATE_COUNT; ++ii) {
+    rpc_template_t   *tmpl = &engine->error_template[ii];
+    hpjsrpc_buffer_t  buf;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.data = tmpl->data;
+    buf.capacity_in_bytes = sizeof(tmpl->data);
+    hpjsrpc_buffer_rewind(&buf);
+
+    if (HPJSRPC_NO_ERROR != rpc_render_error_head(&buf, codes[ii])) {
+      return HPJSRPC_ASSERTION_ERROR;
+    }
+    tmpl->size_in_bytes = buf.size_in_bytes;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* rpc_render_templates() */
+
+/* ------------------------------------------------------------------------- */
+
+static hpjsrpc_allocator_t rpc_allocator = { malloc, free };
+
+HPJSRPC_RETURN
+hpjsrpc_set_allocator (const hpjsrpc_allocator_t *allocator) {
+
+  if (NULL == allocator) {
+    rpc_allocator.malloc_fn = malloc;
+    rpc_allocator.free_fn = free;
+    return HPJSRPC_NO_ERROR;
+  }
+
+  if (NULL == allocator->malloc_fn || NULL == allocator->free_fn) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  rpc_allocator = *allocator;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_set_allocator() */
+
+/* ------------------------------------------------------------------------- */
+
+void *
+hpjsrpc_malloc (size_t size_in_bytes) {
+  return rpc_allocator.malloc_fn(size_in_bytes);
+}
+
+/* ------------------------------------------------------------------------- */
+
+void *
+hpjsrpc_calloc (
+  size_t                count,
+  size_t                size_in_bytes
+) {
+  void *ptr;
+
+  if (0 != size_in_bytes && (SIZE_MAX / size_in_bytes) < count) {
+    return NULL;
+  }
+
+  ptr = rpc_allocator.malloc_fn(count * size_in_bytes);
+  if (NULL != ptr) {
+    memset(ptr, 0, (count * size_in_bytes));
+  }
+
+  return ptr;
+
+} /* hpjsrpc_calloc() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+hpjsrpc_free (void *ptr) {
+  if (NULL != ptr) {
+    rpc_allocator.free_fn(ptr);
+  }
+}
+
 /* ------------------------------------------------------------------------- */
 
 HPJSRPC_RETURN
 hpjsrpc_new (hpjsrpc_engine_t **pptr) {
   HPJSRPC_RETURN     rc;
-  hpjsrpc_engine_t   *new_engine = calloc(sizeof(*new_engine), 1);
+  hpjsrpc_engine_t   *new_engine = hpjsrpc_calloc(1, sizeof(*new_engine));
 
   if (NULL == new_engine) {
     return HPJSRPC_ASSERTION_ERROR;
@@ -54,11 +349,22 @@ hpjsrpc_init (hpjsrpc_engine_t *engine) {
   }
 
   engine->method_count = 0;
+  engine->pool = NULL;
+  engine->method_blocks = NULL;
+  engine->admission = NULL;
+  engine->deadline_expired = 0;
+  engine->deadline_cancelled = 0;
+#if HPJSRPC_TIMING
+  engine->timing_every = 1;
+  hpjsrpc_timing_calibrate();
+#else
+  engine->timing_every = 0;
+#endif
   if (0 != init_art_tree(&engine->method_tree)) {
     return HPJSRPC_ASSERTION_ERROR;
   }
 
-  return HPJSRPC_NO_ERROR;
+  return rpc_render_templates(engine);
 
 } /* hpjsrpc_init() */
 
@@ -71,7 +377,15 @@ hpjsrpc_done (hpjsrpc_engine_t *engine) {
     return HPJSRPC_ASSERTION_ERROR;
   }
 
+  hpjsrpc_stop_workers(engine);
   destroy_art_tree(&engine->method_tree);
+  while (NULL != engine->method_blocks) {
+    rpc_method_block_t *block = engine->method_blocks;
+    engine->method_blocks = block->next;
+    hpjsrpc_free(block);
+  }
+  hpjsrpc_free(engine->admission);
+  engine->admission = NULL;
 
   return HPJSRPC_NO_ERROR;
 
@@ -92,11 +406,179 @@ hpjsrpc_destroy (hpjsrpc_engine_t *engine) {
     return rc;
   }
 
-  free(engine);
+  hpjsrpc_free(engine);
 
   return HPJSRPC_NO_ERROR;
 
 } /* hpjsrpc_done() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_start_workers (
+  hpjsrpc_engine_t             *engine,
+  size_t                        worker_count,
+  size_t                        segment_capacity_in_bytes
+) {
+
+  if (NULL == engine || NULL != engine->pool) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  return hpjsrpc_pool_new(&engine->pool, worker_count,
+    segment_capacity_in_bytes);
+
+} /* hpjsrpc_start_workers() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_stop_workers (hpjsrpc_engine_t *engine) {
+  HPJSRPC_RETURN rc;
+
+  if (NULL == engine) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (NULL == engine->pool) {
+    return HPJSRPC_NO_ERROR;
+  }
+
+  rc = hpjsrpc_pool_destroy(engine->pool);
+  engine->pool = NULL;
+
+  return rc;
+
+} /* hpjsrpc_stop_workers() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_set_timing (
+  hpjsrpc_engine_t                     *engine,
+  uint32_t                              sample_every
+) {
+
+  if (NULL == engine || (0 == HPJSRPC_TIMING && 0 != sample_every)) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  __atomic_store_n(&engine->timing_every, sample_every, __ATOMIC_RELAXED);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_set_timing() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_set_admission (
+  hpjsrpc_engine_t                     *engine,
+  const hpjsrpc_admission_config_t     *config
+) {
+  rpc_admission_t *admission = NULL;
+
+  if (NULL == engine) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  if (NULL != config) {
+    if (0 != config->target_latency_in_us
+        && (0 == config->max_concurrency
+          || config->min_concurrency > config->max_concurrency)) {
+      return HPJSRPC_ASSERTION_ERROR;
+    }
+
+    admission = hpjsrpc_calloc(1, sizeof(*admission));
+    if (NULL == admission) {
+      return HPJSRPC_ASSERTION_ERROR;
+    }
+    admission->config = *config;
+    if (0 == admission->config.min_concurrency) {
+      admission->config.min_concurrency = 1;
+    }
+    admission->limit_fp = ((uint64_t) config->max_concurrency
+      << RPC_LIMIT_SHIFT);
+    /* The adaptive limit is fed latencies whether or not stages are timed */
+    if (0 != config->target_latency_in_us) {
+      hpjsrpc_timing_calibrate();
+    }
+  }
+
+  hpjsrpc_free(engine->admission);
+  engine->admission = admission;
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_set_admission() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_admission_stats (
+  const hpjsrpc_engine_t               *engine,
+  hpjsrpc_admission_stats_t            *stats
+) {
+  const rpc_admission_t *admission;
+
+  if (NULL == engine || NULL == stats) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  memset(stats, 0, sizeof(*stats));
+  admission = engine->admission;
+  if (NULL != admission) {
+    stats->in_progress = __atomic_load_n(&admission->in_progress,
+      __ATOMIC_RELAXED);
+    stats->pending = __atomic_load_n(&admission->pending, __ATOMIC_RELAXED);
+    stats->limit = (size_t) (__atomic_load_n(&admission->limit_fp,
+      __ATOMIC_RELAXED) >> RPC_LIMIT_SHIFT);
+    stats->rejected = __atomic_load_n(&admission->rejected, __ATOMIC_RELAXED);
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_admission_stats() */
+
+/* ------------------------------------------------------------------------- */
+
+uint64_t
+hpjsrpc_clock_ns (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000ull) + (uint64_t) ts.tv_nsec;
+}
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_deadline_stats (
+  const hpjsrpc_engine_t               *engine,
+  hpjsrpc_deadline_stats_t             *stats
+) {
+
+  if (NULL == engine || NULL == stats) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  stats->expired = __atomic_load_n(&engine->deadline_expired,
+    __ATOMIC_RELAXED);
+  stats->cancelled = __atomic_load_n(&engine->deadline_cancelled,
+    __ATOMIC_RELAXED);
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_deadline_stats() */
+
+/* ------------------------------------------------------------------------- */
+
+void
+rpc_deadline_cancelled (const hpjsrpc_engine_t *engine) {
+  /* Counters are the one thing written while requests are processed */
+  __atomic_add_fetch(&((hpjsrpc_engine_t *) engine)->deadline_cancelled, 1,
+    __ATOMIC_RELAXED);
+}
+
 /* ------------------------------------------------------------------------- */
 
 static void
@@ -152,6 +634,16 @@ rpc_register_methods (
   const hpjsrpc_method_t       *methods,
   size_t                        method_count
 ) {
+  rpc_method_block_t *block = hpjsrpc_calloc(1, (sizeof(*block)
+    + (method_count * sizeof(block->entries[0]))));
+
+  if (NULL == block) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+  /* Kept even if registration fails part way, for what got installed */
+  block->next = server->method_blocks;
+  server->method_blocks = block;
+
   for (size_t ii = 0; ii < method_count; ++ii) {
     if (!((0 != methods[ii].name[0]) & (NULL != methods[ii].func))) {
       return HPJSRPC_RPC_ERROR_INSTALLMETHODS;
@@ -163,8 +655,9 @@ rpc_register_methods (
       return HPJSRPC_RPC_ERROR_INSTALLMETHODS;
     }
 
+    block->entries[ii].method = methods[ii];
     void *rp = art_insert(&server->method_tree, (unsigned char *) methods[ii].name,
-      methods[ii].name_length_in_bytes, (void *) &methods[ii]);
+      methods[ii].name_length_in_bytes, (void *) &block->entries[ii].method);
     if (NULL != rp) {
       return HPJSRPC_RPC_ERROR_INSTALLMETHODS;
     }
@@ -175,6 +668,65 @@ rpc_register_methods (
 
 /* ------------------------------------------------------------------------- */
 
+/*
+ * Stage timing, see hpjsrpc_timing.h. Whether a request is timed is decided
+ * once per thread in N, on a countdown of the thread's own.
+ */
+static inline bool
+rpc_timing_sample (const hpjsrpc_engine_t *engine) {
+#if HPJSRPC_TIMING
+  static __thread uint32_t countdown;
+  uint32_t every;
+
+  if (unlikely(NULL == engine)) {
+    return false;
+  }
+  every = __atomic_load_n(&engine->timing_every, __ATOMIC_RELAXED);
+  if (0 == every) {
+    return false;
+  }
+  if (0 < countdown) {
+    countdown--;
+    return false;
+  }
+  countdown = (every - 1);
+  return true;
+#else
+  (void) engine;
+  return false;
+#endif
+}
+
+static inline uint64_t
+rpc_stage_begin (const hpjsrpc_request_t *req) {
+#if HPJSRPC_TIMING
+  if (req->is_timed) {
+    return hpjsrpc_timing_begin();
+  }
+#endif
+  (void) req;
+  return 0;
+}
+
+static inline void
+rpc_stage_end (
+  hpjsrpc_request_t      *req,
+  hpjsrpc_stage_t         stage,
+  uint64_t                begin
+) {
+#if HPJSRPC_TIMING
+  if (req->is_timed) {
+    req->stat_ns[stage] = hpjsrpc_timing_ns(hpjsrpc_timing_end() - begin);
+  }
+#else
+  (void) req;
+  (void) stage;
+  (void) begin;
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+
 HPJSRPC_RETURN
 rpc_parse_request (
   const char * const      buffer,
@@ -183,10 +735,19 @@ rpc_parse_request (
 ) {
   int iRes;
   jsmn_parser sParser;
+  uint64_t stage;
+
+#if HPJSRPC_TIMING
+  memset(req->stat_ns, 0, sizeof(req->stat_ns));
+  req->stat_total_ns = 0;
+#endif
+  req->is_timed = rpc_timing_sample(req->engine);
 
+  stage = rpc_stage_begin(req);
   jsmn_init(&sParser);
   iRes = jsmn_parse(&sParser, buffer, buffer_length_in_bytes, req->tokens,
     req->max_token_count);
+  rpc_stage_end(req, HPJSRPC_STAGE_PARSE, stage);
 
   // if error during parse, return translated code
   if (iRes < 0) {
@@ -211,6 +772,7 @@ rpc_parse_request (
   req->buffer_length_in_bytes = buffer_length_in_bytes;
   req->tokens = req->tokens;
   req->token_count = iRes;
+  req->root_token = 0;
   req->versionToken = NULL;
   req->methodToken = NULL;
   req->paramsToken = NULL;
@@ -219,6 +781,44 @@ rpc_parse_request (
   return HPJSRPC_NO_ERROR;
 }
 
+/*
+ * Applies the envelope's "deadline_ms", counted from when the request was
+ * received, unless the transport's deadline is earlier. Values other than
+ * non-negative integers are ignored.
+ */
+static void
+rpc_apply_deadline (
+  hpjsrpc_request_t    *req,
+  const jsmntok_t      *key
+) {
+  const jsmntok_t *value;
+  uint64_t         ms = 0;
+  uint64_t         deadline_ns;
+
+  if (1 != key->size) {
+    return;
+  }
+  value = &req->tokens[key->first_child];
+  /* Up to 12 digits, i.e. some 30 years, cannot overflow */
+  if (JSMN_PRIMITIVE != value->type || value->end <= value->start
+      || 12 < (value->end - value->start)) {
+    return;
+  }
+  for (int ii = value->start; ii < value->end; ++ii) {
+    if ('0' > req->buffer[ii] || '9' < req->buffer[ii]) {
+      return;
+    }
+    ms = (ms * 10) + (uint64_t) (req->buffer[ii] - '0');
+  }
+
+  deadline_ns = ((0 != req->received_ns) ? req->received_ns
+    : hpjsrpc_clock_ns()) + (ms * 1000000ull);
+  if (0 == req->deadline_ns || deadline_ns < req->deadline_ns) {
+    req->deadline_ns = deadline_ns;
+  }
+
+} /* rpc_apply_deadline() */
+
 // -------------------------------------------------------------------------- //
 //
 // Here we check the RPC requirements (JSON-RPC Version 2)
@@ -262,18 +862,20 @@ rpc_validate_request_format (
   req->methodToken = NULL;
   req->paramsToken = NULL;
   req->idToken = NULL;
+  req->is_notification = false;
 
   /*
    * In this function, we're validating a single request object. In the case
    * where the client has submitted a batch request, each request in the batch
    * array is validated individually.
    */
-  if (unlikely(!((0 < req->token_count) & (JSMN_OBJECT == req->tokens[0].type)))) {
+  if (unlikely(!((0 < req->token_count)
+      & (JSMN_OBJECT == req->tokens[req->root_token].type)))) {
     return HPJSRPC_RPC_ERROR_INVALIDOUTER;
   }
 
-  if (likely(0 < req->tokens[0].size)) {
-    int sibling = req->tokens[0].first_child;
+  if (likely(0 < req->tokens[req->root_token].size)) {
+    int sibling = req->tokens[req->root_token].first_child;
     do {
       switch (req->tokens[sibling].end - req->tokens[sibling].start) {
         case 6:
@@ -293,6 +895,11 @@ rpc_validate_request_format (
             req->idToken = &req->tokens[sibling];
           }
           break;
+        case 11:
+          if (0 == memcmp("deadline_ms", &req->buffer[req->tokens[sibling].start], 11)) {
+            rpc_apply_deadline(req, &req->tokens[sibling]);
+          }
+          break;
       }
     } while (-1 != (sibling = req->tokens[sibling].next_sibling));
   }
@@ -325,6 +932,8 @@ rpc_validate_request_format (
     if (unlikely(!((1 == req->idToken->size)
         & (0 != ((JSMN_STRING == req->tokens[req->idToken->first_child].type)
                   | (JSMN_PRIMITIVE == req->tokens[req->idToken->first_child].type)))))) {
+      /* Not echoed back; the error reply carries a null id instead */
+      req->idToken = NULL;
       return HPJSRPC_RPC_ERROR_INVALIDID;
     }
 
@@ -371,6 +980,7 @@ rpc_validate_request_format (
         condvar &= validIdPrimitiveTable[(uint8_t) req->buffer[ii]];
       }
       if (0x01 != condvar) {
+        req->idToken = NULL;
         return HPJSRPC_RPC_ERROR_INVALIDID;
       }
       if ((4 == (req->idToken->end - req->idToken->start))
@@ -458,183 +1068,841 @@ printf("type = %d, type = %d, [%.*s]\n",
 /* ------------------------------------------------------------------------- */
 
 static HPJSRPC_RETURN
-rpc_invoke_method (
+rpc_write_id (
   hpjsrpc_request_t   *req,
-  hpjsrpc_response_t  *res
+  hpjsrpc_buffer_t    *buf
 ) {
-  HPJSRPC_RETURN rc;
 
-  if (true == req->is_notification || 0 == res->buffer.capacity_in_bytes) {
-    return req->method->func(req, res);
+  /* Errors detected before the id was located are reported with a null id */
+  if (NULL == req->idToken) {
+    return hpjsrpc_json_null(buf);
   }
 
-  if (JSMN_STRING == req->tokens[req->idToken->first_child].type) {
-    rc = hpjsrpc_buffer_printf(&res->buffer,
-      "{\"jsonrpc\":\"2.0\",\"id\":%s%.*s%s,\"result\":",
-      (JSMN_STRING == req->tokens[req->idToken->first_child].type) ? "\"" : "",
-      (req->tokens[req->idToken->first_child].end
-        - req->tokens[req->idToken->first_child].start),
-      &req->buffer[req->tokens[req->idToken->first_child].start],
-      (JSMN_STRING == req->tokens[req->idToken->first_child].type) ? "\"" : "");
-  } else {
-    rc = hpjsrpc_buffer_printf(&res->buffer,
-      "{\"jsonrpc\":\"2.0\",\"id\":%.*s,\"result\":",
-      (req->tokens[req->idToken->first_child].end
-        - req->tokens[req->idToken->first_child].start),
-      &req->buffer[req->tokens[req->idToken->first_child].start]);
-  }
-  if (HPJSRPC_NO_ERROR != rc) {
-    return rc;
-  }
+  return hpjsrpc_json_token(buf, req, &req->tokens[req->idToken->first_child]);
+
+} /* rpc_write_id() */
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+rpc_invoke_method (
+  hpjsrpc_request_t   *req,
+  hpjsrpc_response_t  *res
+) {
+  HPJSRPC_RETURN rc;
+
+  if (true == req->is_notification) {
+    /* Whatever a notification writes is discarded; never stream it */
+    hpjsrpc_sink_t sink = res->buffer.sink;
+    res->buffer.sink = NULL;
+    rc = req->method->func(req, res);
+    res->buffer.sink = sink;
+    return rc;
+  }
+
+  if (0 == res->buffer.capacity_in_bytes
+      && NULL == res->buffer.segment_pool) {
+    return req->method->func(req, res);
+  }
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(&res->buffer,
+      rpc_result_prefix, (sizeof(rpc_result_prefix) - 1))) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+  hpjsrpc_json_expect_value(&res->buffer, 1);
+  rpc_write_id(req, &res->buffer);
+  if (HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(&res->buffer,
+      rpc_result_infix, (sizeof(rpc_result_infix) - 1))) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+  hpjsrpc_json_expect_value(&res->buffer, 1);
+  rc = hpjsrpc_json_status(&res->buffer);
+  if (HPJSRPC_NO_ERROR != rc) {
+    return rc;
+  }
 
   rc = req->method->func(req, res);
   if (HPJSRPC_NO_ERROR != rc) {
     return rc;
   }
 
-  rc = hpjsrpc_buffer_printf(&res->buffer, "}\0");
+  hpjsrpc_json_end_object(&res->buffer);
 
-  return rc;
+  return hpjsrpc_json_status(&res->buffer);
 
 } /* rpc_invoke_method() */
 
 /* ------------------------------------------------------------------------- */
 
+/* Writes an error reply up to the id, from its template where there is one */
+static HPJSRPC_RETURN
+rpc_write_error_head (
+  const hpjsrpc_engine_t *engine,
+  hpjsrpc_buffer_t       *buf,
+  HPJSRPC_RETURN          return_code
+) {
+  int index = rpc_error_template_index(return_code);
+
+  if (likely(0 <= index)) {
+    const rpc_template_t *tmpl = &engine->error_template[index];
+    if (HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(buf, tmpl->data,
+        tmpl->size_in_bytes)) {
+      return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+    }
+    hpjsrpc_json_expect_value(buf, 1);
+    return HPJSRPC_NO_ERROR;
+  }
+
+  return rpc_render_error_head(buf, return_code);
+
+} /* rpc_write_error_head() */
+
+/* ------------------------------------------------------------------------- */
+
 static int
 rpc_print_error_json (
   hpjsrpc_request_t    *req,
   hpjsrpc_response_t   *res,
   HPJSRPC_RETURN        return_code
 ) {
-  res->buffer.size_in_bytes = 0;
-  HPJSRPC_RETURN rc = hpjsrpc_buffer_printf(&res->buffer,
-    "{\"jsonrpc\":\"2.0\",\"error\":{\"code\":%d,\"message\":\"%s\"},\"id\":%s%.*s%s}",
-    return_code,
-    hpjsrpc_error_string(return_code),
-    (JSMN_STRING == req->tokens[req->idToken->first_child].type) ? "\"" : "",
-    (req->tokens[req->idToken->first_child].end
-      - req->tokens[req->idToken->first_child].start),
-    &req->buffer[req->tokens[req->idToken->first_child].start],
-    (JSMN_STRING == req->tokens[req->idToken->first_child].type) ? "\"" : "");
 
-  return rc;
+  hpjsrpc_buffer_rewind(&res->buffer);
+
+  if (HPJSRPC_NO_ERROR != rpc_write_error_head(req->engine, &res->buffer,
+      return_code)) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+  rpc_write_id(req, &res->buffer);
+  hpjsrpc_json_end_object(&res->buffer);
+
+  return hpjsrpc_json_status(&res->buffer);
 }
 
 /* ------------------------------------------------------------------------- */
 
 HPJSRPC_RETURN
-rpc_process_request (
-  hpjsrpc_request_t      *req,
-  hpjsrpc_response_t     *res
+rpc_write_result_head (
+  hpjsrpc_buffer_t       *buf,
+  const void             *id,
+  size_t                  id_length_in_bytes
 ) {
 
-  HPJSRPC_RETURN  rc = HPJSRPC_NO_ERROR;
-  TicTocTimer     command_clock = tic();
-  TicTocTimer     clock;
+  if (HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(buf, rpc_result_prefix,
+      (sizeof(rpc_result_prefix) - 1))) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+  hpjsrpc_json_expect_value(buf, 1);
+  if (NULL == id) {
+    hpjsrpc_json_null(buf);
+  } else {
+    hpjsrpc_json_raw(buf, id, id_length_in_bytes);
+  }
+  if (HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(buf, rpc_result_infix,
+      (sizeof(rpc_result_infix) - 1))) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+  hpjsrpc_json_expect_value(buf, 1);
 
-  __builtin_prefetch(req->buffer, 0, 1);
-  __builtin_prefetch(&req->tokens, 0, 1);
-  __builtin_prefetch(&res->buffer, 0, 1);
-  __builtin_prefetch(&res->buffer.data, 0, 1);
+  return hpjsrpc_json_status(buf);
+
+} /* rpc_write_result_head() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+rpc_write_error (
+  const hpjsrpc_engine_t *engine,
+  hpjsrpc_buffer_t       *buf,
+  HPJSRPC_RETURN          rc,
+  const void             *id,
+  size_t                  id_length_in_bytes
+) {
+
+  if (HPJSRPC_NO_ERROR != rpc_write_error_head(engine, buf,
+      rpc_reply_code(rc))) {
+    return HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+  if (NULL == id) {
+    hpjsrpc_json_null(buf);
+  } else {
+    hpjsrpc_json_raw(buf, id, id_length_in_bytes);
+  }
+  hpjsrpc_json_end_object(buf);
+
+  return hpjsrpc_json_status(buf);
+
+} /* rpc_write_error() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Takes an engine slot; false if the request is to be turned away */
+static bool
+rpc_admit_engine (rpc_admission_t *admission) {
+  size_t limit = (size_t) (__atomic_load_n(&admission->limit_fp,
+    __ATOMIC_RELAXED) >> RPC_LIMIT_SHIFT);
+
+  if (0 != admission->config.max_pending
+      && __atomic_load_n(&admission->pending, __ATOMIC_RELAXED)
+        >= admission->config.max_pending) {
+    return false;
+  }
+
+  /* Taken, then checked, so racing requests cannot overshoot the limit */
+  if (__atomic_add_fetch(&admission->in_progress, 1, __ATOMIC_RELAXED) > limit
+      && 0 != limit) {
+    __atomic_sub_fetch(&admission->in_progress, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  return true;
+
+} /* rpc_admit_engine() */
+
+/* ------------------------------------------------------------------------- */
+
+static bool
+rpc_admit_method (const hpjsrpc_method_t *method) {
+  rpc_method_entry_t *entry = (rpc_method_entry_t *) method;
+
+  if (__atomic_add_fetch(&entry->in_progress, 1, __ATOMIC_RELAXED)
+      > method->max_concurrency) {
+    __atomic_sub_fetch(&entry->in_progress, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  return true;
+
+} /* rpc_admit_method() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Counts a request turned away, and answers it "server busy" */
+static HPJSRPC_RETURN
+rpc_reject (const hpjsrpc_engine_t *engine) {
+
+  if (NULL != engine->admission) {
+    __atomic_add_fetch(&engine->admission->rejected, 1, __ATOMIC_RELAXED);
+  }
 
-  req->stat_validate_request_time = 0;
-  req->stat_validate_method_time = 0;
-  req->stat_invoke_method_time = 0;
+  return HPJSRPC_RPC_ERROR_BUSY;
+
+} /* rpc_reject() */
+
+/* ------------------------------------------------------------------------- */
 
+void
+rpc_admission_release (
+  const hpjsrpc_engine_t               *engine,
+  const hpjsrpc_method_t               *method,
+  uint32_t                              admission
+) {
+
+  if (0 != (admission & RPC_ADMIT_ENGINE)) {
+    __atomic_sub_fetch(&engine->admission->in_progress, 1, __ATOMIC_RELAXED);
+  }
+  if (0 != (admission & RPC_ADMIT_PENDING)) {
+    __atomic_sub_fetch(&engine->admission->pending, 1, __ATOMIC_RELAXED);
+  }
+  if (0 != (admission & RPC_ADMIT_METHOD)) {
+    __atomic_sub_fetch(&((rpc_method_entry_t *) method)->in_progress, 1,
+      __ATOMIC_RELAXED);
+  }
+
+} /* rpc_admission_release() */
+
+/* ------------------------------------------------------------------------- */
+
+uint32_t
+rpc_admission_defer (hpjsrpc_request_t *req) {
+  uint32_t admission = req->admission;
+
+  req->admission = 0;
+  if (0 != (admission & RPC_ADMIT_ENGINE)) {
+    rpc_admission_t *state = req->engine->admission;
+
+    __atomic_add_fetch(&state->pending, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&state->in_progress, 1, __ATOMIC_RELAXED);
+    admission = ((admission & ~RPC_ADMIT_ENGINE) | RPC_ADMIT_PENDING);
+  }
+
+  return admission;
+
+} /* rpc_admission_defer() */
+
+/* ------------------------------------------------------------------------- */
 
-  // handle batch
 /*
-  rc = rpc_parse_request(pcCommand, iCommandLen);
-  if (rc != HPJSRPC_NO_ERROR) {
-      goto L_done;
+ * Adapts the concurrency limit to a request's latency: a tenth off if it
+ * was over the target, at most once per limit's worth of requests, or
+ * 1/limit up if it was within it while the limit is in use.
+ */
+static void
+rpc_admission_sample (
+  rpc_admission_t      *admission,
+  uint64_t              latency_in_us
+) {
+  uint64_t limit_fp = __atomic_load_n(&admission->limit_fp, __ATOMIC_RELAXED);
+  uint64_t limit = (limit_fp >> RPC_LIMIT_SHIFT);
+  uint64_t samples = __atomic_add_fetch(&admission->samples, 1,
+    __ATOMIC_RELAXED);
+  uint64_t next_fp;
+
+  if (latency_in_us > admission->config.target_latency_in_us) {
+    uint64_t floor_fp = ((uint64_t) admission->config.min_concurrency
+      << RPC_LIMIT_SHIFT);
+
+    /* Whoever resets the window cuts */
+    if (samples < limit || __atomic_exchange_n(&admission->samples, 0,
+        __ATOMIC_RELAXED) < limit) {
+      return;
+    }
+    next_fp = (limit_fp - (limit_fp / 10));
+    if (next_fp < floor_fp) {
+      next_fp = floor_fp;
+    }
+  } else {
+    uint64_t ceiling_fp = ((uint64_t) admission->config.max_concurrency
+      << RPC_LIMIT_SHIFT);
+
+    if ((2 * (__atomic_load_n(&admission->in_progress, __ATOMIC_RELAXED) + 1))
+        < limit) {
+      return;
+    }
+    next_fp = (limit_fp + ((1ull << (2 * RPC_LIMIT_SHIFT)) / limit_fp));
+    if (next_fp > ceiling_fp) {
+      next_fp = ceiling_fp;
+    }
   }
-*/
 
-  clock = tic();
+  /* Losing a race drops this step; the winner's stands */
+  __atomic_compare_exchange_n(&admission->limit_fp, &limit_fp, next_fp, false,
+    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+} /* rpc_admission_sample() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Validates the request envelope and resolves the method. This is cheap and
+ * runs on the calling thread, also for batch elements, so that only elements
+ * known to target a thread-safe method are handed to the worker pool.
+ */
+static HPJSRPC_RETURN
+rpc_prepare_request (
+  hpjsrpc_request_t      *req
+) {
+
+  HPJSRPC_RETURN  rc = HPJSRPC_NO_ERROR;
+  uint64_t        stage;
+
+  req->method = NULL;
+  req->admission = 0;
+
+  stage = rpc_stage_begin(req);
   rc = rpc_validate_request_format(req);
-  req->stat_validate_request_time = (uint64_t) (toc(&clock) * 1E6f);
+  rpc_stage_end(req, HPJSRPC_STAGE_VALIDATE, stage);
   if (rc != HPJSRPC_NO_ERROR) {
-      goto L_done;
+      return rc;
   }
 
-  clock = tic();
+  /* Nobody waits for the reply any more: dropped unanswered */
+  if (unlikely(0 != req->deadline_ns)
+      && hpjsrpc_clock_ns() >= req->deadline_ns) {
+    req->is_notification = true;
+    __atomic_add_fetch(&req->engine->deadline_expired, 1, __ATOMIC_RELAXED);
+    return HPJSRPC_RPC_ERROR_EXPIRED;
+  }
+
+  /* Overload is turned away before any more work goes into the request */
+  if (NULL != req->engine->admission) {
+    if (unlikely(!rpc_admit_engine(req->engine->admission))) {
+      return rpc_reject(req->engine);
+    }
+    req->admission = RPC_ADMIT_ENGINE;
+  }
+
+  stage = rpc_stage_begin(req);
   rc = rpc_validate_method(req);
-  req->stat_validate_method_time = (uint64_t) (toc(&clock) * 1E6f);
+  rpc_stage_end(req, HPJSRPC_STAGE_LOOKUP, stage);
   if (rc != HPJSRPC_NO_ERROR) {
-      goto L_done;
+      return rc;
+  }
+
+  if (0 != req->method->max_concurrency) {
+    if (unlikely(!rpc_admit_method(req->method))) {
+      return rpc_reject(req->engine);
+    }
+    req->admission |= RPC_ADMIT_METHOD;
   }
 
 #if 0
   rc = rpc_validate_method_call(req);
   if (rc != HPJSRPC_NO_ERROR) {
-      goto L_done;
+      return rc;
   }
 #endif
 
-  clock = tic();
+  return rc;
+
+} /* rpc_prepare_request() */
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+rpc_complete_request (
+  hpjsrpc_request_t      *req,
+  hpjsrpc_response_t     *res,
+  HPJSRPC_RETURN          rc
+) {
+
+  uint64_t        stage;
+  bool            is_invoked = false;
+
+  if (rc != HPJSRPC_NO_ERROR) {
+      goto L_done;
+  }
+
+  is_invoked = true;
+  stage = rpc_stage_begin(req);
   rc = rpc_invoke_method(req, res);
-  req->stat_invoke_method_time = (uint64_t) (toc(&clock) * 1E6f);
+  rpc_stage_end(req, HPJSRPC_STAGE_INVOKE, stage);
   if (rc != HPJSRPC_NO_ERROR) {
       goto L_done;
   }
 
 L_done:
 
+  /* Slots a deferred reply holds on to were taken over by hpjsrpc_defer() */
+  if (0 != req->admission) {
+    rpc_admission_release(req->engine, req->method, req->admission);
+    req->admission = (is_invoked && 0 != (req->admission & RPC_ADMIT_ENGINE))
+      ? RPC_ADMIT_SAMPLE : 0;
+  }
+
+  /* Part of the reply is already out; an error can no longer be reported */
+  if (unlikely(HPJSRPC_NO_ERROR != rc && (0 < res->buffer.sink_flushed_in_bytes
+      || res->buffer.sink_failed))) {
+    hpjsrpc_buffer_rewind(&res->buffer);
+    return HPJSRPC_RPC_ERROR_SINK;
+  }
+
+  /* The method gave up on a reply nobody waits for: dropped, as at dispatch */
+  if (unlikely(HPJSRPC_RPC_ERROR_EXPIRED == rc)) {
+    req->is_notification = true;
+  }
+
+  /* The method took the reply over, see hpjsrpc_defer() */
+  if (HPJSRPC_PENDING == rc && 0 == req->root_token) {
+    hpjsrpc_buffer_rewind(&res->buffer);
+    return rc;
+  }
+
   //form json response
   if (true == req->is_notification) {
+    hpjsrpc_buffer_rewind(&res->buffer);
     if (res->buffer.data && res->buffer.capacity_in_bytes > 0) {
       res->buffer.data[0] = 0;
     }
   } else if (likely(HPJSRPC_NO_ERROR != rc)) {
-    switch (rc) {
-      case HPJSRPC_NO_ERROR:
-        break;
-
-      case HPJSRPC_PARSE_ERROR_NOMEM:
-      case HPJSRPC_PARSE_ERROR_INVAL:
-      case HPJSRPC_PARSE_ERROR_PART:
-        rc = rpc_print_error_json(req, res, JSONRPC_20_PARSE_ERROR);
-        break;
-
-      //request malformed
-      case HPJSRPC_RPC_ERROR_INVALIDOUTER:
-      case HPJSRPC_RPC_ERROR_INVALIDVERSION:
-      case HPJSRPC_RPC_ERROR_INVALIDID:
-      case HPJSRPC_RPC_ERROR_INVALIDMETHOD:
-      case HPJSRPC_RPC_ERROR_INVALIDPARAMS:
-        rc = rpc_print_error_json(req, res, JSONRPC_20_INVALID_REQUEST);
-        break;
-
-      case HPJSRPC_RPC_ERROR_PARAMSMISMATCH:
-        rc = rpc_print_error_json(req, res, JSONRPC_20_INVALIDPARAMS);
-        break;
-
-      case HPJSRPC_RPC_ERROR_METHODNOTFOUND:
-        rc = rpc_print_error_json(req, res, JSONRPC_20_METHODNOTFOUND);
-        break;
-
-      case HPJSRPC_RPC_ERROR_INSTALLMETHODS:
-      case HPJSRPC_RPC_ERROR_OUTOFRESBUF:
-        rc = rpc_print_error_json(req, res, JSONRPC_20_INTERNALERROR);
-        break;
-      default:
-        assert(0);
-    }
+    rc = rpc_print_error_json(req, res, rpc_reply_code(rc));
 
     //plus a special return code
     if (HPJSRPC_RPC_ERROR_OUTOFRESBUF == rc) {
+      hpjsrpc_buffer_rewind(&res->buffer);
       if (res->buffer.data && res->buffer.capacity_in_bytes > 0) {
         res->buffer.data[0] = 0;
       }
     }
   }
 
-  req->stat_process_request_time = (uint64_t) (toc(&command_clock) * 1E6f);
+  return rc;
+
+} /* rpc_complete_request() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Runs one batch element, appending its response (if any) to out. The
+ * element is processed in a window over the unused tail of out, so the
+ * response is written exactly where it ends up.
+ */
+static void
+rpc_batch_run_element (
+  hpjsrpc_batch_element_t  *el,
+  hpjsrpc_buffer_t         *out
+) {
+  hpjsrpc_response_t  res;
+  size_t              separator = ((0 < out->size_in_bytes)
+                        && ('[' != out->data[out->size_in_bytes - 1]));
+  size_t              used = (out->size_in_bytes + separator);
+
+  memset(&res, 0, sizeof(res));
+  res.buffer.data = (out->data + used);
+  res.buffer.capacity_in_bytes = (used < out->capacity_in_bytes)
+    ? (out->capacity_in_bytes - used) : 0;
+  hpjsrpc_buffer_rewind(&res.buffer);
+
+  el->rc = rpc_complete_request(&el->req, &res, el->rc);
+
+  if (false == el->req.is_notification) {
+    if (0 == res.buffer.size_in_bytes) {
+      el->rc = HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+      return;
+    }
+    if (separator) {
+      out->data[out->size_in_bytes] = ',';
+    }
+    out->size_in_bytes = (used + res.buffer.size_in_bytes);
+  }
+
+} /* rpc_batch_run_element() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Chained counterpart of rpc_batch_run_element(): the element gets a chain of
+ * its own, which is later spliced onto the response without copying.
+ */
+static void
+rpc_batch_run_chained (
+  hpjsrpc_batch_element_t  *el
+) {
+  hpjsrpc_response_t  res;
+
+  memset(&res, 0, sizeof(res));
+  hpjsrpc_buffer_init_chained(&res.buffer, el->batch->segment_pool);
+
+  el->rc = rpc_complete_request(&el->req, &res, el->rc);
+
+  if (true == el->req.is_notification
+      || 0 == hpjsrpc_buffer_length(&res.buffer)) {
+    if (false == el->req.is_notification) {
+      el->rc = HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+    }
+    hpjsrpc_buffer_release(&res.buffer);
+  }
+
+  el->buffer = res.buffer;
+
+} /* rpc_batch_run_chained() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+rpc_batch_task (
+  void                 *arg,
+  size_t                worker_index
+) {
+  hpjsrpc_batch_element_t *el = (hpjsrpc_batch_element_t *) arg;
+
+  (void) worker_index;
+
+  /* Context scratch memory belongs to the thread that owns the context */
+  el->req.context = NULL;
+
+  rpc_batch_run_chained(el);
+
+  hpjsrpc_pool_complete(el->batch->pool, &el->batch->remaining);
+
+} /* rpc_batch_task() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Batch requests are an array of request objects. Elements targeting a
+ * thread-safe method are fanned out on the engine's worker pool, if one is
+ * running; all others are run in order on the calling thread.
+ *
+ * Every element on the pool writes its reply into a chain of its own. With
+ * a chained response buffer so do the rest, and the chains are spliced on
+ * in request order without copying. With a fixed response buffer, the
+ * calling thread writes its elements in place, and the pool's chains are
+ * copied in behind them once everything has completed, the one copy a
+ * contiguous reply needs; JSON-RPC permits batch responses to be returned
+ * in any order.
+ */
+static HPJSRPC_RETURN
+rpc_process_batch (
+  hpjsrpc_request_t      *req,
+  hpjsrpc_response_t     *res
+) {
+  HPJSRPC_RETURN            rc = HPJSRPC_NO_ERROR;
+  const jsmntok_t          *root = &req->tokens[req->root_token];
+  hpjsrpc_batch_element_t  *elements;
+  hpjsrpc_batch_t           batch = { NULL, res->buffer.segment_pool, 0 };
+  bool                      is_chained = (NULL != res->buffer.segment_pool);
+  bool                      is_empty = true;
+  int                       sibling;
+
+  if (0 == root->size) {
+    req->idToken = NULL;
+    req->is_notification = false;
+    return rpc_print_error_json(req, res, JSONRPC_20_INVALID_REQUEST);
+  }
+
+  /* From the request arena when there is one; it outlives the batch */
+  if (NULL != req->context) {
+    elements = hpjsrpc_request_alloc(req,
+      ((size_t) root->size * sizeof(*elements)), 0);
+    if (NULL != elements) {
+      memset(elements, 0, ((size_t) root->size * sizeof(*elements)));
+    }
+  } else {
+    elements = hpjsrpc_calloc(root->size, sizeof(*elements));
+  }
+  if (NULL == elements) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  rc = hpjsrpc_buffer_append(&res->buffer, "[", 1);
+  if (HPJSRPC_NO_ERROR != rc) {
+    if (NULL == req->context) {
+      hpjsrpc_free(elements);
+    }
+    return rc;
+  }
+
+  if (NULL != req->engine->pool && 1 < root->size) {
+    batch.pool = req->engine->pool;
+    if (!is_chained) {
+      batch.segment_pool = hpjsrpc_pool_segments(batch.pool);
+    }
+  }
+
+  sibling = root->first_child;
+  for (int ii = 0; ii < root->size; ++ii) {
+    hpjsrpc_batch_element_t *el = &elements[ii];
+
+    el->req = *req;
+    el->req.root_token = sibling;
+    el->batch = &batch;
+    el->rc = rpc_prepare_request(&el->req);
+
+    if (NULL != batch.pool && HPJSRPC_NO_ERROR == el->rc
+        && el->req.method->is_thread_safe) {
+      hpjsrpc_task_t task = { rpc_batch_task, el };
+      __atomic_add_fetch(&batch.remaining, 1, __ATOMIC_ACQ_REL);
+      el->is_submitted = hpjsrpc_pool_submit(batch.pool, ii, task);
+      if (!el->is_submitted) {
+        __atomic_sub_fetch(&batch.remaining, 1, __ATOMIC_ACQ_REL);
+      }
+    }
+
+    sibling = req->tokens[sibling].next_sibling;
+  }
+
+  for (int ii = 0; ii < root->size; ++ii) {
+    if (elements[ii].is_submitted) {
+      continue;
+    }
+    if (is_chained) {
+      rpc_batch_run_chained(&elements[ii]);
+    } else {
+      rpc_batch_run_element(&elements[ii], &res->buffer);
+    }
+  }
+
+  if (NULL != batch.pool) {
+    hpjsrpc_pool_wait(batch.pool, &batch.remaining);
+  }
+
+  if (is_chained) {
+    for (int ii = 0; ii < root->size; ++ii) {
+      if (NULL == elements[ii].buffer.head_segment) {
+        continue;
+      }
+      if (!is_empty
+          && HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(&res->buffer, ",", 1)) {
+        rc = HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+        hpjsrpc_buffer_release(&elements[ii].buffer);
+        continue;
+      }
+      if (HPJSRPC_NO_ERROR
+          != hpjsrpc_buffer_splice(&res->buffer, &elements[ii].buffer)) {
+        rc = HPJSRPC_RPC_ERROR_SINK;
+      }
+      is_empty = false;
+    }
+  } else {
+    for (int ii = 0; ii < root->size; ++ii) {
+      hpjsrpc_buffer_t *chain = &elements[ii].buffer;
+      size_t            separator = (1 < res->buffer.size_in_bytes);
+      size_t            length;
+
+      if (NULL == chain->head_segment) {
+        continue;
+      }
+      length = hpjsrpc_buffer_length(chain);
+      if ((res->buffer.size_in_bytes + separator + length)
+          >= res->buffer.capacity_in_bytes) {
+        rc = HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+      } else {
+        hpjsrpc_buffer_append(&res->buffer, ",", separator);
+        hpjsrpc_buffer_copy_out(chain,
+          (res->buffer.data + res->buffer.size_in_bytes),
+          (res->buffer.capacity_in_bytes - res->buffer.size_in_bytes));
+        res->buffer.size_in_bytes += length;
+      }
+      hpjsrpc_buffer_release(chain);
+    }
+    is_empty = (1 == res->buffer.size_in_bytes);
+  }
+
+  for (int ii = 0; ii < root->size; ++ii) {
+    if (HPJSRPC_RPC_ERROR_OUTOFRESBUF == elements[ii].rc) {
+      rc = HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+    }
+  }
+  if (NULL == req->context) {
+    hpjsrpc_free(elements);
+  }
+
+  /* A batch made up solely of notifications gets no reply at all */
+  if (is_empty) {
+    hpjsrpc_buffer_rewind(&res->buffer);
+    if (res->buffer.data && res->buffer.capacity_in_bytes > 0) {
+      res->buffer.data[0] = 0;
+    }
+    return rc;
+  }
+
+  if (HPJSRPC_NO_ERROR != hpjsrpc_buffer_append(&res->buffer, "]", 1)) {
+    rc = HPJSRPC_RPC_ERROR_OUTOFRESBUF;
+  }
+
+  return rc;
+
+} /* rpc_process_batch() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+rpc_process_request (
+  hpjsrpc_request_t      *req,
+  hpjsrpc_response_t     *res
+) {
+
+  HPJSRPC_RETURN  rc = HPJSRPC_NO_ERROR;
+  rpc_admission_t *admission = req->engine->admission;
+  bool            is_clocked = (req->is_timed || (NULL != admission
+    && 0 != admission->config.target_latency_in_us));
+  uint64_t        begin = (is_clocked ? hpjsrpc_timing_begin() : 0);
+  uint64_t        stage;
+  uint64_t        total_ns = 0;
+
+  __builtin_prefetch(req->buffer, 0, 1);
+  __builtin_prefetch(&req->tokens, 0, 1);
+  __builtin_prefetch(&res->buffer, 0, 1);
+  __builtin_prefetch(&res->buffer.data, 0, 1);
+
+  hpjsrpc_buffer_rewind(&res->buffer);
+
+  if (0 < req->token_count
+      && JSMN_ARRAY == req->tokens[req->root_token].type) {
+    rc = rpc_process_batch(req, res);
+    stage = rpc_stage_begin(req);
+  } else {
+    rc = rpc_prepare_request(req);
+    stage = rpc_stage_begin(req);
+    rc = rpc_complete_request(req, res, rc);
+  }
+
+  if (NULL != res->buffer.sink && (res->buffer.sink_failed
+      || HPJSRPC_NO_ERROR != hpjsrpc_buffer_flush(&res->buffer))) {
+    rc = HPJSRPC_RPC_ERROR_SINK;
+  }
+
+  /* Writing is what the stretch around the invocation took on top of it */
+  rpc_stage_end(req, HPJSRPC_STAGE_WRITE, stage);
+  if (req->is_timed) {
+    req->stat_ns[HPJSRPC_STAGE_WRITE] =
+      (req->stat_ns[HPJSRPC_STAGE_WRITE] > req->stat_ns[HPJSRPC_STAGE_INVOKE])
+      ? (req->stat_ns[HPJSRPC_STAGE_WRITE] - req->stat_ns[HPJSRPC_STAGE_INVOKE])
+      : 0;
+  }
+
+  if (is_clocked) {
+    total_ns = hpjsrpc_timing_ns(hpjsrpc_timing_end() - begin);
+    if (req->is_timed) {
+      req->stat_total_ns = total_ns;
+    }
+  }
+
+  if (0 != (req->admission & RPC_ADMIT_SAMPLE)
+      && 0 != admission->config.target_latency_in_us) {
+    rpc_admission_sample(admission, (total_ns / 1000));
+  }
+
+  req->received_ns = 0;
+  req->deadline_ns = 0;
+
   return rc;
 }
 
 /* ------------------------------------------------------------------------- */
 
+HPJSRPC_RETURN
+rpc_process_error (
+  hpjsrpc_request_t      *req,
+  hpjsrpc_response_t     *res,
+  HPJSRPC_RETURN          rc
+) {
+
+  if (NULL == req || NULL == res || HPJSRPC_NO_ERROR == rc) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  /* Nothing is known about the request, so it is answered with a null id */
+  req->token_count = 0;
+  req->versionToken = NULL;
+  req->methodToken = NULL;
+  req->paramsToken = NULL;
+  req->idToken = NULL;
+  req->method = NULL;
+  req->is_notification = false;
+  req->admission = 0;
+  req->received_ns = 0;
+  req->deadline_ns = 0;
+  /* The failed parse stays timed; nothing else ran */
+  memset(&req->stat_ns[HPJSRPC_STAGE_VALIDATE], 0,
+    (sizeof(req->stat_ns) - sizeof(req->stat_ns[0])));
+  req->stat_total_ns = 0;
+
+  hpjsrpc_buffer_rewind(&res->buffer);
+  rc = rpc_complete_request(req, res, rc);
+
+  if (NULL != res->buffer.sink && (res->buffer.sink_failed
+      || HPJSRPC_NO_ERROR != hpjsrpc_buffer_flush(&res->buffer))) {
+    rc = HPJSRPC_RPC_ERROR_SINK;
+  }
+
+  return rc;
+
+} /* rpc_process_error() */
+
+/* ------------------------------------------------------------------------- */
+
+HPJSRPC_RETURN
+hpjsrpc_response_release (hpjsrpc_response_t *res) {
+
+  if (NULL == res) {
+    return HPJSRPC_ASSERTION_ERROR;
+  }
+
+  hpjsrpc_buffer_release(&res->buffer);
+
+  if (NULL != res->release_request) {
+    res->release_request(res->release_request_ctx);
+    res->release_request = NULL;
+    res->release_request_ctx = NULL;
+  }
+
+  return HPJSRPC_NO_ERROR;
+
+} /* hpjsrpc_response_release() */
+
+/* ------------------------------------------------------------------------- */
+
 const char *
 hpjsrpc_error_string (HPJSRPC_RETURN rc) {
   switch (rc) {
@@ -664,6 +1932,16 @@ hpjsrpc_error_string (HPJSRPC_RETURN rc) {
       return "HPJSRPC_RPC_ERROR_METHODFORMAT: RPC method install failed, check name/sig/function prototype";
     case HPJSRPC_RPC_ERROR_OUTOFRESBUF:
       return "HPJSRPC_RPC_ERROR_PRINTRESPONSE: Ran out of buffer printing JSON response";
+    case HPJSRPC_RPC_ERROR_SINK:
+      return "HPJSRPC_RPC_ERROR_SINK: response sink failed or response cut short after a partial flush";
+    case HPJSRPC_CLOSED:
+      return "HPJSRPC_CLOSED: the transport was closed";
+    case HPJSRPC_RPC_ERROR_BUSY:
+      return "HPJSRPC_RPC_ERROR_BUSY: turned away by admission control";
+    case HPJSRPC_RPC_ERROR_EXPIRED:
+      return "HPJSRPC_RPC_ERROR_EXPIRED: deadline passed before the request ran";
+    case HPJSRPC_PENDING:
+      return "HPJSRPC_PENDING: reply deferred, it will be delivered on completion";
 
     /* These messages are purposefully short, as they will be sent over the wire */
     case JSONRPC_20_PARSE_ERROR:
@@ -676,6 +1954,8 @@ hpjsrpc_error_string (HPJSRPC_RETURN rc) {
       return "wrong params for remote method";
     case JSONRPC_20_INTERNALERROR:
       return "internal error";
+    case JSONRPC_20_SERVER_BUSY:
+      return "server busy";
 
     default:
       assert(0);
@@ -0,0 +1,101 @@
+
+#ifndef HPJSRPC_TEST_H
+#define	HPJSRPC_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+
+/*
+ * Shared by the programs in tests. Built and run by ./test; each exits
+ * non-zero on its first failed check.
+ */
+
+#define CHECK(cond)                                                          \
+  do {                                                                       \
+    if (!(cond)) {                                                           \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,       \
+        #cond);                                                              \
+      exit(1);                                                               \
+    }                                                                        \
+  } while (0)
+
+/*
+ * "echo": returns its one string parameter. The token's bytes are already
+ * escaped JSON, so they are written as they are.
+ */
+static inline HPJSRPC_RETURN
+test_echo (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  const jsmntok_t *params = &req->tokens[req->paramsToken->first_child];
+  const jsmntok_t *text = &req->tokens[params->first_child];
+
+  return hpjsrpc_json_string_raw(&res->buffer, &req->buffer[text->start],
+    (size_t) (text->end - text->start));
+}
+
+/* Blocking TCP connection to 127.0.0.1:port */
+static inline int
+test_connect (uint16_t port) {
+  struct sockaddr_in addr;
+  int                fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  CHECK(0 <= fd);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK(0 == connect(fd, (struct sockaddr *) &addr, sizeof(addr)));
+
+  return fd;
+}
+
+static inline void
+test_write (int fd, const char *bytes, size_t len) {
+  while (0 < len) {
+    ssize_t put = write(fd, bytes, len);
+    CHECK(0 < put);
+    bytes += put;
+    len -= (size_t) put;
+  }
+}
+
+/*
+ * Reads until EOF, a full buffer or a second without data; returns the
+ * length, NUL-terminating what was read.
+ */
+static inline size_t
+test_read_all (int fd, char *buf, size_t capacity) {
+  size_t len = 0;
+
+  while (len < (capacity - 1)) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    ssize_t       got;
+
+    if (0 >= poll(&pfd, 1, 1000)) {
+      break;
+    }
+    got = read(fd, &buf[len], (capacity - 1 - len));
+    if (0 >= got) {
+      break;
+    }
+    len += (size_t) got;
+  }
+  buf[len] = '\0';
+
+  return len;
+}
+
+#endif	/* HPJSRPC_TEST_H */
+/* vi: set et sw=2 ts=2: */
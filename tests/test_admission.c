@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_segment.h"
+#include "test.h"
+
+/*
+ * Admission control, on one thread: a method that processes a request of
+ * its own on a second context holds its slot meanwhile, which is how the
+ * engine's and a method's max_concurrency are saturated. Requests over a
+ * limit get the pre-rendered "server busy" reply, batch elements counted
+ * one by one; notifications over it are dropped. Requests slower than
+ * target_latency_in_us cut the adaptive limit down to min_concurrency, and
+ * fast ones raise it while it is in use. Every count returns to zero.
+ */
+
+static hpjsrpc_context_t *inner_ctx;
+static const char        *inner_text;
+static char               inner_reply[512];
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+add (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  const jsmntok_t *params = &req->tokens[req->paramsToken->first_child];
+  const jsmntok_t *a = &req->tokens[params->first_child];
+  const jsmntok_t *b = &req->tokens[a->next_sibling];
+
+  return hpjsrpc_json_int(&res->buffer,
+    strtoll(&req->buffer[a->start], NULL, 10)
+    + strtoll(&req->buffer[b->start], NULL, 10));
+
+} /* add() */
+
+/* Processes inner_text on inner_ctx while this request is in progress */
+static HPJSRPC_RETURN
+nest (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  (void) req;
+  hpjsrpc_context_process(inner_ctx, inner_text, strlen(inner_text));
+  hpjsrpc_buffer_copy_out(&hpjsrpc_context_response(inner_ctx)->buffer,
+    inner_reply, sizeof(inner_reply));
+
+  return hpjsrpc_json_int(&res->buffer, 0);
+
+} /* nest() */
+
+/* Well over any target latency used below */
+static HPJSRPC_RETURN
+slow (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  struct timespec ts = { 0, 3000000L };
+
+  (void) req;
+  nanosleep(&ts, NULL);
+
+  return hpjsrpc_json_int(&res->buffer, 0);
+
+} /* slow() */
+
+static hpjsrpc_method_t methods[] = {
+  {"add", sizeof("add"), add, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE },
+    true, 0},
+  /* One at a time */
+  {"add_one", sizeof("add_one"), add, false, 2,
+    { JSMN_PRIMITIVE, JSMN_PRIMITIVE }, true, 1},
+  {"nest", sizeof("nest"), nest, false, 0, { 0 }, false, 0},
+  {"nest_one", sizeof("nest_one"), nest, false, 0, { 0 }, false, 1},
+  {"slow", sizeof("slow"), slow, false, 0, { 0 }, false, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* Processes text and checks the reply, "" for none */
+static void
+process (hpjsrpc_context_t *ctx, const char *text, const char *expected) {
+  static char reply[4096];
+
+  hpjsrpc_context_process(ctx, text, strlen(text));
+  hpjsrpc_buffer_copy_out(&hpjsrpc_context_response(ctx)->buffer, reply,
+    sizeof(reply));
+  if (0 != strcmp(reply, expected)) {
+    fprintf(stderr, "sent     %s\nexpected %s\nreceived %s\n", text,
+      expected, reply);
+  }
+  CHECK(0 == strcmp(reply, expected));
+
+} /* process() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Runs inner as the request nested in outer, and checks what it got */
+static void
+nested (hpjsrpc_context_t *ctx, const char *outer, const char *inner,
+  const char *expected) {
+
+  inner_text = inner;
+  inner_reply[0] = '\0';
+  process(ctx, outer, "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":0}");
+  if (0 != strcmp(inner_reply, expected)) {
+    fprintf(stderr, "nested   %s\nexpected %s\nreceived %s\n", inner,
+      expected, inner_reply);
+  }
+  CHECK(0 == strcmp(inner_reply, expected));
+
+} /* nested() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+check_stats (hpjsrpc_engine_t *engine, size_t limit, uint64_t rejected) {
+  hpjsrpc_admission_stats_t stats;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_admission_stats(engine, &stats));
+  CHECK(0 == stats.in_progress && 0 == stats.pending);
+  CHECK(limit == stats.limit && rejected == stats.rejected);
+
+} /* check_stats() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_limits (hpjsrpc_engine_t *engine, hpjsrpc_context_t *ctx) {
+  static const char           nest_1[] = "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"nest\",\"params\":[],\"id\":1}";
+  static const char           nest_one_1[] = "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"nest_one\",\"params\":[],\"id\":1}";
+  hpjsrpc_admission_config_t  config;
+
+  memset(&config, 0, sizeof(config));
+  config.max_concurrency = 1;
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_set_admission(engine, &config));
+  check_stats(engine, 1, 0);
+
+  /* The one slot is taken by the outer request */
+  nested(ctx, nest_1, "{\"jsonrpc\":\"2.0\",\"method\":\"add\","
+    "\"params\":[1,2],\"id\":2}", "{\"jsonrpc\":\"2.0\",\"error\":"
+    "{\"code\":-32099,\"message\":\"server busy\"},\"id\":2}");
+  nested(ctx, nest_1, "{\"jsonrpc\":\"2.0\",\"method\":\"nowhere\","
+    "\"params\":[],\"id\":\"b\"}", "{\"jsonrpc\":\"2.0\",\"error\":"
+    "{\"code\":-32099,\"message\":\"server busy\"},\"id\":\"b\"}");
+  /* Notifications are dropped */
+  nested(ctx, nest_1, "{\"jsonrpc\":\"2.0\",\"method\":\"add\","
+    "\"params\":[1,2]}", "");
+  check_stats(engine, 1, 3);
+
+  /* Batch elements take a slot each */
+  process(ctx, "[{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[1,2],"
+    "\"id\":1},{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[3,4],"
+    "\"id\":2}]", "[{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":3},"
+    "{\"jsonrpc\":\"2.0\",\"error\":{\"code\":-32099,"
+    "\"message\":\"server busy\"},\"id\":2}]");
+  check_stats(engine, 1, 4);
+
+  /* Within the limit, answered */
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[1,2],"
+    "\"id\":3}", "{\"jsonrpc\":\"2.0\",\"id\":3,\"result\":3}");
+
+  /* A method's own limit, with room left on the engine */
+  config.max_concurrency = 4;
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_set_admission(engine, &config));
+  nested(ctx, nest_one_1, nest_one_1, "{\"jsonrpc\":\"2.0\",\"error\":"
+    "{\"code\":-32099,\"message\":\"server busy\"},\"id\":1}");
+  nested(ctx, nest_one_1, "{\"jsonrpc\":\"2.0\",\"method\":\"add\","
+    "\"params\":[1,2],\"id\":2}", "{\"jsonrpc\":\"2.0\",\"id\":2,"
+    "\"result\":3}");
+  nested(ctx, nest_1, "{\"jsonrpc\":\"2.0\",\"method\":\"add_one\","
+    "\"params\":[1,2],\"id\":2}", "{\"jsonrpc\":\"2.0\",\"id\":2,"
+    "\"result\":3}");
+  check_stats(engine, 4, 1);
+
+  /* And with admission control off */
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_set_admission(engine, NULL));
+  nested(ctx, nest_one_1, nest_one_1, "{\"jsonrpc\":\"2.0\",\"error\":"
+    "{\"code\":-32099,\"message\":\"server busy\"},\"id\":1}");
+  nested(ctx, nest_1, "{\"jsonrpc\":\"2.0\",\"method\":\"add\","
+    "\"params\":[1,2],\"id\":2}", "{\"jsonrpc\":\"2.0\",\"id\":2,"
+    "\"result\":3}");
+  check_stats(engine, 0, 0);
+
+} /* test_limits() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_adaptive (hpjsrpc_engine_t *engine, hpjsrpc_context_t *ctx) {
+  static const char           slow_1[] = "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"slow\",\"params\":[],\"id\":1}";
+  static const char           add_1[] = "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"add\",\"params\":[1,2],\"id\":1}";
+  hpjsrpc_admission_config_t  config;
+  hpjsrpc_admission_stats_t   stats;
+  size_t                      limit = 8;
+  size_t                      requests = 0;
+
+  memset(&config, 0, sizeof(config));
+  config.max_concurrency = 8;
+  config.min_concurrency = 2;
+  config.target_latency_in_us = 1000;
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_set_admission(engine, &config));
+
+  /* Over the target: a tenth off per limit's worth, down to the floor */
+  for (int ii = 0; ii < 200 && 2 < limit; ++ii) {
+    process(ctx, slow_1, "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":0}");
+    CHECK(HPJSRPC_NO_ERROR == hpjsrpc_admission_stats(engine, &stats));
+    CHECK(stats.limit <= limit);
+    if (stats.limit < limit) {
+      /* Not before a limit's worth of slow requests */
+      CHECK(requests >= (limit - 1));
+      requests = 0;
+    } else {
+      requests++;
+    }
+    limit = stats.limit;
+  }
+  for (int ii = 0; ii < 10; ++ii) {
+    process(ctx, slow_1, "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":0}");
+  }
+  check_stats(engine, 2, 0);
+
+  /* Within it, raised while it is in use; at 3 one at a time is not */
+  for (int ii = 0; ii < 20; ++ii) {
+    process(ctx, add_1, "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":3}");
+  }
+  check_stats(engine, 3, 0);
+
+  /* A request in progress and one nested: the limit is used, and grows */
+  for (int ii = 0; ii < 20; ++ii) {
+    nested(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"nest\",\"params\":[],"
+      "\"id\":1}", add_1, "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":3}");
+  }
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_admission_stats(engine, &stats));
+  CHECK(3 < stats.limit && 8 >= stats.limit);
+  check_stats(engine, stats.limit, 0);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_set_admission(engine, NULL));
+
+} /* test_adaptive() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (void) {
+  hpjsrpc_engine_t  *engine;
+  hpjsrpc_context_t *ctx;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_new(&engine));
+  CHECK(HPJSRPC_NO_ERROR == rpc_register_methods(engine, methods,
+    (sizeof(methods) / sizeof(methods[0]))));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_new(&ctx, engine, 64, 256, 0,
+    0));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_new(&inner_ctx, engine, 64, 256,
+    0, 0));
+
+  test_limits(engine, ctx);
+  test_adaptive(engine, ctx);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_destroy(inner_ctx));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_destroy(ctx));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_destroy(engine));
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_segment.h"
+#include "test.h"
+
+/*
+ * Steady state allocates nothing: with a counting allocator installed, a
+ * warmed-up context pool serves requests that fill several response
+ * segments and two arena chunks, batches and parse errors without a single
+ * call to the allocator.
+ */
+
+#define WARMUP_ROUNDS                     16
+#define STEADY_ROUNDS                     1000
+
+static size_t allocations;
+static size_t releases;
+
+static const char *inputs[] = {
+  "{\"jsonrpc\":\"2.0\",\"method\":\"big\",\"params\":[],\"id\":1}",
+  "[{\"jsonrpc\":\"2.0\",\"method\":\"big\",\"params\":[],\"id\":2},"
+    "{\"jsonrpc\":\"2.0\",\"method\":\"big\",\"params\":[],\"id\":3}]",
+  "{\"jsonrpc\":\"2.0\",\"method\":\"missing\",\"params\":[],\"id\":4}",
+  "{\"jsonrpc\":\"2.0\",\"method\":\"big\",\"params\":[",
+};
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+counting_malloc (size_t size_in_bytes) {
+  allocations++;
+  return malloc(size_in_bytes);
+}
+
+static void
+counting_free (void *ptr) {
+  if (NULL != ptr) {
+    releases++;
+  }
+  free(ptr);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* 300 numbers, after 6 arena blocks that take two chunks */
+static HPJSRPC_RETURN
+big (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  size_t block = ((HPJSRPC_ARENA_CHUNK_SIZE / 4) - 64);
+
+  for (int ii = 0; ii < 6; ++ii) {
+    void *p = hpjsrpc_request_alloc(req, block, 0);
+    /* Batch elements run without a context, and so without an arena */
+    CHECK(NULL != p || NULL == req->context);
+    if (NULL != p) {
+      memset(p, ii, block);
+    }
+  }
+
+  hpjsrpc_json_begin_array(&res->buffer);
+  for (int ii = 0; ii < 300; ++ii) {
+    hpjsrpc_json_int(&res->buffer, ii);
+  }
+  hpjsrpc_json_end_array(&res->buffer);
+
+  return hpjsrpc_json_status(&res->buffer);
+
+} /* big() */
+
+static hpjsrpc_method_t methods[] = {
+  {"big", sizeof("big"), big, false, 0, { 0 }, true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+static void
+run (hpjsrpc_context_pool_t *pool, size_t rounds) {
+  for (size_t ii = 0; ii < rounds; ++ii) {
+    for (size_t jj = 0; jj < (sizeof(inputs) / sizeof(inputs[0])); ++jj) {
+      hpjsrpc_context_t *ctx;
+
+      CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_acquire(pool, &ctx));
+      hpjsrpc_context_process(ctx, inputs[jj], strlen(inputs[jj]));
+      CHECK(0 < hpjsrpc_buffer_length(
+        &hpjsrpc_context_response(ctx)->buffer));
+      CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_recycle(ctx));
+    }
+  }
+
+} /* run() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (void) {
+  hpjsrpc_allocator_t             allocator = { counting_malloc,
+    counting_free };
+  hpjsrpc_context_pool_config_t   config;
+  hpjsrpc_engine_t               *engine;
+  hpjsrpc_context_pool_t         *pool;
+  size_t                          warm;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_set_allocator(&allocator));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_new(&engine));
+  CHECK(HPJSRPC_NO_ERROR == rpc_register_methods(engine, methods, 1));
+
+  memset(&config, 0, sizeof(config));
+  config.max_token_count = 256;
+  config.segment_size_in_bytes = 128;
+  config.retained_segments_per_context = 32;
+  config.retained_segments = 64;
+  config.retained_contexts = 2;
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_pool_new(&pool, engine,
+    &config));
+
+  run(pool, WARMUP_ROUNDS);
+  CHECK(0 < allocations);
+
+  warm = allocations;
+  run(pool, STEADY_ROUNDS);
+  if (warm != allocations) {
+    fprintf(stderr, "%zu allocations in steady state\n",
+      (allocations - warm));
+  }
+  CHECK(warm == allocations);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_pool_destroy(pool));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_destroy(engine));
+  CHECK(allocations == releases);
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
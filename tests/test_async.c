@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_segment.h"
+#include "hpjsrpc_async.h"
+#include "test.h"
+
+/*
+ * Deferred replies: completed from another thread and popped once the
+ * queue's eventfd fires; delivered in completion order, string and long
+ * ids intact; an error rc turned into an error reply; a deferred
+ * notification released, not queued; deferral refused inside a batch and
+ * once a sink has flushed part of the reply; and the admission slots a
+ * deferred call holds handed back on completion.
+ */
+
+#define MAX_DEFERRED                      8
+
+static hpjsrpc_completion_queue_t *queue;
+static hpjsrpc_pending_t          *deferred[MAX_DEFERRED];
+static size_t                      deferred_count;
+static size_t                      refused_count;
+
+/* What the sink was handed */
+static char                        streamed[4096];
+static size_t                      streamed_length;
+
+static const char busy[] = "{\"jsonrpc\":\"2.0\",\"error\":{\"code\":-32099,"
+  "\"message\":\"server busy\"},\"id\":9}";
+
+/* ------------------------------------------------------------------------- */
+
+/* Defers where it can; where it cannot, answers "now" */
+static HPJSRPC_RETURN
+later (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  HPJSRPC_RETURN rc;
+
+  CHECK(MAX_DEFERRED > deferred_count);
+  rc = hpjsrpc_defer(req, res, queue, &deferred_count,
+    &deferred[deferred_count]);
+  if (HPJSRPC_PENDING == rc) {
+    deferred_count++;
+    return rc;
+  }
+  CHECK(HPJSRPC_ASSERTION_ERROR == rc);
+  refused_count++;
+
+  return hpjsrpc_json_string_raw(&res->buffer, "now", 3);
+
+} /* later() */
+
+/* Writes past a segment, so that the sink has it, then tries to defer */
+static HPJSRPC_RETURN
+streamed_later (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  hpjsrpc_pending_t *pending = NULL;
+
+  hpjsrpc_json_begin_array(&res->buffer);
+  for (int ii = 0; ii < 100; ++ii) {
+    hpjsrpc_json_int(&res->buffer, ii);
+  }
+  CHECK(0 < res->buffer.sink_flushed_in_bytes);
+  if (HPJSRPC_PENDING == hpjsrpc_defer(req, res, queue, NULL, &pending)) {
+    return HPJSRPC_PENDING;
+  }
+  refused_count++;
+  hpjsrpc_json_end_array(&res->buffer);
+
+  return hpjsrpc_json_status(&res->buffer);
+
+} /* streamed_later() */
+
+static hpjsrpc_method_t methods[] = {
+  {"later", sizeof("later"), later, false, 0, { 0 }, false, 0},
+  {"streamed_later", sizeof("streamed_later"), streamed_later, false, 0,
+    { 0 }, false, 0},
+  /* One call at a time, deferred or not */
+  {"later_one", sizeof("later_one"), later, false, 0, { 0 }, false, 1},
+};
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+collect (void *ctx, const struct iovec *iov, size_t iov_count) {
+  (void) ctx;
+  for (size_t ii = 0; ii < iov_count; ++ii) {
+    CHECK((streamed_length + iov[ii].iov_len) < sizeof(streamed));
+    memcpy(&streamed[streamed_length], iov[ii].iov_base, iov[ii].iov_len);
+    streamed_length += iov[ii].iov_len;
+  }
+  streamed[streamed_length] = '\0';
+
+  return HPJSRPC_NO_ERROR;
+
+} /* collect() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Processes text and checks the immediate reply, "" for none */
+static HPJSRPC_RETURN
+process (hpjsrpc_context_t *ctx, const char *text, const char *expected) {
+  static char     reply[4096];
+  HPJSRPC_RETURN  rc = hpjsrpc_context_process(ctx, text, strlen(text));
+
+  hpjsrpc_buffer_copy_out(&hpjsrpc_context_response(ctx)->buffer, reply,
+    sizeof(reply));
+  if (0 != strcmp(reply, expected)) {
+    fprintf(stderr, "sent     %s\nexpected %s\nreceived %s\n", text,
+      expected, reply);
+  }
+  CHECK(0 == strcmp(reply, expected));
+
+  return rc;
+
+} /* process() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Pops the next completed reply, which must be expected */
+static void
+delivered (const char *expected) {
+  hpjsrpc_pending_t *pending = hpjsrpc_completion_queue_pop(queue);
+  char               reply[512];
+
+  CHECK(NULL != pending);
+  CHECK(&deferred_count == hpjsrpc_pending_tag(pending));
+  hpjsrpc_buffer_copy_out(&hpjsrpc_pending_response(pending)->buffer, reply,
+    sizeof(reply));
+  if (0 != strcmp(reply, expected)) {
+    fprintf(stderr, "expected %s\nreceived %s\n", expected, reply);
+  }
+  CHECK(0 == strcmp(reply, expected));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_pending_release(pending));
+
+} /* delivered() */
+
+/* ------------------------------------------------------------------------- */
+
+/* True if the queue's eventfd fires within timeout_ms; resets it if so */
+static bool
+fired (int timeout_ms) {
+  struct pollfd pfd = { hpjsrpc_completion_queue_fd(queue), POLLIN, 0 };
+  uint64_t      count;
+
+  if (0 >= poll(&pfd, 1, timeout_ms)) {
+    return false;
+  }
+  CHECK(sizeof(count) == read(pfd.fd, &count, sizeof(count)));
+
+  return true;
+
+} /* fired() */
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+complete_main (void *arg) {
+  hpjsrpc_pending_t *pending = arg;
+
+  hpjsrpc_json_string_raw(hpjsrpc_pending_buffer(pending), "done", 4);
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_pending_complete(pending,
+    HPJSRPC_NO_ERROR));
+
+  return NULL;
+
+} /* complete_main() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_thread (hpjsrpc_context_t *ctx) {
+  pthread_t thread;
+
+  deferred_count = 0;
+  CHECK(HPJSRPC_PENDING == process(ctx, "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"later\",\"params\":[],\"id\":1}", ""));
+  CHECK(1 == deferred_count);
+  CHECK(!fired(0) && NULL == hpjsrpc_completion_queue_pop(queue));
+
+  CHECK(0 == pthread_create(&thread, NULL, complete_main, deferred[0]));
+  CHECK(fired(1000));
+  delivered("{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":\"done\"}");
+  CHECK(0 == pthread_join(thread, NULL));
+  CHECK(NULL == hpjsrpc_completion_queue_pop(queue));
+
+} /* test_thread() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_order (hpjsrpc_context_t *ctx) {
+  static const char long_id[] =
+    "\"an id well past the inline space a pending reply has\"";
+  char              text[256];
+
+  /* Numeric, string and long ids; completed last first */
+  deferred_count = 0;
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"later\",\"params\":[],"
+    "\"id\":1}", "");
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"later\",\"params\":[],"
+    "\"id\":\"two\"}", "");
+  snprintf(text, sizeof(text), "{\"jsonrpc\":\"2.0\",\"method\":\"later\","
+    "\"params\":[],\"id\":%s}", long_id);
+  process(ctx, text, "");
+  CHECK(3 == deferred_count);
+
+  for (size_t ii = 3; ii > 0; --ii) {
+    hpjsrpc_json_int(hpjsrpc_pending_buffer(deferred[ii - 1]),
+      (int64_t) ii);
+    CHECK(HPJSRPC_NO_ERROR == hpjsrpc_pending_complete(deferred[ii - 1],
+      HPJSRPC_NO_ERROR));
+  }
+  CHECK(fired(0));
+  snprintf(text, sizeof(text), "{\"jsonrpc\":\"2.0\",\"id\":%s,\"result\":3}",
+    long_id);
+  delivered(text);
+  delivered("{\"jsonrpc\":\"2.0\",\"id\":\"two\",\"result\":2}");
+  delivered("{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":1}");
+  CHECK(NULL == hpjsrpc_completion_queue_pop(queue));
+
+  /* An error replaces whatever result was written */
+  deferred_count = 0;
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"later\",\"params\":[],"
+    "\"id\":4}", "");
+  hpjsrpc_json_string_raw(hpjsrpc_pending_buffer(deferred[0]), "half", 4);
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_pending_complete(deferred[0],
+    HPJSRPC_RPC_ERROR_PARAMSMISMATCH));
+  CHECK(fired(0));
+  delivered("{\"jsonrpc\":\"2.0\",\"error\":{\"code\":-32602,"
+    "\"message\":\"wrong params for remote method\"},\"id\":4}");
+
+} /* test_order() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_refused (hpjsrpc_context_t *ctx) {
+  static const char   head[] = "{\"jsonrpc\":\"2.0\",\"id\":2,\"result\":[0,1,";
+  static const char   tail[] = ",98,99]}";
+  hpjsrpc_response_t *res = hpjsrpc_context_response(ctx);
+
+  /* A notification is deferred, but never queued */
+  deferred_count = 0;
+  CHECK(HPJSRPC_PENDING == process(ctx, "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"later\",\"params\":[]}", ""));
+  CHECK(1 == deferred_count);
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_pending_complete(deferred[0],
+    HPJSRPC_NO_ERROR));
+  CHECK(!fired(0) && NULL == hpjsrpc_completion_queue_pop(queue));
+
+  /* Batches are answered as a whole */
+  deferred_count = 0;
+  refused_count = 0;
+  process(ctx, "[{\"jsonrpc\":\"2.0\",\"method\":\"later\",\"params\":[],"
+    "\"id\":1},{\"jsonrpc\":\"2.0\",\"method\":\"later\",\"params\":[]}]",
+    "[{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":\"now\"}]");
+  CHECK(0 == deferred_count && 2 == refused_count);
+
+  /* Part of the reply went out already */
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_buffer_set_sink(&res->buffer, collect,
+    NULL));
+  streamed_length = 0;
+  CHECK(HPJSRPC_NO_ERROR == process(ctx, "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"streamed_later\",\"params\":[],\"id\":2}", ""));
+  CHECK(3 == refused_count);
+  CHECK(0 == strncmp(streamed, head, strlen(head)));
+  CHECK(0 == strcmp(&streamed[streamed_length - strlen(tail)], tail));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_buffer_set_sink(&res->buffer, NULL,
+    NULL));
+  CHECK(!fired(0) && NULL == hpjsrpc_completion_queue_pop(queue));
+
+} /* test_refused() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_admission (hpjsrpc_engine_t *engine, hpjsrpc_context_t *ctx) {
+  hpjsrpc_admission_config_t  config;
+  hpjsrpc_admission_stats_t   stats;
+
+  memset(&config, 0, sizeof(config));
+  config.max_concurrency = 4;
+  config.max_pending = 2;
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_set_admission(engine, &config));
+
+  /* A deferred call leaves in_progress for pending */
+  deferred_count = 0;
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"later_one\",\"params\":[],"
+    "\"id\":1}", "");
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_admission_stats(engine, &stats));
+  CHECK(0 == stats.in_progress && 1 == stats.pending);
+
+  /* It keeps its method slot too */
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"later_one\",\"params\":[],"
+    "\"id\":9}", busy);
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"later\",\"params\":[],"
+    "\"id\":2}", "");
+  CHECK(2 == deferred_count);
+
+  /* max_pending reached: turned away */
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"later\",\"params\":[],"
+    "\"id\":9}", busy);
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_admission_stats(engine, &stats));
+  CHECK(0 == stats.in_progress && 2 == stats.pending && 2 == stats.rejected);
+
+  /* Completed, an error or not, the slots are handed back */
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_pending_complete(deferred[0],
+    HPJSRPC_RPC_ERROR_OUTOFRESBUF));
+  hpjsrpc_json_int(hpjsrpc_pending_buffer(deferred[1]), 2);
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_pending_complete(deferred[1],
+    HPJSRPC_NO_ERROR));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_admission_stats(engine, &stats));
+  CHECK(0 == stats.in_progress && 0 == stats.pending);
+  CHECK(fired(0));
+  delivered("{\"jsonrpc\":\"2.0\",\"error\":{\"code\":-32603,"
+    "\"message\":\"internal error\"},\"id\":1}");
+  delivered("{\"jsonrpc\":\"2.0\",\"id\":2,\"result\":2}");
+
+  /* And taken again */
+  deferred_count = 0;
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"later_one\",\"params\":[],"
+    "\"id\":3}", "");
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_pending_complete(deferred[0],
+    HPJSRPC_RPC_ERROR_EXPIRED));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_admission_stats(engine, &stats));
+  CHECK(0 == stats.in_progress && 0 == stats.pending && 2 == stats.rejected);
+  CHECK(fired(0));
+  delivered("");
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_set_admission(engine, NULL));
+
+} /* test_admission() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (void) {
+  hpjsrpc_engine_t  *engine;
+  hpjsrpc_context_t *ctx;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_new(&engine));
+  CHECK(HPJSRPC_NO_ERROR == rpc_register_methods(engine, methods,
+    (sizeof(methods) / sizeof(methods[0]))));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_new(&ctx, engine, 64, 128, 0,
+    0));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_completion_queue_new(&queue, 256, 0));
+
+  test_thread(ctx);
+  test_order(ctx);
+  test_refused(ctx);
+  test_admission(engine, ctx);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_completion_queue_destroy(queue));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_destroy(ctx));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_destroy(engine));
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_client.h"
+#include "test.h"
+
+/*
+ * hpjsrpc_client_t against a scripted server on the other end of a socket
+ * pair: pipelined replies out of order, single and batched; replies with
+ * more tokens than the client takes, and malformed ones, which fail just
+ * their calls while their ids can be found, and the client otherwise.
+ */
+
+#define MAX_DONE                          16
+
+typedef struct {
+  uint64_t                        id;
+  HPJSRPC_RETURN                  rc;
+  bool                            is_error;
+  int64_t                         error_code;
+  char                            value[64];
+} done_t;
+
+static done_t done[MAX_DONE];
+static size_t done_count;
+
+/* ------------------------------------------------------------------------- */
+
+static void
+on_reply (void *arg, const hpjsrpc_client_reply_t *reply) {
+  done_t *d;
+
+  (void) arg;
+  CHECK(MAX_DONE > done_count);
+  d = &done[done_count++];
+  memset(d, 0, sizeof(*d));
+  d->id = reply->id;
+  d->rc = reply->rc;
+  d->is_error = reply->is_error;
+  d->error_code = reply->error_code;
+  if (NULL != reply->value) {
+    snprintf(d->value, sizeof(d->value), "%.*s",
+      (int) (reply->value->end - reply->value->start),
+      &reply->json[reply->value->start]);
+  }
+
+} /* on_reply() */
+
+/* ------------------------------------------------------------------------- */
+
+/* A client on one end of a socket pair; *server gets the other end */
+static hpjsrpc_client_t *
+client_pair (int *server) {
+  hpjsrpc_client_config_t  config;
+  hpjsrpc_client_t        *client;
+  int                      fds[2];
+
+  CHECK(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  memset(&config, 0, sizeof(config));
+  config.max_token_count = 32;
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_client_new(&client, fds[0], &config));
+  *server = fds[1];
+  done_count = 0;
+
+  return client;
+
+} /* client_pair() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Makes count calls, and checks the server end got them as lines */
+static void
+call (hpjsrpc_client_t *client, int server, size_t count) {
+  char   requests[4096];
+  size_t length = 0;
+  size_t lines = 0;
+
+  for (size_t ii = 0; ii < count; ++ii) {
+    CHECK(HPJSRPC_NO_ERROR == hpjsrpc_client_call(client, "echo",
+      "[\"x\"]", 5, on_reply, NULL, NULL));
+  }
+  while (lines < count) {
+    ssize_t got = read(server, &requests[length], (sizeof(requests) - length));
+
+    CHECK(0 < got);
+    for (ssize_t ii = 0; ii < got; ++ii) {
+      lines += ('\n' == requests[length + (size_t) ii]) ? 1 : 0;
+    }
+    length += (size_t) got;
+  }
+  CHECK(count == lines);
+
+} /* call() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Writes the replies, then polls until expected calls have completed */
+static void
+reply (hpjsrpc_client_t *client, int server, const char *replies,
+  size_t expected) {
+
+  test_write(server, replies, strlen(replies));
+  while (done_count < expected) {
+    size_t completed;
+
+    CHECK(HPJSRPC_NO_ERROR == hpjsrpc_client_poll(client, 1000,
+      &completed));
+    CHECK(0 < completed);
+  }
+  CHECK(expected == done_count);
+
+} /* reply() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_out_of_order (void) {
+  hpjsrpc_client_t *client;
+  int               server;
+
+  client = client_pair(&server);
+  call(client, server, 4);
+  CHECK(4 == hpjsrpc_client_outstanding(client));
+
+  /* 3, then 1 with an error, then a batch answering 4 and 2 */
+  reply(client, server,
+    "{\"jsonrpc\":\"2.0\",\"id\":3,\"result\":\"c\"}\n"
+    "{\"jsonrpc\":\"2.0\",\"error\":{\"code\":-32601,\"message\":\"no\"},"
+    "\"id\":1}\r\n"
+    "[{\"jsonrpc\":\"2.0\",\"id\":4,\"result\":[4]},"
+    "{\"jsonrpc\":\"2.0\",\"id\":2,\"result\":2}]\n", 4);
+  CHECK(3 == done[0].id && HPJSRPC_NO_ERROR == done[0].rc
+    && !done[0].is_error && 0 == strcmp(done[0].value, "c"));
+  CHECK(1 == done[1].id && HPJSRPC_NO_ERROR == done[1].rc
+    && done[1].is_error && -32601 == done[1].error_code);
+  CHECK(4 == done[2].id && 0 == strcmp(done[2].value, "[4]"));
+  CHECK(2 == done[3].id && 0 == strcmp(done[3].value, "2"));
+  CHECK(0 == hpjsrpc_client_outstanding(client));
+
+  /* A late duplicate and an unknown id are dropped */
+  call(client, server, 1);
+  reply(client, server, "{\"jsonrpc\":\"2.0\",\"id\":3,\"result\":\"c\"}\n"
+    "{\"jsonrpc\":\"2.0\",\"id\":99,\"result\":0}\n"
+    "{\"jsonrpc\":\"2.0\",\"id\":5,\"result\":5}\n", 5);
+  CHECK(5 == done[4].id && 0 == strcmp(done[4].value, "5"));
+  CHECK(!hpjsrpc_client_is_closed(client));
+
+  hpjsrpc_client_destroy(client);
+  close(server);
+
+} /* test_out_of_order() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_unparsed (void) {
+  hpjsrpc_client_t *client;
+  int               server;
+  char              text[1024];
+  int               length;
+
+  client = client_pair(&server);
+  call(client, server, 4);
+
+  /*
+   * More tokens than the client takes, the id after the result, and an
+   * "id" inside the result that belongs to no reply object
+   */
+  length = snprintf(text, sizeof(text), "{\"jsonrpc\":\"2.0\",\"result\":"
+    "[{\"id\":1}");
+  for (int ii = 0; ii < 40; ++ii) {
+    length += snprintf(&text[length], (sizeof(text) - (size_t) length),
+      ",%d", ii);
+  }
+  snprintf(&text[length], (sizeof(text) - (size_t) length), "],\"id\" : 2}\n"
+    "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":1}\n");
+  reply(client, server, text, 2);
+  CHECK(2 == done[0].id && HPJSRPC_PARSE_ERROR_NOMEM == done[0].rc);
+  CHECK('\0' == done[0].value[0]);
+  CHECK(1 == done[1].id && HPJSRPC_NO_ERROR == done[1].rc);
+
+  /* Malformed, the id intact; then a malformed batch of two */
+  reply(client, server, "{\"jsonrpc\":\"2.0\",\"id\":3,\"result\":[1,2}\n"
+    "[{\"id\":4,\"result\":\"a\\\"]\"},{\"id\":99,\"result\":[1}]\n", 4);
+  CHECK(3 == done[2].id && HPJSRPC_PARSE_ERROR_INVAL == done[2].rc);
+  CHECK(4 == done[3].id && HPJSRPC_PARSE_ERROR_INVAL == done[3].rc);
+  CHECK(0 == hpjsrpc_client_outstanding(client));
+  CHECK(!hpjsrpc_client_is_closed(client));
+
+  /* Still usable */
+  call(client, server, 1);
+  reply(client, server, "{\"jsonrpc\":\"2.0\",\"id\":5,\"result\":5}\n", 5);
+  CHECK(5 == done[4].id && HPJSRPC_NO_ERROR == done[4].rc);
+
+  hpjsrpc_client_destroy(client);
+  close(server);
+
+} /* test_unparsed() */
+
+/* ------------------------------------------------------------------------- */
+
+/* A reply whose ids cannot be told fails every call, and the connection */
+static void
+test_lost (const char *text) {
+  hpjsrpc_client_t *client;
+  int               server;
+  char              rest[16];
+
+  client = client_pair(&server);
+  call(client, server, 3);
+
+  test_write(server, text, strlen(text));
+  CHECK(HPJSRPC_CLOSED == hpjsrpc_client_poll(client, 1000, NULL));
+  CHECK(3 == done_count);
+  for (size_t ii = 0; ii < 3; ++ii) {
+    CHECK(HPJSRPC_CLOSED == done[ii].rc);
+  }
+  CHECK(hpjsrpc_client_is_closed(client));
+  CHECK(0 == hpjsrpc_client_outstanding(client));
+  CHECK(HPJSRPC_CLOSED == hpjsrpc_client_call(client, "echo", NULL, 0,
+    on_reply, NULL, NULL));
+  /* The server end sees it closed */
+  CHECK(0 == test_read_all(server, rest, sizeof(rest)));
+
+  hpjsrpc_client_destroy(client);
+  close(server);
+
+} /* test_lost() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (void) {
+
+  test_out_of_order();
+  test_unparsed();
+  /* No id at all, an id cut short, one reply object of two without */
+  test_lost("{\"jsonrpc\":\"2.0\",\"result\":[1,2}\n");
+  test_lost("{\"jsonrpc\":\"2.0\",\"result\":[1,2],\"id\":1\n");
+  test_lost("[{\"id\":1,\"result\":[1}},{\"result\":0}]\n");
+  test_lost("{\"jsonrpc\":\"2.0\",\"id\":\"1\",\"result\":[}\n");
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_segment.h"
+#include "hpjsrpc_async.h"
+#include "hpjsrpc_coro.h"
+#include "test.h"
+
+/*
+ * Requests that run out of time: "deadline_ms":0 is dropped unanswered and
+ * counted, the earlier of "deadline_ms" and the transport's deadline
+ * applies, and the scheduler's timer wheel cancels a request suspended
+ * past its deadline. A method that gives up on an expired request is
+ * dropped unanswered, alone or inside a batch, as is a deferred reply
+ * completed as expired; a method returning a code the engine does not know
+ * gets an internal error reply.
+ */
+
+static hpjsrpc_completion_queue_t *queue;
+static hpjsrpc_pending_t          *deferred;
+
+/* What stall() saw of its awaits, and what the scheduler delivered */
+static int                         stall_errno[3];
+static size_t                      coro_done;
+static size_t                      coro_reply_length;
+
+static const char internal_error[] = "{\"jsonrpc\":\"2.0\",\"error\":"
+  "{\"code\":-32603,\"message\":\"internal error\"},\"id\":1}";
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+add (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  const jsmntok_t *params = &req->tokens[req->paramsToken->first_child];
+  const jsmntok_t *a = &req->tokens[params->first_child];
+  const jsmntok_t *b = &req->tokens[a->next_sibling];
+
+  return hpjsrpc_json_int(&res->buffer,
+    strtoll(&req->buffer[a->start], NULL, 10)
+    + strtoll(&req->buffer[b->start], NULL, 10));
+
+} /* add() */
+
+/* Gives up, as a method polling hpjsrpc_request_expired() would */
+static HPJSRPC_RETURN
+giveup (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  (void) req;
+  (void) res;
+  return HPJSRPC_RPC_ERROR_EXPIRED;
+
+} /* giveup() */
+
+/* Returns a code of its own making */
+static HPJSRPC_RETURN
+odd (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  (void) req;
+  (void) res;
+  return (HPJSRPC_RETURN) 12345;
+
+} /* odd() */
+
+static HPJSRPC_RETURN
+later (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  return hpjsrpc_defer(req, res, queue, NULL, &deferred);
+
+} /* later() */
+
+/* The time the request was given, in ms from when it was received */
+static HPJSRPC_RETURN
+budget (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  return hpjsrpc_json_int(&res->buffer,
+    (int64_t) ((req->deadline_ns - req->received_ns) / 1000000ull));
+
+} /* budget() */
+
+/* Waits far longer than its deadline, then gives up once cancelled */
+static HPJSRPC_RETURN
+stall (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  (void) req;
+  /* Would never return */
+  stall_errno[2] = (-1 == hpjsrpc_await(-1, 0, -1)) ? errno : 0;
+  if (-1 != hpjsrpc_await(-1, 0, 10000)) {
+    return hpjsrpc_json_int(&res->buffer, 0);
+  }
+  stall_errno[0] = errno;
+  stall_errno[1] = (-1 == hpjsrpc_await(-1, 0, 0)) ? errno : 0;
+  return HPJSRPC_RPC_ERROR_EXPIRED;
+
+} /* stall() */
+
+static hpjsrpc_method_t methods[] = {
+  {"add", sizeof("add"), add, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE },
+    true, 0},
+  {"giveup", sizeof("giveup"), giveup, false, 0, { 0 }, true, 0},
+  {"odd", sizeof("odd"), odd, false, 0, { 0 }, true, 0},
+  {"later", sizeof("later"), later, false, 0, { 0 }, false, 0},
+  {"budget", sizeof("budget"), budget, false, 0, { 0 }, true, 0},
+  {"stall", sizeof("stall"), stall, false, 0, { 0 }, false, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* Processes text and checks the reply, "" for none */
+static HPJSRPC_RETURN
+process (hpjsrpc_context_t *ctx, const char *text, const char *expected) {
+  static char     reply[4096];
+  HPJSRPC_RETURN  rc = hpjsrpc_context_process(ctx, text, strlen(text));
+
+  hpjsrpc_buffer_copy_out(&hpjsrpc_context_response(ctx)->buffer, reply,
+    sizeof(reply));
+  if (0 != strcmp(reply, expected)) {
+    fprintf(stderr, "sent     %s\nexpected %s\nreceived %s\n", text,
+      expected, reply);
+  }
+  CHECK(0 == strcmp(reply, expected));
+
+  return rc;
+
+} /* process() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_expired (hpjsrpc_engine_t *engine, hpjsrpc_context_t *ctx) {
+  hpjsrpc_deadline_stats_t stats;
+  uint64_t                 now;
+
+  /* No time at all: dropped unanswered, alone or in a batch */
+  CHECK(HPJSRPC_RPC_ERROR_EXPIRED == process(ctx, "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"add\",\"params\":[1,2],\"id\":1,\"deadline_ms\":0}",
+    ""));
+  process(ctx, "[{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[1,2],"
+    "\"deadline_ms\":0,\"id\":1},{\"jsonrpc\":\"2.0\",\"method\":\"add\","
+    "\"params\":[3,4],\"id\":2}]",
+    "[{\"jsonrpc\":\"2.0\",\"id\":2,\"result\":7}]");
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_deadline_stats(engine, &stats));
+  CHECK(2 == stats.expired && 0 == stats.cancelled);
+
+  /* Ignored unless a non-negative integer */
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[1,2],"
+    "\"id\":1,\"deadline_ms\":-1}", "{\"jsonrpc\":\"2.0\",\"id\":1,"
+    "\"result\":3}");
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[1,2],"
+    "\"id\":1,\"deadline_ms\":\"0\"}", "{\"jsonrpc\":\"2.0\",\"id\":1,"
+    "\"result\":3}");
+
+  /* The earlier of the request's and the transport's deadline applies */
+  now = hpjsrpc_clock_ns();
+  hpjsrpc_context_set_deadline(ctx, now, (now + 50000000ull));
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"budget\",\"params\":[],"
+    "\"id\":1,\"deadline_ms\":10000}", "{\"jsonrpc\":\"2.0\",\"id\":1,"
+    "\"result\":50}");
+  hpjsrpc_context_set_deadline(ctx, now, (now + 50000000ull));
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"budget\",\"params\":[],"
+    "\"id\":1,\"deadline_ms\":20}", "{\"jsonrpc\":\"2.0\",\"id\":1,"
+    "\"result\":20}");
+  hpjsrpc_context_set_deadline(ctx, now, (now + 50000000ull));
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"budget\",\"params\":[],"
+    "\"id\":1}", "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":50}");
+
+  /* The transport's passed, however long the request would wait */
+  hpjsrpc_context_set_deadline(ctx, (now - 2000000ull), (now - 1000000ull));
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"budget\",\"params\":[],"
+    "\"id\":1,\"deadline_ms\":10000}", "");
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_deadline_stats(engine, &stats));
+  CHECK(3 == stats.expired && 0 == stats.cancelled);
+
+  /* Set for one request only */
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[1,2],"
+    "\"id\":1}", "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":3}");
+
+} /* test_expired() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+on_coro_done (void *tag, hpjsrpc_response_t *res, HPJSRPC_RETURN rc) {
+  (void) tag;
+  (void) rc;
+  coro_done++;
+  coro_reply_length = hpjsrpc_buffer_length(&res->buffer);
+
+} /* on_coro_done() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_cancel (hpjsrpc_engine_t *engine) {
+  static const char           request[] = "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"stall\",\"params\":[],\"id\":1,\"deadline_ms\":30}";
+  hpjsrpc_scheduler_config_t  config;
+  hpjsrpc_scheduler_t        *sched;
+  hpjsrpc_deadline_stats_t    stats;
+  uint64_t                    begin;
+
+  memset(&config, 0, sizeof(config));
+  config.stack_size_in_bytes = HPJSRPC_CORO_DEFAULT_STACK_SIZE;
+  config.max_coroutines = 4;
+  config.max_token_count = 64;
+  config.segment_size_in_bytes = 256;
+  config.done = on_coro_done;
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_scheduler_new(&sched, engine, &config));
+
+  /* Outside a coroutine as inside, an endless sleep is refused */
+  errno = 0;
+  CHECK(-1 == hpjsrpc_await(-1, 0, -1) && EINVAL == errno);
+
+  begin = hpjsrpc_clock_ns();
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_scheduler_submit(sched, request,
+    (sizeof(request) - 1), NULL));
+  CHECK(1 == hpjsrpc_scheduler_suspended(sched));
+  while (0 < hpjsrpc_scheduler_run(sched, 1000)) {
+  }
+
+  /* Cancelled at its deadline, not woken by its 10 s timeout */
+  CHECK(1000000000ull > (hpjsrpc_clock_ns() - begin));
+  CHECK(ECANCELED == stall_errno[0] && ECANCELED == stall_errno[1]);
+  CHECK(EINVAL == stall_errno[2]);
+  CHECK(1 == coro_done && 0 == coro_reply_length);
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_deadline_stats(engine, &stats));
+  CHECK(3 == stats.expired && 1 == stats.cancelled);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_scheduler_destroy(sched));
+
+} /* test_cancel() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_giveup (hpjsrpc_context_t *ctx) {
+
+  CHECK(HPJSRPC_RPC_ERROR_EXPIRED == process(ctx, "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"giveup\",\"params\":[],\"id\":1}", ""));
+  process(ctx, "[{\"jsonrpc\":\"2.0\",\"method\":\"giveup\","
+    "\"params\":[],\"id\":1},{\"jsonrpc\":\"2.0\",\"method\":\"add\","
+    "\"params\":[1,2],\"id\":2}]",
+    "[{\"jsonrpc\":\"2.0\",\"id\":2,\"result\":3}]");
+  process(ctx, "[{\"jsonrpc\":\"2.0\",\"method\":\"giveup\","
+    "\"params\":[],\"id\":1}]", "");
+
+  /* Not known to the engine, yet answered */
+  process(ctx, "{\"jsonrpc\":\"2.0\",\"method\":\"odd\",\"params\":[],"
+    "\"id\":1}", internal_error);
+
+} /* test_giveup() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_pending (hpjsrpc_context_t *ctx) {
+  hpjsrpc_pending_t *pending;
+  char               reply[256];
+
+  CHECK(HPJSRPC_PENDING == process(ctx, "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"later\",\"params\":[],\"id\":1}", ""));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_pending_complete(deferred,
+    HPJSRPC_RPC_ERROR_EXPIRED));
+  pending = hpjsrpc_completion_queue_pop(queue);
+  CHECK(NULL != pending);
+  CHECK(0 == hpjsrpc_buffer_length(
+    &hpjsrpc_pending_response(pending)->buffer));
+  hpjsrpc_pending_release(pending);
+
+  CHECK(HPJSRPC_PENDING == process(ctx, "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"later\",\"params\":[],\"id\":1}", ""));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_pending_complete(deferred,
+    (HPJSRPC_RETURN) 12345));
+  pending = hpjsrpc_completion_queue_pop(queue);
+  CHECK(NULL != pending);
+  hpjsrpc_buffer_copy_out(&hpjsrpc_pending_response(pending)->buffer, reply,
+    sizeof(reply));
+  CHECK(0 == strcmp(reply, internal_error));
+  hpjsrpc_pending_release(pending);
+  CHECK(NULL == hpjsrpc_completion_queue_pop(queue));
+
+} /* test_pending() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (void) {
+  hpjsrpc_engine_t  *engine;
+  hpjsrpc_context_t *ctx;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_new(&engine));
+  CHECK(HPJSRPC_NO_ERROR == rpc_register_methods(engine, methods,
+    (sizeof(methods) / sizeof(methods[0]))));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_new(&ctx, engine, 64, 256, 0,
+    0));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_completion_queue_new(&queue, 256, 0));
+
+  test_expired(engine, ctx);
+  test_cancel(engine);
+  test_giveup(ctx);
+  test_pending(ctx);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_completion_queue_destroy(queue));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_destroy(ctx));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_destroy(engine));
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_dgram.h"
+#include "test.h"
+
+/*
+ * hpjsrpc_dgram_t on UDP loopback and on a Unix datagram socket: single
+ * requests, escaped strings, batches, notifications and parse errors; a
+ * reply spread over more segments than it can be gathered from; datagrams
+ * longer than the limit, and Unix senders without an address, both dropped
+ * without stalling the shard; and a burst of requests, every one answered.
+ */
+
+#define BURST                             200
+
+/* ------------------------------------------------------------------------- */
+
+static hpjsrpc_method_t methods[] = {
+  {"echo", sizeof("echo"), test_echo, false, 1, { JSMN_STRING }, true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* The next datagram, NUL-terminated; 0 if none came in time */
+static size_t
+receive (int fd, char *buf, size_t capacity, int timeout_ms) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  ssize_t       got;
+
+  if (0 >= poll(&pfd, 1, timeout_ms)) {
+    return 0;
+  }
+  got = recv(fd, buf, (capacity - 1), 0);
+  CHECK(0 < got);
+  buf[got] = '\0';
+
+  return (size_t) got;
+
+} /* receive() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Sends text as one datagram; expected NULL for no reply at all */
+static void
+exchange (int fd, const char *text, const char *expected) {
+  static char reply[16384];
+
+  CHECK((ssize_t) strlen(text) == send(fd, text, strlen(text), 0));
+  if (NULL == expected) {
+    CHECK(0 == receive(fd, reply, sizeof(reply), 200));
+    return;
+  }
+  CHECK(strlen(expected) == receive(fd, reply, sizeof(reply), 1000));
+  CHECK(0 == strcmp(reply, expected));
+
+} /* exchange() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_requests (int fd) {
+  static char text[10000];
+  static char expected[10000];
+  char        letters[6000];
+
+  exchange(fd, "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"hi\"],"
+    "\"id\":1}", "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":\"hi\"}");
+  /* Escapes come back as they were sent */
+  exchange(fd, "{\"jsonrpc\":\"2.0\",\"method\":\"echo\","
+    "\"params\":[\"a\\\"b\\\\c\\u00e9\"],\"id\":1}", "{\"jsonrpc\":\"2.0\","
+    "\"id\":1,\"result\":\"a\\\"b\\\\c\\u00e9\"}");
+  exchange(fd, "[{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"a\"],"
+    "\"id\":2},{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"b\"]},"
+    "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"c\"],\"id\":3}]",
+    "[{\"jsonrpc\":\"2.0\",\"id\":2,\"result\":\"a\"},"
+    "{\"jsonrpc\":\"2.0\",\"id\":3,\"result\":\"c\"}]");
+  /* Notifications get nothing back, parse errors do */
+  exchange(fd, "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"x\"]}",
+    NULL);
+  exchange(fd, "{\"jsonrpc\":\"2.0\",\"method\"", "{\"jsonrpc\":\"2.0\","
+    "\"error\":{\"code\":-32700,\"message\":\"json parsing error\"},"
+    "\"id\":null}");
+
+  /* Far more segments than a reply is gathered from */
+  memset(letters, 'q', sizeof(letters));
+  snprintf(text, sizeof(text), "{\"jsonrpc\":\"2.0\",\"method\":\"echo\","
+    "\"params\":[\"%.*s\"],\"id\":4}", (int) sizeof(letters), letters);
+  snprintf(expected, sizeof(expected), "{\"jsonrpc\":\"2.0\",\"id\":4,"
+    "\"result\":\"%.*s\"}", (int) sizeof(letters), letters);
+  exchange(fd, text, expected);
+
+  /* Longer than the limit: cut, dropped, and the next one still served */
+  memset(text, ' ', 9000);
+  text[9000] = '\0';
+  exchange(fd, text, NULL);
+  exchange(fd, "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"ok\"],"
+    "\"id\":5}", "{\"jsonrpc\":\"2.0\",\"id\":5,\"result\":\"ok\"}");
+
+} /* test_requests() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Requests sent back to back, before any reply is read */
+static void
+test_burst (int fd) {
+  bool seen[BURST];
+  char text[128];
+
+  memset(seen, 0, sizeof(seen));
+  for (size_t ii = 0; ii < BURST; ++ii) {
+    snprintf(text, sizeof(text), "{\"jsonrpc\":\"2.0\",\"method\":\"echo\","
+      "\"params\":[\"%zu\"],\"id\":%zu}", ii, ii);
+    CHECK((ssize_t) strlen(text) == send(fd, text, strlen(text), 0));
+  }
+  for (size_t ii = 0; ii < BURST; ++ii) {
+    char   reply[128];
+    char   expected[128];
+    size_t id;
+
+    CHECK(0 < receive(fd, reply, sizeof(reply), 1000));
+    CHECK(1 == sscanf(reply, "{\"jsonrpc\":\"2.0\",\"id\":%zu", &id));
+    CHECK(BURST > id && !seen[id]);
+    snprintf(expected, sizeof(expected), "{\"jsonrpc\":\"2.0\",\"id\":%zu,"
+      "\"result\":\"%zu\"}", id, id);
+    CHECK(0 == strcmp(reply, expected));
+    seen[id] = true;
+  }
+
+} /* test_burst() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_udp (hpjsrpc_engine_t *engine) {
+  hpjsrpc_dgram_config_t  config;
+  hpjsrpc_dgram_t        *dgram;
+  struct sockaddr_in      addr;
+  int                     fd;
+
+  memset(&config, 0, sizeof(config));
+  config.address = "127.0.0.1";
+  config.shard_count = 2;
+  config.socket_buffer_size_in_bytes = (1 << 20);
+  config.context.max_token_count = 64;
+  config.context.segment_size_in_bytes = 256;
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_dgram_new(&dgram, engine, &config));
+  CHECK(0 != hpjsrpc_dgram_port(dgram));
+  CHECK(2 == hpjsrpc_dgram_shard_count(dgram));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_dgram_start(dgram));
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  CHECK(0 <= fd);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(hpjsrpc_dgram_port(dgram));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  CHECK(0 == connect(fd, (struct sockaddr *) &addr, sizeof(addr)));
+
+  test_requests(fd);
+  test_burst(fd);
+
+  /* Stopped, then started again */
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_dgram_stop(dgram));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_dgram_start(dgram));
+  exchange(fd, "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"re\"],"
+    "\"id\":6}", "{\"jsonrpc\":\"2.0\",\"id\":6,\"result\":\"re\"}");
+
+  close(fd);
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_dgram_destroy(dgram));
+
+} /* test_udp() */
+
+/* ------------------------------------------------------------------------- */
+
+static int
+unix_socket (const char *bind_path, const char *server_path) {
+  struct sockaddr_un addr;
+  int                fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+
+  CHECK(0 <= fd);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (NULL != bind_path) {
+    unlink(bind_path);
+    strncpy(addr.sun_path, bind_path, (sizeof(addr.sun_path) - 1));
+    CHECK(0 == bind(fd, (struct sockaddr *) &addr, sizeof(addr)));
+  }
+  strncpy(addr.sun_path, server_path, (sizeof(addr.sun_path) - 1));
+  CHECK(0 == connect(fd, (struct sockaddr *) &addr, sizeof(addr)));
+
+  return fd;
+
+} /* unix_socket() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_unix (hpjsrpc_engine_t *engine) {
+  hpjsrpc_dgram_config_t  config;
+  hpjsrpc_dgram_t        *dgram;
+  char                    server_path[64];
+  char                    client_path[64];
+  int                     fd;
+
+  snprintf(server_path, sizeof(server_path), "/tmp/test_dgram.%d.server",
+    (int) getpid());
+  snprintf(client_path, sizeof(client_path), "/tmp/test_dgram.%d.client",
+    (int) getpid());
+
+  memset(&config, 0, sizeof(config));
+  config.unix_path = server_path;
+  config.shard_count = 2;
+  config.socket_buffer_size_in_bytes = (1 << 20);
+  config.context.max_token_count = 64;
+  config.context.segment_size_in_bytes = 256;
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_dgram_new(&dgram, engine, &config));
+  CHECK(0 == hpjsrpc_dgram_port(dgram));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_dgram_start(dgram));
+
+  /* Nowhere to send the reply to */
+  fd = unix_socket(NULL, server_path);
+  exchange(fd, "{\"jsonrpc\":\"2.0\",\"method\":\"echo\",\"params\":[\"hi\"],"
+    "\"id\":1}", NULL);
+  close(fd);
+
+  fd = unix_socket(client_path, server_path);
+  test_requests(fd);
+  test_burst(fd);
+  close(fd);
+  unlink(client_path);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_dgram_destroy(dgram));
+  CHECK(0 != access(server_path, F_OK));
+
+} /* test_unix() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (void) {
+  hpjsrpc_engine_t *engine;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_new(&engine));
+  CHECK(HPJSRPC_NO_ERROR == rpc_register_methods(engine, methods, 1));
+
+  test_udp(engine);
+  test_unix(engine);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_destroy(engine));
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_server.h"
+#include "test.h"
+
+/*
+ * hpjsrpc_server_t over loopback, with each backend the kernel supports:
+ * requests split across writes, pipelined requests answered in order, an
+ * unterminated last line taken as a request once the client shuts down,
+ * and for HTTP, a Deadline-Ms header, malformed and refused requests.
+ */
+
+static const char add_1[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[1,2],\"id\":1}";
+static const char add_2[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[3,4],\"id\":2}";
+static const char add_3[] =
+  "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[5,6],\"id\":3}";
+
+static const char reply_1[] = "{\"jsonrpc\":\"2.0\",\"id\":1,\"result\":3}\n";
+static const char reply_2[] = "{\"jsonrpc\":\"2.0\",\"id\":2,\"result\":7}\n";
+static const char reply_3[] = "{\"jsonrpc\":\"2.0\",\"id\":3,\"result\":11}\n";
+
+static const char http_400[] = "HTTP/1.1 400 Bad Request\r\n"
+  "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+/* ------------------------------------------------------------------------- */
+
+static HPJSRPC_RETURN
+add (
+  hpjsrpc_request_t          *req,
+  hpjsrpc_response_t         *res
+) {
+  const jsmntok_t *params = &req->tokens[req->paramsToken->first_child];
+  const jsmntok_t *a = &req->tokens[params->first_child];
+  const jsmntok_t *b = &req->tokens[a->next_sibling];
+
+  return hpjsrpc_json_int(&res->buffer,
+    strtoll(&req->buffer[a->start], NULL, 10)
+    + strtoll(&req->buffer[b->start], NULL, 10));
+
+} /* add() */
+
+static hpjsrpc_method_t methods[] = {
+  {"add", sizeof("add"), add, false, 2, { JSMN_PRIMITIVE, JSMN_PRIMITIVE },
+    true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+static void
+pause_ms (long ms) {
+  struct timespec ts = { 0, (ms * 1000000L) };
+  nanosleep(&ts, NULL);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Sends "text", shuts down the sending side and checks the whole reply */
+static void
+exchange (uint16_t port, const char *text, const char *expected) {
+  char  reply[4096];
+  int   fd = test_connect(port);
+
+  test_write(fd, text, strlen(text));
+  shutdown(fd, SHUT_WR);
+  test_read_all(fd, reply, sizeof(reply));
+  close(fd);
+  if (0 != strcmp(reply, expected)) {
+    fprintf(stderr, "sent     %s\nexpected %sreceived %s\n", text, expected,
+      reply);
+  }
+  CHECK(0 == strcmp(reply, expected));
+
+} /* exchange() */
+
+/* ------------------------------------------------------------------------- */
+
+static hpjsrpc_server_t *
+start_server (hpjsrpc_engine_t *engine, hpjsrpc_server_backend_t backend,
+  hpjsrpc_server_protocol_t protocol) {
+  hpjsrpc_server_config_t  config;
+  hpjsrpc_server_t        *server;
+
+  memset(&config, 0, sizeof(config));
+  config.address = "127.0.0.1";
+  config.shard_count = 1;
+  config.read_buffer_size_in_bytes = 4096;
+  config.protocol = protocol;
+  config.http_path = "/rpc";
+  config.context.max_token_count = 64;
+  config.context.segment_size_in_bytes = 256;
+  config.backend = backend;
+  if (HPJSRPC_NO_ERROR != hpjsrpc_server_new(&server, engine, &config)) {
+    CHECK(HPJSRPC_SERVER_IO_URING == backend);
+    printf("io_uring not available, skipped\n");
+    return NULL;
+  }
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_server_start(server));
+
+  return server;
+
+} /* start_server() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_ndjson (hpjsrpc_engine_t *engine, hpjsrpc_server_backend_t backend) {
+  hpjsrpc_server_t        *server = start_server(engine, backend,
+    HPJSRPC_SERVER_NDJSON);
+  char                     text[1024];
+  char                     expected[1024];
+  char                     reply[1024];
+  uint16_t                 port;
+  int                      fd;
+
+  if (NULL == server) {
+    return;
+  }
+  port = hpjsrpc_server_port(server);
+
+  /* Pipelined, answered in order */
+  snprintf(text, sizeof(text), "%s\n%s\r\n\n%s\n", add_1, add_2, add_3);
+  snprintf(expected, sizeof(expected), "%s%s%s", reply_1, reply_2, reply_3);
+  exchange(port, text, expected);
+
+  /* No newline on the last line: answered once the client shuts down */
+  snprintf(text, sizeof(text), "%s\n%s", add_1, add_2);
+  snprintf(expected, sizeof(expected), "%s%s", reply_1, reply_2);
+  exchange(port, text, expected);
+
+  /* Nor on a broken one: a parse error */
+  exchange(port, "{\"jsonrpc\":\"2.0\",\"method\":",
+    "{\"jsonrpc\":\"2.0\",\"error\":{\"code\":-32700,"
+    "\"message\":\"json parsing error\"},\"id\":null}\n");
+
+  /* A request split across writes, the connection kept open */
+  fd = test_connect(port);
+  test_write(fd, add_1, 10);
+  pause_ms(20);
+  test_write(fd, &add_1[10], (sizeof(add_1) - 11));
+  pause_ms(20);
+  test_write(fd, "\n", 1);
+  CHECK((sizeof(reply_1) - 1) == test_read_all(fd, reply, sizeof(reply)));
+  CHECK(0 == strcmp(reply, reply_1));
+  close(fd);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_server_destroy(server));
+
+} /* test_ndjson() */
+
+/* ------------------------------------------------------------------------- */
+
+/* A POST of body to path, with extra header lines */
+static void
+http_post (char *text, size_t capacity, const char *path, const char *extra,
+  const char *body) {
+  snprintf(text, capacity, "POST %s HTTP/1.1\r\nHost: test\r\n%s"
+    "Content-Length: %zu\r\n\r\n%s", path, extra, strlen(body), body);
+}
+
+/* The 200 reply carrying body */
+static void
+http_ok (char *text, size_t capacity, const char *extra, const char *body) {
+  snprintf(text, capacity, "HTTP/1.1 200 OK\r\n"
+    "Content-Type: application/json\r\nContent-Length: %zu\r\n%s\r\n%s",
+    strlen(body), extra, body);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_http (hpjsrpc_engine_t *engine, hpjsrpc_server_backend_t backend) {
+  hpjsrpc_server_t        *server = start_server(engine, backend,
+    HPJSRPC_SERVER_HTTP);
+  char                     text[2048];
+  char                     expected[4096];
+  char                     reply[2048];
+  char                     body[128];
+  hpjsrpc_deadline_stats_t stats;
+  uint64_t                 expired;
+  uint16_t                 port;
+  size_t                   length;
+  int                      fd;
+
+  if (NULL == server) {
+    return;
+  }
+  port = hpjsrpc_server_port(server);
+
+  /* Pipelined, answered in order; the last closes the connection */
+  http_post(text, sizeof(text), "/rpc", "", add_1);
+  length = strlen(text);
+  http_post(&text[length], (sizeof(text) - length), "/rpc?x=1", "", add_2);
+  length = strlen(text);
+  http_post(&text[length], (sizeof(text) - length), "/rpc",
+    "Connection: close\r\n", add_3);
+  snprintf(body, sizeof(body), "%.*s", (int) (sizeof(reply_1) - 2), reply_1);
+  http_ok(expected, sizeof(expected), "", body);
+  length = strlen(expected);
+  snprintf(body, sizeof(body), "%.*s", (int) (sizeof(reply_2) - 2), reply_2);
+  http_ok(&expected[length], (sizeof(expected) - length), "", body);
+  length = strlen(expected);
+  snprintf(body, sizeof(body), "%.*s", (int) (sizeof(reply_3) - 2), reply_3);
+  http_ok(&expected[length], (sizeof(expected) - length),
+    "Connection: close\r\n", body);
+  exchange(port, text, expected);
+
+  /* Head and body split across writes, mid-line and mid-body */
+  http_post(text, sizeof(text), "/rpc", "", add_1);
+  snprintf(body, sizeof(body), "%.*s", (int) (sizeof(reply_1) - 2), reply_1);
+  http_ok(expected, sizeof(expected), "", body);
+  fd = test_connect(port);
+  length = strlen(text);
+  for (size_t at = 0, step = 23; at < length; at += step) {
+    size_t n = (length - at) < step ? (length - at) : step;
+    test_write(fd, &text[at], n);
+    pause_ms(5);
+  }
+  test_read_all(fd, reply, sizeof(reply));
+  CHECK(0 == strcmp(reply, expected));
+  close(fd);
+
+  /* A notification still gets a reply */
+  http_post(text, sizeof(text), "/rpc", "Connection: close\r\n",
+    "{\"jsonrpc\":\"2.0\",\"method\":\"add\",\"params\":[1,2]}");
+  exchange(port, text, "HTTP/1.1 204 No Content\r\nConnection: close\r\n\r\n");
+
+  /* Out of time by the time it is processed: no reply, so 204 */
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_deadline_stats(engine, &stats));
+  expired = stats.expired;
+  http_post(text, sizeof(text), "/rpc",
+    "Deadline-Ms: 0\r\nConnection: close\r\n", add_1);
+  exchange(port, text, "HTTP/1.1 204 No Content\r\nConnection: close\r\n\r\n");
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_deadline_stats(engine, &stats));
+  CHECK((expired + 1) == stats.expired);
+  /* Time enough: answered */
+  http_post(text, sizeof(text), "/rpc",
+    "Deadline-Ms: 10000\r\nConnection: close\r\n", add_1);
+  snprintf(body, sizeof(body), "%.*s", (int) (sizeof(reply_1) - 2), reply_1);
+  http_ok(expected, sizeof(expected), "Connection: close\r\n", body);
+  exchange(port, text, expected);
+
+  /* Malformed heads */
+  exchange(port, "POST /rpc HTTP/1.1\r\nContent-Length: 12x\r\n\r\n",
+    http_400);
+  exchange(port, "POST /rpc HTTP/1.1\r\nContent-Length: 2\r\n"
+    "Content-Length: 3\r\n\r\n{}", http_400);
+  exchange(port, "POST /rpc HTTP/1.1\r\nno colon here\r\n\r\n", http_400);
+  exchange(port, "POST /rpc HTTP/2.0\r\nContent-Length: 0\r\n\r\n",
+    http_400);
+  exchange(port, "POST\r\n\r\n", http_400);
+
+  /* Refused requests */
+  exchange(port, "GET /rpc HTTP/1.1\r\n\r\n", "HTTP/1.1 405 Method Not "
+    "Allowed\r\nAllow: POST\r\nContent-Length: 0\r\nConnection: close\r\n"
+    "\r\n");
+  http_post(text, sizeof(text), "/other", "", add_1);
+  exchange(port, text, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+    "Connection: close\r\n\r\n");
+  exchange(port, "POST /rpc HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "2\r\n{}\r\n0\r\n\r\n", "HTTP/1.1 411 Length Required\r\n"
+    "Content-Length: 0\r\nConnection: close\r\n\r\n");
+  exchange(port, "POST /rpc HTTP/1.1\r\nContent-Length: 100000\r\n\r\n{",
+    "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\n"
+    "Connection: close\r\n\r\n");
+
+  /* A good request after a bad one on the same connection is not served */
+  http_post(text, sizeof(text), "/rpc", "", add_1);
+  snprintf(expected, sizeof(expected), "GET /rpc HTTP/1.1\r\n\r\n%s", text);
+  exchange(port, expected, "HTTP/1.1 405 Method Not Allowed\r\n"
+    "Allow: POST\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_server_destroy(server));
+
+} /* test_http() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (void) {
+  hpjsrpc_engine_t *engine;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_new(&engine));
+  CHECK(HPJSRPC_NO_ERROR == rpc_register_methods(engine, methods, 1));
+
+  test_ndjson(engine, HPJSRPC_SERVER_EPOLL);
+  test_ndjson(engine, HPJSRPC_SERVER_IO_URING);
+  test_http(engine, HPJSRPC_SERVER_EPOLL);
+  test_http(engine, HPJSRPC_SERVER_IO_URING);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_destroy(engine));
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
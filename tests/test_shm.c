@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_shm.h"
+#include "test.h"
+
+/*
+ * hpjsrpc_shm_t between two threads of one process: pipelined requests of
+ * varying size through small rings, so that records wrap around them, with
+ * replies checked in order; then records whose length does not fit the
+ * ring, or runs past what the client published, which must close the
+ * channel rather than be parsed.
+ */
+
+#define ROUNDS                            2000
+#define IN_FLIGHT                         8
+
+typedef struct {
+  hpjsrpc_shm_t                  *shm;
+  hpjsrpc_engine_t               *engine;
+  HPJSRPC_RETURN                  rc;
+} server_arg_t;
+
+/* ------------------------------------------------------------------------- */
+
+static hpjsrpc_method_t methods[] = {
+  {"echo", sizeof("echo"), test_echo, false, 1, { JSMN_STRING }, true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+server_main (void *arg) {
+  server_arg_t       *s = (server_arg_t *) arg;
+  hpjsrpc_context_t  *ctx;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_new(&ctx, s->engine, 64, 512, 0,
+    0));
+  s->rc = hpjsrpc_shm_serve(s->shm, ctx);
+  hpjsrpc_context_destroy(ctx);
+
+  return NULL;
+
+} /* server_main() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Request i echoes i letters; sizes vary so records land all over the ring */
+static size_t
+make_request (char *text, size_t capacity, size_t ii) {
+  char letters[200];
+  size_t count = (ii * 37) % sizeof(letters);
+
+  memset(letters, ('a' + (int) (ii % 26)), count);
+  return (size_t) snprintf(text, capacity, "{\"jsonrpc\":\"2.0\","
+    "\"method\":\"echo\",\"params\":[\"%.*s\"],\"id\":%zu}", (int) count,
+    letters, ii);
+
+} /* make_request() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+check_reply (hpjsrpc_shm_t *client, size_t ii) {
+  char        expected[512];
+  char        letters[200];
+  size_t      count = (ii * 37) % sizeof(letters);
+  const char *reply;
+  size_t      length;
+
+  memset(letters, ('a' + (int) (ii % 26)), count);
+  snprintf(expected, sizeof(expected), "{\"jsonrpc\":\"2.0\",\"id\":%zu,"
+    "\"result\":\"%.*s\"}", ii, (int) count, letters);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_shm_receive(client, &reply, &length));
+  CHECK(strlen(expected) == length);
+  CHECK(0 == memcmp(reply, expected, length));
+  CHECK('\0' == reply[length]);
+  hpjsrpc_shm_consume(client);
+
+} /* check_reply() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_round_trip (hpjsrpc_engine_t *engine) {
+  hpjsrpc_shm_config_t  config = { 4096, 4096, 16 };
+  hpjsrpc_shm_t        *client;
+  server_arg_t          server;
+  pthread_t             thread;
+  char                  text[512];
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_shm_new(&client, &config));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_shm_attach(&server.shm,
+    hpjsrpc_shm_fd(client), 16));
+  server.engine = engine;
+  pthread_create(&thread, NULL, server_main, &server);
+
+  /* IN_FLIGHT requests ahead of the replies, answered in order */
+  for (size_t ii = 0; ii < (ROUNDS + IN_FLIGHT); ++ii) {
+    if (ii < ROUNDS) {
+      size_t length = make_request(text, sizeof(text), ii);
+      CHECK(HPJSRPC_NO_ERROR == hpjsrpc_shm_send(client, text, length));
+    }
+    if (ii >= IN_FLIGHT) {
+      check_reply(client, (ii - IN_FLIGHT));
+    }
+  }
+
+  /* Too long for the request ring */
+  CHECK(HPJSRPC_ASSERTION_ERROR == hpjsrpc_shm_send(client, text, 4096));
+
+  hpjsrpc_shm_close(client);
+  pthread_join(thread, NULL);
+  CHECK(HPJSRPC_NO_ERROR == server.rc);
+  CHECK(HPJSRPC_CLOSED == hpjsrpc_shm_send(client, text, 1));
+  hpjsrpc_shm_destroy(server.shm);
+  hpjsrpc_shm_destroy(client);
+
+} /* test_round_trip() */
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Sends a request, then overwrites the length in front of it in the shared
+ * region as a broken client might; the server must refuse it.
+ */
+static void
+test_corrupt (hpjsrpc_engine_t *engine, uint32_t length) {
+  static const char     marker[] = "{\"jsonrpc\":\"2.0\",\"method\":\"echo\","
+    "\"params\":[\"corrupt me\"],\"id\":1}";
+  hpjsrpc_shm_config_t  config = { 4096, 4096, 16 };
+  hpjsrpc_shm_t        *client;
+  hpjsrpc_shm_t        *server;
+  hpjsrpc_context_t    *ctx;
+  struct stat           st;
+  uint8_t              *region;
+  uint8_t              *found;
+  size_t                processed = 0;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_shm_new(&client, &config));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_shm_attach(&server,
+    hpjsrpc_shm_fd(client), 16));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_new(&ctx, engine, 64, 512, 0,
+    0));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_shm_send(client, marker,
+    (sizeof(marker) - 1)));
+
+  CHECK(0 == fstat(hpjsrpc_shm_fd(client), &st));
+  region = mmap(NULL, (size_t) st.st_size, (PROT_READ | PROT_WRITE),
+    MAP_SHARED, hpjsrpc_shm_fd(client), 0);
+  CHECK(MAP_FAILED != region);
+  found = memmem(region, (size_t) st.st_size, marker, (sizeof(marker) - 1));
+  CHECK(NULL != found);
+  /* The length is the first word of the record's 8-byte header */
+  memcpy((found - 8), &length, sizeof(length));
+
+  CHECK(HPJSRPC_ASSERTION_ERROR == hpjsrpc_shm_process(server, ctx,
+    &processed));
+  CHECK(0 == processed);
+  CHECK(HPJSRPC_CLOSED == hpjsrpc_shm_process(server, ctx, &processed));
+  CHECK(HPJSRPC_CLOSED == hpjsrpc_shm_send(client, marker, 1));
+
+  munmap(region, (size_t) st.st_size);
+  hpjsrpc_context_destroy(ctx);
+  hpjsrpc_shm_destroy(server);
+  hpjsrpc_shm_destroy(client);
+
+} /* test_corrupt() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (void) {
+  hpjsrpc_engine_t *engine;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_new(&engine));
+  CHECK(HPJSRPC_NO_ERROR == rpc_register_methods(engine, methods, 1));
+
+  test_round_trip(engine);
+  /* Longer than the ring takes */
+  test_corrupt(engine, 100000);
+  test_corrupt(engine, UINT32_MAX - 1);
+  /* Fits the ring, but runs past the one request published */
+  test_corrupt(engine, 1000);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_destroy(engine));
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */
@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "libhpjsrpc.h"
+#include "hpjsrpc_json.h"
+#include "hpjsrpc_context.h"
+#include "hpjsrpc_stream.h"
+#include "test.h"
+
+/*
+ * Content-Length framing: messages fed to the framer a byte at a time, all
+ * at once, and with bodies longer than its buffer; header blocks it must
+ * refuse; then hpjsrpc_stream_serve() over a socket pair, with pipelined
+ * requests written in pieces that split headers and bodies, and the framed
+ * replies checked in order.
+ */
+
+#define ROUNDS                            200
+
+typedef struct {
+  hpjsrpc_engine_t               *engine;
+  int                             in_fd;
+  int                             out_fd;
+  HPJSRPC_RETURN                  rc;
+} serve_arg_t;
+
+/* ------------------------------------------------------------------------- */
+
+static hpjsrpc_method_t methods[] = {
+  {"echo", sizeof("echo"), test_echo, false, 1, { JSMN_STRING }, true, 0},
+};
+
+/* ------------------------------------------------------------------------- */
+
+/* Copies up to step bytes of text into the framer, as one read would */
+static size_t
+feed (hpjsrpc_stream_t *stream, const char *text, size_t length,
+  size_t step) {
+  size_t  available;
+  char   *space = hpjsrpc_stream_space(stream, &available);
+  size_t  put = (length < step) ? length : step;
+
+  if (put > available) {
+    put = available;
+  }
+  memcpy(space, text, put);
+  hpjsrpc_stream_commit(stream, put);
+
+  return put;
+
+} /* feed() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Reads that all fit, without taking messages out in between */
+static void
+feed_all (hpjsrpc_stream_t *stream, const char *text, size_t length,
+  size_t step) {
+
+  while (0 < length) {
+    size_t put = feed(stream, text, length, step);
+
+    CHECK(0 < put);
+    text += put;
+    length -= put;
+  }
+
+} /* feed_all() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+expect_body (hpjsrpc_stream_t *stream, const char *expected) {
+  const char *body;
+  size_t      length;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_stream_next(stream, &body, &length));
+  CHECK(strlen(expected) == length);
+  CHECK(0 == memcmp(body, expected, length));
+
+} /* expect_body() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_framing (void) {
+  static const char  text[] =
+    "Content-Length: 5\r\n\r\nfirst"
+    "content-type: application/vscode-jsonrpc\r\n"
+    "CONTENT-LENGTH:\t6 \r\n\r\nsecond"
+    "Content-Length: 0\r\n\r\n"
+    "Content-Length: 5\r\n\r\nthird";
+  static const char *bodies[] = { "first", "second", "", "third" };
+  size_t             ends[4];
+  size_t             done = 0;
+  hpjsrpc_stream_t  *stream;
+  const char        *body;
+  size_t             length;
+
+  ends[0] = (size_t) (strstr(text, "first") + 5 - text);
+  ends[1] = (size_t) (strstr(text, "second") + 6 - text);
+  ends[2] = (size_t) (strstr(text, ": 0\r\n\r\n") + 7 - text);
+  ends[3] = (sizeof(text) - 1);
+
+  /* A byte per read: each message is handed out with its last byte */
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_stream_new(&stream,
+    HPJSRPC_STREAM_MAX_HEAD, 64));
+  CHECK(hpjsrpc_stream_is_idle(stream));
+  for (size_t ii = 0; ii < (sizeof(text) - 1); ++ii) {
+    HPJSRPC_RETURN rc;
+
+    feed_all(stream, &text[ii], 1, 1);
+    rc = hpjsrpc_stream_next(stream, &body, &length);
+    if (HPJSRPC_NO_ERROR == rc) {
+      CHECK(ends[done] == (ii + 1));
+      CHECK(strlen(bodies[done]) == length);
+      CHECK(0 == memcmp(body, bodies[done], length));
+      done++;
+    } else {
+      CHECK(HPJSRPC_PARSE_ERROR_PART == rc);
+      CHECK(!hpjsrpc_stream_is_idle(stream));
+    }
+  }
+  CHECK(4 == done);
+  CHECK(HPJSRPC_PARSE_ERROR_PART == hpjsrpc_stream_next(stream, &body,
+    &length));
+  CHECK(hpjsrpc_stream_is_idle(stream));
+  hpjsrpc_stream_destroy(stream);
+
+  /* All of it in one read */
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_stream_new(&stream,
+    HPJSRPC_STREAM_MAX_HEAD, 64));
+  feed_all(stream, text, (sizeof(text) - 1), sizeof(text));
+  expect_body(stream, "first");
+  expect_body(stream, "second");
+  expect_body(stream, "");
+  expect_body(stream, "third");
+  CHECK(hpjsrpc_stream_is_idle(stream));
+  hpjsrpc_stream_destroy(stream);
+
+} /* test_framing() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Bodies several times the initial buffer, arriving in odd-sized reads */
+static void
+test_growth (void) {
+  static char        text[3 * 8192];
+  static char        expected[8000];
+  hpjsrpc_stream_t  *stream;
+  size_t             length = 0;
+  size_t             round = 0;
+
+  for (size_t ii = 0; ii < sizeof(expected); ++ii) {
+    expected[ii] = (char) ('a' + (ii % 26));
+  }
+  for (size_t ii = 0; ii < 3; ++ii) {
+    length += hpjsrpc_stream_header(&text[length], (sizeof(expected) - 1));
+    memcpy(&text[length], expected, (sizeof(expected) - 1));
+    length += (sizeof(expected) - 1);
+  }
+  expected[sizeof(expected) - 1] = '\0';
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_stream_new(&stream,
+    HPJSRPC_STREAM_MAX_HEAD, sizeof(expected)));
+  /* Taking out every message complete after each read, as a loop would */
+  for (size_t offset = 0; offset < length; ) {
+    const char *body;
+    size_t      got;
+
+    offset += feed(stream, &text[offset], (length - offset), 777);
+    while (HPJSRPC_NO_ERROR == hpjsrpc_stream_next(stream, &body, &got)) {
+      CHECK(strlen(expected) == got);
+      CHECK(0 == memcmp(body, expected, got));
+      round++;
+    }
+  }
+  CHECK(3 == round);
+  CHECK(hpjsrpc_stream_is_idle(stream));
+  hpjsrpc_stream_destroy(stream);
+
+} /* test_growth() */
+
+/* ------------------------------------------------------------------------- */
+
+/* A message after a valid one, whose header block must fail the stream */
+static void
+expect_invalid (const char *head) {
+  hpjsrpc_stream_t *stream;
+  const char       *body;
+  size_t            length;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_stream_new(&stream,
+    (2 * HPJSRPC_STREAM_MAX_HEAD), 64));
+  feed_all(stream, "Content-Length: 2\r\n\r\n{}", 23, 23);
+  feed_all(stream, head, strlen(head), 7);
+  expect_body(stream, "{}");
+  CHECK(HPJSRPC_PARSE_ERROR_INVAL == hpjsrpc_stream_next(stream, &body,
+    &length));
+  /* And stays failed */
+  feed_all(stream, "Content-Length: 2\r\n\r\n{}", 23, 23);
+  CHECK(HPJSRPC_PARSE_ERROR_INVAL == hpjsrpc_stream_next(stream, &body,
+    &length));
+  hpjsrpc_stream_destroy(stream);
+
+} /* expect_invalid() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_malformed (void) {
+  char long_head[HPJSRPC_STREAM_MAX_HEAD + 64];
+
+  expect_invalid("Content-Type: text/plain\r\n\r\n{}");
+  expect_invalid("\r\n\r\n{}");
+  expect_invalid("Content-Length:\r\n\r\n{}");
+  expect_invalid("Content-Length: two\r\n\r\n{}");
+  expect_invalid("Content-Length: 2x\r\n\r\n{}");
+  expect_invalid("Content-Length: -2\r\n\r\n{}");
+  expect_invalid("Content-Length: 2\r\nContent-Length: 2\r\n\r\n{}");
+  expect_invalid("Content-Length: 99999999999999999999999\r\n\r\n{}");
+  /* Larger than max_body */
+  expect_invalid("Content-Length: 65\r\n\r\n{}");
+
+  /* A header block that never ends, without and with a blank line */
+  memset(long_head, 'x', sizeof(long_head));
+  long_head[sizeof(long_head) - 1] = '\0';
+  expect_invalid(long_head);
+  memcpy(&long_head[sizeof(long_head) - 27], "\r\nContent-Length: 2\r\n\r\n{}",
+    26);
+  expect_invalid(long_head);
+
+} /* test_malformed() */
+
+/* ------------------------------------------------------------------------- */
+
+static void *
+serve_main (void *arg) {
+  serve_arg_t        *s = (serve_arg_t *) arg;
+  hpjsrpc_context_t  *ctx;
+  hpjsrpc_stream_t   *stream;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_context_new(&ctx, s->engine, 64, 512, 0,
+    0));
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_stream_new(&stream,
+    HPJSRPC_STREAM_MAX_HEAD, 4096));
+  s->rc = hpjsrpc_stream_serve(stream, ctx, s->in_fd, s->out_fd);
+  hpjsrpc_stream_destroy(stream);
+  hpjsrpc_context_destroy(ctx);
+  close(s->out_fd);
+
+  return NULL;
+
+} /* serve_main() */
+
+/* ------------------------------------------------------------------------- */
+
+/* Request i echoes i % 300 letters, so bodies vary in size */
+static size_t
+make_message (char *text, size_t ii, bool is_reply) {
+  char   body[512];
+  char   letters[300];
+  size_t count = (ii % sizeof(letters));
+  size_t length;
+
+  memset(letters, ('a' + (int) (ii % 26)), count);
+  length = (size_t) ((is_reply)
+    ? snprintf(body, sizeof(body), "{\"jsonrpc\":\"2.0\",\"id\":%zu,"
+      "\"result\":\"%.*s\"}", ii, (int) count, letters)
+    : snprintf(body, sizeof(body), "{\"jsonrpc\":\"2.0\",\"method\":\"echo\","
+      "\"params\":[\"%.*s\"],\"id\":%zu}", (int) count, letters, ii));
+  length += hpjsrpc_stream_header(text, length);
+  memcpy(&text[length - strlen(body)], body, strlen(body));
+
+  return length;
+
+} /* make_message() */
+
+/* ------------------------------------------------------------------------- */
+
+static void
+test_serve (hpjsrpc_engine_t *engine, const char *tail, HPJSRPC_RETURN rc) {
+  static const char parse_error[] = "{\"jsonrpc\":\"2.0\",\"error\":"
+    "{\"code\":-32700,\"message\":\"json parsing error\"},\"id\":null}";
+  static char  requests[ROUNDS * 512];
+  static char  expected[ROUNDS * 512];
+  static char  replies[ROUNDS * 512];
+  serve_arg_t  server;
+  pthread_t    thread;
+  int          in[2];
+  int          out[2];
+  size_t       length = 0;
+  size_t       expected_length = 0;
+
+  for (size_t ii = 0; ii < ROUNDS; ++ii) {
+    length += make_message(&requests[length], ii, false);
+    expected_length += make_message(&expected[expected_length], ii, true);
+  }
+  /* Then a message the engine cannot parse, answered all the same */
+  memcpy(&requests[length], "Content-Length: 3\r\n\r\n{x}", 24);
+  length += 24;
+  expected_length += (size_t) snprintf(&expected[expected_length],
+    (sizeof(expected) - expected_length), "Content-Length: %zu\r\n\r\n%s",
+    (sizeof(parse_error) - 1), parse_error);
+
+  CHECK(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, in));
+  CHECK(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, out));
+  server.engine = engine;
+  server.in_fd = in[1];
+  server.out_fd = out[1];
+  pthread_create(&thread, NULL, serve_main, &server);
+
+  /* Writes of 61 bytes split headers and bodies all over */
+  for (size_t offset = 0; offset < length; offset += 61) {
+    test_write(in[0], &requests[offset], ((length - offset) < 61)
+      ? (length - offset) : 61);
+  }
+  test_write(in[0], tail, strlen(tail));
+  shutdown(in[0], SHUT_WR);
+
+  CHECK(expected_length == test_read_all(out[0], replies, sizeof(replies)));
+  CHECK(0 == memcmp(replies, expected, expected_length));
+  pthread_join(thread, NULL);
+  CHECK(rc == server.rc);
+
+  close(in[0]);
+  close(in[1]);
+  close(out[0]);
+
+} /* test_serve() */
+
+/* ------------------------------------------------------------------------- */
+
+int
+main (void) {
+  hpjsrpc_engine_t *engine;
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_new(&engine));
+  CHECK(HPJSRPC_NO_ERROR == rpc_register_methods(engine, methods, 1));
+
+  test_framing();
+  test_growth();
+  test_malformed();
+  /* EOF between messages ends the loop cleanly, within one does not */
+  test_serve(engine, "", HPJSRPC_NO_ERROR);
+  test_serve(engine, "Content-Length: 40\r\n\r\n{\"jsonrpc\"",
+    HPJSRPC_PARSE_ERROR_PART);
+  test_serve(engine, "Content-Length: 1O\r\n\r\n", HPJSRPC_PARSE_ERROR_INVAL);
+
+  CHECK(HPJSRPC_NO_ERROR == hpjsrpc_destroy(engine));
+
+  return 0;
+
+} /* main() */
+/* vi: set et sw=2 ts=2: */